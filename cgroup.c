@@ -0,0 +1,414 @@
+// SPDX-License-Identifier: MIT
+
+/* Monitor cgroup v2 memory limits.
+ *
+ * The global /proc/meminfo numbers say nothing about a cgroup that is about
+ * to hit its memory.max, at which point the kernel's in-cgroup OOM killer
+ * takes over. So for each configured cgroup, we look at
+ *
+ *   available = memory.max - memory.current + inactive_file + slab_reclaimable
+ *
+ * (the last two from memory.stat, as the kernel reclaims them before OOM)
+ * as a percentage of memory.max, and compare it with the cgroup's own
+ * SIGTERM and SIGKILL limits. memory.events is polled so we wake up when the
+ * cgroup hits memory.max. Running over memory.high changes it too, up to
+ * 100 times a second, which we sleep through.
+ *
+ * All files are opened once and read with pread().
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cgroup.h"
+#include "dirscan.h"
+#include "globals.h"
+#include "meminfo.h"
+#include "msg.h"
+#include "psi.h"
+
+// Nesting limit when walking the members of a cgroup
+#define CGROUP_DEPTH_MAX 32
+
+// The memory.events counters in cgroup_t.events
+static const char* const event_names[] = { "max", "oom", "oom_kill" };
+#define EVENT_OOM_KILL 2
+
+static cgroup_t cgroups[CGROUP_MAX];
+static int ncgroups = 0;
+
+/* Add a cgroup to monitor from a "PATH:PERCENT[,KILL_PERCENT]" spec.
+ * Relative paths are taken relative to /sys/fs/cgroup (cgroup_root_path).
+ */
+void cgroup_add(const char* spec)
+{
+    if (ncgroups >= CGROUP_MAX) {
+        fatal(14, "cgroup: can monitor at most %d cgroups\n", CGROUP_MAX);
+    }
+    const char* colon = strrchr(spec, ':');
+    if (colon == NULL || colon == spec) {
+        fatal(14, "cgroup: expected PATH:PERCENT[,KILL_PERCENT], got '%s'\n", spec);
+    }
+    term_kill_tuple_t tuple = parse_term_kill_tuple(colon + 1, 100);
+    if (strlen(tuple.err)) {
+        fatal(14, "cgroup: %s", tuple.err);
+    }
+    cgroup_t* cg = &cgroups[ncgroups];
+    int pathlen = (int)(colon - spec);
+    int len;
+    if (spec[0] == '/') {
+        len = snprintf(cg->path, sizeof(cg->path), "%.*s", pathlen, spec);
+    } else {
+        len = snprintf(cg->path, sizeof(cg->path), "%s/%.*s", cgroup_root_path, pathlen, spec);
+    }
+    if (len < 0 || (size_t)len >= sizeof(cg->path)) {
+        fatal(14, "cgroup: path too long: '%s'\n", spec);
+    }
+    cg->term_percent = tuple.term;
+    cg->kill_percent = tuple.kill;
+    cg->dirfd = cg->current_fd = cg->max_fd = cg->stat_fd = cg->events_fd = -1;
+    ncgroups++;
+}
+
+int cgroup_count(void)
+{
+    return ncgroups;
+}
+
+static void cgroup_close(cgroup_t* cg)
+{
+    if (cg->events_fd >= 0) {
+        psi_unwatch_fd(cg->events_fd);
+    }
+    int* fds[] = { &cg->current_fd, &cg->max_fd, &cg->stat_fd, &cg->events_fd, &cg->dirfd };
+    for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+        if (*fds[i] >= 0) {
+            close(*fds[i]);
+            *fds[i] = -1;
+        }
+    }
+}
+
+// Returns 0 on success and -errno on error
+static int cgroup_open(cgroup_t* cg)
+{
+    cg->dirfd = open(cg->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (cg->dirfd < 0) {
+        return -errno;
+    }
+    cg->current_fd = openat(cg->dirfd, "memory.current", O_RDONLY | O_CLOEXEC);
+    cg->max_fd = openat(cg->dirfd, "memory.max", O_RDONLY | O_CLOEXEC);
+    cg->stat_fd = openat(cg->dirfd, "memory.stat", O_RDONLY | O_CLOEXEC);
+    cg->events_fd = openat(cg->dirfd, "memory.events", O_RDONLY | O_CLOEXEC);
+    if (cg->current_fd < 0 || cg->max_fd < 0 || cg->stat_fd < 0 || cg->events_fd < 0) {
+        // Most likely the memory controller is not enabled for this cgroup
+        int open_errno = errno;
+        cgroup_close(cg);
+        return -open_errno;
+    }
+    for (size_t i = 0; i < sizeof(cg->events) / sizeof(cg->events[0]); i++) {
+        cg->events[i] = -1;
+    }
+    if (!psi_watch_fd(cg->events_fd, cgroup_events_changed, cg)) {
+        debug("cgroup %s: no free poll slot for memory.events\n", cg->path);
+    }
+    return 0;
+}
+
+/* Stop monitoring all cgroups. Only used by the testsuite.
+ */
+void cgroup_exit(void)
+{
+    for (int i = 0; i < ncgroups; i++) {
+        cgroup_close(&cgroups[i]);
+    }
+    ncgroups = 0;
+}
+
+/* Open all configured cgroups. Cgroups that do not exist (yet) are
+ * retried in cgroup_check().
+ */
+void cgroup_init(void)
+{
+    for (int i = 0; i < ncgroups; i++) {
+        cgroup_t* cg = &cgroups[i];
+        int res = cgroup_open(cg);
+        if (res < 0) {
+            warn("cgroup %s: could not open: %s. Will retry.\n", cg->path, strerror(-res));
+        }
+        fprintf(stderr, "monitoring cgroup %s: SIGTERM when avail <= " PRIPCT ", SIGKILL when avail <= " PRIPCT "\n",
+            cg->path, cg->term_percent, cg->kill_percent);
+    }
+}
+
+/* Read a memory.current or memory.max value in bytes, and return it in KiB.
+ * "max" (no limit) is returned as -1.
+ * On error, returns -1 and stores -errno in `err`.
+ */
+static long long read_kib(int fd, int* err)
+{
+    char buf[64];
+    ssize_t len = pread_file(fd, buf, sizeof(buf));
+    if (len < 0) {
+        *err = (int)len;
+        return -1;
+    }
+    if (strncmp(buf, "max", 3) == 0) {
+        return -1;
+    }
+    return strtoll(buf, NULL, 10) / 1024;
+}
+
+/* Get the value of `key` from a flat-keyed file like memory.stat
+ * ("key value\n" lines). Returns -1 if the key is not there.
+ */
+static long long flat_keyed_value(const char* buf, const char* key)
+{
+    size_t keylen = strlen(key);
+    for (const char* line = buf; *line;) {
+        if (strncmp(line, key, keylen) == 0 && line[keylen] == ' ') {
+            return strtoll(line + keylen + 1, NULL, 10);
+        }
+        const char* eol = strchr(line, '\n');
+        if (eol == NULL) {
+            break;
+        }
+        line = eol + 1;
+    }
+    return -1;
+}
+
+/* Read memory.events, which also re-arms the poll() notification.
+ * Returns 1 if the max, oom or oom_kill counter went up since the last
+ * read, 0 if not, and -errno on error.
+ */
+static int events_read(cgroup_t* cg)
+{
+    // low, high, max, oom, oom_kill, oom_group_kill
+    char buf[256];
+    ssize_t len = pread_file(cg->events_fd, buf, sizeof(buf));
+    if (len < 0) {
+        return (int)len;
+    }
+    int up = 0;
+    for (int i = 0; i < (int)(sizeof(cg->events) / sizeof(cg->events[0])); i++) {
+        long long count = flat_keyed_value(buf, event_names[i]);
+        if (cg->events[i] >= 0 && count > cg->events[i]) {
+            up = 1;
+            if (i == EVENT_OOM_KILL) {
+                warn("cgroup %s: the kernel OOM killer killed %lld processes\n", cg->path, count - cg->events[i]);
+            }
+        }
+        cg->events[i] = count;
+    }
+    return up;
+}
+
+/* psi_wait() callback for memory.events: only wake up when the cgroup hit
+ * memory.max or the OOM killer, or is gone.
+ */
+bool cgroup_events_changed(void* ctx)
+{
+    cgroup_t* cg = ctx;
+    return events_read(cg) != 0;
+}
+
+// Returns 0 on success and -errno on error
+static int cgroup_read(cgroup_t* cg)
+{
+    // memory.stat has about 50 lines of up to 30 bytes
+    static char buf[8192];
+    int err = 0;
+
+    cg->current_kib = read_kib(cg->current_fd, &err);
+    cg->max_kib = read_kib(cg->max_fd, &err);
+    int res = events_read(cg);
+    if (res < 0) {
+        err = res;
+    }
+    if (err < 0) {
+        return err;
+    }
+
+    if (cg->max_kib < 0) {
+        // No limit, nothing to check against
+        cg->avail_kib = -1;
+        cg->avail_percent = 100;
+        return 0;
+    }
+    ssize_t len = pread_file(cg->stat_fd, buf, sizeof(buf));
+    if (len < 0) {
+        return (int)len;
+    }
+    long long reclaimable_kib = 0;
+    long long inactive_file = flat_keyed_value(buf, "inactive_file");
+    long long slab_reclaimable = flat_keyed_value(buf, "slab_reclaimable");
+    if (inactive_file > 0) {
+        reclaimable_kib += inactive_file / 1024;
+    }
+    if (slab_reclaimable > 0) {
+        reclaimable_kib += slab_reclaimable / 1024;
+    }
+    long long avail_kib = cg->max_kib - cg->current_kib + reclaimable_kib;
+    if (avail_kib < 0) {
+        avail_kib = 0;
+    }
+    if (avail_kib > cg->max_kib) {
+        avail_kib = cg->max_kib;
+    }
+    cg->avail_kib = avail_kib;
+    cg->avail_percent = cg->max_kib ? (double)avail_kib * 100 / (double)cg->max_kib : 0;
+    return 0;
+}
+
+/* Check all cgroups against their limits.
+ * Returns the cgroup that is worst off and sets `sig` to SIGTERM or SIGKILL,
+ * or returns NULL if all are fine.
+ */
+cgroup_t* cgroup_check(int* sig)
+{
+    cgroup_t* worst = NULL;
+    *sig = 0;
+
+    for (int i = 0; i < ncgroups; i++) {
+        cgroup_t* cg = &cgroups[i];
+        if (cg->dirfd < 0 && cgroup_open(cg) < 0) {
+            continue;
+        }
+        int res = cgroup_read(cg);
+        if (res < 0) {
+            // The cgroup has probably been removed
+            warn("cgroup %s: could not read: %s. Will retry.\n", cg->path, strerror(-res));
+            cgroup_close(cg);
+            continue;
+        }
+        int cg_sig = 0;
+        if (cg->avail_percent <= cg->kill_percent) {
+            cg_sig = SIGKILL;
+        } else if (cg->avail_percent <= cg->term_percent) {
+            cg_sig = SIGTERM;
+        } else {
+            continue;
+        }
+        warn("cgroup %s: low memory! avail %lld of %lld MiB (" PRIPCT "), at or below %s limit " PRIPCT "\n",
+            cg->path, cg->avail_kib / 1024, cg->max_kib / 1024, cg->avail_percent,
+            cg_sig == SIGKILL ? "SIGKILL" : "SIGTERM",
+            cg_sig == SIGKILL ? cg->kill_percent : cg->term_percent);
+        if (worst == NULL || (cg_sig == SIGKILL && *sig != SIGKILL)
+            || (cg_sig == *sig && cg->avail_percent < worst->avail_percent)) {
+            worst = cg;
+            *sig = cg_sig;
+        }
+    }
+    return worst;
+}
+
+/* Smallest distance to the SIGTERM limit over all cgroups with a memory.max,
+ * in KiB, as of the last cgroup_check(). Returns -1 if there is none.
+ */
+long long cgroup_headroom_kib(void)
+{
+    long long min_headroom = -1;
+    for (int i = 0; i < ncgroups; i++) {
+        const cgroup_t* cg = &cgroups[i];
+        if (cg->dirfd < 0 || cg->max_kib < 0) {
+            continue;
+        }
+        long long headroom = cg->avail_kib - (long long)(cg->term_percent * (double)cg->max_kib / 100);
+        if (headroom < 0) {
+            headroom = 0;
+        }
+        if (min_headroom < 0 || headroom < min_headroom) {
+            min_headroom = headroom;
+        }
+    }
+    return min_headroom;
+}
+
+/* Call fn() for each pid in cgroup.procs of the cgroup at `dirfd`.
+ * Returns the number of pids.
+ */
+static int procs_for_each(int dirfd, void (*fn)(int pid, void* ctx), void* ctx)
+{
+    int fd = openat(dirfd, "cgroup.procs", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+    char buf[4096];
+    // Bytes of an incomplete pid left over from the last read
+    size_t carry = 0;
+    int n = 0;
+    while (1) {
+        ssize_t len = read(fd, buf + carry, sizeof(buf) - carry - 1);
+        if (len <= 0) {
+            break;
+        }
+        len += (ssize_t)carry;
+        buf[len] = 0;
+        char* p = buf;
+        char* eol;
+        while ((eol = strchr(p, '\n')) != NULL) {
+            int pid = (int)strtol(p, NULL, 10);
+            if (pid > 0) {
+                fn(pid, ctx);
+                n++;
+            }
+            p = eol + 1;
+        }
+        carry = (size_t)(buf + len - p);
+        memmove(buf, p, carry);
+    }
+    close(fd);
+    return n;
+}
+
+static int walk(int dirfd, void (*fn)(int pid, void* ctx), void* ctx, int depth)
+{
+    int n = procs_for_each(dirfd, fn, ctx);
+    if (depth >= CGROUP_DEPTH_MAX) {
+        return n;
+    }
+    // One buffer per level, cgroup directories are small
+    char buf[1024] __attribute__((aligned(8)));
+    dirscan_t dir;
+    if (dirscan_openat(&dir, dirfd, buf, sizeof(buf)) < 0) {
+        return n;
+    }
+    const char* name;
+    bool is_dir;
+    while ((name = dirscan_next(&dir, &is_dir)) != NULL) {
+        if (!is_dir || name[0] == '.') {
+            continue;
+        }
+        int child = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (child < 0) {
+            continue;
+        }
+        n += walk(child, fn, ctx, depth + 1);
+        close(child);
+    }
+    dirscan_close(&dir);
+    return n;
+}
+
+/* Call fn() for each process in the cgroup and all its descendants.
+ * Returns the number of processes.
+ */
+int cgroup_for_each_pid(const cgroup_t* cg, void (*fn)(int pid, void* ctx), void* ctx)
+{
+    if (cg->dirfd < 0) {
+        return 0;
+    }
+    return walk(cg->dirfd, fn, ctx, 0);
+}
+
+// Like cgroup_for_each_pid(), for a cgroup directory we did not configure
+int cgroup_dir_for_each_pid(int dirfd, void (*fn)(int pid, void* ctx), void* ctx)
+{
+    return walk(dirfd, fn, ctx, 0);
+}
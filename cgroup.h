@@ -0,0 +1,43 @@
+/* SPDX-License-Identifier: MIT */
+#ifndef CGROUP_H
+#define CGROUP_H
+
+#include <stdbool.h>
+
+// Where the cgroup v2 hierarchy is mounted, see cgroup_root_path
+#define CGROUP_ROOT "/sys/fs/cgroup"
+// Maximum number of monitored cgroups
+#define CGROUP_MAX 16
+
+typedef struct {
+    char path[256];
+    double term_percent;
+    double kill_percent;
+    // -1 = not open
+    int dirfd;
+    int current_fd;
+    int max_fd;
+    int stat_fd;
+    int events_fd;
+    // From the last cgroup_check(), in KiB. max_kib and avail_kib
+    // are -1 for "max".
+    long long current_kib;
+    long long max_kib;
+    long long avail_kib;
+    double avail_percent;
+    // memory.events "max", "oom" and "oom_kill" counters, -1 = not read
+    // yet. We wake up early when one goes up, and warn about OOM kills.
+    long long events[3];
+} cgroup_t;
+
+void cgroup_add(const char* spec);
+void cgroup_init(void);
+void cgroup_exit(void);
+int cgroup_count(void);
+cgroup_t* cgroup_check(int* sig);
+bool cgroup_events_changed(void* cg);
+long long cgroup_headroom_kib(void);
+int cgroup_for_each_pid(const cgroup_t* cg, void (*fn)(int pid, void* ctx), void* ctx);
+int cgroup_dir_for_each_pid(int dirfd, void (*fn)(int pid, void* ctx), void* ctx);
+
+#endif
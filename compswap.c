@@ -0,0 +1,216 @@
+// SPDX-License-Identifier: MIT
+
+/* Effective memory accounting for compressed swap (zram and zswap).
+ *
+ * A page swapped out to zram is not gone, it still takes up compressed RAM,
+ * so free zram swap says little about how close we are to running out.
+ * The RAM used by zram and zswap is already missing from MemAvailable. What
+ * is left to gain is what compressing more anonymous memory would still
+ * free up:
+ *
+ *   room * (1 - 1 / ratio)
+ *
+ * where `room` is how much uncompressed data still fits (into the swap
+ * device, and under zram's mem_limit or zswap's max_pool_percent), and
+ * `ratio` is the compression ratio measured so far. compswap_adjust() adds
+ * that to MemAvailable, and takes the zram devices out of SwapTotal and
+ * SwapFree, so the swap limits only see real swap.
+ *
+ * zram swap devices are found in /proc/swaps once at startup, and their
+ * mm_stat files are opened once and read with pread().
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "compswap.h"
+#include "globals.h"
+#include "msg.h"
+
+typedef struct {
+    int dev;
+    // Size of the swap area, in KiB
+    long long swap_kib;
+    int mm_stat_fd;
+} zram_t;
+
+static zram_t zrams[ZRAM_MAX];
+static int nzrams = 0;
+static bool enabled = false;
+// 0 = zswap is off
+static int zswap_max_pool_percent = 0;
+
+// Find the zram devices in /proc/swaps
+static void find_zram_swaps(void)
+{
+    char path[PATH_LEN];
+    char line[256];
+
+    snprintf(path, sizeof(path), "%s/swaps", procdir_path);
+    FILE* f = fopen(path, "r");
+    if (f == NULL) {
+        warn("compswap: could not open %s: %s\n", path, strerror(errno));
+        return;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        int dev = 0;
+        long long size = 0;
+        // /dev/zram0                              partition	4194300		0		100
+        if (sscanf(line, "/dev/zram%d %*s %lld", &dev, &size) != 2) {
+            continue;
+        }
+        if (nzrams >= ZRAM_MAX) {
+            warn("compswap: more than %d zram swap devices, ignoring zram%d\n", ZRAM_MAX, dev);
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s" ZRAM_BLOCK_DIR "/zram%d/mm_stat", sysfs_path, dev);
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            warn("compswap: could not open %s: %s. Ignoring zram%d.\n", path, strerror(errno), dev);
+            continue;
+        }
+        zrams[nzrams++] = (zram_t) { .dev = dev, .swap_kib = size, .mm_stat_fd = fd };
+    }
+    fclose(f);
+}
+
+/* Look for zram swap devices and zswap.
+ * Returns false if there are none.
+ */
+bool compswap_init(void)
+{
+    char buf[64];
+    char path[PATH_LEN];
+
+    find_zram_swaps();
+    for (int i = 0; i < nzrams; i++) {
+        fprintf(stderr, "effective swap: zram%d, %lld MiB of swap\n", zrams[i].dev, zrams[i].swap_kib / 1024);
+    }
+    snprintf(path, sizeof(path), "%s" ZSWAP_PARAM_DIR "/enabled", sysfs_path);
+    if (read_file_at(NULL, AT_FDCWD, path, buf, sizeof(buf)) > 0 && buf[0] == 'Y') {
+        snprintf(path, sizeof(path), "%s" ZSWAP_PARAM_DIR "/max_pool_percent", sysfs_path);
+        if (read_file_at(NULL, AT_FDCWD, path, buf, sizeof(buf)) > 0) {
+            zswap_max_pool_percent = atoi(buf);
+            fprintf(stderr, "effective swap: zswap, pool up to %d%% of RAM\n", zswap_max_pool_percent);
+        }
+    }
+    enabled = nzrams > 0 || zswap_max_pool_percent > 0;
+    return enabled;
+}
+
+/* Forget the devices found by compswap_init(). Only used by the testsuite.
+ */
+void compswap_exit(void)
+{
+    for (int i = 0; i < nzrams; i++) {
+        close(zrams[i].mm_stat_fd);
+    }
+    nzrams = 0;
+    zswap_max_pool_percent = 0;
+    enabled = false;
+}
+
+bool compswap_enabled(void)
+{
+    return enabled;
+}
+
+/* Compression ratio for `orig` KiB of data stored in `used` KiB of RAM.
+ * Below a megabyte, the numbers are mostly noise.
+ */
+static double ratio(long long orig, long long used)
+{
+    if (orig < 1024 || used <= 0) {
+        return COMPSWAP_DEFAULT_RATIO;
+    }
+    double r = (double)orig / (double)used;
+    return r > 1 ? r : 1;
+}
+
+/* What compressing up to `room` KiB more of anonymous memory at `r`
+ * would still free up, in KiB
+ */
+static long long gain(long long room, double r)
+{
+    if (room <= 0) {
+        return 0;
+    }
+    return (long long)((double)room * (1 - 1 / r));
+}
+
+/* Add the gain from one zram device to `avail`, and take it out of the
+ * swap numbers.
+ */
+static void zram_adjust(const zram_t* z, long long* avail, long long* swap_total, long long* swap_free)
+{
+    // orig_data_size compr_data_size mem_used_total mem_limit mem_used_max
+    // same_pages pages_compacted huge_pages, in bytes or pages
+    long long orig = 0, compr = 0, used = 0, limit = 0, used_max = 0, same = 0;
+    char buf[256];
+    ssize_t len = pread_file(z->mm_stat_fd, buf, sizeof(buf));
+    if (len < 0) {
+        warn("compswap: could not read zram%d mm_stat: %s\n", z->dev, strerror((int)-len));
+        return;
+    }
+    if (sscanf(buf, "%lld %lld %lld %lld %lld %lld", &orig, &compr, &used, &limit, &used_max, &same) < 4) {
+        warn("compswap: could not parse zram%d mm_stat: '%s'\n", z->dev, buf);
+        return;
+    }
+    // Same-filled pages take swap slots, but no memory
+    long long slots_used = orig / 1024 + same * (sysconf(_SC_PAGESIZE) / 1024);
+    long long room = z->swap_kib - slots_used;
+    double r = ratio(orig / 1024, used / 1024);
+    if (limit > 0) {
+        long long limit_room = (long long)((double)(limit - used) / 1024 * r);
+        if (limit_room < room) {
+            room = limit_room;
+        }
+    }
+    *avail += gain(room, r);
+    *swap_total -= z->swap_kib;
+    *swap_free -= z->swap_kib - slots_used;
+}
+
+/* Replace the MemAvailable and swap numbers in `m` with what they
+ * effectively are with compressed swap. No-op unless compswap_init()
+ * found zram or zswap.
+ */
+void compswap_adjust(meminfo_t* m)
+{
+    if (!enabled) {
+        return;
+    }
+    long long avail = m->MemAvailableKiB;
+    long long swap_free = m->SwapFreeKiB;
+    for (int i = 0; i < nzrams; i++) {
+        zram_adjust(&zrams[i], &avail, &m->SwapTotalKiB, &swap_free);
+    }
+    if (m->SwapTotalKiB < 0) {
+        m->SwapTotalKiB = 0;
+    }
+    if (swap_free < 0) {
+        swap_free = 0;
+    }
+    if (swap_free > m->SwapTotalKiB) {
+        swap_free = m->SwapTotalKiB;
+    }
+    // zswap sits in front of the remaining (real) swap. Zswap and
+    // Zswapped are in /proc/meminfo since Linux 5.19.
+    if (zswap_max_pool_percent > 0 && m->ZswapKiB >= 0 && m->ZswappedKiB >= 0) {
+        double r = ratio(m->ZswappedKiB, m->ZswapKiB);
+        long long pool_room = m->MemTotalKiB * zswap_max_pool_percent / 100 - m->ZswapKiB;
+        long long room = (long long)((double)pool_room * r);
+        if (room > swap_free) {
+            room = swap_free;
+        }
+        avail += gain(room, r);
+    }
+    if (avail > m->MemTotalKiB) {
+        avail = m->MemTotalKiB;
+    }
+    meminfo_derive(m, avail, swap_free);
+}
@@ -0,0 +1,23 @@
+/* SPDX-License-Identifier: MIT */
+#ifndef COMPSWAP_H
+#define COMPSWAP_H
+
+#include <stdbool.h>
+
+#include "meminfo.h"
+
+#define SYSFS_ROOT "/sys"
+// Relative to sysfs_path
+#define ZRAM_BLOCK_DIR "/block"
+#define ZSWAP_PARAM_DIR "/module/zswap/parameters"
+// Maximum number of zram swap devices
+#define ZRAM_MAX 16
+// Compression ratio to assume until there is enough data to measure it
+#define COMPSWAP_DEFAULT_RATIO 2.0
+
+bool compswap_init(void);
+bool compswap_enabled(void);
+void compswap_adjust(meminfo_t* m);
+void compswap_exit(void);
+
+#endif
@@ -11,7 +11,12 @@
 
 #include "globals.h"
 #include "kill.h"
+#include "group.h"
 #include "msg.h"
+#include "msglog.h"
+#include "proctable.h"
+#include "workers.h"
+#include "vmstat.h"
 
 
 regex_t _c_prefer_regex;
@@ -19,26 +24,39 @@ regex_t _c_avoid_regex;
 regex_t _c_user_regex;
 regex_t _c_old_regex;
 char _c_emerg_kill[EMERG_KILL_MAXLEN];
+char _c_metrics[512];
+char _c_flight_recorder[512];
 
 
 int parse_config(char* filename, poll_loop_args_t* confdata)
 {
     FILE* f;
     char* tpos;
-    char* line = NULL;
+    // Longer than any key plus cvalue, and no getline() buffer to leak
+    char line[1024];
     char ckey[64];
     char cvalue[512];
     int regerr = 0;
-    size_t buflen = 0;
-    ssize_t read;
+    size_t read;
 
     fprintf(stderr, "Loading configuration from %s\n", filename);
+    // The regexes may have changed
+    kill_match_cache_clear();
 
     if ((f = fopen(filename, "r")) == NULL) {
         fatal(7, "failed to read configuration file '%s': %s\n", filename, strerror(errno));
     }
 
-    while ((read = getline(&line, &buflen, f)) != -1) {
+    while (fgets(line, sizeof(line), f) != NULL) {
+        read = strlen(line);
+        if (read == sizeof(line) - 1 && line[read - 1] != '\n') {
+            warn("ignoring a line longer than %zu bytes in %s\n", sizeof(line) - 2, filename);
+            // Skip the rest of it
+            int ch;
+            while ((ch = fgetc(f)) != EOF && ch != '\n') {
+            }
+            continue;
+        }
         if (read < 2) {
             continue;
         } else if(line[0] == '#' || line[0] == ';') {
@@ -68,6 +86,11 @@ int parse_config(char* filename, poll_loop_args_t* confdata)
             confdata->mem_term_percent = atof(cvalue);
         } else if (!strcmp(ckey, "memory_kill")) {
             confdata->mem_kill_percent = atof(cvalue);
+        } else if (!strcmp(ckey, "memory_throttle")) {
+            confdata->mem_throttle_percent = atof(cvalue);
+            if (confdata->mem_throttle_percent < 0 || confdata->mem_throttle_percent > 100) {
+                fatal(15, "memory_throttle: invalid percentage '%s'\n", cvalue);
+            }
         } else if (!strcmp(ckey, "memory_emerg")) {
             confdata->mem_emerg_percent = atof(cvalue);
         } else if (!strcmp(ckey, "swap_low")) {
@@ -91,17 +114,85 @@ int parse_config(char* filename, poll_loop_args_t* confdata)
             if ((regerr = regcomp(confdata->avoid_users, cvalue, REG_EXTENDED | REG_NOSUB)) != 0) {
                 fatal(6, "could not compile regexp '%s'\n", cvalue);
             }
-            fprintf(stderr, "Will avoid killing process owned by users that match regex '%s'\n", cvalue);
+            fprintf(stderr, "Will avoid killing process owned by users that match regex '%s' (%zu users)\n",
+                cvalue, kill_avoid_users_set(confdata->avoid_users));
         } else if (!strcmp(ckey, "prefer_old")) {
             confdata->prefer_old = &_c_old_regex;
             if ((regerr = regcomp(confdata->prefer_old, cvalue, REG_EXTENDED | REG_NOSUB)) != 0) {
                 fatal(6, "could not compile regexp '%s'\n", cvalue);
             }
             fprintf(stderr, "Preferring to kill old processes by age that match regex '%s'\n", cvalue);
+        } else if (!strcmp(ckey, "rule")) {
+            const char* err = kill_rule_add(cvalue);
+            if (err) {
+                fatal(14, "rule '%s': %s\n", cvalue, err);
+            }
+            fprintf(stderr, "Scoring rule: %s\n", cvalue);
+        } else if (!strcmp(ckey, "prefer_growing")) {
+            confdata->prefer_growing = atof(cvalue);
+            if (confdata->prefer_growing < 0) {
+                fatal(14, "prefer_growing must not be negative\n");
+            }
         } else if (!strcmp(ckey, "emerg_kill")) {
             confdata->emerg_kill = _c_emerg_kill;
             strncpy(confdata->emerg_kill, cvalue, EMERG_KILL_MAXLEN);
+            kill_emergency_set_names(cvalue);
             fprintf(stderr, "In case of emergency, will kill the following processes: %s\n", confdata->emerg_kill);
+        } else if (!strcmp(ckey, "log")) {
+            confdata->log_mode = msglog_parse_mode(cvalue);
+            if (confdata->log_mode < 0) {
+                fatal(14, "log: expected sync, async or journal, got '%s'\n", cvalue);
+            }
+        } else if (!strcmp(ckey, "scan_threads")) {
+            confdata->scan_threads = atoi(cvalue);
+            if (confdata->scan_threads < 1 || confdata->scan_threads > WORKERS_MAX) {
+                fatal(14, "scan_threads must be between 1 and %d\n", WORKERS_MAX);
+            }
+        } else if (!strcmp(ckey, "io_uring")) {
+            confdata->io_uring = (cvalue[0] == 'y' || cvalue[0] == '1') ? true : false;
+        } else if (!strcmp(ckey, "effective_swap")) {
+            confdata->effective_swap = (cvalue[0] == 'y' || cvalue[0] == '1') ? true : false;
+        } else if (!strcmp(ckey, "psi")) {
+            confdata->psi = (cvalue[0] == 'y' || cvalue[0] == '1') ? true : false;
+        } else if (!strcmp(ckey, "psi_some")) {
+            confdata->psi_some_ms = (unsigned)atoi(cvalue);
+        } else if (!strcmp(ckey, "psi_full")) {
+            confdata->psi_full_ms = (unsigned)atoi(cvalue);
+        } else if (!strcmp(ckey, "psi_heartbeat")) {
+            confdata->psi_heartbeat_ms = atoi(cvalue) * 1000;
+        } else if (!strcmp(ckey, "cgroup")) {
+            cgroup_add(cvalue);
+        } else if (!strcmp(ckey, "numa")) {
+            numa_add(cvalue);
+        } else if (!strcmp(ckey, "thrash")) {
+            vmstat_add(cvalue);
+        } else if (!strcmp(ckey, "trend_horizon")) {
+            confdata->trend_horizon = atof(cvalue);
+        } else if (!strcmp(ckey, "kill_unit")) {
+            confdata->kill_unit = group_parse_unit(cvalue);
+            if (confdata->kill_unit < 0) {
+                fatal(14, "kill_unit: expected process, cgroup or pgrp, got '%s'\n", cvalue);
+            }
+        } else if (!strcmp(ckey, "flight_recorder")) {
+            confdata->flight_recorder = _c_flight_recorder;
+            snprintf(_c_flight_recorder, sizeof(_c_flight_recorder), "%s", cvalue);
+        } else if (!strcmp(ckey, "metrics")) {
+            confdata->metrics = _c_metrics;
+            snprintf(_c_metrics, sizeof(_c_metrics), "%s", cvalue);
+        } else if (!strcmp(ckey, "batch")) {
+            confdata->batch = atoi(cvalue);
+            if (confdata->batch < 0 || confdata->batch > BATCH_MAX) {
+                fatal(14, "batch must be between 0 and %d\n", BATCH_MAX);
+            }
+        } else if (!strcmp(ckey, "process_table")) {
+            confdata->process_table = atoi(cvalue);
+        } else if (!strcmp(ckey, "proc_events")) {
+            confdata->proc_events = (cvalue[0] == 'y' || cvalue[0] == '1') ? true : false;
+        } else if (!strcmp(ckey, "process_table_top")) {
+            confdata->process_table_top = atoi(cvalue);
+            if (confdata->process_table_top < 1 || confdata->process_table_top > PROCTABLE_TOP_MAX) {
+                fatal(14, "process_table_top must be between 1 and %d\n", PROCTABLE_TOP_MAX);
+            }
         } else {
             warn("warning: unrecognized config parameter '%s'\n", ckey);
             continue;
@@ -0,0 +1,152 @@
+// SPDX-License-Identifier: MIT
+
+/* Allocation-free directory scanning.
+ *
+ * opendir() mallocs its buffer, and under memory pressure that can fault or
+ * stall right when we need to find a victim. Here, getdents64() reads into
+ * a static arena that is faulted in by dirscan_init() before mlockall(),
+ * so a /proc scan after startup touches no new memory. Pid names are parsed
+ * while walking the entries, without a separate isnumeric() pass.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "dirscan.h"
+
+// What getdents64() fills the buffer with. glibc only has struct dirent64
+// with _LARGEFILE64_SOURCE.
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// DT_DIR from dirent.h
+#define DIRSCAN_DT_DIR 4
+
+static char arena[DIRSCAN_SLOTS][DIRSCAN_BUF_LEN] __attribute__((aligned(8)));
+static bool slot_used[DIRSCAN_SLOTS];
+
+/*
+ * Fault in the arena. Call before mlockall(), so that it stays resident.
+ */
+void dirscan_init(void)
+{
+    memset(arena, 0, sizeof(arena));
+}
+
+static int open_fd(dirscan_t* d, int fd, int slot, char* buf, size_t size)
+{
+    if (fd < 0) {
+        return -errno;
+    }
+    *d = (dirscan_t) { .fd = fd, .slot = slot, .buf = buf, .size = size };
+    if (slot >= 0) {
+        slot_used[slot] = true;
+    }
+    return 0;
+}
+
+/*
+ * Open the directory at `path`, with a buffer from the arena.
+ * Returns 0 or -errno, -EBUSY if all slots are in use.
+ */
+int dirscan_open(dirscan_t* d, const char* path)
+{
+    int slot = 0;
+    while (slot < DIRSCAN_SLOTS && slot_used[slot]) {
+        slot++;
+    }
+    if (slot == DIRSCAN_SLOTS) {
+        return -EBUSY;
+    }
+    return open_fd(d, open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC), slot, arena[slot], DIRSCAN_BUF_LEN);
+}
+
+/*
+ * Open the directory `dirfd` again, from the start, with the caller's
+ * buffer of `size` bytes: this is for recursive walks, which would need
+ * one arena slot per level. Returns 0 or -errno.
+ */
+int dirscan_openat(dirscan_t* d, int dirfd, char* buf, size_t size)
+{
+    return open_fd(d, openat(dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC), -1, buf, size);
+}
+
+/*
+ * Return the name of the next entry, and set *is_dir. Like readdir(),
+ * returns NULL at the end, and also on error, with errno set.
+ */
+const char* dirscan_next(dirscan_t* d, bool* is_dir)
+{
+    if (d->pos >= d->len) {
+        long len = syscall(SYS_getdents64, d->fd, d->buf, d->size);
+        d->syscalls++;
+        if (len <= 0) {
+            if (len == 0) {
+                errno = 0;
+            }
+            return NULL;
+        }
+        d->pos = 0;
+        d->len = (size_t)len;
+    }
+    // The caller's buffer may not be aligned
+    unsigned short reclen;
+    unsigned char type;
+    memcpy(&reclen, d->buf + d->pos + offsetof(struct linux_dirent64, d_reclen), sizeof(reclen));
+    memcpy(&type, d->buf + d->pos + offsetof(struct linux_dirent64, d_type), sizeof(type));
+    const char* name = d->buf + d->pos + offsetof(struct linux_dirent64, d_name);
+    d->pos += reclen;
+    if (is_dir) {
+        *is_dir = type == DIRSCAN_DT_DIR;
+    }
+    return name;
+}
+
+/*
+ * Return the next entry with a numeric name, as a number. Returns 0 at the
+ * end, and also on error, with errno set.
+ */
+int dirscan_next_pid(dirscan_t* d)
+{
+    const char* name;
+    while ((name = dirscan_next(d, NULL)) != NULL) {
+        int pid = 0;
+        const char* c = name;
+        // pid_max is at most 2^22, so 9 digits can not overflow
+        while (*c >= '0' && *c <= '9' && c - name < 9) {
+            pid = pid * 10 + (*c - '0');
+            c++;
+        }
+        if (*c == 0 && pid > 0) {
+            return pid;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Start over at the first entry, like rewinddir().
+ */
+void dirscan_rewind(dirscan_t* d)
+{
+    lseek(d->fd, 0, SEEK_SET);
+    d->pos = d->len = 0;
+}
+
+void dirscan_close(dirscan_t* d)
+{
+    if (d->slot >= 0) {
+        slot_used[d->slot] = false;
+    }
+    close(d->fd);
+    d->fd = -1;
+}
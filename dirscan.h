@@ -0,0 +1,35 @@
+/* SPDX-License-Identifier: MIT */
+#ifndef DIRSCAN_H
+#define DIRSCAN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Size of one getdents64() buffer in the arena, about 600 /proc entries
+#define DIRSCAN_BUF_LEN 16384
+// Number of directories that can be scanned at the same time from the arena:
+// two for the victim scans, and two that the process table keeps open
+#define DIRSCAN_SLOTS 4
+
+typedef struct {
+    int fd;
+    // Arena slot, -1 = caller's buffer
+    int slot;
+    char* buf;
+    size_t size;
+    // Unparsed entries are buf[pos..len)
+    size_t pos;
+    size_t len;
+    // number of getdents64() calls
+    unsigned long syscalls;
+} dirscan_t;
+
+void dirscan_init(void);
+int dirscan_open(dirscan_t* d, const char* path);
+int dirscan_openat(dirscan_t* d, int dirfd, char* buf, size_t size);
+const char* dirscan_next(dirscan_t* d, bool* is_dir);
+int dirscan_next_pid(dirscan_t* d);
+void dirscan_rewind(dirscan_t* d);
+void dirscan_close(dirscan_t* d);
+
+#endif
@@ -0,0 +1,208 @@
+// SPDX-License-Identifier: MIT
+
+/* Flight recorder (--flight-recorder FILE).
+ *
+ * Keeps the last FLIGHT_ENTRIES poll loop iterations in a fixed, locked
+ * ring: the memory sample, the sleep time, the hysteresis state and, if a
+ * victim was selected, how long that took and the top candidates. Nothing
+ * is written until a signal has been sent. After that iteration, the
+ * entries since the last dump are written to FILE (replaced atomically),
+ * or to the log if FILE is "-".
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "flight.h"
+#include "msg.h"
+
+typedef struct {
+    int pid;
+    int badness;
+    long long rss_kib;
+    char name[16];
+} flight_candidate_t;
+
+typedef struct {
+    double t;
+    meminfo_t m;
+    unsigned sleep_ms;
+    int hystis;
+    int sig;
+    // Victim selection in this iteration, scan_secs < 0 = none
+    double scan_secs;
+    int candidates;
+    int ntop;
+    flight_candidate_t top[FLIGHT_TOP];
+} flight_entry_t;
+
+static flight_entry_t ring[FLIGHT_ENTRIES];
+// Number of entries begun so far, the current one is (count - 1)
+static unsigned long count;
+// count at the last dump
+static unsigned long dumped;
+static char flight_path[PATH_LEN];
+static bool enabled;
+// What was killed in the current iteration, empty if nothing
+static char killed[PATH_LEN + 64];
+
+/*
+ * Record to the ring and dump to `path` after kills, or to the log if it
+ * is "-". NULL disables the recorder.
+ */
+void flight_init(const char* path)
+{
+    if (path == NULL) {
+        enabled = false;
+        return;
+    }
+    snprintf(flight_path, sizeof(flight_path), "%s", path);
+    memset(ring, 0, sizeof(ring));
+    if (mlock(ring, sizeof(ring)) != 0) {
+        debug("flight: could not mlock the ring: %s\n", strerror(errno));
+    }
+    enabled = true;
+}
+
+bool flight_enabled(void)
+{
+    return enabled;
+}
+
+static flight_entry_t* current(void)
+{
+    return count > 0 ? &ring[(count - 1) % FLIGHT_ENTRIES] : NULL;
+}
+
+// Start the entry for a poll loop iteration
+void flight_begin(double now, const meminfo_t* m)
+{
+    if (!enabled) {
+        return;
+    }
+    count++;
+    flight_entry_t* e = current();
+    *e = (flight_entry_t) { .t = now, .m = *m, .scan_secs = -1 };
+}
+
+// Record a victim selection, `top` holds the best `n` candidates
+void flight_scan(double secs, int candidates, const struct procinfo* top, int n)
+{
+    flight_entry_t* e = current();
+    if (!enabled || e == NULL) {
+        return;
+    }
+    e->scan_secs = secs;
+    e->candidates = candidates;
+    e->ntop = n < FLIGHT_TOP ? n : FLIGHT_TOP;
+    for (int i = 0; i < e->ntop; i++) {
+        e->top[i] = (flight_candidate_t) { .pid = top[i].pid, .badness = top[i].badness, .rss_kib = top[i].VmRSSkiB };
+        snprintf(e->top[i].name, sizeof(e->top[i].name), "%.15s", top[i].name);
+    }
+}
+
+// Note that a signal was sent to `what`, to dump at the end of the iteration
+void flight_killed(const char* what)
+{
+    if (enabled) {
+        snprintf(killed, sizeof(killed), "%s", what);
+    }
+}
+
+static const char* sig_short(int sig)
+{
+    switch (sig) {
+    case SIGTERM:
+        return "TERM";
+    case SIGKILL:
+        return "KILL";
+    default:
+        return "-";
+    }
+}
+
+static void print_entry(FILE* f, const flight_entry_t* e, double now)
+{
+    char line[MSG_LEN * 4];
+    int len = snprintf(line, sizeof(line), "%+8.3fs mem " PRIPCT " (%lld MiB) swap " PRIPCT " sleep %4u ms hyst %s sig %s",
+        e->t - now, e->m.MemAvailablePercent, e->m.MemAvailableMiB, e->m.SwapFreePercent, e->sleep_ms,
+        sig_short(e->hystis), sig_short(e->sig));
+    if (e->scan_secs >= 0 && len < (int)sizeof(line)) {
+        len += snprintf(line + len, sizeof(line) - (size_t)len, " | scan %.3f ms, %d candidates, top:",
+            e->scan_secs * 1000, e->candidates);
+        for (int i = 0; i < e->ntop && len < (int)sizeof(line); i++) {
+            len += snprintf(line + len, sizeof(line) - (size_t)len, " %d \"%s\" %d %lld MiB%s",
+                e->top[i].pid, e->top[i].name, e->top[i].badness, e->top[i].rss_kib / 1024,
+                i + 1 < e->ntop ? "," : "");
+        }
+    }
+    if (f) {
+        fprintf(f, "%s\n", line);
+    } else {
+        info("flight: %s\n", line);
+    }
+}
+
+static void dump(void)
+{
+    double now = current()->t;
+    unsigned long first = dumped;
+    if (count - first > FLIGHT_ENTRIES) {
+        first = count - FLIGHT_ENTRIES;
+    }
+    dumped = count;
+
+    if (strcmp(flight_path, "-") == 0) {
+        info("flight: last %lu iterations before killing %s\n", count - first, killed);
+        for (unsigned long i = first; i < count; i++) {
+            print_entry(NULL, &ring[i % FLIGHT_ENTRIES], now);
+        }
+        return;
+    }
+    char tmp[PATH_LEN + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", flight_path);
+    FILE* f = fopen(tmp, "w");
+    if (f == NULL) {
+        warn("flight: could not write %s: %s\n", tmp, strerror(errno));
+        return;
+    }
+    fprintf(f, "earlyoom flight recorder: last %lu iterations before killing %s at %ld\n",
+        count - first, killed, (long)time(NULL));
+    for (unsigned long i = first; i < count; i++) {
+        print_entry(f, &ring[i % FLIGHT_ENTRIES], now);
+    }
+    if (fclose(f) != 0) {
+        warn("flight: could not write %s: %s\n", tmp, strerror(errno));
+        remove(tmp);
+        return;
+    }
+    if (rename(tmp, flight_path) != 0) {
+        warn("flight: could not rename %s to %s: %s\n", tmp, flight_path, strerror(errno));
+        remove(tmp);
+        return;
+    }
+    info("flight: wrote the last %lu iterations to %s\n", count - first, flight_path);
+}
+
+/*
+ * Complete the entry for this iteration. Dumps the ring if a signal was
+ * sent in it.
+ */
+void flight_end(unsigned sleep_ms, int hystis, int sig)
+{
+    flight_entry_t* e = current();
+    if (!enabled || e == NULL) {
+        return;
+    }
+    e->sleep_ms = sleep_ms;
+    e->hystis = hystis;
+    e->sig = sig;
+    if (killed[0]) {
+        dump();
+        killed[0] = 0;
+    }
+}
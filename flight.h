@@ -0,0 +1,21 @@
+/* SPDX-License-Identifier: MIT */
+#ifndef FLIGHT_H
+#define FLIGHT_H
+
+#include <stdbool.h>
+
+#include "meminfo.h"
+
+// Number of poll loop iterations kept
+#define FLIGHT_ENTRIES 128
+// Number of top candidates kept per victim selection
+#define FLIGHT_TOP 5
+
+void flight_init(const char* path);
+bool flight_enabled(void);
+void flight_begin(double now, const meminfo_t* m);
+void flight_scan(double secs, int candidates, const struct procinfo* top, int n);
+void flight_killed(const char* what);
+void flight_end(unsigned sleep_ms, int hystis, int sig);
+
+#endif
@@ -1 +1,13 @@
+#include "cgroup.h"
+#include "compswap.h"
+
 int enable_debug = 0;
+// Where procfs is mounted. Only changed by the testsuite, which points it
+// to synthetic trees for benchmarks.
+const char* procdir_path = "/proc";
+// Where the cgroup v2 hierarchy is mounted. Only changed by the testsuite,
+// like procdir_path.
+const char* cgroup_root_path = CGROUP_ROOT;
+// Where sysfs is mounted, for zram and zswap. Only changed by the
+// testsuite, like procdir_path.
+const char* sysfs_path = SYSFS_ROOT;
@@ -3,5 +3,8 @@
 #define GLOBALS_H
 
 extern int enable_debug;
+extern const char* procdir_path;
+extern const char* cgroup_root_path;
+extern const char* sysfs_path;
 
 #endif
@@ -0,0 +1,428 @@
+// SPDX-License-Identifier: MIT
+
+/* Kill whole units (cgroups or process groups) instead of single processes.
+ *
+ * Killing one process out of a multi-process service frees little memory,
+ * and the supervisor usually respawns it right away. So we add up the VmRSS
+ * of all processes in a unit during the scan, and kill the unit with the
+ * largest score as a whole. Like the kernel's oom_badness(), the score is
+ * the memory in permille of RAM + swap plus oom_score_adj, where
+ * oom_score_adj (together with --prefer and the other preferences) is that
+ * of the member with the largest one. Adding up oom_score instead would let
+ * a unit of many small processes beat one large process.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cgroup.h"
+#include "dirscan.h"
+#include "globals.h"
+#include "group.h"
+#include "kill.h"
+#include "meminfo.h"
+#include "metrics.h"
+#include "msg.h"
+
+// Hash table slots, power of two, at most half full
+#define GROUP_SLOTS (2 * GROUP_MAX)
+
+// Allocated by group_init(), so we don't lock the memory if the feature is
+// not used
+static group_t* groups;
+// Slots in use in the current scan, so we can reset them quickly
+static int used[GROUP_MAX];
+static int nused;
+
+typedef struct {
+    const poll_loop_args_t* args;
+    procscan_t* scan;
+    int self_pgrp;
+    char self_cgroup[PATH_LEN];
+    // MemTotal + SwapTotal
+    long long total_kib;
+    // Set if we ran out of slots
+    bool overflow;
+    int candidates;
+} group_scan_t;
+
+// Parse a kill_unit value. Returns KILL_UNIT_* or -1 if unknown.
+int group_parse_unit(const char* name)
+{
+    if (!strcmp(name, "process")) {
+        return KILL_UNIT_PROCESS;
+    } else if (!strcmp(name, "cgroup")) {
+        return KILL_UNIT_CGROUP;
+    } else if (!strcmp(name, "pgrp")) {
+        return KILL_UNIT_PGRP;
+    }
+    return -1;
+}
+
+const char* group_unit_name(int type)
+{
+    switch (type) {
+    case KILL_UNIT_CGROUP:
+        return "cgroup";
+    case KILL_UNIT_PGRP:
+        return "process group";
+    default:
+        return "process";
+    }
+}
+
+void group_init(void)
+{
+    groups = calloc(GROUP_SLOTS, sizeof(group_t));
+    if (groups == NULL) {
+        fatal(1, "group: could not allocate %d slots\n", GROUP_SLOTS);
+    }
+    // Fault in all pages now so mlockall() covers them
+    memset(groups, 0, GROUP_SLOTS * sizeof(group_t));
+}
+
+static unsigned group_hash(int type, int id, const char* cgroup)
+{
+    // FNV-1a
+    unsigned h = 2166136261u;
+    if (type == KILL_UNIT_CGROUP) {
+        for (const char* c = cgroup; *c; c++) {
+            h = (h ^ (unsigned char)*c) * 16777619u;
+        }
+    } else {
+        h = (h ^ (unsigned)type) * 16777619u;
+        h = (h ^ (unsigned)id) * 16777619u;
+    }
+    return h & (GROUP_SLOTS - 1);
+}
+
+// Find or add a unit. Returns NULL if the table is full.
+static group_t* group_get(int type, int id, const char* cgroup)
+{
+    unsigned i = group_hash(type, id, cgroup);
+    for (;; i = (i + 1) & (GROUP_SLOTS - 1)) {
+        group_t* g = &groups[i];
+        if (!g->in_use) {
+            break;
+        }
+        if (g->type == type && (type == KILL_UNIT_CGROUP ? !strcmp(g->cgroup, cgroup) : g->id == id)) {
+            return g;
+        }
+    }
+    if (nused >= GROUP_MAX) {
+        return NULL;
+    }
+    group_t* g = &groups[i];
+    *g = (group_t) { .type = type, .id = id, .in_use = true };
+    if (type == KILL_UNIT_CGROUP) {
+        snprintf(g->cgroup, sizeof(g->cgroup), "%s", cgroup);
+    }
+    used[nused++] = (int)i;
+    return g;
+}
+
+static void group_reset(void)
+{
+    for (int i = 0; i < nused; i++) {
+        groups[used[i]] = (group_t) { 0 };
+    }
+    nused = 0;
+}
+
+static void consider_member(int pid, void* ctx)
+{
+    group_scan_t* s = ctx;
+    const poll_loop_args_t* args = s->args;
+    struct procinfo cur = {
+        .pid = pid,
+        .uid = -1,
+        .badness = -1,
+        .VmRSSkiB = -1,
+    };
+
+    // Let's not kill init, or ourselves.
+    if (pid <= 1 || pid == getpid()) {
+        return;
+    }
+    int dirfd = procinfo_open(s->scan, pid);
+    if (dirfd < 0) {
+        return;
+    }
+    unsigned unit_field = args->kill_unit == KILL_UNIT_CGROUP ? PROC_CGROUP : PROC_PGRP;
+    int res = procinfo_read(s->scan, dirfd, &cur,
+        PROC_OOM_SCORE | PROC_OOM_SCORE_ADJ | PROC_RSS | PROC_COMM | unit_field | badness_fields(args));
+    procinfo_close(s->scan, dirfd);
+    s->candidates++;
+    // Kernel threads have zero rss
+    if (res < 0 || cur.VmRSSkiB == 0) {
+        return;
+    }
+    // oom_score_adj and the preferences: what badness_adjust() makes of
+    // oom_score, plus the oom_score_adj that oom_score already contains
+    int oom_score = cur.badness;
+    badness_adjust(args, &cur);
+    int adjust = cur.badness - oom_score + cur.oom_score_adj;
+
+    // Units we are part of ourselves, and the root cgroup, are not killed
+    // as a whole. Their members compete as single processes.
+    int type = args->kill_unit;
+    int id = 0;
+    if (type == KILL_UNIT_CGROUP) {
+        if (!strcmp(cur.cgroup, "/") || !strcmp(cur.cgroup, s->self_cgroup)) {
+            type = KILL_UNIT_PROCESS;
+            id = pid;
+        }
+    } else {
+        id = cur.pgrp;
+        if (cur.pgrp <= 1 || cur.pgrp == s->self_pgrp) {
+            type = KILL_UNIT_PROCESS;
+            id = pid;
+        }
+    }
+    group_t* g = group_get(type, id, cur.cgroup);
+    if (g == NULL) {
+        s->overflow = true;
+        return;
+    }
+    if (cur.oom_score_adj == -1000) {
+        g->protected = true;
+        return;
+    }
+    if (g->members == 0 || adjust > g->max_adjust) {
+        g->max_adjust = adjust;
+    }
+    g->members++;
+    g->VmRSSkiB += cur.VmRSSkiB;
+    if (g->leader_pid == 0 || cur.badness > g->leader_badness
+        || (cur.badness == g->leader_badness && cur.VmRSSkiB > g->leader_VmRSSkiB)) {
+        g->leader_pid = pid;
+        g->leader_badness = cur.badness;
+        g->leader_adjust = adjust;
+        g->leader_VmRSSkiB = cur.VmRSSkiB;
+        // comm is at most 15 bytes, the rest of cur.name is unused
+        strncpy(g->leader_name, cur.name, sizeof(g->leader_name) - 1);
+    }
+}
+
+/*
+ * Scan all processes (only the members of `cg` if it is not NULL) and find
+ * the unit with the largest score, then VmRSS.
+ * Units with a protected member are represented by their largest member.
+ * Returns false if there is none, or if there are too many units.
+ */
+bool group_find_largest(const poll_loop_args_t* args, const cgroup_t* cg, group_t* out)
+{
+    procscan_t scan;
+    group_scan_t s = { .args = args, .scan = &scan };
+    struct procinfo self = { .pid = getpid() };
+
+    if (groups == NULL) {
+        return false;
+    }
+    procscan_begin(&scan);
+    int dirfd = procinfo_open(&scan, self.pid);
+    if (dirfd >= 0) {
+        procinfo_read(&scan, dirfd, &self, PROC_PGRP | PROC_CGROUP);
+        procinfo_close(&scan, dirfd);
+    }
+    s.self_pgrp = self.pgrp;
+    meminfo_t m = parse_meminfo();
+    s.total_kib = m.MemTotalKiB + m.SwapTotalKiB;
+    snprintf(s.self_cgroup, sizeof(s.self_cgroup), "%s", self.cgroup);
+
+    if (cg) {
+        cgroup_for_each_pid(cg, consider_member, &s);
+    } else {
+        dirscan_t procdir;
+        int err = dirscan_open(&procdir, procdir_path);
+        if (err < 0) {
+            fatal(5, "Could not open %s: %s", procdir_path, strerror(-err));
+        }
+        int pid;
+        while ((pid = dirscan_next_pid(&procdir)) != 0) {
+            consider_member(pid, &s);
+        }
+        scan.syscalls += procdir.syscalls;
+        dirscan_close(&procdir);
+    }
+
+    bool found = false;
+    for (int i = 0; i < nused && !s.overflow; i++) {
+        group_t g = groups[used[i]];
+        if (g.members == 0) {
+            continue;
+        }
+        if (g.protected || g.members == 1) {
+            // Compete as a single process
+            g.type = KILL_UNIT_PROCESS;
+            g.id = g.leader_pid;
+            g.members = 1;
+            g.max_adjust = g.leader_adjust;
+            g.VmRSSkiB = g.leader_VmRSSkiB;
+        }
+        // Single processes are scored the same way, so that they compare
+        // with the units
+        g.badness = (int)(g.VmRSSkiB * 1000 / s.total_kib) + g.max_adjust;
+        if (!found || g.badness > out->badness || (g.badness == out->badness && g.VmRSSkiB > out->VmRSSkiB)) {
+            *out = g;
+            found = true;
+        }
+    }
+    if (s.overflow) {
+        warn("group: more than %d units, falling back to killing single processes\n", GROUP_MAX);
+    }
+    debug("group: looked at %d processes in %d units using %lu syscalls\n", s.candidates, nused, scan.syscalls);
+    group_reset();
+    return found;
+}
+
+void group_describe(const group_t* g, char* buf, size_t len)
+{
+    if (g->type == KILL_UNIT_CGROUP) {
+        snprintf(buf, len, "cgroup %s", g->cgroup);
+    } else if (g->type == KILL_UNIT_PGRP) {
+        snprintf(buf, len, "process group %d", g->id);
+    } else {
+        snprintf(buf, len, "process %d \"%s\"", g->id, g->leader_name);
+    }
+}
+
+typedef struct {
+    int sig;
+    int sent;
+    int err;
+} group_signal_t;
+
+static void signal_member(int pid, void* ctx)
+{
+    group_signal_t* gs = ctx;
+    if (kill(pid, gs->sig) == 0) {
+        gs->sent++;
+    } else if (errno != ESRCH) {
+        gs->err = errno;
+    }
+}
+
+/* Send `sig` to all members of the unit.
+ * Returns 0 on success, or -1 with errno set.
+ */
+static int group_signal(int cgroup_dirfd, const group_t* g, int sig)
+{
+    if (g->type == KILL_UNIT_PGRP) {
+        return kill(-g->id, sig);
+    }
+    if (sig == SIGKILL) {
+        // cgroup.kill (Linux 5.14+) kills all members including ones
+        // forked while we are at it
+        int res = write_file_at(cgroup_dirfd, "cgroup.kill", "1");
+        if (res == 0) {
+            return 0;
+        }
+        if (res != -ENOENT) {
+            debug("group: writing cgroup.kill failed: %s\n", strerror(-res));
+        }
+    }
+    group_signal_t gs = { .sig = sig };
+    cgroup_dir_for_each_pid(cgroup_dirfd, signal_member, &gs);
+    if (gs.sent == 0 && gs.err != 0) {
+        errno = gs.err;
+        return -1;
+    }
+    return 0;
+}
+
+/* Returns true if the unit has no live members left.
+ * For cgroups, this waits for a change of cgroup.events for up to
+ * `timeout_ms`.
+ */
+static bool group_wait_gone(int events_fd, const group_t* g, int timeout_ms)
+{
+    if (g->type == KILL_UNIT_PGRP) {
+        usleep((useconds_t)timeout_ms * 1000);
+        return kill(-g->id, 0) != 0 && errno == ESRCH;
+    }
+    if (events_fd < 0) {
+        usleep((useconds_t)timeout_ms * 1000);
+        return false;
+    }
+    struct pollfd pfd = { .fd = events_fd, .events = POLLPRI };
+    poll(&pfd, 1, timeout_ms);
+    char buf[256];
+    ssize_t len = pread(events_fd, buf, sizeof(buf) - 1, 0);
+    if (len <= 0) {
+        // The cgroup has been removed
+        return true;
+    }
+    buf[len] = 0;
+    return strstr(buf, "populated 0") != NULL;
+}
+
+/*
+ * Send `sig` to all members of the unit and wait for them to exit
+ * (max 10 seconds). Escalates to SIGKILL like kill_wait().
+ * Returns 0 on success, or -1 with errno set.
+ */
+int group_kill_wait(const poll_loop_args_t* args, const group_t* g, int sig)
+{
+    if (args->dryrun && sig != 0) {
+        warn("dryrun, not actually sending any signal\n");
+        return 0;
+    }
+    int cgroup_dirfd = -1;
+    int events_fd = -1;
+    if (g->type == KILL_UNIT_CGROUP) {
+        char path[2 * PATH_LEN];
+        snprintf(path, sizeof(path), "%s%s", cgroup_root_path, g->cgroup);
+        cgroup_dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (cgroup_dirfd < 0) {
+            return -1;
+        }
+        events_fd = openat(cgroup_dirfd, "cgroup.events", O_RDONLY | O_CLOEXEC);
+    }
+
+    int res = group_signal(cgroup_dirfd, g, sig);
+    double t0 = monotonic_secs();
+    while (res == 0 && sig != 0) {
+        float secs = (float)(monotonic_secs() - t0);
+        if (secs >= 10) {
+            errno = ETIME;
+            res = -1;
+            break;
+        }
+        if (sig != SIGKILL) {
+            meminfo_t m = parse_meminfo();
+            print_mem_stats(debug, m);
+            if (secs >= SIGTERM_WAIT || (m.MemAvailablePercent <= args->mem_kill_percent && m.SwapFreePercent <= args->swap_kill_percent)) {
+                sig = SIGKILL;
+                res = group_signal(cgroup_dirfd, g, sig);
+                // kill first, print after
+                warn("escalating to SIGKILL after %.1f seconds\n", secs);
+                metrics_add(METRIC_ESCALATIONS, 1);
+                if (res != 0) {
+                    break;
+                }
+            }
+        }
+        if (group_wait_gone(events_fd, g, 100)) {
+            double exit_secs = monotonic_secs() - t0;
+            warn("%s exited after %.1f seconds\n", group_unit_name(g->type), (float)exit_secs);
+            metrics_observe(METRIC_EXIT_SECONDS, exit_secs);
+            break;
+        }
+    }
+    int saved_errno = errno;
+    if (events_fd >= 0) {
+        close(events_fd);
+    }
+    if (cgroup_dirfd >= 0) {
+        close(cgroup_dirfd);
+    }
+    errno = saved_errno;
+    return res;
+}
@@ -0,0 +1,52 @@
+/* SPDX-License-Identifier: MIT */
+#ifndef GROUP_H
+#define GROUP_H
+
+#include <stdbool.h>
+
+#include "cgroup.h"
+#include "kill.h"
+#include "meminfo.h"
+
+// Maximum number of distinct units looked at in one scan.
+// If there are more, we fall back to killing single processes.
+#define GROUP_MAX 512
+
+typedef struct {
+    // KILL_UNIT_CGROUP, KILL_UNIT_PGRP, or KILL_UNIT_PROCESS for processes
+    // that can not be killed as a group
+    int type;
+    // The key: pgrp, cgroup, or pid for KILL_UNIT_PROCESS
+    int id;
+    char cgroup[PATH_LEN];
+    int members;
+    // The score of the unit: VmRSS of all members in permille of RAM +
+    // swap, plus the largest adjustment of a member
+    int badness;
+    // Sum over all members
+    long long VmRSSkiB;
+    // oom_score_adj and what badness_adjust() adds, largest over all
+    // members. Counted once, so that many small members with a high
+    // oom_score_adj or a --prefer match do not add up.
+    int max_adjust;
+    // Largest member, for logging
+    int leader_pid;
+    int leader_badness;
+    int leader_adjust;
+    long long leader_VmRSSkiB;
+    char leader_name[16];
+    // Has a member with oom_score_adj = -1000. Such units are never killed
+    // as a whole, instead their largest other member competes on its own.
+    bool protected;
+    // Hash table slot is taken
+    bool in_use;
+} group_t;
+
+void group_init(void);
+int group_parse_unit(const char* name);
+const char* group_unit_name(int type);
+bool group_find_largest(const poll_loop_args_t* args, const cgroup_t* cg, group_t* out);
+int group_kill_wait(const poll_loop_args_t* args, const group_t* g, int sig);
+void group_describe(const group_t* g, char* buf, size_t len);
+
+#endif
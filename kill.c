@@ -2,11 +2,12 @@
 
 /* Kill the most memory-hungy process */
 
-#include <ctype.h>
-#include <dirent.h>
 #include <errno.h>
 #include <limits.h> // for PATH_MAX
+#include <poll.h>
 #include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -16,73 +17,89 @@
 #include <pwd.h>
 #include <unistd.h>
 
+#include "cgroup.h"
+#include "dirscan.h"
+#include "flight.h"
 #include "globals.h"
+#include "group.h"
 #include "kill.h"
 #include "meminfo.h"
+#include "metrics.h"
 #include "msg.h"
+#include "notify.h"
+#include "pidfd.h"
+#include "proctable.h"
+#include "trace.h"
+#include "uring.h"
+#include "workers.h"
 
 #define BADNESS_PREFER 300
 #define BADNESS_AVOID -300
 #define BADNESS_AVOID_USER -150
 #define BADNESS_AGE_DIV 600
 
-#define SIGTERM_WAIT 6.0
 #define EMERG_LIST_MAX 64
-#define PROC_LEN_MAX 32
+// Size of the emerg_kill hash table, more than twice EMERG_LIST_MAX
+#define EMERG_HASH_SIZE 131
+// Check memory after this many emergency kills
+#define EMERG_BATCH 8
+// Process names in /proc/[pid]/comm are truncated to TASK_COMM_LEN - 1
+#define TASK_COMM_LEN 16
 
-static int isnumeric(char* str)
-{
-    int i = 0;
+// emerg_kill names, and a hash table of their indices + 1 (0 = empty slot)
+static char emerg_names[EMERG_LIST_MAX][TASK_COMM_LEN];
+static int emerg_count;
+static unsigned char emerg_slots[EMERG_HASH_SIZE];
 
-    // Empty string is not numeric
-    if (str[0] == 0)
-        return 0;
+// Most user names kept for log lines
+#define USER_NAMES_MAX 256
 
-    while (1) {
-        if (str[i] == 0) // End of string
-            return 1;
+// Sorted uids of the users matching avoid_users
+static uid_t* avoid_uids;
+static size_t avoid_uids_count;
 
-        if (isdigit(str[i]) == 0)
-            return 0;
+// uid -> name for log lines, sorted by uid
+typedef struct {
+    uid_t uid;
+    char name[MAX_USERLEN];
+} user_name_t;
+static user_name_t user_names[USER_NAMES_MAX];
+static size_t user_names_count;
 
-        i++;
+// FNV-1a hash of a process name
+static uint32_t name_hash(const char* name)
+{
+    uint32_t h = 2166136261u;
+    for (const char* c = name; *c; c++) {
+        h = (h ^ (unsigned char)*c) * 16777619u;
     }
+    return h;
 }
 
-static void notify(const char* summary, const char* body)
+// Seconds on the monotonic clock, or on the trace clock when replaying
+double monotonic_secs(void)
 {
-    int pid = fork();
-    if (pid > 0) {
-        // parent
-        return;
+    if (trace_replaying()) {
+        return trace_now();
     }
-    char summary2[1024] = { 0 };
-    snprintf(summary2, sizeof(summary2), "string:%s", summary);
-    char body2[1024] = "string:";
-    if (body != NULL) {
-        snprintf(body2, sizeof(body2), "string:%s", body);
-    }
-    // Complete command line looks like this:
-    // dbus-send --system / net.nuetzlich.SystemNotifications.Notify 'string:summary text' 'string:and body text'
-    execl("/usr/bin/dbus-send", "dbus-send", "--system", "/", "net.nuetzlich.SystemNotifications.Notify",
-        summary2, body2, NULL);
-    warn("notify: exec failed: %s\n", strerror(errno));
-    exit(1);
+    struct timespec ts = { 0 };
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
 }
 
 /*
- * Send the selected signal to "pid" and wait for the process to exit
- * (max 10 seconds)
+ * Send the selected signal to "pid" (through "pidfd" if it is >= 0)
+ * and wait for the process to exit (max 10 seconds)
  */
-int kill_wait(const poll_loop_args_t* args, pid_t pid, int sig)
+int kill_wait(const poll_loop_args_t* args, int pidfd, pid_t pid, int sig)
 {
     if (args->dryrun && sig != 0) {
         warn("dryrun, not actually sending any signal\n");
         return 0;
     }
     meminfo_t m = { 0 };
-    const unsigned poll_ms = 100;
-    int res = kill(pid, sig);
+    const int poll_ms = 100;
+    int res = pidfd_kill(pidfd, pid, sig);
     if (res != 0) {
         return res;
     }
@@ -90,8 +107,15 @@ int kill_wait(const poll_loop_args_t* args, pid_t pid, int sig)
     if (sig == 0) {
         return 0;
     }
-    for (unsigned i = 0; i < 100; i++) {
-        float secs = (float)(i * poll_ms) / 1000;
+    if (sig == SIGKILL) {
+        pidfd_reap(pidfd);
+    }
+    double t0 = monotonic_secs();
+    while (1) {
+        float secs = (float)(monotonic_secs() - t0);
+        if (secs >= 10) {
+            break;
+        }
         // We have sent SIGTERM but now have dropped below SIGKILL limits.
         // Escalate to SIGKILL.
         if (sig != SIGKILL) {
@@ -99,364 +123,1714 @@ int kill_wait(const poll_loop_args_t* args, pid_t pid, int sig)
             print_mem_stats(debug, m);
             if (secs >= SIGTERM_WAIT || (m.MemAvailablePercent <= args->mem_kill_percent && m.SwapFreePercent <= args->swap_kill_percent)) {
                 sig = SIGKILL;
-                res = kill(pid, sig);
+                res = pidfd_kill(pidfd, pid, sig);
                 // kill first, print after
                 warn("escalating to SIGKILL after %.1f seconds\n", secs);
+                metrics_add(METRIC_ESCALATIONS, 1);
                 if (res != 0) {
                     return res;
                 }
+                pidfd_reap(pidfd);
             }
         } else if (enable_debug) {
             m = parse_meminfo();
-            print_mem_stats(printf, m);
+            print_mem_stats(info, m);
         }
-        if (!is_alive(pid)) {
-            warn("process exited after %.1f seconds\n", secs);
+        // Returns as soon as the process exits when we have a pidfd
+        if (pidfd_wait_exit(pidfd, pid, poll_ms)) {
+            double exit_secs = monotonic_secs() - t0;
+            warn("process exited after %.1f seconds\n", (float)exit_secs);
+            metrics_observe(METRIC_EXIT_SECONDS, exit_secs);
             return 0;
         }
-        usleep(poll_ms * 1000);
     }
     errno = ETIME;
     return -1;
 }
 
 /*
- * Find the process with the largest oom_score and kill it.
+ * Get a pidfd for the victim, making sure it still refers to the
+ * process we selected and not to a new one that got the same pid.
+ * Returns the pidfd, -1 if pidfds are not supported (use the plain pid),
+ * or -2 if the victim is gone.
  */
-void kill_largest_process(const poll_loop_args_t* args, int sig)
+static int victim_pidfd(const struct procinfo* victim)
 {
-    struct procinfo victim = { 0 };
-    struct timespec t0 = { 0 }, t1 = { 0 };
-    char ppath[PATH_LEN] = { 0 };
-    struct stat pstat;
-    struct passwd* puser;
-    proctime_t ptimes;
-
-    if (enable_debug) {
-        clock_gettime(CLOCK_MONOTONIC, &t0);
+    int pidfd = pidfd_get(victim->pid);
+    if (pidfd == -ENOSYS) {
+        debug("pidfd_open is not supported by the kernel, using plain pids\n");
+        return -1;
     }
-
-    DIR* procdir = opendir("/proc");
-    if (procdir == NULL) {
-        fatal(5, "Could not open /proc: %s", strerror(errno));
+    if (pidfd < 0) {
+        debug("pidfd_open(%d) failed: %s\n", victim->pid, strerror(-pidfd));
+        return -2;
+    }
+    // The pidfd refers to whatever process has the pid now. Check that this
+    // is still our victim via the start time (pid + starttime is unique).
+    struct procinfo now = { .pid = victim->pid };
+    procscan_t scan;
+    procscan_begin(&scan);
+    int dirfd = procinfo_open(&scan, victim->pid);
+    int res = dirfd;
+    if (dirfd >= 0) {
+        res = procinfo_read(&scan, dirfd, &now, PROC_TIMES);
+        procinfo_close(&scan, dirfd);
     }
+    if (res < 0 || now.starttime != victim->starttime) {
+        close(pidfd);
+        return -2;
+    }
+    return pidfd;
+}
 
-    int candidates = 0;
-    while (1) {
-        errno = 0;
-        struct dirent* d = readdir(procdir);
-        if (d == NULL) {
-            if (errno != 0)
-                warn("userspace_kill: readdir error: %s", strerror(errno));
-            break;
-        }
+// What a scoring rule matches on
+enum {
+    RULE_ON_COMM, // regex on the process name
+    RULE_ON_CGROUP, // regex on the cgroup path
+    RULE_ON_UID, // uid in [lo, hi]
+    RULE_ON_AGE, // running for at least lo seconds
+    RULE_ON_AVOIDED_USER, // avoid_users
+};
 
-        // proc contains lots of directories not related to processes,
-        // skip them
-        if (!isnumeric(d->d_name))
-            continue;
+// What a matching rule does to the badness
+enum {
+    RULE_ADD, // badness += value
+    RULE_MUL, // badness *= value
+    RULE_AGE_DIV, // badness += age in seconds / value
+};
 
-        struct procinfo cur = {
-            .pid = (int)strtol(d->d_name, NULL, 10),
-            .uid = -1,
-            .badness = -1,
-            .VmRSSkiB = -1,
-            .utime = 0,
-            .stime = 0,
-            .rtime = 0
-        };
+typedef struct {
+    unsigned char on;
+    unsigned char action;
+    // RULE_ON_COMM: bit in the match cache mask
+    unsigned char bit;
+    const regex_t* re;
+    long lo, hi;
+    double value;
+} kill_rule_t;
 
-        if (cur.pid <= 1)
-            // Let's not kill init.
-            continue;
+/* The scoring rules, compiled by kill_rules_compile() into one flat table
+ * that badness_adjust() walks: prefer_regex, avoid_regex, prefer_old and
+ * avoid_users first, then the "rule" lines in the order they were given.
+ * rule_fields is what the table needs from /proc, so processes are only
+ * read as far as some rule looks at.
+ */
+static kill_rule_t rules[KILL_RULES_MAX];
+static int rules_count;
+static unsigned rule_fields;
+// Number of RULE_ON_COMM rules, whose results the match cache keeps
+static int comm_rules_count;
+// Bumped by kill_rules_compile(), to invalidate the match caches
+static unsigned rules_generation = 1;
 
-        debug("pid %5d:", cur.pid);
+// From the "rule" lines, before compiling
+static kill_rule_t user_rules[KILL_USER_RULES_MAX];
+static regex_t user_rule_regexes[KILL_USER_RULES_MAX];
+static int user_rules_count;
 
-        {
-            int res = get_oom_score(cur.pid);
-            if (res < 0) {
-                debug(" error reading oom_score: %s\n", strerror(-res));
-                continue;
-            }
-            cur.badness = res;
-        }
-        if (args->ignore_oom_score_adj) {
-            int oom_score_adj = 0;
-            int res = get_oom_score_adj(cur.pid, &oom_score_adj);
-            if (res < 0) {
-                debug(" error reading oom_score_adj: %s\n", strerror(-res));
-                continue;
-            }
-            if (oom_score_adj > 0) {
-                cur.badness -= oom_score_adj;
+// The PROC_* fields a rule needs
+static unsigned rule_needs(const kill_rule_t* r)
+{
+    unsigned fields = r->action == RULE_AGE_DIV ? PROC_TIMES : 0;
+    switch (r->on) {
+    case RULE_ON_COMM:
+        return fields | PROC_COMM;
+    case RULE_ON_CGROUP:
+        return fields | PROC_CGROUP;
+    case RULE_ON_UID:
+    case RULE_ON_AVOIDED_USER:
+        return fields | PROC_UID;
+    case RULE_ON_AGE:
+        return fields | PROC_TIMES;
+    }
+    return fields;
+}
+
+/*
+ * Parse a "rule" line, like "comm ^(chrome|firefox)$ +100":
+ *   comm REGEX | cgroup REGEX | uid N[-M] | age SECONDS
+ * followed by what to do with the badness of matching processes:
+ *   +N / -N (add) | *F (multiply) | age/N (add the age in seconds / N)
+ * The regex may contain spaces. NULL drops all rules.
+ * Returns NULL, or what is wrong with `spec`.
+ */
+const char* kill_rule_add(const char* spec)
+{
+    if (spec == NULL) {
+        for (int i = 0; i < user_rules_count; i++) {
+            if (user_rules[i].re) {
+                regfree(&user_rule_regexes[i]);
             }
         }
+        user_rules_count = 0;
+        return NULL;
+    }
+    if (user_rules_count == KILL_USER_RULES_MAX) {
+        return "too many rules";
+    }
+    char buf[512];
+    snprintf(buf, sizeof(buf), "%s", spec);
+    char* on = buf + strspn(buf, " \t");
+    char* pattern = on + strcspn(on, " \t");
+    if (*pattern == 0) {
+        return "expected WHAT PATTERN ACTION";
+    }
+    *pattern++ = 0;
+    pattern += strspn(pattern, " \t");
+    size_t len = strlen(pattern);
+    while (len > 0 && (pattern[len - 1] == ' ' || pattern[len - 1] == '\t')) {
+        pattern[--len] = 0;
+    }
+    char* action = strrchr(pattern, ' ');
+    char* tab = strrchr(pattern, '\t');
+    if (tab > action) {
+        action = tab;
+    }
+    if (action == NULL) {
+        return "expected WHAT PATTERN ACTION";
+    }
+    *action++ = 0;
+    len = strlen(pattern);
+    while (len > 0 && (pattern[len - 1] == ' ' || pattern[len - 1] == '\t')) {
+        pattern[--len] = 0;
+    }
 
-        // get times for all processes if prefer_old is enabled
-        if (args->prefer_old) {
-            ptimes = get_process_times(cur.pid);
-            if (ptimes.valid) {
-                debug(" [process times: %lu user, %lu sys, %lu real] ", ptimes.c_utime, ptimes.c_stime, ptimes.c_runtime);
-                cur.utime = ptimes.c_utime;
-                cur.stime = ptimes.c_stime;
-                cur.rtime = ptimes.c_runtime;
-            }
+    kill_rule_t r = { 0 };
+    char* end;
+    if (!strcmp(on, "comm") || !strcmp(on, "cgroup")) {
+        r.on = !strcmp(on, "comm") ? RULE_ON_COMM : RULE_ON_CGROUP;
+    } else if (!strcmp(on, "uid")) {
+        r.on = RULE_ON_UID;
+        r.lo = strtol(pattern, &end, 10);
+        r.hi = r.lo;
+        if (*end == '-') {
+            r.hi = strtol(end + 1, &end, 10);
+        }
+        if (end == pattern || *end != 0 || r.lo < 0 || r.hi < r.lo) {
+            return "uid: expected N or N-M";
         }
+    } else if (!strcmp(on, "age")) {
+        r.on = RULE_ON_AGE;
+        r.lo = strtol(pattern, &end, 10);
+        if (end == pattern || *end != 0 || r.lo < 0) {
+            return "age: expected a number of seconds";
+        }
+    } else {
+        return "expected comm, cgroup, uid or age";
+    }
 
-        if ((args->prefer_regex || args->avoid_regex || args->prefer_old)) {
-            int res = get_comm(cur.pid, cur.name, sizeof(cur.name));
-            if (res < 0) {
-                debug(" error reading process name: %s\n", strerror(-res));
-                continue;
-            }
-            if (args->prefer_regex && regexec(args->prefer_regex, cur.name, (size_t)0, NULL, 0) == 0) {
-                cur.badness += BADNESS_PREFER;
-            }
-            if (args->avoid_regex && regexec(args->avoid_regex, cur.name, (size_t)0, NULL, 0) == 0) {
-                cur.badness += BADNESS_AVOID;
-            }
-            if (args->prefer_old && regexec(args->prefer_old, cur.name, (size_t)0, NULL, 0) == 0) {
-                if (ptimes.valid) {
-                    cur.badness += (int)(ptimes.c_runtime / BADNESS_AGE_DIV);
-                }
-            }
+    if (action[0] == '+' || action[0] == '-') {
+        r.action = RULE_ADD;
+        r.value = strtod(action, &end);
+    } else if (action[0] == '*') {
+        r.action = RULE_MUL;
+        r.value = strtod(action + 1, &end);
+    } else if (!strncmp(action, "age/", 4)) {
+        r.action = RULE_AGE_DIV;
+        r.value = strtod(action + 4, &end);
+        if (r.value <= 0) {
+            return "age/N: N must be positive";
         }
+    } else {
+        return "expected +N, -N, *F or age/N";
+    }
+    if (*end != 0 || end == action) {
+        return "could not parse the action";
+    }
 
-        if (args->avoid_users) {
-            snprintf(ppath, sizeof(ppath), "/proc/%d", cur.pid);
-            if (stat(ppath, &pstat) == 0) {
-                if ((puser = getpwuid(pstat.st_uid)) != NULL) {
-                    strncpy(cur.username, puser->pw_name, MAX_USERLEN);
-                    if (regexec(args->avoid_users, cur.username, (size_t)0, NULL, 0) == 0) {
-                        cur.badness += BADNESS_AVOID_USER;
-                    }
-                } else {
-                    debug(" error looking up user with uid %d\n", pstat.st_uid);
-                    continue;
-                }
-            } else {
-                debug(" error stat'ing file: %s: %s\n", ppath, strerror(errno));
-                continue;
-            }
+    if (r.on == RULE_ON_COMM || r.on == RULE_ON_CGROUP) {
+        regex_t* re = &user_rule_regexes[user_rules_count];
+        if (regcomp(re, pattern, REG_EXTENDED | REG_NOSUB) != 0) {
+            return "could not compile the regexp";
         }
+        r.re = re;
+    }
+    user_rules[user_rules_count++] = r;
+    return NULL;
+}
+
+static void rule_append(kill_rule_t r)
+{
+    if (r.on == RULE_ON_COMM) {
+        r.bit = (unsigned char)comm_rules_count++;
+    }
+    rule_fields |= rule_needs(&r);
+    rules[rules_count++] = r;
+}
 
-        debug(" badness %3d", cur.badness);
-        candidates++;
+/*
+ * Build the table that badness_adjust() evaluates from the user
+ * preferences in `args` and the "rule" lines. Call after they are all set,
+ * and while no scan is running.
+ * Returns the number of rules.
+ */
+int kill_rules_compile(const poll_loop_args_t* args)
+{
+    rules_count = 0;
+    comm_rules_count = 0;
+    rule_fields = 0;
+    rules_generation++;
+    if (args->prefer_regex) {
+        rule_append((kill_rule_t) { .on = RULE_ON_COMM, .re = args->prefer_regex, .action = RULE_ADD, .value = BADNESS_PREFER });
+    }
+    if (args->avoid_regex) {
+        rule_append((kill_rule_t) { .on = RULE_ON_COMM, .re = args->avoid_regex, .action = RULE_ADD, .value = BADNESS_AVOID });
+    }
+    if (args->prefer_old) {
+        rule_append((kill_rule_t) { .on = RULE_ON_COMM, .re = args->prefer_old, .action = RULE_AGE_DIV, .value = BADNESS_AGE_DIV });
+    }
+    if (args->avoid_users) {
+        rule_append((kill_rule_t) { .on = RULE_ON_AVOIDED_USER, .action = RULE_ADD, .value = BADNESS_AVOID_USER });
+    }
+    for (int i = 0; i < user_rules_count; i++) {
+        rule_append(user_rules[i]);
+    }
+    return rules_count;
+}
 
-        if (cur.badness < victim.badness) {
-            // skip "type 1", encoded as 1 space
-            debug(" \n");
-            continue;
+/*
+ * PROC_* fields that badness_adjust() needs in addition to PROC_OOM_SCORE
+ */
+unsigned badness_fields(const poll_loop_args_t* args)
+{
+    unsigned fields = rule_fields;
+    if (args->ignore_oom_score_adj) {
+        fields |= PROC_OOM_SCORE_ADJ;
+    }
+    return fields;
+}
+
+// Size of the cache, a power of two. Cleared once it is 3/4 full.
+#define MATCH_CACHE_SIZE 512
+// Longer names are not cached. Kernel workqueue threads have up to 63
+// characters in /proc/[pid]/comm.
+#define MATCH_NAME_LEN 64
+
+typedef struct {
+    char name[MATCH_NAME_LEN];
+    // Bit i: the i-th comm rule matches
+    uint32_t mask;
+    bool used;
+} match_entry_t;
+
+typedef struct {
+    match_entry_t entries[MATCH_CACHE_SIZE];
+    int used;
+    unsigned long hits, misses;
+    // The rules_generation the cached results are for
+    unsigned generation;
+} match_cache_t;
+
+// One per scan thread, so that they do not need a lock
+static match_cache_t match_caches[WORKERS_MAX];
+static __thread match_cache_t* match_cache = &match_caches[0];
+
+static void match_cache_reset(match_cache_t* c)
+{
+    memset(c->entries, 0, sizeof(c->entries));
+    c->used = 0;
+}
+
+// Only while the scan threads are idle
+void kill_match_cache_clear(void)
+{
+    for (int i = 0; i < WORKERS_MAX; i++) {
+        match_cache_reset(&match_caches[i]);
+    }
+}
+
+static uint32_t match_regexes(const char* name)
+{
+    uint32_t mask = 0;
+    for (int i = 0; i < rules_count; i++) {
+        const kill_rule_t* r = &rules[i];
+        if (r->on == RULE_ON_COMM && regexec(r->re, name, (size_t)0, NULL, 0) == 0) {
+            mask |= 1u << r->bit;
         }
+    }
+    return mask;
+}
 
-        {
-            long long res = get_vm_rss_kib(cur.pid);
-            if (res < 0) {
-                debug(" error reading rss: %s\n", strerror((int)-res));
-                continue;
-            }
-            cur.VmRSSkiB = res;
+/*
+ * Which of the comm rules match `name`. Most processes share a few
+ * distinct names, so the results are cached by name.
+ */
+static uint32_t match_name(const char* name)
+{
+    match_cache_t* c = match_cache;
+    if (c->generation != rules_generation) {
+        match_cache_reset(c);
+        c->generation = rules_generation;
+    }
+    size_t len = strlen(name);
+    if (len >= MATCH_NAME_LEN) {
+        c->misses++;
+        return match_regexes(name);
+    }
+    unsigned slot = name_hash(name) & (MATCH_CACHE_SIZE - 1);
+    while (c->entries[slot].used) {
+        if (strcmp(c->entries[slot].name, name) == 0) {
+            c->hits++;
+            return c->entries[slot].mask;
         }
-        debug(" vm_rss %7llu", cur.VmRSSkiB);
-        if (cur.VmRSSkiB == 0) {
-            // Kernel threads have zero rss
-            // skip "type 2", encoded as 2 spaces
-            debug("  \n");
-            continue;
+        slot = (slot + 1) & (MATCH_CACHE_SIZE - 1);
+    }
+    c->misses++;
+    uint32_t mask = match_regexes(name);
+    if (c->used >= MATCH_CACHE_SIZE / 4 * 3) {
+        // Lots of distinct names. Start over rather than probe forever.
+        match_cache_reset(c);
+        return mask;
+    }
+    memcpy(c->entries[slot].name, name, len + 1);
+    c->entries[slot].mask = mask;
+    c->entries[slot].used = true;
+    c->used++;
+    return mask;
+}
+
+static int uid_cmp(const void* a, const void* b)
+{
+    uid_t x = *(const uid_t*)a;
+    uid_t y = *(const uid_t*)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Resolve the avoid_users regex against the user database into a sorted
+ * uid set, so the scan only has to compare st_uid. getpwuid() can go through
+ * NSS and block on the network, which we must not do while memory is low.
+ * Users that are added later, or that NSS does not enumerate, are not
+ * matched. NULL clears the set.
+ * Returns the number of matching users.
+ */
+size_t kill_avoid_users_set(const regex_t* re)
+{
+    size_t cap = 0;
+
+    free(avoid_uids);
+    avoid_uids = NULL;
+    avoid_uids_count = 0;
+    user_names_count = 0;
+    if (re == NULL) {
+        return 0;
+    }
+
+    setpwent();
+    struct passwd* pw;
+    while ((pw = getpwent()) != NULL) {
+        if (user_names_count < USER_NAMES_MAX) {
+            user_names[user_names_count].uid = pw->pw_uid;
+            snprintf(user_names[user_names_count].name, MAX_USERLEN, "%s", pw->pw_name);
+            user_names_count++;
         }
-        if (cur.badness == victim.badness && cur.VmRSSkiB <= victim.VmRSSkiB) {
-            // skip "type 3", encoded as 3 spaces
-            debug("   \n");
+        if (regexec(re, pw->pw_name, (size_t)0, NULL, 0) != 0) {
             continue;
         }
-
-        // Skip processes with oom_score_adj = -1000, like the
-        // kernel oom killer would.
-        int oom_score_adj = 0;
-        {
-            int res = get_oom_score_adj(cur.pid, &oom_score_adj);
-            if (res < 0) {
-                debug(" error reading oom_score_adj: %s\n", strerror(-res));
-                continue;
-            }
-            if (oom_score_adj == -1000) {
-                // skip "type 4", encoded as 3 spaces
-                debug("    \n");
-                continue;
+        if (avoid_uids_count == cap) {
+            cap = cap ? cap * 2 : 16;
+            uid_t* p = realloc(avoid_uids, cap * sizeof(*avoid_uids));
+            if (p == NULL) {
+                fatal(1, "avoid_users: could not allocate %zu uids\n", cap);
             }
+            avoid_uids = p;
         }
+        avoid_uids[avoid_uids_count++] = pw->pw_uid;
+    }
+    endpwent();
 
-        // Fill out remaining fields
-        if (strlen(cur.name) == 0) {
-            int res = get_comm(cur.pid, cur.name, sizeof(cur.name));
-            if (res < 0) {
-                debug(" error reading process name: %s\n", strerror(-res));
-                continue;
-            }
+    qsort(avoid_uids, avoid_uids_count, sizeof(*avoid_uids), uid_cmp);
+    // uid is the first member
+    qsort(user_names, user_names_count, sizeof(*user_names), uid_cmp);
+    return avoid_uids_count;
+}
+
+bool kill_user_avoided(int uid)
+{
+    uid_t key = (uid_t)uid;
+    return avoid_uids_count > 0 && bsearch(&key, avoid_uids, avoid_uids_count, sizeof(*avoid_uids), uid_cmp) != NULL;
+}
+
+/*
+ * Name of the user with `uid` for log lines, or "" if we do not know it.
+ * Only looks at what kill_avoid_users_set() saw, never at NSS.
+ */
+const char* kill_user_name(int uid)
+{
+    uid_t key = (uid_t)uid;
+    const user_name_t* u = bsearch(&key, user_names, user_names_count, sizeof(*user_names), uid_cmp);
+    return u ? u->name : "";
+}
+
+/*
+ * Turn the kernel's oom_score in cur->badness into our badness by applying
+ * the user preferences. The fields from badness_fields() must have been read.
+ * Must be called exactly once per oom_score reading.
+ */
+void badness_adjust(const poll_loop_args_t* args, struct procinfo* cur)
+{
+    if (args->ignore_oom_score_adj && cur->oom_score_adj > 0) {
+        cur->badness -= cur->oom_score_adj;
+    }
+    uint32_t comm_match = comm_rules_count > 0 ? match_name(cur->name) : 0;
+    bool have_times = cur->fields & PROC_TIMES;
+    for (int i = 0; i < rules_count; i++) {
+        const kill_rule_t* r = &rules[i];
+        bool match = false;
+        switch (r->on) {
+        case RULE_ON_COMM:
+            match = comm_match & (1u << r->bit);
+            break;
+        case RULE_ON_CGROUP:
+            match = regexec(r->re, cur->cgroup, (size_t)0, NULL, 0) == 0;
+            break;
+        case RULE_ON_UID:
+            match = cur->uid >= r->lo && cur->uid <= r->hi;
+            break;
+        case RULE_ON_AGE:
+            match = have_times && (long)cur->rtime >= r->lo;
+            break;
+        case RULE_ON_AVOIDED_USER:
+            match = kill_user_avoided(cur->uid);
+            break;
         }
-        {
-            int res = get_uid(cur.pid);
-            if (res < 0) {
-                debug(" error reading uid: %s\n", strerror(-res));
-                continue;
-            }
-            cur.uid = res;
+        if (!match) {
+            continue;
         }
+        if (r->action == RULE_ADD) {
+            cur->badness += (int)r->value;
+        } else if (r->action == RULE_MUL) {
+            cur->badness = (int)(cur->badness * r->value);
+        } else if (have_times) {
+            cur->badness += (int)((double)cur->rtime / r->value);
+        }
+    }
+    if (args->prefer_growing > 0) {
+        cur->badness += proctable_growth_bonus(cur->pid, args->prefer_growing);
+    }
+}
 
-        // Save new victim
-        victim = cur;
-        debug(" uid %4d oom_score_adj %4d \"%s\" <--- new victim\n", victim.uid, oom_score_adj, victim.name);
-
-    } // end of while(1) loop
-    closedir(procdir);
+// The debug line about the candidate being looked at. It is put together
+// piece by piece and printed with one debug() call once it ends in a
+// newline, so that the lines of the scan threads do not interleave.
+static __thread char cand_line[MSG_LEN];
+static __thread size_t cand_len;
 
-    if (candidates <= 1 && victim.pid == getpid()) {
-        warn("Only found myself (pid %d) in /proc. Do you use hidpid? See https://github.com/rfjakob/earlyoom/wiki/proc-hidepid\n",
-            victim.pid);
-        victim.pid = 0;
+static void cand_debug(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+static void cand_debug(const char* fmt, ...)
+{
+    if (!enable_debug) {
+        return;
+    }
+    va_list vl;
+    va_start(vl, fmt);
+    int res = vsnprintf(cand_line + cand_len, sizeof(cand_line) - cand_len, fmt, vl);
+    va_end(vl);
+    if (res > 0) {
+        cand_len += (size_t)res;
+        if (cand_len >= sizeof(cand_line)) {
+            // Truncated, keep the newline
+            cand_len = sizeof(cand_line) - 1;
+            cand_line[cand_len - 1] = '\n';
+        }
+    }
+    if (cand_len > 0 && cand_line[cand_len - 1] == '\n') {
+        debug("%s", cand_line);
+        cand_len = 0;
     }
+}
 
-    if (victim.pid <= 0) {
-        warn("Could not find a process to kill. Sleeping 1 second.\n");
-        if (args->notify) {
-            notify("earlyoom", "Error: Could not find a process to kill. Sleeping 1 second.");
+/*
+ * Read the attributes of `cur` that are needed to decide whether it is
+ * a better victim than `victim`. Attributes are read lazily from the
+ * pinned /proc/[pid] directory `dirfd`, cheapest and most selective first.
+ * Attributes that are already present in cur->fields are not read again.
+ * `adjusted` says that badness_adjust() has been applied to cur->badness
+ * already.
+ * Returns true if `cur` should become the new victim.
+ */
+static bool is_larger(const poll_loop_args_t* args, procscan_t* scan, int dirfd, const struct procinfo* victim, struct procinfo* cur, bool adjusted)
+{
+    {
+        int res = procinfo_read(scan, dirfd, cur, PROC_OOM_SCORE);
+        if (res < 0) {
+            cand_debug(" error reading oom_score: %s\n", strerror(-res));
+            return false;
+        }
+    }
+    if (args->ignore_oom_score_adj) {
+        int res = procinfo_read(scan, dirfd, cur, PROC_OOM_SCORE_ADJ);
+        if (res < 0) {
+            cand_debug(" error reading oom_score_adj: %s\n", strerror(-res));
+            return false;
         }
-        sleep(1);
-        return;
     }
 
-    if (enable_debug) {
-        clock_gettime(CLOCK_MONOTONIC, &t1);
-        long delta = (t1.tv_sec - t0.tv_sec) * 1000000 + (t1.tv_nsec - t0.tv_nsec) / 1000;
-        debug("selecting victim took %ld.%03ld ms\n", delta / 1000, delta % 1000);
+    // Only what the scoring rules look at
+    if (rule_fields & PROC_TIMES) {
+        int res = procinfo_read(scan, dirfd, cur, PROC_TIMES);
+        if (res == 0) {
+            cand_debug(" [process times: %lu user, %lu sys, %lu real] ", cur->utime, cur->stime, cur->rtime);
+        } else {
+            cand_debug(" [error reading process times: %s] ", strerror(-res));
+        }
+    }
+    if (rule_fields & ~(unsigned)PROC_TIMES) {
+        int res = procinfo_read(scan, dirfd, cur, rule_fields & ~(unsigned)PROC_TIMES);
+        if (res < 0) {
+            cand_debug(" error reading process name, uid or cgroup: %s\n", strerror(-res));
+            return false;
+        }
     }
 
-    char* sig_name = "?";
-    if (sig == SIGTERM) {
-        sig_name = "SIGTERM";
-    } else if (sig == SIGKILL) {
-        sig_name = "SIGKILL";
-    } else if (sig == 0) {
-        sig_name = "0 (no-op signal)";
+    if (!adjusted) {
+        badness_adjust(args, cur);
     }
-    // sig == 0 is used as a self-test during startup. Don't notifiy the user.
-    if (sig != 0 || enable_debug) {
-        warn("sending %s to process %d uid %d/%s \"%s\": badness %d, VmRSS %lld MiB, %lu re / %lu u / %lu s\n",
-            sig_name, victim.pid, victim.uid, victim.username, victim.name, victim.badness, victim.VmRSSkiB / 1024,
-            victim.rtime, victim.utime, victim.stime);
+
+    cand_debug(" badness %3d", cur->badness);
+
+    if (cur->badness < victim->badness) {
+        // skip "type 1", encoded as 1 space
+        cand_debug(" \n");
+        return false;
     }
 
-    int res = kill_wait(args, victim.pid, sig);
-    int saved_errno = errno;
+    {
+        int res = procinfo_read(scan, dirfd, cur, PROC_RSS);
+        if (res < 0) {
+            cand_debug(" error reading rss: %s\n", strerror(-res));
+            return false;
+        }
+    }
+    cand_debug(" vm_rss %7llu", cur->VmRSSkiB);
+    if (cur->VmRSSkiB == 0) {
+        // Kernel threads have zero rss
+        // skip "type 2", encoded as 2 spaces
+        cand_debug("  \n");
+        return false;
+    }
+    if (cur->badness == victim->badness && cur->VmRSSkiB <= victim->VmRSSkiB) {
+        // skip "type 3", encoded as 3 spaces
+        cand_debug("   \n");
+        return false;
+    }
 
-    // Send the GUI notification AFTER killing a process. This makes it more likely
-    // that there is enough memory to spawn the notification helper.
-    if (sig != 0) {
-        char notif_args[PATH_MAX + 1000];
-        snprintf(notif_args, sizeof(notif_args),
-            "Low memory! Killing process %d %s", victim.pid, victim.name);
-        if (args->notify) {
-            notify("earlyoom", notif_args);
+    // Skip processes with oom_score_adj = -1000, like the
+    // kernel oom killer would.
+    {
+        int res = procinfo_read(scan, dirfd, cur, PROC_OOM_SCORE_ADJ);
+        if (res < 0) {
+            cand_debug(" error reading oom_score_adj: %s\n", strerror(-res));
+            return false;
+        }
+        if (cur->oom_score_adj == -1000) {
+            // skip "type 4", encoded as 3 spaces
+            cand_debug("    \n");
+            return false;
         }
     }
 
-    if (sig == 0) {
-        return;
+    // Fill out remaining fields
+    {
+        // PROC_TIMES: we need the starttime to recognize the victim later
+        int res = procinfo_read(scan, dirfd, cur, PROC_COMM | PROC_UID | PROC_TIMES);
+        if (res < 0) {
+            cand_debug(" error reading process name or uid: %s\n", strerror(-res));
+            return false;
+        }
     }
+    return true;
+}
 
-    if (res != 0) {
-        warn("kill failed: %s\n", strerror(saved_errno));
-        if (args->notify) {
-            notify("earlyoom", "Error: Failed to kill process");
+/*
+ * Like is_larger(), but for a kill on behalf of the NUMA node
+ * scan->numa_node: The badness is computed like the kernel's oom_badness()
+ * from what the process has resident on that node, instead of taken from
+ * oom_score. Reading numa_maps is expensive, so it is only read if the
+ * process could beat `victim` even with all of its RSS on the node.
+ */
+static bool is_larger_on_node(const poll_loop_args_t* args, procscan_t* scan, int dirfd, const struct procinfo* victim, struct procinfo* cur)
+{
+    {
+        int res = procinfo_read(scan, dirfd, cur, PROC_OOM_SCORE_ADJ | PROC_RSS | badness_fields(args));
+        if (res < 0) {
+            cand_debug(" error reading process attributes: %s\n", strerror(-res));
+            return false;
         }
-        // Killing the process may have failed because we are not running as root.
-        // In that case, trying again in 100ms will just yield the same error.
-        // Throttle ourselves to not spam the log.
-        if (saved_errno == EPERM) {
-            warn("sleeping 1 second\n");
-            sleep(1);
+    }
+    if (cur->oom_score_adj == -1000 || cur->VmRSSkiB == 0) {
+        cand_debug(" \n");
+        return false;
+    }
+    // oom_score_adj and the user preferences, without the memory part
+    cur->badness = cur->oom_score_adj;
+    badness_adjust(args, cur);
+    int bound = cur->badness + (int)(cur->VmRSSkiB * 1000 / scan->numa_total_kib);
+    if (bound < victim->badness) {
+        cand_debug(" bound %4d\n", bound);
+        return false;
+    }
+    {
+        int res = procinfo_read(scan, dirfd, cur, PROC_NUMA);
+        if (res < 0) {
+            cand_debug(" error reading numa_maps: %s\n", strerror(-res));
+            return false;
+        }
+    }
+    cur->badness += (int)(cur->NodeKiB * 1000 / scan->numa_total_kib);
+    cand_debug(" node badness %4d node_rss %7lld", cur->badness, cur->NodeKiB);
+    if (cur->NodeKiB == 0 || cur->badness < victim->badness
+        || (cur->badness == victim->badness && cur->NodeKiB <= victim->NodeKiB)) {
+        cand_debug("  \n");
+        return false;
+    }
+    {
+        int res = procinfo_read(scan, dirfd, cur, PROC_OOM_SCORE | PROC_COMM | PROC_UID | PROC_TIMES);
+        if (res < 0) {
+            cand_debug(" error reading process name or uid: %s\n", strerror(-res));
+            return false;
         }
     }
+    return true;
 }
 
-int kill_emergency(const poll_loop_args_t* args)
-{
-    char victim_list[EMERG_LIST_MAX][PROC_LEN_MAX] = { 0 };
-    meminfo_t m = { 0 };
-    int kills = 0;
-    const char vtok[2] = ",";
-    char emerg_kill_str[EMERG_KILL_MAXLEN];
+// The best victims found so far, best first
+typedef struct {
+    struct procinfo* list;
+    int n;
+    int max;
+} victims_t;
 
-    // create a copy of args->emerg_kill, since strtok
-    // will screw up our data by injecting NULLs into it
-    strncpy(emerg_kill_str, args->emerg_kill, EMERG_KILL_MAXLEN);
+/*
+ * What a process has to beat to get into `v`
+ */
+static const struct procinfo* victims_threshold(const victims_t* v)
+{
+    static const struct procinfo none = { 0 };
+    return v->n < v->max ? &none : &v->list[v->n - 1];
+}
 
-    int num_victim = 0;
-    char* ttok = strtok(emerg_kill_str, vtok);
+/*
+ * Insert `cur` at its rank, dropping the last entry if `v` is full.
+ */
+static void victims_insert(victims_t* v, const struct procinfo* cur)
+{
+    int i = v->n < v->max ? v->n : v->max - 1;
+    while (i > 0 && (cur->badness > v->list[i - 1].badness || (cur->badness == v->list[i - 1].badness && cur->VmRSSkiB > v->list[i - 1].VmRSSkiB))) {
+        v->list[i] = v->list[i - 1];
+        i--;
+    }
+    v->list[i] = *cur;
+    if (v->n < v->max) {
+        v->n++;
+    }
+}
 
-    while (ttok != NULL) {
-        strncpy(victim_list[num_victim], ttok, PROC_LEN_MAX);
-        ttok = strtok(NULL, vtok);
-        num_victim++;
+/*
+ * Add `cur` to the victims if it is larger than the last one. `adjusted`
+ * as for is_larger(), the node badness is never adjusted beforehand.
+ */
+static void consider(const poll_loop_args_t* args, procscan_t* scan, int dirfd, struct procinfo* cur, bool adjusted, victims_t* v, int* candidates)
+{
+    bool larger;
+    if (scan->numa_node >= 0) {
+        larger = is_larger_on_node(args, scan, dirfd, victims_threshold(v), cur);
+    } else {
+        larger = is_larger(args, scan, dirfd, victims_threshold(v), cur, adjusted);
     }
 
-    for (int i = 0; i < num_victim; i++) {
-        m = parse_meminfo();
-        if (m.MemAvailablePercent > args->mem_high_percent) {
-            break;
-        }
+    // The node badness does not need oom_score
+    if (cur->fields & (scan->numa_node >= 0 ? PROC_OOM_SCORE_ADJ : PROC_OOM_SCORE)) {
+        (*candidates)++;
+    }
+    if (larger) {
+        victims_insert(v, cur);
+        cand_debug(" uid %4d oom_score_adj %4d \"%s\" <--- new victim\n", cur->uid, cur->oom_score_adj, cur->name);
+    }
+}
 
-        char* victim_name = victim_list[i];
-        warn("kill_emergency: killing all processes with name '%s'\n", victim_name);
+static struct procinfo candidate(int pid)
+{
+    return (struct procinfo) {
+        .pid = pid,
+        .uid = -1,
+        .badness = -1,
+        .VmRSSkiB = -1,
+    };
+}
 
-        DIR* procdir = opendir("/proc");
-        if (procdir == NULL) {
-            fatal(5, "Could not open /proc: %s", strerror(errno));
-        }
+/*
+ * Look at process `cur` and add it to the victims if it is larger.
+ * Fields already in cur->fields are not read again, `adjusted` as for
+ * is_larger().
+ */
+static void consider_read(const poll_loop_args_t* args, procscan_t* scan, struct procinfo* cur, bool adjusted, victims_t* v, int* candidates)
+{
+    cand_debug("pid %5d:", cur->pid);
 
-        while (1) {
-            errno = 0;
-            struct dirent* d = readdir(procdir);
-            if (d == NULL) {
-                if (errno != 0) warn("kill_emergency: readdir error: %s", strerror(errno));
-                break;
-            }
+    int dirfd = procinfo_open(scan, cur->pid);
+    if (dirfd < 0) {
+        cand_debug(" error opening process directory: %s\n", strerror(-dirfd));
+        return;
+    }
+    // When recording, read everything, so that the replay can
+    // use any configuration
+    if (trace_collecting() && procinfo_read(scan, dirfd, cur, TRACE_PROC_FIELDS) == 0) {
+        trace_candidate(cur);
+    }
+    consider(args, scan, dirfd, cur, adjusted, v, candidates);
+    procinfo_close(scan, dirfd);
+}
 
-            // proc contains lots of directories not related to processes,
-            // skip them
-            if (!isnumeric(d->d_name)) continue;
-
-            struct procinfo cur = {
-                .pid = (int)strtol(d->d_name, NULL, 10),
-                .uid = -1,
-                .badness = -1,
-                .VmRSSkiB = -1,
-                .utime = 0,
-                .stime = 0,
-                .rtime = 0
-            };
-
-            if (cur.pid <= 1)
-                // Let's not kill init.
-                continue;
-
-            if (strlen(cur.name) == 0) {
-                int res = get_comm(cur.pid, cur.name, sizeof(cur.name));
-                if (res < 0) {
-                    debug(" error reading process name: %s\n", strerror(-res));
-                    continue;
-                }
-            }
+/*
+ * Look at process `pid` and add it to the victims if it is larger.
+ */
+static void consider_pid(const poll_loop_args_t* args, procscan_t* scan, int pid, victims_t* v, int* candidates)
+{
+    struct procinfo cur = candidate(pid);
+    consider_read(args, scan, &cur, false, v, candidates);
+}
 
-            if (!strcmp(cur.name, victim_name)) {
-                debug("kill_emergency: sending SIGKILL to process %d (%s)\n", cur.pid, cur.name);
-                kill(cur.pid, SIGKILL);
-                kills++;
+/*
+ * Look at the `n` processes in `batch`, reading their cheap fields through
+ * io_uring first. Most processes can be dismissed by those alone, with the
+ * same checks is_larger() starts with, without opening /proc/[pid]. The
+ * others, and everything that could not be read, go through the
+ * synchronous path. Each badness is adjusted only once.
+ */
+static void consider_batch(const poll_loop_args_t* args, procscan_t* scan, struct procinfo* batch, int n, unsigned fields, victims_t* v, int* candidates)
+{
+    if (uring_read(scan, batch, n, fields) < 0) {
+        for (int i = 0; i < n; i++) {
+            consider_read(args, scan, &batch[i], false, v, candidates);
+        }
+        return;
+    }
+    for (int i = 0; i < n; i++) {
+        struct procinfo* cur = &batch[i];
+        if ((cur->fields & fields) != fields) {
+            consider_read(args, scan, cur, false, v, candidates);
+            continue;
+        }
+        badness_adjust(args, cur);
+        const struct procinfo* victim = victims_threshold(v);
+        if (cur->badness < victim->badness || cur->VmRSSkiB == 0
+            || (cur->badness == victim->badness && cur->VmRSSkiB <= victim->VmRSSkiB)) {
+            // is_larger() dismisses it with what is there, without touching
+            // the dirfd, and logs it like the synchronous path
+            cand_debug("pid %5d:", cur->pid);
+            consider(args, scan, -1, cur, true, v, candidates);
+            continue;
+        }
+        consider_read(args, scan, cur, true, v, candidates);
+    }
+}
+
+/*
+ * Pick the victim from the candidates of the last recorded victim selection.
+ */
+static void find_largest_replay(const poll_loop_args_t* args, procscan_t* scan, victims_t* v, int* candidates)
+{
+    int n = 0;
+    const struct procinfo* recorded = trace_replay_candidates(&n);
+
+    for (int i = 0; i < n; i++) {
+        struct procinfo cur = recorded[i];
+        cand_debug("pid %5d:", cur.pid);
+        // All fields are there, so is_larger() does not touch the dirfd
+        consider(args, scan, -1, &cur, false, v, candidates);
+    }
+}
+
+// Pids per round of the parallel scan
+#define SCAN_CHUNK 16384
+
+typedef struct {
+    const poll_loop_args_t* args;
+    const procscan_t* scan;
+    const int* pids;
+    int n;
+    int max;
+} scan_round_t;
+
+// What each scan thread found in its part of a round
+static struct {
+    procscan_t scan;
+    victims_t v;
+    int candidates;
+    struct procinfo list[BATCH_MAX];
+} scan_parts[WORKERS_MAX];
+
+static void scan_part(int worker, void* ctx)
+{
+    const scan_round_t* r = ctx;
+    int per = (r->n + workers_count() - 1) / workers_count();
+    int from = worker * per;
+    int to = from + per < r->n ? from + per : r->n;
+
+    match_cache = &match_caches[worker];
+    scan_parts[worker].scan = *r->scan;
+    scan_parts[worker].scan.syscalls = 0;
+    scan_parts[worker].v = (victims_t) { scan_parts[worker].list, 0, r->max };
+    scan_parts[worker].candidates = 0;
+    for (int i = from; i < to; i++) {
+        consider_pid(r->args, &scan_parts[worker].scan, r->pids[i], &scan_parts[worker].v, &scan_parts[worker].candidates);
+    }
+}
+
+/*
+ * Split `pids` between the scan threads, and merge what they found into
+ * `v`. The parts are contiguous and merged in order, so ties are resolved
+ * like in the serial scan.
+ */
+static void scan_parallel(const poll_loop_args_t* args, procscan_t* scan, const int* pids, int n, victims_t* v, int* candidates)
+{
+    scan_round_t r = { args, scan, pids, n, v->max };
+    workers_run(scan_part, &r);
+    for (int w = 0; w < workers_count(); w++) {
+        scan->syscalls += scan_parts[w].scan.syscalls;
+        *candidates += scan_parts[w].candidates;
+        for (int i = 0; i < scan_parts[w].v.n; i++) {
+            const struct procinfo* cur = &scan_parts[w].list[i];
+            const struct procinfo* last = victims_threshold(v);
+            if (cur->badness > last->badness || (cur->badness == last->badness && cur->VmRSSkiB > last->VmRSSkiB)) {
+                victims_insert(v, cur);
+            }
+        }
+    }
+}
+
+/*
+ * Scan all of /proc for the process with the largest oom_score.
+ */
+static void find_largest_scan(const poll_loop_args_t* args, procscan_t* scan, victims_t* v, int* candidates)
+{
+    dirscan_t procdir;
+    int res = dirscan_open(&procdir, procdir_path);
+    if (res < 0) {
+        fatal(5, "Could not open %s: %s", procdir_path, strerror(-res));
+    }
+    // The io_uring batches can only dismiss processes if badness_adjust()
+    // needs nothing that they can not read. Recording and the node badness
+    // need more than that anyway.
+    static struct procinfo batch[URING_BATCH];
+    unsigned fields = PROC_OOM_SCORE | PROC_RSS | badness_fields(args);
+    int batch_max = 0;
+    int n = 0;
+    if (uring_enabled() && !trace_collecting() && scan->numa_node < 0 && (fields & ~(unsigned)URING_FIELDS) == 0) {
+        batch_max = uring_batch_max(fields);
+    }
+    // Pids for the scan threads. Not when recording, the trace is
+    // written by the poll loop thread only.
+    static int pids[SCAN_CHUNK];
+    bool parallel = batch_max == 0 && workers_count() > 1 && !trace_collecting() && v->max <= BATCH_MAX;
+
+    while (1) {
+        // proc contains lots of directories not related to processes,
+        // dirscan_next_pid() skips them
+        errno = 0;
+        int pid = dirscan_next_pid(&procdir);
+        if (pid == 0) {
+            if (errno != 0)
+                warn("userspace_kill: getdents64 error: %s", strerror(errno));
+            break;
+        }
+
+        if (pid <= 1)
+            // Let's not kill init.
+            continue;
+
+        if (parallel) {
+            pids[n++] = pid;
+            if (n == SCAN_CHUNK) {
+                scan_parallel(args, scan, pids, n, v, candidates);
+                n = 0;
+            }
+            continue;
+        }
+        if (batch_max == 0) {
+            consider_pid(args, scan, pid, v, candidates);
+            continue;
+        }
+        batch[n++] = candidate(pid);
+        if (n == batch_max) {
+            consider_batch(args, scan, batch, n, fields, v, candidates);
+            n = 0;
+        }
+    } // end of while(1) loop
+    if (n > 0 && parallel) {
+        scan_parallel(args, scan, pids, n, v, candidates);
+    } else if (n > 0) {
+        consider_batch(args, scan, batch, n, fields, v, candidates);
+    }
+    scan->syscalls += procdir.syscalls;
+    dirscan_close(&procdir);
+}
+
+/*
+ * Find the process with the largest oom_score using the process table:
+ * Only the top entries of the table, and processes that appeared since
+ * they were last refreshed, are read from /proc.
+ * Returns false if there were too many untracked processes.
+ */
+static bool find_largest_cached(const poll_loop_args_t* args, procscan_t* scan, victims_t* v, int* candidates)
+{
+    static int untracked[PROCTABLE_UNTRACKED_MAX];
+    static int top[PROCTABLE_TOP_MAX];
+
+    proctable_sync(args);
+    int n_untracked = proctable_untracked(untracked, PROCTABLE_UNTRACKED_MAX);
+    if (n_untracked < 0) {
+        debug("proctable: more than %d untracked processes\n", PROCTABLE_UNTRACKED_MAX);
+        return false;
+    }
+    for (int i = 0; i < n_untracked; i++) {
+        consider_pid(args, scan, untracked[i], v, candidates);
+    }
+    // The cached values are only used for ranking. Attributes of the top
+    // entries are read again, as they may have changed since the refresh,
+    // or the pid may belong to a different process by now.
+    int n_top = proctable_top(top, PROCTABLE_TOP_MAX);
+    for (int i = 0; i < n_top; i++) {
+        consider_pid(args, scan, top[i], v, candidates);
+    }
+    debug("proctable: %d processes tracked, looked at %d untracked and %d top entries\n",
+        proctable_count(), n_untracked, n_top);
+
+    // Check how often the pre-ranked pick matches a full scan, so we know
+    // whether we can trust it. Only in debug mode, as this costs a full scan.
+    if (enable_debug) {
+        static int selections, matches;
+        struct procinfo full = { 0 };
+        victims_t full_v = { &full, 0, 1 };
+        procscan_t full_scan;
+        int full_candidates = 0;
+        int pick = v->n > 0 ? v->list[0].pid : 0;
+
+        debug("proctable: verifying the pick against a full scan\n");
+        procscan_begin(&full_scan);
+        find_largest_scan(args, &full_scan, &full_v, &full_candidates);
+        selections++;
+        if (full.pid == pick) {
+            matches++;
+        } else {
+            debug("proctable: full scan picked pid %d \"%s\" instead of pid %d \"%s\"\n",
+                full.pid, full.name, pick, v->n > 0 ? v->list[0].name : "");
+        }
+        debug("proctable: pre-ranked pick matched the full scan in %d of %d selections (%.1f%%)\n",
+            matches, selections, 100 * (double)matches / selections);
+    }
+    return true;
+}
+
+typedef struct {
+    const poll_loop_args_t* args;
+    procscan_t* scan;
+    victims_t* v;
+    int* candidates;
+} cgroup_scan_ctx_t;
+
+static void consider_cgroup_pid(int pid, void* ctx)
+{
+    cgroup_scan_ctx_t* c = ctx;
+    // Let's not kill init.
+    if (pid <= 1) {
+        return;
+    }
+    consider_pid(c->args, c->scan, pid, c->v, c->candidates);
+}
+
+// Numbers from the last find_largest_process() call, for benchmarks
+static int last_scan_candidates;
+static unsigned long last_scan_syscalls;
+
+void kill_scan_stats(int* candidates, unsigned long* syscalls)
+{
+    *candidates = last_scan_candidates;
+    *syscalls = last_scan_syscalls;
+}
+
+/*
+ * Find the `max` processes with the largest oom_score, only looking at
+ * members of `cg` (and its descendants) if it is not NULL, or with the
+ * largest badness on NUMA node `node` if that is not NULL, in one scan.
+ * Stores them in `out`, largest first, and returns how many there are.
+ */
+static int find_victims(const poll_loop_args_t* args, const cgroup_t* cg, const numa_node_t* node, struct procinfo* out, int max)
+{
+    // The flight recorder wants the top few, even if we need fewer
+    struct procinfo top[FLIGHT_TOP];
+    bool record = flight_enabled() && max < FLIGHT_TOP;
+    victims_t v = { record ? top : out, 0, record ? FLIGHT_TOP : max };
+    procscan_t scan;
+    int candidates = 0;
+    struct timespec t0 = { 0 }, t1 = { 0 };
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    procscan_begin(&scan);
+    if (node) {
+        // The process table ranks by oom_score, which says nothing
+        // about the node
+        debug("looking for a victim on NUMA node %d\n", node->node);
+        scan.numa_node = node->node;
+        scan.numa_total_kib = node->total_kib;
+        find_largest_scan(args, &scan, &v, &candidates);
+    } else if (trace_replaying()) {
+        find_largest_replay(args, &scan, &v, &candidates);
+    } else if (cg) {
+        cgroup_scan_ctx_t ctx = { args, &scan, &v, &candidates };
+        debug("looking for a victim in cgroup %s\n", cg->path);
+        cgroup_for_each_pid(cg, consider_cgroup_pid, &ctx);
+    } else if (!proctable_enabled() || !find_largest_cached(args, &scan, &v, &candidates)) {
+        find_largest_scan(args, &scan, &v, &candidates);
+    }
+    debug("looked at %d processes using %lu syscalls (%.1f per process)\n",
+        candidates, scan.syscalls, candidates ? (double)scan.syscalls / candidates : 0);
+    unsigned long match_hits = 0, match_misses = 0;
+    int match_used = 0;
+    for (int i = 0; i < workers_count(); i++) {
+        match_hits += match_caches[i].hits;
+        match_misses += match_caches[i].misses;
+        match_used += match_caches[i].used;
+    }
+    if (match_hits + match_misses > 0) {
+        debug("regex cache: %lu hits, %lu misses (%.1f%% hit rate), %d names cached\n",
+            match_hits, match_misses, 100 * (double)match_hits / (double)(match_hits + match_misses), match_used);
+    }
+    last_scan_candidates = candidates;
+    last_scan_syscalls = scan.syscalls;
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    flight_scan((double)(t1.tv_sec - t0.tv_sec) + (double)(t1.tv_nsec - t0.tv_nsec) / 1e9, candidates, v.list, v.n);
+    if (record) {
+        v.n = v.n < max ? v.n : max;
+        memcpy(out, top, sizeof(top[0]) * (size_t)v.n);
+    }
+
+    if (candidates <= 1 && v.n == 1 && out[0].pid == getpid()) {
+        warn("Only found myself (pid %d) in /proc. Do you use hidpid? See https://github.com/rfjakob/earlyoom/wiki/proc-hidepid\n",
+            out[0].pid);
+        return 0;
+    }
+    return v.n;
+}
+
+int find_largest_processes(const poll_loop_args_t* args, const cgroup_t* cg, struct procinfo* out, int max)
+{
+    return find_victims(args, cg, NULL, out, max);
+}
+
+/*
+ * Find the process with the largest oom_score, only looking at members
+ * of `cg` (and its descendants) if it is not NULL.
+ * Returns a procinfo with pid 0 if there is none.
+ */
+struct procinfo find_largest_process(const poll_loop_args_t* args, const cgroup_t* cg)
+{
+    struct procinfo victim = { 0 };
+    if (find_largest_processes(args, cg, &victim, 1) == 0) {
+        victim.pid = 0;
+    }
+    return victim;
+}
+
+// What we sent the last signal to, for the status file
+static char last_victim[PATH_LEN + 64];
+
+const char* kill_last_victim(void)
+{
+    return last_victim;
+}
+
+static const char* sig_name(int sig)
+{
+    if (sig == SIGTERM) {
+        return "SIGTERM";
+    } else if (sig == SIGKILL) {
+        return "SIGKILL";
+    } else if (sig == 0) {
+        return "0 (no-op signal)";
+    }
+    return "?";
+}
+
+/*
+ * Notify the user and handle errors after sending `sig` to `what`,
+ * which are `n` processes or units.
+ */
+static void kill_done(const poll_loop_args_t* args, int sig, const char* what, int n, int res, int saved_errno)
+{
+    if (sig == 0) {
+        return;
+    }
+    snprintf(last_victim, sizeof(last_victim), "%s", what);
+    flight_killed(what);
+    if (res == 0) {
+        metrics_add(sig == SIGKILL ? METRIC_SIGKILL : METRIC_SIGTERM, (unsigned long)n);
+    }
+
+    // Send the GUI notification AFTER killing a process. This makes it more likely
+    // that there is enough memory to spawn the notification helper.
+    char notif_args[PATH_MAX + 1000];
+    snprintf(notif_args, sizeof(notif_args), "Low memory! Killing %s", what);
+    if (args->notify) {
+        notify("earlyoom", notif_args);
+    }
+
+    if (res != 0) {
+        warn("kill failed: %s\n", strerror(saved_errno));
+        if (args->notify) {
+            notify("earlyoom", "Error: Failed to kill process");
+        }
+        // Killing the process may have failed because we are not running as root.
+        // In that case, trying again in 100ms will just yield the same error.
+        // Throttle ourselves to not spam the log.
+        if (saved_errno == EPERM) {
+            metrics_add(METRIC_EPERM, 1);
+            warn("sleeping 1 second\n");
+            sleep(1);
+        }
+    }
+}
+
+static void selection_done(const struct timespec* t0, int sig)
+{
+    struct timespec t1 = { 0 };
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    long delta = (t1.tv_sec - t0->tv_sec) * 1000000 + (t1.tv_nsec - t0->tv_nsec) / 1000;
+    debug("selecting victim took %ld.%03ld ms\n", delta / 1000, delta % 1000);
+    // sig == 0 is the startup self-test
+    if (sig != 0) {
+        metrics_observe(METRIC_SELECTION_SECONDS, (double)delta / 1e6);
+    }
+}
+
+/*
+ * Kill all members of the unit `g`.
+ */
+static void kill_group(const poll_loop_args_t* args, const group_t* g, int sig)
+{
+    char what[PATH_LEN + 64];
+    group_describe(g, what, sizeof(what));
+
+    // sig == 0 is used as a self-test during startup. Don't notifiy the user.
+    if (sig != 0 || enable_debug) {
+        warn_victim(g->leader_pid, g->badness, g->VmRSSkiB, "sending %s to %s: %d processes, badness %d, VmRSS %lld MiB, largest is process %d \"%s\"\n",
+            sig_name(sig), what, g->members, g->badness, g->VmRSSkiB / 1024, g->leader_pid, g->leader_name);
+    }
+    int res = group_kill_wait(args, g, sig);
+    kill_done(args, sig, what, 1, res, errno);
+}
+
+/*
+ * Number of victims from the top of `list` that are needed to get back to
+ * the high watermark: the shortest prefix whose VmRSS + VmSwap covers the
+ * deficit. Victims that have exited in the meantime are dropped.
+ */
+static int batch_select(const poll_loop_args_t* args, struct procinfo* list, int n)
+{
+    meminfo_t m = parse_meminfo();
+    // We are not out of trouble below the SIGTERM limit, even if the high
+    // watermark is lower
+    double target = args->mem_high_percent > args->mem_term_percent ? args->mem_high_percent : args->mem_term_percent;
+    long long deficit = (long long)(target * (double)m.MemTotalKiB / 100) - m.MemAvailableKiB;
+    long long covered = 0;
+    procscan_t scan;
+    int k = 0;
+
+    procscan_begin(&scan);
+    for (int i = 0; i < n && (k == 0 || covered < deficit); i++) {
+        int res = procinfo_open(&scan, list[i].pid);
+        if (res >= 0) {
+            int dirfd = res;
+            res = procinfo_read(&scan, dirfd, &list[i], PROC_SWAP);
+            procinfo_close(&scan, dirfd);
+        }
+        if (res < 0) {
+            debug("batch: process %d is gone\n", list[i].pid);
+            continue;
+        }
+        covered += list[i].VmRSSkiB + list[i].VmSwapkiB;
+        list[k++] = list[i];
+    }
+    debug("batch: %lld KiB below the high watermark, %d of %d candidates cover %lld KiB\n",
+        deficit, k, n, covered);
+    return k;
+}
+
+/*
+ * Send `sig` to all processes that are not `gone` yet. Processes that
+ * could not be signalled are marked `gone`, and the first error other
+ * than ESRCH is stored in `err`.
+ */
+static void batch_signal(const int* pidfds, const pid_t* pids, bool* gone, int n, int sig, int* err)
+{
+    for (int i = 0; i < n; i++) {
+        if (gone[i]) {
+            continue;
+        }
+        if (pidfd_kill(pidfds[i], pids[i], sig) != 0) {
+            if (errno != ESRCH && *err == 0) {
+                *err = errno;
+            }
+            gone[i] = true;
+        }
+    }
+    // Only after everyone got the signal, as process_mrelease() takes a
+    // while for large processes
+    if (sig == SIGKILL) {
+        for (int i = 0; i < n; i++) {
+            if (!gone[i]) {
+                pidfd_reap(pidfds[i]);
+            }
+        }
+    }
+}
+
+/*
+ * Wait up to `timeout_ms` for any of the processes that are not `gone`
+ * to exit, and mark the ones that did.
+ * Returns how many are left.
+ */
+static int batch_wait_exit(const int* pidfds, const pid_t* pids, bool* gone, int n, int timeout_ms)
+{
+    struct pollfd pfds[BATCH_MAX];
+    int npfds = 0;
+
+    for (int i = 0; i < n; i++) {
+        if (!gone[i] && pidfds[i] >= 0) {
+            pfds[npfds++] = (struct pollfd) { .fd = pidfds[i], .events = POLLIN };
+        }
+    }
+    if (npfds > 0) {
+        if (poll(pfds, (nfds_t)npfds, timeout_ms) < 0 && errno != EINTR) {
+            warn("batch: poll failed: %s\n", strerror(errno));
+        }
+    } else {
+        // Plain pids, checked via /proc below
+        usleep((useconds_t)timeout_ms * 1000);
+    }
+    int left = 0;
+    for (int i = 0; i < n; i++) {
+        if (!gone[i]) {
+            gone[i] = pidfd_wait_exit(pidfds[i], pids[i], 0);
+            left += !gone[i];
+        }
+    }
+    return left;
+}
+
+/*
+ * Like kill_wait(), for `n` processes at once: signal all of them, then
+ * wait until all have exited (max 10 seconds), escalating to SIGKILL
+ * for all that are left.
+ */
+static int batch_kill_wait(const poll_loop_args_t* args, const int* pidfds, const pid_t* pids, int n, int sig)
+{
+    if (args->dryrun) {
+        warn("dryrun, not actually sending any signal\n");
+        return 0;
+    }
+    bool gone[BATCH_MAX] = { false };
+    int err = 0;
+
+    batch_signal(pidfds, pids, gone, n, sig, &err);
+    double t0 = monotonic_secs();
+    while (1) {
+        float secs = (float)(monotonic_secs() - t0);
+        if (secs >= 10) {
+            errno = ETIME;
+            return -1;
+        }
+        if (sig != SIGKILL) {
+            meminfo_t m = parse_meminfo();
+            print_mem_stats(debug, m);
+            if (secs >= SIGTERM_WAIT || (m.MemAvailablePercent <= args->mem_kill_percent && m.SwapFreePercent <= args->swap_kill_percent)) {
+                sig = SIGKILL;
+                batch_signal(pidfds, pids, gone, n, sig, &err);
+                // kill first, print after
+                warn("escalating to SIGKILL after %.1f seconds\n", secs);
+                metrics_add(METRIC_ESCALATIONS, 1);
+            }
+        }
+        if (batch_wait_exit(pidfds, pids, gone, n, 100) == 0) {
+            break;
+        }
+    }
+    double exit_secs = monotonic_secs() - t0;
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    warn("%d processes exited after %.1f seconds\n", n, (float)exit_secs);
+    metrics_observe(METRIC_EXIT_SECONDS, exit_secs);
+    return 0;
+}
+
+/*
+ * Kill the `n` processes in `list` at once.
+ */
+static void kill_batch(const poll_loop_args_t* args, const struct procinfo* list, int n, int sig)
+{
+    int pidfds[BATCH_MAX];
+    pid_t pids[BATCH_MAX];
+    int k = 0;
+    char what[PATH_LEN + 64];
+    size_t len = (size_t)snprintf(what, sizeof(what), "processes");
+
+    for (int i = 0; i < n; i++) {
+        const struct procinfo* victim = &list[i];
+        int pidfd = victim_pidfd(victim);
+        if (pidfd == -2) {
+            warn("process %d exited before we could send a signal\n", victim->pid);
+            continue;
+        }
+        warn_victim(victim->pid, victim->badness, victim->VmRSSkiB,
+            "sending %s to process %d uid %d/%s \"%s\" (%d of %d): badness %d, VmRSS %lld MiB, VmSwap %lld MiB\n",
+            sig_name(sig), victim->pid, victim->uid, kill_user_name(victim->uid), victim->name, i + 1, n,
+            victim->badness, victim->VmRSSkiB / 1024, victim->VmSwapkiB / 1024);
+        pidfds[k] = pidfd;
+        pids[k] = victim->pid;
+        k++;
+        if (len < sizeof(what)) {
+            len += (size_t)snprintf(what + len, sizeof(what) - len, "%s %d %s", k > 1 ? "," : "", victim->pid, victim->name);
+        }
+    }
+    if (k == 0) {
+        return;
+    }
+    int res = batch_kill_wait(args, pidfds, pids, k, sig);
+    int saved_errno = errno;
+    for (int i = 0; i < k; i++) {
+        if (pidfds[i] >= 0) {
+            close(pidfds[i]);
+        }
+        if (res == 0) {
+            trace_signal(sig, pids[i]);
+        }
+    }
+    kill_done(args, sig, what, k, res, saved_errno);
+}
+
+/*
+ * Find the process with the largest oom_score (in `cg`, if not NULL)
+ * and kill it. With kill_unit, kill the largest unit instead.
+ * With batch, kill as many of the largest processes at once as are
+ * needed to get back to the high watermark.
+ * With `node`, kill the process with the most memory on that NUMA node.
+ */
+static void kill_largest(const poll_loop_args_t* args, const cgroup_t* cg, const numa_node_t* node, int sig)
+{
+    static struct procinfo batch[BATCH_MAX];
+    struct timespec t0 = { 0 };
+    struct procinfo victim = { 0 };
+    bool have_victim = false;
+    int n = 1;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    if (node) {
+        // Units and batches are sized by their total memory
+        if (find_victims(args, NULL, node, &victim, 1) == 0) {
+            victim.pid = 0;
+        }
+        have_victim = true;
+    } else if (args->kill_unit != KILL_UNIT_PROCESS) {
+        group_t g = { 0 };
+        if (group_find_largest(args, cg, &g)) {
+            if (g.type != KILL_UNIT_PROCESS) {
+                selection_done(&t0, sig);
+                kill_group(args, &g, sig);
+                return;
+            }
+            // The largest unit is a single process. Fill in the details.
+            procscan_t scan;
+            victims_t v = { &victim, 0, 1 };
+            int candidates = 0;
+            procscan_begin(&scan);
+            consider_pid(args, &scan, g.id, &v, &candidates);
+            have_victim = v.n > 0;
+        }
+    }
+    if (!have_victim) {
+        if (sig != 0) {
+            trace_candidates_begin();
+        }
+        // Replays have no /proc to read VmSwap from
+        if (args->batch > 1 && cg == NULL && sig != 0 && !trace_replaying()) {
+            n = find_largest_processes(args, cg, batch, args->batch);
+            victim = batch[0];
+            if (n == 0) {
+                victim.pid = 0;
+            }
+        } else {
+            victim = find_largest_process(args, cg);
+        }
+        trace_candidates_end();
+    }
+
+    if (victim.pid <= 0) {
+        if (sig != 0) {
+            metrics_add(METRIC_NO_VICTIM, 1);
+        }
+        if (trace_replaying()) {
+            warn("replay: no recorded process to kill\n");
+            trace_replay_signal(sig, 0);
+            return;
+        }
+        warn("Could not find a process to kill. Sleeping 1 second.\n");
+        if (args->notify) {
+            notify("earlyoom", "Error: Could not find a process to kill. Sleeping 1 second.");
+        }
+        sleep(1);
+        return;
+    }
+
+    if (n > 1) {
+        n = batch_select(args, batch, n);
+        if (n > 1) {
+            selection_done(&t0, sig);
+            kill_batch(args, batch, n, sig);
+            return;
+        }
+        if (n == 0) {
+            warn("process %d exited before we could send a signal\n", victim.pid);
+            return;
+        }
+        victim = batch[0];
+    }
+
+    selection_done(&t0, sig);
+
+    // sig == 0 is used as a self-test during startup. Don't notifiy the user.
+    if (sig != 0 || enable_debug) {
+        warn_victim(victim.pid, victim.badness, victim.VmRSSkiB,
+            "sending %s to process %d uid %d/%s \"%s\": badness %d, VmRSS %lld MiB, %lu re / %lu u / %lu s\n",
+            sig_name(sig), victim.pid, victim.uid, kill_user_name(victim.uid), victim.name, victim.badness, victim.VmRSSkiB / 1024,
+            victim.rtime, victim.utime, victim.stime);
+    }
+
+    if (node && sig != 0) {
+        warn("process %d has %lld MiB on NUMA node %d\n", victim.pid, victim.NodeKiB / 1024, node->node);
+    }
+
+    char what[PATH_LEN + 64];
+    snprintf(what, sizeof(what), "process %d %s", victim.pid, victim.name);
+
+    if (trace_replaying()) {
+        // The recorded processes are long gone, or never were on this machine
+        trace_replay_signal(sig, victim.pid);
+        kill_done(args, sig, what, 1, 0, 0);
+        return;
+    }
+
+    int pidfd = victim_pidfd(&victim);
+    if (pidfd == -2) {
+        warn("process %d exited before we could send a signal\n", victim.pid);
+        return;
+    }
+    int res = kill_wait(args, pidfd, victim.pid, sig);
+    int saved_errno = errno;
+    if (pidfd >= 0) {
+        close(pidfd);
+    }
+    if (res == 0 && sig != 0) {
+        trace_signal(sig, victim.pid);
+    }
+    kill_done(args, sig, what, 1, res, saved_errno);
+}
+
+void kill_largest_process(const poll_loop_args_t* args, int sig)
+{
+    kill_largest(args, NULL, NULL, sig);
+}
+
+/*
+ * Kill the process with the largest oom_score in `cg`, which is
+ * about to hit its memory limit.
+ */
+void kill_largest_in_cgroup(const poll_loop_args_t* args, const cgroup_t* cg, int sig)
+{
+    kill_largest(args, cg, NULL, sig);
+}
+
+/*
+ * Kill the process with the most memory on NUMA node `node`, which is
+ * running out of memory.
+ */
+void kill_largest_on_node(const poll_loop_args_t* args, const numa_node_t* node, int sig)
+{
+    kill_largest(args, NULL, node, sig);
+}
+
+static unsigned emerg_hash(const char* name)
+{
+    return name_hash(name) % EMERG_HASH_SIZE;
+}
+
+static bool emerg_lookup(const char* name)
+{
+    for (unsigned h = emerg_hash(name); emerg_slots[h] != 0; h = (h + 1) % EMERG_HASH_SIZE) {
+        if (strcmp(emerg_names[emerg_slots[h] - 1], name) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * SIGKILL `cur`, whose /proc directory is pinned as `dirfd`.
+ * Returns true if the signal was sent.
+ */
+static bool emerg_kill_pid(const poll_loop_args_t* args, procscan_t* scan, int dirfd, struct procinfo* cur)
+{
+    debug("kill_emergency: sending SIGKILL to process %d (%s)\n", cur->pid, cur->name);
+    if (args->dryrun) {
+        return true;
+    }
+    int pidfd = pidfd_get(cur->pid);
+    if (pidfd == -ENOSYS) {
+        pidfd = -1;
+    } else if (pidfd < 0) {
+        // Gone already
+        return false;
+    } else if (procinfo_read(scan, dirfd, cur, PROC_OOM_SCORE) < 0) {
+        // The pinned directory is dead, so the pidfd may belong to a
+        // new process with the same pid
+        close(pidfd);
+        return false;
+    }
+    int res = pidfd_kill(pidfd, cur->pid, SIGKILL);
+    if (res == 0) {
+        pidfd_reap(pidfd);
+    }
+    if (pidfd >= 0) {
+        close(pidfd);
+    }
+    return res == 0;
+}
+
+/*
+ * Set the comma-separated list of process names for kill_emergency().
+ * Called once at config time, so the poll loop only has to hash.
+ */
+void kill_emergency_set_names(const char* list)
+{
+    char buf[EMERG_KILL_MAXLEN];
+    char* saveptr = NULL;
+
+    memset(emerg_slots, 0, sizeof(emerg_slots));
+    emerg_count = 0;
+    snprintf(buf, sizeof(buf), "%s", list);
+    for (char* tok = strtok_r(buf, ",", &saveptr); tok != NULL; tok = strtok_r(NULL, ",", &saveptr)) {
+        if (emerg_count == EMERG_LIST_MAX) {
+            warn("emerg_kill: more than %d names, ignoring '%s' and the rest\n", EMERG_LIST_MAX, tok);
+            break;
+        }
+        if (strlen(tok) >= TASK_COMM_LEN) {
+            warn("emerg_kill: '%s' is longer than %d characters, matching the first %d like /proc/[pid]/comm does\n",
+                tok, TASK_COMM_LEN - 1, TASK_COMM_LEN - 1);
+        }
+        char* name = emerg_names[emerg_count];
+        snprintf(name, TASK_COMM_LEN, "%s", tok);
+        if (emerg_lookup(name)) {
+            // Duplicate
+            continue;
+        }
+        unsigned h = emerg_hash(name);
+        while (emerg_slots[h] != 0) {
+            h = (h + 1) % EMERG_HASH_SIZE;
+        }
+        emerg_count++;
+        emerg_slots[h] = (unsigned char)emerg_count;
+    }
+}
+
+/*
+ * Whether memory is above mem_high_percent again, so that kill_emergency()
+ * can stop.
+ */
+static bool emerg_recovered(const poll_loop_args_t* args)
+{
+    meminfo_t m = parse_meminfo();
+    if (m.MemAvailablePercent > args->mem_high_percent) {
+        debug("kill_emergency: memory is above the high watermark again\n");
+        return true;
+    }
+    return false;
+}
+
+/*
+ * SIGKILL all processes whose name is in the emerg_kill list, in a single
+ * walk over /proc. Stops early once memory is above mem_high_percent again,
+ * checked before the first kill and then after every EMERG_BATCH kills.
+ * Returns the number of processes killed.
+ */
+int kill_emergency(const poll_loop_args_t* args)
+{
+    int kills = 0;
+    // Kills at the last memory check
+    int checked_at = 0;
+    procscan_t scan;
+
+    if (trace_replaying()) {
+        // It walks the live /proc, not the recorded candidates
+        warn("replay: skipping the emergency kill\n");
+        return 0;
+    }
+
+    // Memory may have come back since the poll loop looked
+    if (emerg_recovered(args)) {
+        return 0;
+    }
+    warn("kill_emergency: killing all processes named %s\n", args->emerg_kill);
+    if (args->dryrun) {
+        warn("dryrun, not actually sending any signal\n");
+    }
+
+    dirscan_t procdir;
+    int err = dirscan_open(&procdir, procdir_path);
+    if (err < 0) {
+        fatal(5, "Could not open %s: %s", procdir_path, strerror(-err));
+    }
+    procscan_begin(&scan);
+
+    while (1) {
+        errno = 0;
+        struct procinfo cur = { .pid = dirscan_next_pid(&procdir) };
+        if (cur.pid == 0) {
+            if (errno != 0) warn("kill_emergency: getdents64 error: %s", strerror(errno));
+            break;
+        }
+
+        if (cur.pid <= 1)
+            // Let's not kill init.
+            continue;
+
+        int dirfd = procinfo_open(&scan, cur.pid);
+        if (dirfd < 0) {
+            continue;
+        }
+        int res = procinfo_read(&scan, dirfd, &cur, PROC_COMM);
+        if (res < 0) {
+            debug(" error reading process name: %s\n", strerror(-res));
+        } else if (emerg_lookup(cur.name)) {
+            if (emerg_kill_pid(args, &scan, dirfd, &cur)) {
+                kills++;
+            }
+        }
+        procinfo_close(&scan, dirfd);
+
+        if (kills - checked_at >= EMERG_BATCH) {
+            checked_at = kills;
+            if (emerg_recovered(args)) {
+                break;
             }
         }
-        closedir(procdir);
     }
+    dirscan_close(&procdir);
 
     warn("kill_emergency: finished after killing %d victims\n", kills);
+    metrics_add(METRIC_EMERGENCY_KILLS, (unsigned long)kills);
     return kills;
 }
@@ -3,9 +3,29 @@
 #define KILL_H
 
 #include <regex.h>
+#include <stddef.h>
 #include <stdbool.h>
 
+#include "cgroup.h"
+#include "meminfo.h"
+#include "numa.h"
+
 #define EMERG_KILL_MAXLEN 512
+// Seconds to wait after SIGTERM before escalating to SIGKILL
+#define SIGTERM_WAIT 6.0
+// Most processes killed at once with batch
+#define BATCH_MAX 16
+// Most "rule" lines in the configuration file, and scoring rules in total
+// with prefer_regex, avoid_regex, prefer_old and avoid_users
+#define KILL_USER_RULES_MAX 28
+#define KILL_RULES_MAX (KILL_USER_RULES_MAX + 4)
+
+// What kill_largest_process() kills
+enum {
+    KILL_UNIT_PROCESS = 0, // the largest process
+    KILL_UNIT_CGROUP, // the cgroup with the largest score, see group.c
+    KILL_UNIT_PGRP, // the process group with the largest score
+};
 
 typedef struct {
     /* kill processes until we reach the upper watermark */
@@ -26,6 +46,9 @@ typedef struct {
     regex_t* avoid_regex;
     regex_t* avoid_users;
     regex_t* prefer_old;
+    /* badness bonus per permille of RAM + swap a process grew per second,
+     * from the process table. 0 = disabled */
+    double prefer_growing;
     /* memory report interval, in milliseconds */
     int report_interval_ms;
     /* Flag --dryrun was passed */
@@ -33,9 +56,67 @@ typedef struct {
     bool nice;
     /* comma-delimited list of processes to kill in case of emergency */
     char* emerg_kill;
+    /* wake up on /proc/pressure/memory triggers instead of polling only */
+    bool psi;
+    /* trigger when tasks stalled this many milliseconds per PSI_WINDOW_MS,
+     * 0 = trigger disabled */
+    unsigned psi_some_ms;
+    unsigned psi_full_ms;
+    /* upper limit for the adaptive sleep time while PSI triggers are active,
+     * in milliseconds */
+    int psi_heartbeat_ms;
+    /* maximum number of processes in the persistent process table,
+     * 0 = no table, scan /proc every time */
+    int process_table;
+    /* number of pre-ranked top candidates from the process table that are
+     * re-checked when selecting a victim */
+    int process_table_top;
+    /* keep the process table current with the kernel's proc connector */
+    bool proc_events;
+    /* KILL_UNIT_*: kill single processes, or whole cgroups or
+     * process groups */
+    int kill_unit;
+    /* send SIGTERM when the SIGKILL limits are projected to be reached
+     * within this many seconds, 0 = disabled */
+    double trend_horizon;
+    /* node_exporter textfile to write metrics to, NULL = none */
+    char* metrics;
+    /* kill up to this many processes at once to get back to the high
+     * watermark, 0 or 1 = one at a time */
+    int batch;
+    /* count zram and zswap by what compression can still free instead
+     * of as swap */
+    bool effective_swap;
+    /* MSGLOG_*: write messages directly, or through the log thread */
+    int log_mode;
+    /* file for the flight recorder, "-" = the log, NULL = off */
+    char* flight_recorder;
+    /* read /proc in batches through io_uring */
+    bool io_uring;
+    /* threads for the /proc scan, 1 = scan on the poll loop thread */
+    int scan_threads;
+    /* lower memory.high of the cgroup of the top candidate when
+     * MemAvailable is at or below this percentage, 0 = disabled */
+    double mem_throttle_percent;
 } poll_loop_args_t;
 
+double monotonic_secs(void);
+const char* kill_rule_add(const char* spec);
+int kill_rules_compile(const poll_loop_args_t* args);
+unsigned badness_fields(const poll_loop_args_t* args);
+void kill_match_cache_clear(void);
+size_t kill_avoid_users_set(const regex_t* re);
+bool kill_user_avoided(int uid);
+const char* kill_user_name(int uid);
+void badness_adjust(const poll_loop_args_t* args, struct procinfo* cur);
+int find_largest_processes(const poll_loop_args_t* args, const cgroup_t* cg, struct procinfo* out, int max);
+struct procinfo find_largest_process(const poll_loop_args_t* args, const cgroup_t* cg);
+void kill_scan_stats(int* candidates, unsigned long* syscalls);
 void kill_largest_process(const poll_loop_args_t* args, int sig);
+const char* kill_last_victim(void);
+void kill_largest_in_cgroup(const poll_loop_args_t* args, const cgroup_t* cg, int sig);
+void kill_largest_on_node(const poll_loop_args_t* args, const numa_node_t* node, int sig);
+void kill_emergency_set_names(const char* list);
 int kill_emergency(const poll_loop_args_t* args);
 
 #endif
@@ -13,13 +13,31 @@
 #include <sys/resource.h>
 #include <sys/wait.h>
 #include <unistd.h>
-#include <time.h>
 
 #include "globals.h"
 #include "kill.h"
 #include "meminfo.h"
+#include "metrics.h"
 #include "msg.h"
+#include "msglog.h"
+#include "notify.h"
+#include "numa.h"
 #include "config.h"
+#include "psi.h"
+#include "cgroup.h"
+#include "compswap.h"
+#include "dirscan.h"
+#include "flight.h"
+#include "group.h"
+#include "procevents.h"
+#include "proctable.h"
+#include "status.h"
+#include "throttle.h"
+#include "trace.h"
+#include "trend.h"
+#include "uring.h"
+#include "vmstat.h"
+#include "workers.h"
 
 /* Don't fail compilation if the user has an old glibc that
  * does not define MCL_ONFAULT. The kernel may still be recent
@@ -33,9 +51,16 @@
 #define VERSION "*** unknown version ***"
 #endif
 
+/* mallinfo2() is new in glibc 2.33. Without it, -d does not check that
+ * the heap stays the same after startup.
+ */
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+#include <malloc.h>
+#define HAVE_MALLINFO2
+#endif
+
 // Minimum time between invoking kill_emergency(), in milliseconds
 #define EMERGENCY_TIMEOUT 30000
-#define STATUS_FILENAME "/var/run/earlyoom/status"
 
 /* Arbitrary identifiers for long options that do not have a short
  * version */
@@ -43,11 +68,27 @@ enum {
     LONG_OPT_PREFER = 513,
     LONG_OPT_AVOID,
     LONG_OPT_DRYRUN,
+    LONG_OPT_PSI,
+    LONG_OPT_CGROUP,
+    LONG_OPT_KILL_UNIT,
+    LONG_OPT_TREND_HORIZON,
+    LONG_OPT_RECORD,
+    LONG_OPT_REPLAY,
+    LONG_OPT_METRICS,
+    LONG_OPT_BATCH,
+    LONG_OPT_NUMA,
+    LONG_OPT_EFFECTIVE_SWAP,
+    LONG_OPT_LOG,
+    LONG_OPT_FLIGHT_RECORDER,
+    LONG_OPT_IO_URING,
+    LONG_OPT_SCAN_THREADS,
+    LONG_OPT_THROTTLE,
+    LONG_OPT_THRASH,
 };
 
 static int set_oom_score_adj(int);
 static void poll_loop(const poll_loop_args_t* args);
-static void update_status(int sig, bool emergency, bool high, double memavail, double setpoint);
+static void check_heap(void);
 
 // Prevent Golang / Cgo name collision when the test suite runs -
 // Cgo generates it's own main function.
@@ -68,6 +109,14 @@ void handle_sigchld(int sig)
     waitpid(-1, NULL, WNOHANG);
 }
 
+// SIGTERM, SIGINT or SIGHUP that we have to exit for, 0 = none
+static volatile sig_atomic_t exit_signal;
+
+static void handle_exit_signal(int sig)
+{
+    exit_signal = sig;
+}
+
 void handle_sigpipe(int sig)
 {
     (void)sig; // unused
@@ -86,12 +135,19 @@ int main(int argc, char* argv[])
         .mem_kill_percent = 5,
         .swap_kill_percent = 5,
         .report_interval_ms = 1000,
+        .psi_some_ms = 150,
+        .psi_full_ms = 50,
+        .psi_heartbeat_ms = 10000,
+        .process_table_top = PROCTABLE_TOP,
+        .scan_threads = 1,
         /* omitted fields are set to zero */
     };
     int set_my_priority = 0;
     char* prefer_cmds = NULL;
     char* avoid_cmds = NULL;
     char* config_path = NULL;
+    char* record_path = NULL;
+    char* replay_path = NULL;
     regex_t _prefer_regex;
     regex_t _avoid_regex;
 
@@ -105,8 +161,8 @@ int main(int argc, char* argv[])
 
     fprintf(stderr, "earlyoom " VERSION "\n");
 
-    if (chdir("/proc") != 0) {
-        fatal(4, "Could not cd to /proc: %s", strerror(errno));
+    if (chdir(procdir_path) != 0) {
+        fatal(4, "Could not cd to %s: %s", procdir_path, strerror(errno));
     }
 
     meminfo_t m = parse_meminfo();
@@ -117,6 +173,22 @@ int main(int argc, char* argv[])
         { "prefer", required_argument, NULL, LONG_OPT_PREFER },
         { "avoid", required_argument, NULL, LONG_OPT_AVOID },
         { "dryrun", no_argument, NULL, LONG_OPT_DRYRUN },
+        { "psi", no_argument, NULL, LONG_OPT_PSI },
+        { "cgroup", required_argument, NULL, LONG_OPT_CGROUP },
+        { "kill-unit", required_argument, NULL, LONG_OPT_KILL_UNIT },
+        { "trend-horizon", required_argument, NULL, LONG_OPT_TREND_HORIZON },
+        { "record", required_argument, NULL, LONG_OPT_RECORD },
+        { "replay", required_argument, NULL, LONG_OPT_REPLAY },
+        { "metrics", required_argument, NULL, LONG_OPT_METRICS },
+        { "batch", required_argument, NULL, LONG_OPT_BATCH },
+        { "numa", required_argument, NULL, LONG_OPT_NUMA },
+        { "effective-swap", no_argument, NULL, LONG_OPT_EFFECTIVE_SWAP },
+        { "log", required_argument, NULL, LONG_OPT_LOG },
+        { "flight-recorder", required_argument, NULL, LONG_OPT_FLIGHT_RECORDER },
+        { "io-uring", no_argument, NULL, LONG_OPT_IO_URING },
+        { "scan-threads", required_argument, NULL, LONG_OPT_SCAN_THREADS },
+        { "throttle", required_argument, NULL, LONG_OPT_THROTTLE },
+        { "thrash", required_argument, NULL, LONG_OPT_THRASH },
         { "help", no_argument, NULL, 'h' },
         { 0, 0, NULL, 0 } /* end-of-array marker */
     };
@@ -217,6 +289,72 @@ int main(int argc, char* argv[])
             warn("dryrun mode enabled, will not kill anything\n");
             args.dryrun = 1;
             break;
+        case LONG_OPT_PSI:
+            args.psi = true;
+            break;
+        case LONG_OPT_CGROUP:
+            cgroup_add(optarg);
+            break;
+        case LONG_OPT_TREND_HORIZON:
+            args.trend_horizon = strtod(optarg, NULL);
+            if (args.trend_horizon < 0) {
+                fatal(14, "--trend-horizon: invalid value '%s'\n", optarg);
+            }
+            break;
+        case LONG_OPT_RECORD:
+            record_path = optarg;
+            break;
+        case LONG_OPT_REPLAY:
+            replay_path = optarg;
+            break;
+        case LONG_OPT_METRICS:
+            args.metrics = optarg;
+            break;
+        case LONG_OPT_BATCH:
+            args.batch = (int)strtol(optarg, NULL, 10);
+            if (args.batch < 0 || args.batch > BATCH_MAX) {
+                fatal(14, "--batch: must be between 0 and %d, got '%s'\n", BATCH_MAX, optarg);
+            }
+            break;
+        case LONG_OPT_NUMA:
+            numa_add(optarg);
+            break;
+        case LONG_OPT_EFFECTIVE_SWAP:
+            args.effective_swap = true;
+            break;
+        case LONG_OPT_FLIGHT_RECORDER:
+            args.flight_recorder = optarg;
+            break;
+        case LONG_OPT_IO_URING:
+            args.io_uring = true;
+            break;
+        case LONG_OPT_SCAN_THREADS:
+            args.scan_threads = (int)strtol(optarg, NULL, 10);
+            if (args.scan_threads < 1 || args.scan_threads > WORKERS_MAX) {
+                fatal(14, "--scan-threads: must be between 1 and %d, got '%s'\n", WORKERS_MAX, optarg);
+            }
+            break;
+        case LONG_OPT_THROTTLE:
+            args.mem_throttle_percent = strtod(optarg, NULL);
+            if (args.mem_throttle_percent <= 0 || args.mem_throttle_percent > 100) {
+                fatal(15, "--throttle: invalid percentage '%s'\n", optarg);
+            }
+            break;
+        case LONG_OPT_THRASH:
+            vmstat_add(optarg);
+            break;
+        case LONG_OPT_LOG:
+            args.log_mode = msglog_parse_mode(optarg);
+            if (args.log_mode < 0) {
+                fatal(14, "--log: expected sync, async or journal, got '%s'\n", optarg);
+            }
+            break;
+        case LONG_OPT_KILL_UNIT:
+            args.kill_unit = group_parse_unit(optarg);
+            if (args.kill_unit < 0) {
+                fatal(14, "--kill-unit: expected process, cgroup or pgrp, got '%s'\n", optarg);
+            }
+            break;
         case 'h':
             fprintf(stderr,
                 "Usage: %s [OPTION]...\n"
@@ -245,6 +383,42 @@ int main(int argc, char* argv[])
                 "  --prefer REGEX            prefer to kill processes matching REGEX\n"
                 "  --avoid REGEX             avoid killing processes matching REGEX\n"
                 "  --dryrun                  dry run (do not kill any processes)\n"
+                "  --psi                     wake up immediately on memory pressure (PSI)\n"
+                "  --cgroup PATH:PERCENT[,KILL_PERCENT]\n"
+                "                            also monitor cgroup PATH and kill inside it when\n"
+                "                            its available memory is below PERCENT of\n"
+                "                            memory.max (can be given multiple times)\n"
+                "  --kill-unit UNIT          kill whole units instead of single processes:\n"
+                "                            process (default), cgroup or pgrp\n"
+                "  --trend-horizon SECONDS   send SIGTERM early when memory is projected to\n"
+                "                            reach the SIGKILL limits within SECONDS\n"
+                "  --record FILE             append memory samples and victim candidates to\n"
+                "                            the trace FILE\n"
+                "  --replay FILE             run on the samples from trace FILE instead of\n"
+                "                            the live system, at full speed, without killing\n"
+                "  --metrics FILE            write Prometheus metrics to FILE, for the\n"
+                "                            node_exporter textfile collector\n"
+                "  --batch N                 kill up to N processes at once to get back to\n"
+                "                            the high watermark\n"
+                "  --numa [NODE:]PERCENT[,KILL_PERCENT]\n"
+                "                            also monitor NUMA node NODE (without NODE: all\n"
+                "                            nodes) and kill the process with the most memory\n"
+                "                            on it when its available memory is below PERCENT\n"
+                "                            of the node (can be given multiple times)\n"
+                "  --effective-swap          count zram and zswap as the memory that\n"
+                "                            compression can still free, not as swap\n"
+                "  --log MODE                write messages directly (sync, default), from a\n"
+                "                            log thread (async), or to journald (journal)\n"
+                "  --flight-recorder FILE    keep the last iterations in memory and write them\n"
+                "                            to FILE (\"-\": the log) after sending a signal\n"
+                "  --io-uring                read /proc in batches through io_uring\n"
+                "  --scan-threads N          scan /proc with N threads (default 1)\n"
+                "  --throttle PERCENT        lower memory.high of the cgroup of the top\n"
+                "                            candidate when mem <= PERCENT, before SIGTERM\n"
+                "  --thrash COUNTER:TERM[,KILL]\n"
+                "                            also kill when the refault, swapin, swapout or\n"
+                "                            majfault rate from /proc/vmstat stays at or above\n"
+                "                            TERM per second (can be given multiple times)\n"
                 "  -h, --help                this help text\n",
                 argv[0]);
             exit(0);
@@ -257,6 +431,18 @@ int main(int argc, char* argv[])
     if (optind < argc) {
         fatal(13, "extra argument not understood: '%s'\n", argv[optind]);
     }
+    if (record_path && replay_path) {
+        fatal(2, "--record and --replay can not be used together\n");
+    }
+    if (record_path) {
+        trace_record_open(record_path);
+        fprintf(stderr, "recording to trace file %s\n", record_path);
+    }
+    if (replay_path) {
+        // Use the memory sizes of the recorded machine
+        m = trace_replay_open(replay_path);
+        fprintf(stderr, "replaying trace file %s\n", replay_path);
+    }
     // Merge "-M" with "-m" values
     if (have_M) {
         double M_term_percent = 100 * mem_term_kib / (double)m.MemTotalKiB;
@@ -303,6 +489,39 @@ int main(int argc, char* argv[])
         parse_config(config_path, &args);
         set_my_priority = args.nice;
     }
+    if (trace_replaying()) {
+        // Everything except the recorded samples and candidates would come
+        // from the live system
+        if (cgroup_count() > 0) {
+            fatal(2, "--replay: cgroup monitoring is not supported\n");
+        }
+        if (numa_count() > 0) {
+            fatal(2, "--replay: NUMA monitoring is not supported\n");
+        }
+        if (vmstat_count() > 0) {
+            fatal(2, "--replay: thrash detection is not supported\n");
+        }
+        args.dryrun = 1;
+        args.notify = false;
+        args.psi = false;
+        args.process_table = 0;
+        args.proc_events = false;
+        // Needs the process table
+        args.prefer_growing = 0;
+        args.kill_unit = KILL_UNIT_PROCESS;
+        args.batch = 0;
+        // The recorded samples are effective already, or not
+        args.effective_swap = false;
+        args.io_uring = false;
+        // Would write to the cgroups of the live system
+        args.mem_throttle_percent = 0;
+        set_my_priority = 0;
+    }
+    // After -c, --prefer and --avoid
+    kill_rules_compile(&args);
+    if (trace_replaying() && (badness_fields(&args) & ~(unsigned)TRACE_PROC_FIELDS)) {
+        fatal(2, "--replay: scoring rules on the cgroup are not supported\n");
+    }
     if (set_my_priority) {
         bool fail = 0;
         if (setpriority(PRIO_PROCESS, 0, -20) != 0) {
@@ -319,6 +538,15 @@ int main(int argc, char* argv[])
         }
     }
 
+    if (args.log_mode != MSGLOG_SYNC && msglog_start(args.log_mode)) {
+        fprintf(stderr, "logging through the log thread (%s)\n", msglog_mode_name(msglog_mode()));
+    }
+
+    // Fork the helper while we are small, and before mlockall()
+    if (args.notify && !notify_init()) {
+        warn("could not start the notification helper, forking dbus-send for every notification\n");
+    }
+
     // Print memory limits
     fprintf(stderr, "mem total: %4lld MiB, swap total: %4lld MiB\n",
         m.MemTotalMiB, m.SwapTotalMiB);
@@ -330,13 +558,111 @@ int main(int argc, char* argv[])
         fprintf(stderr, "        EMERGENCY when mem <= " PRIPCT " and swap <= " PRIPCT "\n",
             args.mem_emerg_percent, args.swap_kill_percent);
     }
-    fprintf(stderr, "writing status to file: %s\n", STATUS_FILENAME);
+    if (args.mem_throttle_percent > args.mem_high_percent) {
+        // It would be restored right away
+        warn("throttle limit " PRIPCT " is above the high watermark " PRIPCT ", using that\n",
+            args.mem_throttle_percent, args.mem_high_percent);
+        args.mem_throttle_percent = args.mem_high_percent;
+    }
+    if (args.mem_throttle_percent > 0) {
+        fprintf(stderr, "        throttling the cgroup of the top candidate when mem <= " PRIPCT "\n",
+            args.mem_throttle_percent);
+        // Exit from the poll loop, which writes back memory.high first
+        signal(SIGTERM, handle_exit_signal);
+        signal(SIGINT, handle_exit_signal);
+        signal(SIGHUP, handle_exit_signal);
+    }
+    if (!trace_replaying()) {
+        status_init(STATUS_DIR);
+        fprintf(stderr, "writing status to file: %s/%s and %s/%s\n", STATUS_DIR, STATUS_NAME, STATUS_DIR, STATUS_SHM_NAME);
+        // Also without --throttle, the last run may have had it
+        throttle_init(STATUS_DIR);
+    }
+    if (args.psi) {
+        if (psi_init(args.psi_some_ms, args.psi_full_ms)) {
+            fprintf(stderr, "waking up on memory pressure: some %u ms, full %u ms per %u ms\n",
+                args.psi_some_ms * psi_window_ms() / PSI_WINDOW_MS,
+                args.psi_full_ms * psi_window_ms() / PSI_WINDOW_MS, psi_window_ms());
+        } else {
+            warn("PSI triggers not available, falling back to adaptive sleep\n");
+        }
+    }
+
+    if (cgroup_count() > 0) {
+        cgroup_init();
+    }
+    numa_init();
+    if (vmstat_count() > 0) {
+        vmstat_init();
+    }
+    if (args.effective_swap && !compswap_init()) {
+        warn("--effective-swap: found neither zram swap nor zswap\n");
+    }
+    if (args.io_uring && uring_init()) {
+        fprintf(stderr, "reading /proc through io_uring, up to %d processes at once\n", URING_BATCH);
+        if (args.scan_threads > 1) {
+            warn("--scan-threads is ignored with --io-uring\n");
+            args.scan_threads = 1;
+        }
+    }
+    // After setpriority(), which is per thread, so they inherit it
+    if (args.scan_threads > 1 && workers_init(args.scan_threads)) {
+        fprintf(stderr, "scanning /proc with %d threads\n", workers_count());
+    }
+
+    if (args.flight_recorder) {
+        flight_init(args.flight_recorder);
+        fprintf(stderr, "flight recorder: keeping the last %d iterations, writing them to %s after a kill\n",
+            FLIGHT_ENTRIES, strcmp(args.flight_recorder, "-") ? args.flight_recorder : "the log");
+    }
+
+    if (args.metrics) {
+        metrics_init(args.metrics);
+        fprintf(stderr, "writing metrics to file: %s\n", args.metrics);
+    }
+
+    if (args.kill_unit != KILL_UNIT_PROCESS) {
+        group_init();
+        fprintf(stderr, "killing whole units: %s\n", group_unit_name(args.kill_unit));
+    }
+
+    if (args.batch > 1) {
+        fprintf(stderr, "killing up to %d processes at once\n", args.batch);
+    }
+
+    if (args.process_table > 0) {
+        proctable_init(args.process_table, args.process_table_top);
+        if (args.prefer_growing > 0) {
+            proctable_track_growth(m.MemTotalKiB + m.SwapTotalKiB);
+            fprintf(stderr, "preferring to kill growing processes: badness += %g per permille of RAM + swap per second\n",
+                args.prefer_growing);
+        }
+        // Before the first pass, so we do not miss anything that happens
+        // during it
+        if (args.proc_events && procevents_init()) {
+            fprintf(stderr, "keeping the process table current with proc events\n");
+        } else if (args.proc_events) {
+            warn("proc events not available, looking for new processes in %s\n", procdir_path);
+        }
+        proctable_refresh(&args, 0);
+        fprintf(stderr, "tracking up to %d processes in the process table, re-checking the top %d\n",
+            args.process_table, args.process_table_top);
+    } else if (args.proc_events) {
+        warn("proc_events needs process_table, ignoring it\n");
+    }
+    if (args.process_table <= 0 && args.prefer_growing > 0) {
+        warn("prefer_growing needs process_table, ignoring it\n");
+        args.prefer_growing = 0;
+    }
 
     /* Dry-run oom kill to make sure stack grows to maximum size before
      * calling mlockall()
      */
-    debug("dry-running kill_largest_process()...\n");
-    kill_largest_process(&args, 0);
+    dirscan_init();
+    if (!trace_replaying()) {
+        debug("dry-running kill_largest_process()...\n");
+        kill_largest_process(&args, 0);
+    }
 
     int err = mlockall(MCL_CURRENT | MCL_FUTURE | MCL_ONFAULT);
     // kernels older than 4.4 don't support MCL_ONFAULT. Retry without it.
@@ -345,7 +671,13 @@ int main(int argc, char* argv[])
     }
     if (err != 0) {
         perror("Could not lock memory - continuing anyway");
+    } else {
+        long long locked_kib = get_vm_lck_kib(getpid());
+        if (locked_kib >= 0) {
+            fprintf(stderr, "locked %lld kiB of memory\n", locked_kib);
+        }
     }
+    check_heap();
 
     // Jump into main poll loop
     poll_loop(&args);
@@ -382,15 +714,29 @@ static int set_oom_score_adj(int oom_score_adj)
  * limits we are (headroom). Returns a millisecond value between 100 and 1000 (inclusive).
  * The idea is simple: if memory and swap can only fill up so fast, we know how long we can sleep
  * without risking to miss a low memory event.
+ * When PSI triggers are active, the kernel wakes us up on memory pressure, and the
+ * upper limit is raised to psi_heartbeat_ms.
+ * If we have a trend (`t` not NULL), the fill rates follow twice the observed rates,
+ * but do not go below a quarter of the worst case we have seen.
  */
-static unsigned sleep_time_ms(const poll_loop_args_t* args, const meminfo_t* m)
+static unsigned sleep_time_ms(const poll_loop_args_t* args, const meminfo_t* m, const trend_t* t)
 {
     // Maximum expected memory/swap fill rate. In kiB per millisecond ==~ MiB per second.
-    const long long mem_fill_rate = 6000; // 6000MiB/s seen with "stress -m 4 --vm-bytes 4G"
-    const long long swap_fill_rate = 800; //  800MiB/s seen with membomb on ZRAM
+    long long mem_fill_rate = 6000; // 6000MiB/s seen with "stress -m 4 --vm-bytes 4G"
+    long long swap_fill_rate = 800; //  800MiB/s seen with membomb on ZRAM
+    if (t) {
+        // trend_t rates are in KiB per second and negative when filling up
+        long long mem_observed = (long long)(-t->mem_rate * 2 / 1000);
+        long long swap_observed = (long long)(-t->swap_rate * 2 / 1000);
+        mem_fill_rate = mem_observed > mem_fill_rate / 4 ? mem_observed : mem_fill_rate / 4;
+        swap_fill_rate = swap_observed > swap_fill_rate / 4 ? swap_observed : swap_fill_rate / 4;
+    }
     // Clamp calculated value to this range (milliseconds)
     const unsigned min_sleep = 100;
-    const unsigned max_sleep = 1000;
+    unsigned max_sleep = 1000;
+    if (psi_active() && args->psi_heartbeat_ms > (int)max_sleep) {
+        max_sleep = (unsigned)args->psi_heartbeat_ms;
+    }
 
     long long mem_headroom_kib = (long long)((m->MemAvailablePercent - args->mem_term_percent) * 10 * (double)m->MemTotalMiB);
     if (mem_headroom_kib < 0) {
@@ -401,6 +747,16 @@ static unsigned sleep_time_ms(const poll_loop_args_t* args, const meminfo_t* m)
         swap_headroom_kib = 0;
     }
     long long ms = mem_headroom_kib / mem_fill_rate + swap_headroom_kib / swap_fill_rate;
+    // A cgroup can fill up just as fast, but has less room
+    long long cg_headroom_kib = cgroup_headroom_kib();
+    if (cg_headroom_kib >= 0 && cg_headroom_kib / mem_fill_rate < ms) {
+        ms = cg_headroom_kib / mem_fill_rate;
+    }
+    // So can a NUMA node
+    long long numa_headroom = numa_headroom_kib();
+    if (numa_headroom >= 0 && numa_headroom / mem_fill_rate < ms) {
+        ms = numa_headroom / mem_fill_rate;
+    }
     if (ms < min_sleep) {
         return min_sleep;
     }
@@ -410,38 +766,27 @@ static unsigned sleep_time_ms(const poll_loop_args_t* args, const meminfo_t* m)
     return (unsigned)ms;
 }
 
-static void update_status(int sig, bool emergency, bool high, double memavail, double setpoint)
+/* With -d, warn when the heap has grown since the last call: after
+ * startup, nothing should malloc() anymore. The first call sets the
+ * baseline.
+ */
+static void check_heap(void)
 {
-    FILE* sfile;
-
-    if ((sfile = fopen(STATUS_FILENAME, "w"))) {
-        // Write status file, one value per line:
-        // StatusCode
-        if (high) {
-            fprintf(sfile, "high\n");
-        } else if (emergency) {
-            fprintf(sfile, "emergency\n");
-        } else if (sig == SIGTERM) {
-            fprintf(sfile, "term\n");
-        } else if (sig == SIGKILL) {
-            fprintf(sfile, "kill\n");
-        } else {
-            fprintf(sfile, "ok\n");
-        }
-
-        // MemAvailable
-        fprintf(sfile, "%0.02f\n", memavail);
-
-        // TriggeredSetpoint
-        fprintf(sfile, "%0.02f\n", setpoint);
+#ifdef HAVE_MALLINFO2
+    static bool have_baseline;
+    static size_t baseline;
 
-        // LastUpdate
-        fprintf(sfile, "%ld\n", time(NULL));
-
-        fclose(sfile);
-    } else {
-        warn("failed to write to status file (%s)\n", STATUS_FILENAME);
+    if (!enable_debug) {
+        return;
     }
+    struct mallinfo2 mi = mallinfo2();
+    size_t used = mi.uordblks + mi.hblkhd;
+    if (have_baseline && used > baseline) {
+        warn("heap grew by %zu bytes to %zu bytes after startup\n", used - baseline, used);
+    }
+    have_baseline = true;
+    baseline = used;
+#endif
 }
 
 static void poll_loop(const poll_loop_args_t* args)
@@ -454,11 +799,28 @@ static void poll_loop(const poll_loop_args_t* args)
     bool emergency_invoked = false;
     int emergency_timeout_ms = 0;
     double current_setpoint = 0;
+    // When the hysteresis started, for the recovery time
+    double trigger_secs = 0;
 
     while (1) {
+        if (exit_signal) {
+            throttle_restore();
+            // Die from the signal, like we would have without the handler
+            signal(exit_signal, SIG_DFL);
+            raise(exit_signal);
+        }
         int sig = 0;
         bool high = false;
+        // Early SIGTERM because of the trend or thrashing: does not start
+        // the hysteresis
+        bool predicted = false;
         meminfo_t m = parse_meminfo();
+        double now = monotonic_secs();
+        trace_meminfo(&m);
+        flight_begin(now, &m);
+        trend_t trend;
+        trend_add(&m, now);
+        bool have_trend = trend_get(now, &trend);
         if (args->emerg_kill && emergency_timeout_ms <= 0 &&
             m.MemAvailablePercent <= args->mem_emerg_percent && m.SwapFreePercent <= args->swap_kill_percent) {
             sig = SIGKILL;
@@ -490,11 +852,62 @@ static void poll_loop(const poll_loop_args_t* args)
                 current_setpoint = 0;
                 print_mem_stats(warn, m);
                 warn("recovery complete (MemAvailable > mem_high_percent)\n");
+                metrics_observe(METRIC_RECOVERY_SECONDS, now - trigger_secs);
+            }
+        }
+
+        if (!sig && args->trend_horizon > 0 && have_trend) {
+            double eta = trend_eta(&trend, &m, args->mem_kill_percent, args->swap_kill_percent);
+            if (eta < args->trend_horizon) {
+                print_mem_stats(warn, m);
+                warn("low memory soon! projected to reach SIGKILL limits in %.1f seconds (mem %.0f MiB/s, swap %.0f MiB/s)\n",
+                    eta, trend.mem_rate / 1024, trend.swap_rate / 1024);
+                sig = SIGTERM;
+                predicted = true;
+                current_setpoint = args->mem_kill_percent;
+            }
+        }
+
+        // Thrashing with enough memory available on paper. Checked on every
+        // iteration, so the rates stay current.
+        int thrash_sig = 0;
+        const char* thrash = vmstat_check(now, &thrash_sig);
+        if (!sig && thrash) {
+            print_mem_stats(warn, m);
+            warn("thrashing! %s, at or above the %s limit\n", thrash,
+                thrash_sig == SIGKILL ? "SIGKILL" : "SIGTERM");
+            sig = thrash_sig;
+            predicted = true;
+            current_setpoint = 0;
+        }
+
+        // Cgroups only matter if the system as a whole is fine
+        cgroup_t* cg = NULL;
+        int cg_sig = 0;
+        if (!sig && cgroup_count() > 0) {
+            cg = cgroup_check(&cg_sig);
+        }
+        // NUMA nodes only if no cgroup is in trouble either
+        numa_node_t* node = NULL;
+        int node_sig = 0;
+        if (!sig && !cg && numa_count() > 0) {
+            node = numa_check(&node_sig);
+        }
+
+        // Slow down the top candidate before it comes to SIGTERM, and let
+        // it go once we are back above the high watermark
+        if (args->mem_throttle_percent > 0) {
+            if (m.MemAvailablePercent > args->mem_high_percent) {
+                throttle_restore();
+            } else if (!sig && !cg && !node && m.MemAvailablePercent <= args->mem_throttle_percent) {
+                throttle_start(args, &m);
             }
         }
 
-        // write updated status file
-        update_status(sig, emergency_invoked, high, m.MemAvailablePercent, current_setpoint);
+        // update the status files, unless this is not the live system
+        if (!trace_replaying()) {
+            status_update(sig ? sig : cg_sig ? cg_sig : node_sig, emergency_invoked, high, m.MemAvailablePercent, current_setpoint);
+        }
 
         if (sig) {
             if (emergency_invoked) {
@@ -506,14 +919,52 @@ static void poll_loop(const poll_loop_args_t* args)
                 kill_largest_process(args, sig);
                 sleep_ms = (hystis == SIGKILL) ? 50 : 500;
             }
-            hystis = sig;
-        } else if (args->report_interval_ms && report_countdown_ms <= 0) {
-            print_mem_stats(printf, m);
-            report_countdown_ms = args->report_interval_ms;
-            sleep_ms = sleep_time_ms(args, &m);
+            if (!predicted) {
+                if (!hystis) {
+                    trigger_secs = now;
+                }
+                hystis = sig;
+            }
+            // The samples from before the kill do not predict anything
+            trend_reset();
+            vmstat_reset();
+        } else if (cg) {
+            kill_largest_in_cgroup(args, cg, cg_sig);
+            sleep_ms = (cg_sig == SIGKILL) ? 50 : 500;
+            trend_reset();
+            vmstat_reset();
+        } else if (node) {
+            kill_largest_on_node(args, node, node_sig);
+            sleep_ms = (node_sig == SIGKILL) ? 50 : 500;
+            trend_reset();
+            vmstat_reset();
+        } else {
+            if (args->report_interval_ms && report_countdown_ms <= 0) {
+                print_mem_stats(info, m);
+                report_countdown_ms = args->report_interval_ms;
+            }
+            sleep_ms = sleep_time_ms(args, &m, have_trend ? &trend : NULL);
+            // Use the calm phase to keep the process table fresh
+            if (proctable_enabled() && !hystis) {
+                proctable_refresh(args, PROCTABLE_BATCH);
+            }
+        }
+        flight_end(sleep_ms, hystis, sig ? sig : cg_sig ? cg_sig : node_sig);
+        check_heap();
+        metrics_flush();
+        if (have_trend) {
+            debug("trend: mem %+.1f MiB/s, swap %+.1f MiB/s\n", trend.mem_rate / 1024, trend.swap_rate / 1024);
         }
         debug("adaptive sleep time: %d ms\n", sleep_ms);
-        usleep(sleep_ms * 1000);
+        // After a kill, give the system time to settle even if there is
+        // still memory pressure. Otherwise, let PSI triggers wake us early.
+        if (trace_replaying()) {
+            // Full speed, the trace brings its own timing
+        } else if (!sig && !cg && !node && psi_pollable()) {
+            sleep_ms = psi_wait(sleep_ms);
+        } else {
+            usleep(sleep_ms * 1000);
+        }
         report_countdown_ms -= (int)sleep_ms;
         if (emergency_timeout_ms > 0) {
             emergency_timeout_ms -= (int)sleep_ms;
@@ -4,6 +4,7 @@
  * Returned values are in kiB */
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stddef.h> // for size_t
 #include <stdio.h>
 #include <stdlib.h>
@@ -13,48 +14,195 @@
 #include <unistd.h>
 
 
+#include "compswap.h"
 #include "globals.h"
 #include "meminfo.h"
 #include "msg.h"
-
-/* Parse the contents of /proc/meminfo (in buf), return value of "name"
- * (example: MemTotal)
- * Returns -errno if the entry cannot be found. */
-static long long get_entry(const char* name, const char* buf)
+#include "trace.h"
+
+// Entries of /proc/meminfo we look at
+enum {
+    MI_MEMTOTAL,
+    MI_MEMFREE,
+    MI_MEMAVAILABLE,
+    MI_BUFFERS,
+    MI_CACHED,
+    MI_SWAPTOTAL,
+    MI_SWAPFREE,
+    MI_ACTIVE_FILE,
+    MI_INACTIVE_FILE,
+    MI_SRECLAIMABLE,
+    MI_SHMEM,
+    MI_DIRTY,
+    MI_WRITEBACK,
+    MI_ZSWAP,
+    MI_ZSWAPPED,
+    MI_COUNT
+};
+
+static const keyed_key_t meminfo_keys[MI_COUNT] = {
+    [MI_MEMTOTAL] = KEYED_KEY("MemTotal:"),
+    [MI_MEMFREE] = KEYED_KEY("MemFree:"),
+    [MI_MEMAVAILABLE] = KEYED_KEY("MemAvailable:"),
+    [MI_BUFFERS] = KEYED_KEY("Buffers:"),
+    [MI_CACHED] = KEYED_KEY("Cached:"),
+    [MI_SWAPTOTAL] = KEYED_KEY("SwapTotal:"),
+    [MI_SWAPFREE] = KEYED_KEY("SwapFree:"),
+    [MI_ACTIVE_FILE] = KEYED_KEY("Active(file):"),
+    [MI_INACTIVE_FILE] = KEYED_KEY("Inactive(file):"),
+    [MI_SRECLAIMABLE] = KEYED_KEY("SReclaimable:"),
+    [MI_SHMEM] = KEYED_KEY("Shmem:"),
+    [MI_DIRTY] = KEYED_KEY("Dirty:"),
+    [MI_WRITEBACK] = KEYED_KEY("Writeback:"),
+    [MI_ZSWAP] = KEYED_KEY("Zswap:"),
+    [MI_ZSWAPPED] = KEYED_KEY("Zswapped:"),
+};
+
+static size_t meminfo_offsets[MI_COUNT];
+static keyed_file_t meminfo_file = {
+    .name = "meminfo",
+    .sep = ':',
+    .keys = meminfo_keys,
+    .count = MI_COUNT,
+    .offsets = meminfo_offsets,
+    .fd = -1,
+};
+
+/* Parse the number after a key, skipping leading spaces.
+ * Returns -ENODATA if there is none. */
+static long long parse_value(const char* p, const char* end)
 {
-    char* hit = strstr(buf, name);
-    if (hit == NULL) {
+    while (p < end && *p == ' ') {
+        p++;
+    }
+    if (p >= end || *p < '0' || *p > '9') {
         return -ENODATA;
     }
-
-    errno = 0;
-    long long val = strtoll(hit + strlen(name), NULL, 10);
-    if (errno != 0) {
-        int strtoll_errno = errno;
-        perror("get_entry: strtol() failed");
-        return -strtoll_errno;
+    long long val = 0;
+    while (p < end && *p >= '0' && *p <= '9') {
+        val = val * 10 + (*p - '0');
+        p++;
     }
     return val;
 }
 
-/* Like get_entry(), but exit if the value cannot be found */
-static long long get_entry_fatal(const char* name, const char* buf)
+/* Read all entries at their learned offsets. The order of the lines never
+ * changes, but the offsets shift when a value gets wider, so they are only
+ * a hint.
+ * Returns false if an entry is not where we expect it anymore.
+ */
+static bool keyed_scan_learned(const keyed_file_t* f, const char* buf, size_t len, long long* vals)
 {
-    long long val = get_entry(name, buf);
-    if (val < 0) {
-        fatal(104, "could not find entry '%s' in /proc/meminfo: %s\n", name, strerror((int)-val));
+    if (!f->learned) {
+        return false;
     }
-    return val;
+    for (int i = 0; i < f->count; i++) {
+        if (f->offsets[i] == 0) {
+            // Not provided by this kernel
+            vals[i] = -ENODATA;
+            continue;
+        }
+        size_t off = f->offsets[i] - 1;
+        // Must be at the start of a line, "Cached:" is also in "SwapCached:"
+        if (off + f->keys[i].len > len || (off > 0 && buf[off - 1] != '\n')
+            || memcmp(buf + off, f->keys[i].name, f->keys[i].len) != 0) {
+            return false;
+        }
+        vals[i] = parse_value(buf + off + f->keys[i].len, buf + len);
+    }
+    return true;
+}
+
+/* Read all entries in one pass over the lines, and learn their offsets.
+ * Keys are matched against the whole name up to the separator, so
+ * "SwapCached:" does not match "Cached:".
+ */
+static void keyed_scan_full(keyed_file_t* f, const char* buf, size_t len, long long* vals)
+{
+    const char* end = buf + len;
+    for (int i = 0; i < f->count; i++) {
+        vals[i] = -ENODATA;
+        f->offsets[i] = 0;
+    }
+    for (const char* line = buf; line < end;) {
+        const char* eol = memchr(line, '\n', (size_t)(end - line));
+        if (eol == NULL) {
+            eol = end;
+        }
+        const char* sep = memchr(line, f->sep, (size_t)(eol - line));
+        if (sep != NULL) {
+            size_t keylen = (size_t)(sep - line) + 1;
+            for (int i = 0; i < f->count; i++) {
+                if (f->offsets[i] == 0 && keylen == f->keys[i].len
+                    && memcmp(line, f->keys[i].name, keylen) == 0) {
+                    f->offsets[i] = (size_t)(line - buf) + 1;
+                    vals[i] = parse_value(sep + 1, eol);
+                    break;
+                }
+            }
+        }
+        line = eol + 1;
+    }
+    f->learned = true;
+}
+
+/* Open `f` if it is not open yet. Note that we do not need to close the
+ * fds, they are opened at most once (per procdir_path).
+ * Returns the fd or -errno.
+ */
+int keyed_file_open(keyed_file_t* f)
+{
+    if (f->fd >= 0 && f->fd_procdir != procdir_path) {
+        // The testsuite has switched to another proc tree
+        close(f->fd);
+        f->fd = -1;
+        f->learned = false;
+    }
+    if (f->fd < 0) {
+        char path[PATH_LEN];
+        snprintf(path, sizeof(path), "%s/%s", procdir_path, f->name);
+        f->fd = open(path, O_RDONLY | O_CLOEXEC);
+        f->fd_procdir = procdir_path;
+        if (f->fd < 0) {
+            return -errno;
+        }
+    }
+    return f->fd;
+}
+
+/* Read the open file `f` into `buf` and parse the values of all its keys
+ * into `vals`, -ENODATA for the ones that are not there.
+ * Returns the number of bytes read or -errno.
+ */
+ssize_t keyed_file_read(keyed_file_t* f, char* buf, size_t buflen, long long* vals)
+{
+    ssize_t len = pread_file(f->fd, buf, buflen);
+    if (len < 0) {
+        return len;
+    }
+    if (!keyed_scan_learned(f, buf, (size_t)len, vals)) {
+        keyed_scan_full(f, buf, (size_t)len, vals);
+    }
+    return len;
+}
+
+/* Exit if entry `i` could not be found */
+static long long entry_fatal(const long long* vals, int i)
+{
+    if (vals[i] < 0) {
+        fatal(104, "could not find entry '%s' in /proc/meminfo: %s\n", meminfo_keys[i].name, strerror((int)-vals[i]));
+    }
+    return vals[i];
 }
 
 /* If the kernel does not provide MemAvailable (introduced in Linux 3.14),
  * approximate it using other data we can get */
-static long long available_guesstimate(const char* buf)
+static long long available_guesstimate(const long long* vals)
 {
-    long long Cached = get_entry_fatal("Cached:", buf);
-    long long MemFree = get_entry_fatal("MemFree:", buf);
-    long long Buffers = get_entry_fatal("Buffers:", buf);
-    long long Shmem = get_entry_fatal("Shmem:", buf);
+    long long Cached = entry_fatal(vals, MI_CACHED);
+    long long MemFree = entry_fatal(vals, MI_MEMFREE);
+    long long Buffers = entry_fatal(vals, MI_BUFFERS);
+    long long Shmem = entry_fatal(vals, MI_SHMEM);
 
     return MemFree + Cached + Buffers - Shmem;
 }
@@ -62,40 +210,42 @@ static long long available_guesstimate(const char* buf)
 /* Parse /proc/meminfo.
  * This function either returns valid data or kills the process
  * with a fatal error.
+ *
+ * As this runs on every iteration of the main loop, it reuses one fd
+ * and one buffer, and reads each entry at the offset it was found at
+ * last time.
  */
 meminfo_t parse_meminfo()
 {
-    // Note that we do not need to close static FDs that we ensure to
-    // `fopen()` maximally once.
-    static FILE* fd;
     static int guesstimate_warned = 0;
     // On Linux 5.3, "wc -c /proc/meminfo" counts 1391 bytes.
     // 8192 should be enough for the foreseeable future.
-    char buf[8192] = { 0 };
+    static char buf[8192];
+    long long vals[MI_COUNT];
     meminfo_t m = { 0 };
 
-    if (fd == NULL)
-        fd = fopen("/proc/meminfo", "r");
-    if (fd == NULL) {
-        fatal(102, "could not open /proc/meminfo: %s\n", strerror(errno));
+    if (trace_replaying()) {
+        return trace_next_meminfo();
     }
-    rewind(fd);
-
-    size_t len = fread(buf, 1, sizeof(buf) - 1, fd);
-    if (ferror(fd)) {
-        fatal(103, "could not read /proc/meminfo: %s\n", strerror(errno));
+    int res = keyed_file_open(&meminfo_file);
+    if (res < 0) {
+        fatal(102, "could not open /proc/meminfo: %s\n", strerror(-res));
+    }
+    ssize_t len = keyed_file_read(&meminfo_file, buf, sizeof(buf), vals);
+    if (len < 0) {
+        fatal(103, "could not read /proc/meminfo: %s\n", strerror((int)-len));
     }
     if (len == 0) {
         fatal(103, "could not read /proc/meminfo: 0 bytes returned\n");
     }
 
-    m.MemTotalKiB = get_entry_fatal("MemTotal:", buf);
-    m.SwapTotalKiB = get_entry_fatal("SwapTotal:", buf);
-    long long SwapFree = get_entry_fatal("SwapFree:", buf);
+    m.MemTotalKiB = entry_fatal(vals, MI_MEMTOTAL);
+    m.SwapTotalKiB = entry_fatal(vals, MI_SWAPTOTAL);
+    long long SwapFree = entry_fatal(vals, MI_SWAPFREE);
 
-    long long MemAvailable = get_entry("MemAvailable:", buf);
+    long long MemAvailable = vals[MI_MEMAVAILABLE];
     if (MemAvailable < 0) {
-        MemAvailable = available_guesstimate(buf);
+        MemAvailable = available_guesstimate(vals);
         if (guesstimate_warned == 0) {
             fprintf(stderr, "Warning: Your kernel does not provide MemAvailable data (needs 3.14+)\n"
                             "         Falling back to guesstimate\n");
@@ -103,134 +253,606 @@ meminfo_t parse_meminfo()
         }
     }
 
+    meminfo_derive(&m, MemAvailable, SwapFree);
+
+    // Optional entries, -1 if the kernel does not have them
+    m.ActiveFileKiB = vals[MI_ACTIVE_FILE] < 0 ? -1 : vals[MI_ACTIVE_FILE];
+    m.InactiveFileKiB = vals[MI_INACTIVE_FILE] < 0 ? -1 : vals[MI_INACTIVE_FILE];
+    m.SReclaimableKiB = vals[MI_SRECLAIMABLE] < 0 ? -1 : vals[MI_SRECLAIMABLE];
+    m.ShmemKiB = vals[MI_SHMEM] < 0 ? -1 : vals[MI_SHMEM];
+    m.DirtyKiB = vals[MI_DIRTY] < 0 ? -1 : vals[MI_DIRTY];
+    m.WritebackKiB = vals[MI_WRITEBACK] < 0 ? -1 : vals[MI_WRITEBACK];
+    m.ZswapKiB = vals[MI_ZSWAP] < 0 ? -1 : vals[MI_ZSWAP];
+    m.ZswappedKiB = vals[MI_ZSWAPPED] < 0 ? -1 : vals[MI_ZSWAPPED];
+
+    compswap_adjust(&m);
+
+    return m;
+}
+
+/* Fill in the percentages and MiB values of `m`, which has MemTotalKiB
+ * and SwapTotalKiB set already.
+ */
+void meminfo_derive(meminfo_t* m, long long MemAvailableKiB, long long SwapFreeKiB)
+{
+    m->MemAvailableKiB = MemAvailableKiB;
+    m->SwapFreeKiB = SwapFreeKiB;
+
     // Calculate percentages
-    m.MemAvailablePercent = (double)MemAvailable * 100 / (double)m.MemTotalKiB;
-    if (m.SwapTotalKiB > 0) {
-        m.SwapFreePercent = (double)SwapFree * 100 / (double)m.SwapTotalKiB;
+    m->MemAvailablePercent = (double)MemAvailableKiB * 100 / (double)m->MemTotalKiB;
+    if (m->SwapTotalKiB > 0) {
+        m->SwapFreePercent = (double)SwapFreeKiB * 100 / (double)m->SwapTotalKiB;
     } else {
-        m.SwapFreePercent = 0;
+        m->SwapFreePercent = 0;
     }
 
     // Convert kiB to MiB
-    m.MemTotalMiB = m.MemTotalKiB / 1024;
-    m.MemAvailableMiB = MemAvailable / 1024;
-    m.SwapTotalMiB = m.SwapTotalKiB / 1024;
-    m.SwapFreeMiB = SwapFree / 1024;
+    m->MemTotalMiB = m->MemTotalKiB / 1024;
+    m->MemAvailableMiB = MemAvailableKiB / 1024;
+    m->SwapTotalMiB = m->SwapTotalKiB / 1024;
+    m->SwapFreeMiB = SwapFreeKiB / 1024;
+}
 
-    return m;
+bool is_alive(int pid)
+{
+    char buf[256];
+    // Read /proc/[pid]/stat, without fopen(), which mallocs
+    snprintf(buf, sizeof(buf), "%s/%d/stat", procdir_path, pid);
+    int fd = open(buf, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        // Process is gone - good.
+        return false;
+    }
+    ssize_t len = read(fd, buf, sizeof(buf) - 1);
+    int read_errno = errno;
+    close(fd);
+    if (len <= 0) {
+        if (len < 0 && read_errno != ESRCH) {
+            warn("is_alive: read() failed: %s\n", strerror(read_errno));
+        }
+        return false;
+    }
+    buf[len] = 0;
+    // File content looks like this:
+    // 10751 (cat) R 2663 10751 2663[...]
+    // The name can contain spaces and parentheses, the state follows the
+    // last ')'.
+    char* rparen = strrchr(buf, ')');
+    if (rparen == NULL || rparen[1] != ' ' || rparen[2] == 0) {
+        warn("is_alive: could not parse %s/%d/stat\n", procdir_path, pid);
+        return false;
+    }
+    char state = rparen[2];
+    debug("process state: %c\n", state);
+    if (state == 'Z') {
+        // A zombie process does not use any memory. Consider it dead.
+        return false;
+    }
+    return true;
 }
 
-proctime_t get_process_times(int pid)
+/* Read the open file `fd` from offset 0 into `buf`, NUL-terminated.
+ * Returns the number of bytes read or -errno on error.
+ */
+ssize_t pread_file(int fd, char* buf, size_t buflen)
 {
-    FILE* f;
-    char ppath[PATH_LEN];
-    proctime_t tt = { 0 };
-    unsigned long clk_ticks;
-    tt.valid = false;
+    ssize_t len = pread(fd, buf, buflen - 1, 0);
+    if (len < 0) {
+        return -errno;
+    }
+    buf[len] = 0;
+    return len;
+}
 
-    clk_ticks = (unsigned long)sysconf(_SC_CLK_TCK);
+/* Read the file `name` relative to the directory fd `dirfd` into `buf`
+ * using plain openat() + read(), without going through stdio.
+ * The result is NUL-terminated. The syscalls are counted in `scan`,
+ * which may be NULL.
+ * Returns the number of bytes read or -errno on error.
+ */
+ssize_t read_file_at(procscan_t* scan, int dirfd, const char* name, char* buf, size_t buflen)
+{
+    int fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+    if (scan) {
+        scan->syscalls++;
+    }
+    if (fd < 0) {
+        return -errno;
+    }
+    size_t len = 0;
+    while (len < buflen - 1) {
+        ssize_t n = read(fd, buf + len, buflen - 1 - len);
+        if (scan) {
+            scan->syscalls++;
+        }
+        if (n < 0) {
+            int read_errno = errno;
+            close(fd);
+            return -read_errno;
+        }
+        len += (size_t)n;
+        // The small files in /proc/[pid] are generated in one go. A short
+        // read means we got everything, save the extra read() that would
+        // return zero.
+        if (n == 0 || len < buflen - 1) {
+            break;
+        }
+    }
+    close(fd);
+    if (scan) {
+        scan->syscalls++;
+    }
+    buf[len] = 0;
+    return (ssize_t)len;
+}
 
-    snprintf(ppath, sizeof(ppath), "/proc/%d/stat", pid);
-    if ((f = fopen(ppath, "r")) == NULL) {
-        warn("get_process_times: failed to read stat for pid %d\n", pid);
-        return tt;
+/* Write `value` to the file `name` relative to `dirfd`, like a cgroup
+ * control file, in one write(). Returns 0 or -errno.
+ */
+int write_file_at(int dirfd, const char* name, const char* value)
+{
+    int fd = openat(dirfd, name, O_WRONLY | O_TRUNC | O_CLOEXEC);
+    if (fd < 0) {
+        return -errno;
     }
+    size_t len = strlen(value);
+    ssize_t res = write(fd, value, len);
+    int write_errno = errno;
+    close(fd);
+    if (res < 0) {
+        return -write_errno;
+    }
+    return (size_t)res == len ? 0 : -EIO;
+}
 
-    // pid(%d), comm(%s), state(%c), ppid(%d), pgrp(%d), session(%d), tty_nr(%d), tpgid(%d),
-    // flags(%u), minflt(%lu), cminflt(%lu), majflt(%lu), cmajflt(%lu), utime(%lu), stime(%lu),
-    // cutime(%ld), cstime(%ld), priority(%ld), nice(%ld), num_threads(%ld),
-    // itrealvalue(%ld), starttime(%llu), ...
-    #pragma GCC diagnostic ignored "-Wformat"
-    fscanf(f, "%*d %*s %*c %*d %*d %*d %*d %*d %*u %*lu %*lu %*lu %*lu %lu %lu %ld %ld %*ld %*ld %*ld %*ld %llu ",
-              &tt.utime, &tt.stime, &tt.cutime, &tt.cstime, &tt.starttime);
-    #pragma GCC diagnostic warning "-Wformat"
-    fclose(f);
+/* Parse a file containing a single integer, like oom_score.
+ * Returns 0 on success and -errno on error.
+ */
+static int parse_int(const char* buf, int* out)
+{
+    char* endptr = NULL;
+    long val = strtol(buf, &endptr, 10);
+    if (endptr == buf) {
+        return -ENODATA;
+    }
+    *out = (int)val;
+    return 0;
+}
 
-    tt.c_utime = tt.utime / clk_ticks;
-    tt.c_stime = tt.stime / clk_ticks;
-    tt.c_cutime = tt.cutime / clk_ticks;
-    tt.c_cstime = tt.cstime / clk_ticks;
-    tt.c_runtime = (unsigned long)get_uptime() - (tt.starttime / clk_ticks);
-    tt.valid = true;
+/* Read a file containing a single integer, like oom_score.
+ * Returns 0 on success and -errno on error.
+ */
+static int read_int_at(procscan_t* scan, int dirfd, const char* name, int* out)
+{
+    char buf[32];
+    ssize_t len = read_file_at(scan, dirfd, name, buf, sizeof(buf));
+    if (len < 0) {
+        return (int)len;
+    }
+    return parse_int(buf, out);
+}
 
-    return tt;
+/* Read /proc/uptime, in seconds. Returns -1 on error. */
+static double read_uptime(procscan_t* scan)
+{
+    char buf[64];
+    char path[PATH_LEN];
+    snprintf(path, sizeof(path), "%s/uptime", procdir_path);
+    if (read_file_at(scan, AT_FDCWD, path, buf, sizeof(buf)) <= 0) {
+        return -1;
+    }
+    return strtod(buf, NULL);
 }
 
-float get_uptime()
+/* Start a /proc scan: read the values that are the same
+ * for all processes exactly once.
+ */
+void procscan_begin(procscan_t* scan)
 {
-    FILE* f;
-    float uptime;
+    static long clk_tck;
+    static long page_size;
 
-    if ((f = fopen("/proc/uptime", "r")) == NULL) {
-        return -1.0f;
+    if (clk_tck == 0) {
+        clk_tck = sysconf(_SC_CLK_TCK);
+        if (clk_tck <= 0) {
+            fatal(1, "could not read clock ticks\n");
+        }
     }
+    if (page_size == 0) {
+        page_size = sysconf(_SC_PAGESIZE);
+        if (page_size <= 0) {
+            fatal(1, "could not read page size\n");
+        }
+    }
+    *scan = (procscan_t) {
+        .clk_tck = clk_tck,
+        .page_size = page_size,
+        .uptime = -1,
+        .numa_node = -1,
+    };
+}
 
-    fscanf(f, "%f ", &uptime);
-    fclose(f);
+/* Open /proc/[pid] and keep the directory pinned while its
+ * files are read via procinfo_read().
+ * Returns the directory fd or -errno on error.
+ */
+int procinfo_open(procscan_t* scan, int pid)
+{
+    char path[PATH_LEN] = { 0 };
+    snprintf(path, sizeof(path), "%s/%d", procdir_path, pid);
+    int dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    scan->syscalls++;
+    if (dirfd < 0) {
+        return -errno;
+    }
+    return dirfd;
+}
 
-    return uptime;
+void procinfo_close(procscan_t* scan, int dirfd)
+{
+    close(dirfd);
+    scan->syscalls++;
 }
 
-bool is_alive(int pid)
+/* Parse /proc/[pid]/stat. The process name may contain spaces and
+ * parentheses, so we start after the last ')'.
+ */
+static int read_stat_at(procscan_t* scan, int dirfd, struct procinfo* p)
 {
-    char buf[256];
-    // Read /proc/[pid]/stat
-    snprintf(buf, sizeof(buf), "/proc/%d/stat", pid);
-    FILE* f = fopen(buf, "r");
-    if (f == NULL) {
-        // Process is gone - good.
-        return false;
+    char buf[1024];
+    ssize_t len = read_file_at(scan, dirfd, "stat", buf, sizeof(buf));
+    if (len < 0) {
+        return (int)len;
     }
     // File content looks like this:
     // 10751 (cat) R 2663 10751 2663[...]
-    char state;
-    int res = fscanf(f, "%*d %*s %c", &state);
-    int fscanf_errno = errno;
-    fclose(f);
-    if (res < 1) {
-        warn("is_alive: fscanf() failed: %s\n", strerror(fscanf_errno));
-        return false;
+    // Field numbers from "man 5 proc", fields 1 and 2 are pid and comm.
+    char* pos = strrchr(buf, ')');
+    if (pos == NULL) {
+        return -ENODATA;
     }
-    debug("process state: %c\n", state);
-    if (state == 'Z') {
-        // A zombie process does not use any memory. Consider it dead.
-        return false;
+    pos++;
+    unsigned long long utime = 0, stime = 0, starttime = 0, pgrp = 0, session = 0;
+    for (int field = 3; field <= 22; field++) {
+        char* endptr = NULL;
+        if (field == 3) {
+            // state(%c)
+            while (*pos == ' ')
+                pos++;
+            if (*pos == 0) {
+                return -ENODATA;
+            }
+            pos++;
+            continue;
+        }
+        unsigned long long val = strtoull(pos, &endptr, 10);
+        if (endptr == pos) {
+            return -ENODATA;
+        }
+        pos = endptr;
+        if (field == 5) {
+            pgrp = val;
+        } else if (field == 6) {
+            session = val;
+        } else if (field == 14) {
+            utime = val;
+        } else if (field == 15) {
+            stime = val;
+        } else if (field == 22) {
+            starttime = val;
+        }
     }
-    return true;
+    if (scan->uptime < 0) {
+        scan->uptime = read_uptime(scan);
+    }
+    unsigned long long clk_tck = (unsigned long long)scan->clk_tck;
+    p->utime = (unsigned long)(utime / clk_tck);
+    p->stime = (unsigned long)(stime / clk_tck);
+    p->starttime = starttime;
+    p->pgrp = (int)pgrp;
+    p->session = (int)session;
+    if (scan->uptime >= 0 && (double)(starttime / clk_tck) <= scan->uptime) {
+        p->rtime = (unsigned long)scan->uptime - (unsigned long)(starttime / clk_tck);
+    } else {
+        p->rtime = 0;
+    }
+    return 0;
 }
 
-/* Read /proc/[pid]/[name] and convert to integer.
- * As the value may legitimately be < 0 (think oom_score_adj),
- * it is stored in the `out` pointer, and the return value is either
- * 0 (sucess) or -errno (failure).
+/* Get the cgroup v2 path from /proc/[pid]/cgroup. The v2 hierarchy is the
+ * line starting with "0::". On cgroup v1-only systems there is none, and
+ * the result is "/".
  */
-static int read_proc_file_integer(const int pid, const char* name, int* out)
+static int read_cgroup_at(procscan_t* scan, int dirfd, struct procinfo* p)
 {
-    char path[PATH_LEN] = { 0 };
-    snprintf(path, sizeof(path), "/proc/%d/%s", pid, name);
-    FILE* f = fopen(path, "r");
-    if (f == NULL) {
+    char buf[2048];
+    ssize_t len = read_file_at(scan, dirfd, "cgroup", buf, sizeof(buf));
+    if (len < 0) {
+        return (int)len;
+    }
+    strcpy(p->cgroup, "/");
+    for (char* line = buf; *line;) {
+        char* eol = strchr(line, '\n');
+        if (eol) {
+            *eol = 0;
+        }
+        if (strncmp(line, "0::", 3) == 0) {
+            snprintf(p->cgroup, sizeof(p->cgroup), "%s", line + 3);
+            break;
+        }
+        if (eol == NULL) {
+            break;
+        }
+        line = eol + 1;
+    }
+    return 0;
+}
+
+/* Get VmSwap from /proc/[pid]/status. The line looks like this:
+ * VmSwap:	     123 kB
+ * Kernel threads have none.
+ */
+static int read_swap_at(procscan_t* scan, int dirfd, struct procinfo* p)
+{
+    char buf[4096];
+    ssize_t len = read_file_at(scan, dirfd, "status", buf, sizeof(buf));
+    if (len < 0) {
+        return (int)len;
+    }
+    p->VmSwapkiB = 0;
+    char* pos = strstr(buf, "\nVmSwap:");
+    if (pos != NULL) {
+        p->VmSwapkiB = strtoll(pos + strlen("\nVmSwap:"), NULL, 10);
+    }
+    return 0;
+}
+
+/* Add up the pages that one /proc/[pid]/numa_maps line, like
+ * 7f2c5e9fd000 default file=/usr/lib/libc.so.6 mapped=5 N0=3 N1=2 kernelpagesize_kB=4
+ * has on the node with the " N<node>=" tag `tag`.
+ */
+static long long numa_maps_line_kib(const char* line, const char* tag)
+{
+    const char* pos = strstr(line, tag);
+    if (pos == NULL) {
+        return 0;
+    }
+    long long pages = strtoll(pos + strlen(tag), NULL, 10);
+    long long page_kib = 4;
+    const char* ps = strstr(line, " kernelpagesize_kB=");
+    if (ps != NULL) {
+        page_kib = strtoll(ps + strlen(" kernelpagesize_kB="), NULL, 10);
+    }
+    return pages * page_kib;
+}
+
+/* Sum up what the process has resident on scan->numa_node, according to
+ * /proc/[pid]/numa_maps. The file has one line per mapping and can be
+ * large, so it is read in chunks, carrying over the incomplete last line.
+ */
+static int read_numa_at(procscan_t* scan, int dirfd, struct procinfo* p)
+{
+    if (scan == NULL || scan->numa_node < 0) {
+        return -EINVAL;
+    }
+    char tag[32];
+    snprintf(tag, sizeof(tag), " N%d=", scan->numa_node);
+
+    int fd = openat(dirfd, "numa_maps", O_RDONLY | O_CLOEXEC);
+    scan->syscalls++;
+    if (fd < 0) {
         return -errno;
     }
-    int matches = fscanf(f, "%d", out);
-    fclose(f);
-    if (matches != 1) {
-        return -ENODATA;
+    char buf[8192];
+    size_t carry = 0;
+    long long kib = 0;
+    while (1) {
+        ssize_t n = read(fd, buf + carry, sizeof(buf) - 1 - carry);
+        scan->syscalls++;
+        if (n < 0) {
+            int read_errno = errno;
+            close(fd);
+            scan->syscalls++;
+            return -read_errno;
+        }
+        size_t len = carry + (size_t)n;
+        buf[len] = 0;
+        char* line = buf;
+        char* nl;
+        while ((nl = strchr(line, '\n')) != NULL) {
+            *nl = 0;
+            kib += numa_maps_line_kib(line, tag);
+            line = nl + 1;
+        }
+        carry = len - (size_t)(line - buf);
+        if (n == 0 || carry == sizeof(buf) - 1) {
+            // At the end, or a line that does not fit: count what we have
+            kib += numa_maps_line_kib(line, tag);
+            carry = 0;
+            if (n == 0) {
+                break;
+            }
+        }
+        memmove(buf, line, carry);
     }
+    close(fd);
+    scan->syscalls++;
+    p->NodeKiB = kib;
     return 0;
 }
 
+/* Set the PROC_* field `field` (one of PROC_OOM_SCORE, PROC_OOM_SCORE_ADJ,
+ * PROC_COMM or PROC_RSS) of `p` from the contents of its file, which were
+ * read into `buf` by someone else, like the io_uring backend. `buf` holds
+ * `len` bytes and is NUL-terminated. It may be p->name.
+ * Returns 0 on success and -errno on error.
+ */
+int procinfo_parse(procscan_t* scan, struct procinfo* p, unsigned field, char* buf, size_t len)
+{
+    int res = 0;
+    switch (field) {
+    case PROC_OOM_SCORE:
+        res = parse_int(buf, &p->badness);
+        break;
+    case PROC_OOM_SCORE_ADJ:
+        res = parse_int(buf, &p->oom_score_adj);
+        break;
+    case PROC_COMM:
+        // Process name may be empty, but we should get at least a newline
+        // Example for empty process name: perl -MPOSIX -e '$0=""; pause'
+        if (len < 1) {
+            p->name[0] = 0;
+            return -ENODATA;
+        }
+        if (len > sizeof(p->name)) {
+            len = sizeof(p->name);
+        }
+        // Strip trailing newline
+        if (buf != p->name) {
+            memcpy(p->name, buf, len - 1);
+        }
+        p->name[len - 1] = 0;
+        fix_truncated_utf8(p->name);
+        break;
+    case PROC_RSS: {
+        // The first field is the total program size, and the second
+        // is the resident set size
+        char* endptr = NULL;
+        strtoll(buf, &endptr, 10);
+        char* rss = endptr;
+        long long rss_pages = strtoll(rss, &endptr, 10);
+        if (endptr == rss) {
+            return -ENODATA;
+        }
+        // Convert to kiB
+        p->VmRSSkiB = rss_pages * scan->page_size / 1024;
+        break;
+    }
+    default:
+        return -EINVAL;
+    }
+    if (res == 0) {
+        p->fields |= field;
+    }
+    return res;
+}
+
+/* Read the PROC_* fields in `fields` of the process with the pinned
+ * directory `dirfd` into `p`. Fields that have already been read
+ * (as recorded in p->fields) are not read again.
+ * Returns 0 on success and -errno on the first error.
+ */
+int procinfo_read(procscan_t* scan, int dirfd, struct procinfo* p, unsigned fields)
+{
+    fields &= ~p->fields;
+
+    if (fields & PROC_OOM_SCORE) {
+        int res = read_int_at(scan, dirfd, "oom_score", &p->badness);
+        if (res < 0) {
+            return res;
+        }
+        p->fields |= PROC_OOM_SCORE;
+    }
+    if (fields & PROC_OOM_SCORE_ADJ) {
+        int res = read_int_at(scan, dirfd, "oom_score_adj", &p->oom_score_adj);
+        if (res < 0) {
+            return res;
+        }
+        p->fields |= PROC_OOM_SCORE_ADJ;
+    }
+    if (fields & PROC_COMM) {
+        ssize_t n = read_file_at(scan, dirfd, "comm", p->name, sizeof(p->name));
+        if (n < 0) {
+            return (int)n;
+        }
+        int res = procinfo_parse(scan, p, PROC_COMM, p->name, (size_t)n);
+        if (res < 0) {
+            return res;
+        }
+    }
+    if (fields & PROC_UID) {
+        // The owner of /proc/[pid] is the effective uid (EUID)
+        struct stat st = { 0 };
+        int res = fstat(dirfd, &st);
+        scan->syscalls++;
+        if (res < 0) {
+            return -errno;
+        }
+        p->uid = (int)st.st_uid;
+        p->fields |= PROC_UID;
+    }
+    if (fields & PROC_RSS) {
+        // Read VmRSS from /proc/[pid]/statm (in pages)
+        char buf[256];
+        ssize_t len = read_file_at(scan, dirfd, "statm", buf, sizeof(buf));
+        if (len < 0) {
+            return (int)len;
+        }
+        int res = procinfo_parse(scan, p, PROC_RSS, buf, (size_t)len);
+        if (res < 0) {
+            return res;
+        }
+    }
+    if (fields & (PROC_TIMES | PROC_PGRP)) {
+        // Both come from /proc/[pid]/stat
+        int res = read_stat_at(scan, dirfd, p);
+        if (res < 0) {
+            return res;
+        }
+        p->fields |= PROC_TIMES | PROC_PGRP;
+    }
+    if (fields & PROC_CGROUP) {
+        int res = read_cgroup_at(scan, dirfd, p);
+        if (res < 0) {
+            return res;
+        }
+        p->fields |= PROC_CGROUP;
+    }
+    if (fields & PROC_SWAP) {
+        int res = read_swap_at(scan, dirfd, p);
+        if (res < 0) {
+            return res;
+        }
+        p->fields |= PROC_SWAP;
+    }
+    if (fields & PROC_NUMA) {
+        int res = read_numa_at(scan, dirfd, p);
+        if (res < 0) {
+            return res;
+        }
+        p->fields |= PROC_NUMA;
+    }
+    return 0;
+}
+
+/* Read the PROC_* fields in `fields` of `pid` into `p`, opening and
+ * closing /proc/[pid]. Meant for one-off lookups outside of a scan.
+ * Returns 0 on success and -errno on error.
+ */
+static int procinfo_read_pid(int pid, struct procinfo* p, unsigned fields)
+{
+    procscan_t scan;
+    procscan_begin(&scan);
+    int dirfd = procinfo_open(&scan, pid);
+    if (dirfd < 0) {
+        return dirfd;
+    }
+    int res = procinfo_read(&scan, dirfd, p, fields);
+    procinfo_close(&scan, dirfd);
+    return res;
+}
+
 /* Read /proc/[pid]/oom_score.
  * Returns the value (>= 0) or -errno on error.
  */
 int get_oom_score(const int pid)
 {
-    int out = 0;
-    int res = read_proc_file_integer(pid, "oom_score", &out);
+    struct procinfo p = { .pid = pid };
+    int res = procinfo_read_pid(pid, &p, PROC_OOM_SCORE);
     if (res < 0) {
         return res;
     }
-    return out;
+    return p.badness;
 }
 
 /* Read /proc/[pid]/oom_score_adj.
@@ -241,7 +863,13 @@ int get_oom_score(const int pid)
  */
 int get_oom_score_adj(const int pid, int* out)
 {
-    return read_proc_file_integer(pid, "oom_score_adj", out);
+    struct procinfo p = { .pid = pid };
+    int res = procinfo_read_pid(pid, &p, PROC_OOM_SCORE_ADJ);
+    if (res < 0) {
+        return res;
+    }
+    *out = p.oom_score_adj;
+    return 0;
 }
 
 /* Read /proc/[pid]/comm (process name truncated to 16 bytes).
@@ -249,28 +877,12 @@ int get_oom_score_adj(const int pid, int* out)
  */
 int get_comm(int pid, char* out, size_t outlen)
 {
-    char path[PATH_LEN] = { 0 };
-    snprintf(path, sizeof(path), "/proc/%d/comm", pid);
-    FILE* f = fopen(path, "r");
-    if (f == NULL) {
-        return -errno;
-    }
-    size_t n = fread(out, 1, outlen - 1, f);
-    if (ferror(f)) {
-        int fread_errno = errno;
-        perror("get_comm: fread() failed");
-        fclose(f);
-        return -fread_errno;
-    }
-    fclose(f);
-    // Process name may be empty, but we should get at least a newline
-    // Example for empty process name: perl -MPOSIX -e '$0=""; pause'
-    if (n < 1) {
-        return -ENODATA;
+    struct procinfo p = { .pid = pid };
+    int res = procinfo_read_pid(pid, &p, PROC_COMM);
+    if (res < 0) {
+        return res;
     }
-    // Strip trailing newline
-    out[n - 1] = 0;
-    fix_truncated_utf8(out);
+    snprintf(out, outlen, "%s", p.name);
     return 0;
 }
 
@@ -278,47 +890,64 @@ int get_comm(int pid, char* out, size_t outlen)
 // Returns the uid (>= 0) or -errno on error.
 int get_uid(int pid)
 {
-    char path[PATH_LEN] = { 0 };
-    snprintf(path, sizeof(path), "/proc/%d", pid);
-    struct stat st = { 0 };
-    int res = stat(path, &st);
+    struct procinfo p = { .pid = pid };
+    int res = procinfo_read_pid(pid, &p, PROC_UID);
     if (res < 0) {
-        return -errno;
+        return res;
     }
-    return (int)st.st_uid;
+    return p.uid;
 }
 
 // Read VmRSS from /proc/[pid]/statm and convert to kiB.
 // Returns the value (>= 0) or -errno on error.
 long long get_vm_rss_kib(int pid)
 {
-    long long vm_rss_kib = -1;
-    char path[PATH_LEN] = { 0 };
+    struct procinfo p = { .pid = pid };
+    int res = procinfo_read_pid(pid, &p, PROC_RSS);
+    if (res < 0) {
+        return res;
+    }
+    return p.VmRSSkiB;
+}
 
-    // Read VmRSS from /proc/[pid]/statm (in pages)
-    snprintf(path, sizeof(path), "/proc/%d/statm", pid);
-    FILE* f = fopen(path, "r");
-    if (f == NULL) {
-        return -errno;
+// Read VmLck, the memory locked by mlock() and mlockall(), from
+// /proc/[pid]/status, in kiB.
+// Returns the value (>= 0) or -errno on error.
+long long get_vm_lck_kib(int pid)
+{
+    char path[PATH_LEN];
+    char buf[4096];
+    snprintf(path, sizeof(path), "%s/%d/status", procdir_path, pid);
+    ssize_t len = read_file_at(NULL, AT_FDCWD, path, buf, sizeof(buf));
+    if (len < 0) {
+        return len;
     }
-    int matches = fscanf(f, "%*u %lld", &vm_rss_kib);
-    fclose(f);
-    if (matches < 1) {
+    char* pos = strstr(buf, "\nVmLck:");
+    if (pos == NULL) {
         return -ENODATA;
     }
+    return strtoll(pos + strlen("\nVmLck:"), NULL, 10);
+}
 
-    // Read and cache page size
-    static long page_size;
-    if (page_size == 0) {
-        page_size = sysconf(_SC_PAGESIZE);
-        if (page_size <= 0) {
-            fatal(1, "could not read page size\n");
-        }
+// Read what `pid` has resident on NUMA node `node` from
+// /proc/[pid]/numa_maps, in kiB.
+// Returns the value (>= 0) or -errno on error.
+long long get_numa_node_kib(int pid, int node)
+{
+    struct procinfo p = { .pid = pid };
+    procscan_t scan;
+    procscan_begin(&scan);
+    scan.numa_node = node;
+    int dirfd = procinfo_open(&scan, pid);
+    if (dirfd < 0) {
+        return dirfd;
     }
-
-    // Convert to kiB
-    vm_rss_kib = vm_rss_kib * page_size / 1024;
-    return vm_rss_kib;
+    int res = procinfo_read(&scan, dirfd, &p, PROC_NUMA);
+    procinfo_close(&scan, dirfd);
+    if (res < 0) {
+        return res;
+    }
+    return p.NodeKiB;
 }
 
 /* Print a status line like
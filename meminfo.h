@@ -6,6 +6,8 @@
 #define MAX_USERLEN 33
 
 #include <stdbool.h>
+#include <sys/types.h>
+#include <stddef.h> // for size_t
 
 typedef struct {
     // Values from /proc/meminfo, in KiB or converted to MiB.
@@ -15,51 +17,123 @@ typedef struct {
     long long SwapTotalMiB;
     long long SwapTotalKiB;
     long long SwapFreeMiB;
+    long long MemAvailableKiB;
+    long long SwapFreeKiB;
     // Calculated percentages
     double MemAvailablePercent; // percent of total memory that is available
     double SwapFreePercent; // percent of total swap that is free
+    // Additional values from /proc/meminfo in KiB, -1 if not provided
+    // by the kernel
+    long long ActiveFileKiB;
+    long long InactiveFileKiB;
+    long long SReclaimableKiB;
+    long long ShmemKiB;
+    long long DirtyKiB;
+    long long WritebackKiB;
+    // zswap pool size and what is stored in it, uncompressed
+    long long ZswapKiB;
+    long long ZswappedKiB;
 } meminfo_t;
 
+// Fields of struct procinfo, as read by procinfo_read()
+#define PROC_OOM_SCORE (1 << 0) // badness
+#define PROC_OOM_SCORE_ADJ (1 << 1) // oom_score_adj
+#define PROC_COMM (1 << 2) // name
+#define PROC_UID (1 << 3) // uid
+#define PROC_RSS (1 << 4) // VmRSSkiB
+#define PROC_TIMES (1 << 5) // utime, stime, rtime, starttime
+#define PROC_PGRP (1 << 6) // pgrp, session
+#define PROC_CGROUP (1 << 7) // cgroup
+#define PROC_SWAP (1 << 8) // VmSwapkiB
+#define PROC_NUMA (1 << 9) // NodeKiB, needs procscan_t.numa_node
+
 struct procinfo {
     int pid;
     int uid;
     int badness;
+    int oom_score_adj;
     long long VmRSSkiB;
+    long long VmSwapkiB;
+    // resident on procscan_t.numa_node
+    long long NodeKiB;
+    // times are in seconds
     unsigned long utime;
     unsigned long stime;
     unsigned long rtime;
+    // in clock ticks since boot, identifies the process together with the pid
+    unsigned long long starttime;
+    int pgrp;
+    int session;
+    // cgroup v2 path relative to the cgroup root, like "/system.slice/foo.service"
+    char cgroup[PATH_LEN];
     char name[PATH_LEN];
-    char username[MAX_USERLEN];
+    // PROC_* fields that have been filled in
+    unsigned fields;
 };
 
+// State shared by all procinfo_read() calls during one /proc scan
 typedef struct {
-    // all times are in clock ticks
-    // divide by sysconf(_SC_CLK_TCK) to get seconds
-    unsigned long utime;
-    unsigned long stime;
-    unsigned long cutime;
-    unsigned long cstime;
-    // divide by sysconf(_SC_CLK_TCK) to get seconds
-    // then subtract from uptime to get absolute runtime duration
-    unsigned long long starttime;
-    // calculated times, rounded to nearest second
-    unsigned long c_utime;
-    unsigned long c_stime;
-    unsigned long c_cutime;
-    unsigned long c_cstime;
-    unsigned long c_runtime;
-    bool valid;
-} proctime_t;
+    long clk_tck;
+    long page_size;
+    // seconds since boot, read on first use, -1 = not read yet
+    double uptime;
+    // number of syscalls issued for this scan
+    unsigned long syscalls;
+    // NUMA node for PROC_NUMA, -1 = none
+    int numa_node;
+    // MemTotal of numa_node, for the node badness
+    long long numa_total_kib;
+} procscan_t;
+
+// A key of a keyed_file_t, including its separator, like "MemTotal:"
+typedef struct {
+    const char* name;
+    size_t len;
+} keyed_key_t;
+
+#define KEYED_KEY(name) { name, sizeof(name) - 1 }
+
+/* A /proc file of "key value" lines that is read on every poll loop
+ * iteration, like meminfo or vmstat. It is kept open and read with
+ * pread(), and each key is parsed at the offset it was found at last time.
+ */
+typedef struct {
+    // Relative to procdir_path, like "meminfo"
+    const char* name;
+    // What ends a key: ':' in meminfo, ' ' in vmstat
+    char sep;
+    const keyed_key_t* keys;
+    int count;
+    // `count` offsets of the lines, plus one (0 = not seen)
+    size_t* offsets;
+    bool learned;
+    // -1 = not open
+    int fd;
+    const char* fd_procdir;
+} keyed_file_t;
+
+int keyed_file_open(keyed_file_t* f);
+ssize_t keyed_file_read(keyed_file_t* f, char* buf, size_t buflen, long long* vals);
+
+ssize_t pread_file(int fd, char* buf, size_t buflen);
+ssize_t read_file_at(procscan_t* scan, int dirfd, const char* name, char* buf, size_t buflen);
+int write_file_at(int dirfd, const char* name, const char* value);
 
 meminfo_t parse_meminfo();
-proctime_t get_process_times(int pid);
-float get_uptime();
+void meminfo_derive(meminfo_t* m, long long MemAvailableKiB, long long SwapFreeKiB);
 bool is_alive(int pid);
 void print_mem_stats(int (*out_func)(const char* fmt, ...), const meminfo_t m);
 int get_oom_score(int pid);
 int get_oom_score_adj(const int pid, int* out);
 long long get_vm_rss_kib(int pid);
+long long get_vm_lck_kib(int pid);
+long long get_numa_node_kib(int pid, int node);
 int get_comm(int pid, char* out, size_t outlen);
 int get_uid(int pid);
+void procscan_begin(procscan_t* scan);
+int procinfo_open(procscan_t* scan, int pid);
+int procinfo_read(procscan_t* scan, int dirfd, struct procinfo* p, unsigned fields);
+int procinfo_parse(procscan_t* scan, struct procinfo* p, unsigned field, char* buf, size_t len);
+void procinfo_close(procscan_t* scan, int dirfd);
 
 #endif
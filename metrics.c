@@ -0,0 +1,158 @@
+// SPDX-License-Identifier: MIT
+
+/* Counters and latency histograms in the Prometheus text format, written to
+ * a file for the node_exporter textfile collector (--metrics FILE).
+ *
+ * Everything lives in static arrays and is only touched by the poll loop,
+ * so recording a value is an increment. The file is rewritten by
+ * metrics_flush(), and only if something changed.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "meminfo.h"
+#include "metrics.h"
+#include "msg.h"
+
+#define BUCKETS_MAX 10
+
+typedef struct {
+    const char* name;
+    const char* help;
+    // Upper bounds in seconds, ascending, 0-terminated
+    double le[BUCKETS_MAX];
+    // counts[i] is the number of observations <= le[i], non-cumulative.
+    // The last one is +Inf.
+    unsigned long counts[BUCKETS_MAX + 1];
+    double sum;
+    unsigned long count;
+} histogram_t;
+
+static const struct {
+    const char* name;
+    const char* labels;
+    const char* help;
+} counter_info[METRIC_COUNTERS] = {
+    [METRIC_SIGTERM] = { "earlyoom_signals_total", "{signal=\"SIGTERM\"}", "Signals sent to processes or units" },
+    [METRIC_SIGKILL] = { "earlyoom_signals_total", "{signal=\"SIGKILL\"}", NULL },
+    [METRIC_EMERGENCY_KILLS] = { "earlyoom_emergency_kills_total", "", "Processes killed by the emergency kill" },
+    [METRIC_ESCALATIONS] = { "earlyoom_escalations_total", "", "Escalations from SIGTERM to SIGKILL" },
+    [METRIC_NO_VICTIM] = { "earlyoom_no_victim_total", "", "Times there was no process to kill" },
+    [METRIC_EPERM] = { "earlyoom_kill_eperm_total", "", "Signals that failed with EPERM" },
+};
+
+static unsigned long counters[METRIC_COUNTERS];
+
+static histogram_t histograms[METRIC_HISTOGRAMS] = {
+    [METRIC_SELECTION_SECONDS] = {
+        .name = "earlyoom_victim_selection_seconds",
+        .help = "Time to select a victim",
+        .le = { 0.0001, 0.0003, 0.001, 0.003, 0.01, 0.03, 0.1, 0.3, 1 },
+    },
+    [METRIC_EXIT_SECONDS] = {
+        .name = "earlyoom_victim_exit_seconds",
+        .help = "Time from the first signal until the victim was gone",
+        .le = { 0.01, 0.03, 0.1, 0.3, 1, 2, 5, 10 },
+    },
+    [METRIC_RECOVERY_SECONDS] = {
+        .name = "earlyoom_recovery_seconds",
+        .help = "Time from the first signal until memory was above the high watermark again",
+        .le = { 0.1, 0.3, 1, 3, 10, 30, 60, 300 },
+    },
+};
+
+static char metrics_path[PATH_LEN];
+static bool dirty;
+
+/*
+ * Write metrics to `path`, or nowhere if it is NULL.
+ */
+void metrics_init(const char* path)
+{
+    if (path == NULL) {
+        metrics_path[0] = 0;
+        return;
+    }
+    snprintf(metrics_path, sizeof(metrics_path), "%s", path);
+    // Write the zeroes, so scrapers see that we are there
+    dirty = true;
+    metrics_flush();
+}
+
+void metrics_add(int counter, unsigned long n)
+{
+    counters[counter] += n;
+    dirty = true;
+}
+
+void metrics_observe(int histogram, double secs)
+{
+    histogram_t* h = &histograms[histogram];
+    int i = 0;
+    while (i < BUCKETS_MAX && h->le[i] > 0 && secs > h->le[i]) {
+        i++;
+    }
+    if (i < BUCKETS_MAX && h->le[i] == 0) {
+        // Past the last bound
+        i = BUCKETS_MAX;
+    }
+    h->counts[i]++;
+    h->sum += secs;
+    h->count++;
+    dirty = true;
+}
+
+static void write_metrics(FILE* f)
+{
+    for (int i = 0; i < METRIC_COUNTERS; i++) {
+        if (counter_info[i].help) {
+            fprintf(f, "# HELP %s %s\n# TYPE %s counter\n", counter_info[i].name, counter_info[i].help, counter_info[i].name);
+        }
+        fprintf(f, "%s%s %lu\n", counter_info[i].name, counter_info[i].labels, counters[i]);
+    }
+    for (int i = 0; i < METRIC_HISTOGRAMS; i++) {
+        const histogram_t* h = &histograms[i];
+        unsigned long cumulative = 0;
+        fprintf(f, "# HELP %s %s\n# TYPE %s histogram\n", h->name, h->help, h->name);
+        for (int j = 0; j < BUCKETS_MAX && h->le[j] > 0; j++) {
+            cumulative += h->counts[j];
+            fprintf(f, "%s_bucket{le=\"%g\"} %lu\n", h->name, h->le[j], cumulative);
+        }
+        fprintf(f, "%s_bucket{le=\"+Inf\"} %lu\n", h->name, h->count);
+        fprintf(f, "%s_sum %g\n", h->name, h->sum);
+        fprintf(f, "%s_count %lu\n", h->name, h->count);
+    }
+}
+
+/*
+ * Rewrite the metrics file if anything changed. The file is replaced
+ * atomically, so the collector never sees a partial one.
+ */
+void metrics_flush(void)
+{
+    if (!dirty || metrics_path[0] == 0) {
+        return;
+    }
+    dirty = false;
+
+    char tmp[PATH_LEN + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", metrics_path);
+    FILE* f = fopen(tmp, "w");
+    if (f == NULL) {
+        warn("failed to write metrics file %s: %s\n", tmp, strerror(errno));
+        return;
+    }
+    write_metrics(f);
+    if (fclose(f) != 0) {
+        warn("failed to write metrics file %s: %s\n", tmp, strerror(errno));
+        remove(tmp);
+        return;
+    }
+    if (rename(tmp, metrics_path) != 0) {
+        warn("failed to rename %s to %s: %s\n", tmp, metrics_path, strerror(errno));
+        remove(tmp);
+    }
+}
@@ -0,0 +1,29 @@
+/* SPDX-License-Identifier: MIT */
+#ifndef METRICS_H
+#define METRICS_H
+
+// Counters
+enum {
+    METRIC_SIGTERM,
+    METRIC_SIGKILL,
+    METRIC_EMERGENCY_KILLS,
+    METRIC_ESCALATIONS,
+    METRIC_NO_VICTIM,
+    METRIC_EPERM,
+    METRIC_COUNTERS,
+};
+
+// Histograms
+enum {
+    METRIC_SELECTION_SECONDS,
+    METRIC_EXIT_SECONDS,
+    METRIC_RECOVERY_SECONDS,
+    METRIC_HISTOGRAMS,
+};
+
+void metrics_init(const char* path);
+void metrics_add(int counter, unsigned long n);
+void metrics_observe(int histogram, double secs);
+void metrics_flush(void);
+
+#endif
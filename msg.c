@@ -9,15 +9,47 @@
 
 #include "globals.h"
 #include "msg.h"
+#include "msglog.h"
 
-// color_log writed to `f`, prefixing the `color` code if `f` is a tty.
-static void color_log(FILE* f, const char* color, const char* fmt, va_list vl)
+static const char* const colors[] = {
+    [MSG_FATAL] = "\033[31m", // red
+    [MSG_WARN] = "\033[33m", // yellow
+    [MSG_INFO] = "",
+    [MSG_DEBUG] = "\033[2m", // gray
+};
+
+// isatty() of stdout and stderr, -1 = not checked yet. Checked once, as
+// it is an ioctl.
+static int stdout_tty = -1;
+static int stderr_tty = -1;
+
+static FILE* level_stream(int level)
+{
+    return level <= MSG_WARN ? stderr : stdout;
+}
+
+/* The color code for messages of `level`, or "" if their stream is not
+ * a tty.
+ */
+const char* msg_color(int level)
+{
+    int* tty = level <= MSG_WARN ? &stderr_tty : &stdout_tty;
+    if (*tty < 0) {
+        *tty = isatty(fileno(level_stream(level)));
+    }
+    return *tty ? colors[level] : "";
+}
+
+// color_log writes to the stream for `level`, prefixing the color code
+// if it is a tty. Goes through the log thread if there is one.
+static void color_log(int level, const msg_fields_t* fields, const char* fmt, va_list vl)
 {
-    char* reset = "\033[0m";
-    if (!isatty(fileno(f))) {
-        color = "";
-        reset = "";
+    if (msglog_push(level, fields, fmt, vl)) {
+        return;
     }
+    FILE* f = level_stream(level);
+    const char* color = msg_color(level);
+    const char* reset = color[0] ? "\033[0m" : "";
     fputs(color, f);
     vfprintf(f, fmt, vl);
     fputs(reset, f);
@@ -34,12 +66,14 @@ static void color_log(FILE* f, const char* color, const char* fmt, va_list vl)
 // Example: fatal(6, "could not compile regexp '%s'\n", regex_str);
 int fatal(int code, char* fmt, ...)
 {
-    const char* red = "\033[31m";
     char fmt2[MSG_LEN] = { 0 };
     snprintf(fmt2, sizeof(fmt2), "fatal: %s", fmt);
+    // What was queued before, then our message synchronously
+    msglog_flush(1000);
+    msglog_start(MSGLOG_SYNC);
     va_list vl;
     va_start(vl, fmt);
-    color_log(stderr, red, fmt2, vl);
+    color_log(MSG_FATAL, NULL, fmt2, vl);
     va_end(vl);
     exit(code);
 }
@@ -47,10 +81,31 @@ int fatal(int code, char* fmt, ...)
 // Print a yellow warning message to stderr. No "warning" prefix is added.
 int warn(const char* fmt, ...)
 {
-    const char* yellow = "\033[33m";
     va_list vl;
     va_start(vl, fmt);
-    color_log(stderr, yellow, fmt, vl);
+    color_log(MSG_WARN, NULL, fmt, vl);
+    va_end(vl);
+    return 0;
+}
+
+// Like warn(), for a message about a victim. With --log journal, the
+// victim is also in the VICTIM_PID, BADNESS and RSS_KIB fields.
+int warn_victim(int pid, int badness, long long rss_kib, const char* fmt, ...)
+{
+    msg_fields_t fields = { .victim_pid = pid, .badness = badness, .rss_kib = rss_kib };
+    va_list vl;
+    va_start(vl, fmt);
+    color_log(MSG_WARN, &fields, fmt, vl);
+    va_end(vl);
+    return 0;
+}
+
+// Print an uncolored message to stdout, like the memory report
+int info(const char* fmt, ...)
+{
+    va_list vl;
+    va_start(vl, fmt);
+    color_log(MSG_INFO, NULL, fmt, vl);
     va_end(vl);
     return 0;
 }
@@ -61,10 +116,9 @@ int debug(const char* fmt, ...)
     if (!enable_debug) {
         return 0;
     }
-    const char* gray = "\033[2m";
     va_list vl;
     va_start(vl, fmt);
-    color_log(stdout, gray, fmt, vl);
+    color_log(MSG_DEBUG, NULL, fmt, vl);
     va_end(vl);
     return 0;
 }
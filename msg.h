@@ -16,6 +16,9 @@
 int fatal(int code, char* fmt, ...) __attribute__((noreturn, format(printf, 2, 3)));
 int warn(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
 int debug(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+int info(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+int warn_victim(int pid, int badness, long long rss_kib, const char* fmt, ...) __attribute__((format(printf, 4, 5)));
+const char* msg_color(int level);
 
 typedef struct {
     // If the conversion failed, err contains the error message.
@@ -0,0 +1,418 @@
+// SPDX-License-Identifier: MIT
+
+/* Asynchronous logging (--log async / --log journal).
+ *
+ * With -d, victim selection writes several messages per process, and
+ * writing each one to a slow terminal or journald from the poll loop makes
+ * it much slower, or blocks it outright. Instead, warn(), info() and
+ * debug() format into a ring of fixed-size slots that is allocated once
+ * and mlock'ed, and a log thread at low priority writes them out, batched,
+ * to stdout / stderr or to the journald native socket with structured
+ * fields. If the ring is full, messages are dropped and counted, the
+ * poll loop never waits for the log thread.
+ *
+ * The ring is a bounded multi-producer queue with a sequence number per
+ * slot (Dmitry Vyukov's design), so it needs no locks. The log thread
+ * sleeps on a futex while the ring is empty.
+ *
+ * fatal() waits for the ring to drain before writing its message, and
+ * forked children log synchronously, as they do not have the log thread.
+ */
+
+#include <errno.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "msg.h"
+#include "msglog.h"
+
+typedef struct {
+    // Vyukov sequence: == position when free, position + 1 when filled
+    unsigned seq;
+    unsigned char level;
+    msg_fields_t fields;
+    char text[MSGLOG_TEXT_LEN];
+} slot_t;
+
+static slot_t ring[MSGLOG_SLOTS];
+// Next position to fill, shared by the producers
+static unsigned enqueue_pos;
+// Next position the log thread takes
+static unsigned dequeue_pos;
+// Everything before this position has been written out
+static unsigned written_pos;
+// Messages dropped because the ring was full, not reported yet
+static unsigned long dropped;
+// 1 while the log thread sleeps or is about to, futex word
+static int waiting;
+static int mode = MSGLOG_SYNC;
+// Socket to journald, for MSGLOG_JOURNAL
+static int journal_fd = -1;
+
+static const char* const mode_names[] = {
+    [MSGLOG_SYNC] = "sync",
+    [MSGLOG_ASYNC] = "async",
+    [MSGLOG_JOURNAL] = "journal",
+};
+
+// syslog(3) priorities for journald
+static const int priorities[] = {
+    [MSG_FATAL] = 3, // LOG_ERR
+    [MSG_WARN] = 4, // LOG_WARNING
+    [MSG_INFO] = 6, // LOG_INFO
+    [MSG_DEBUG] = 7, // LOG_DEBUG
+};
+
+/* Parse a --log MODE name.
+ * Returns MSGLOG_* or -1 if unknown.
+ */
+int msglog_parse_mode(const char* name)
+{
+    for (int i = 0; i < (int)(sizeof(mode_names) / sizeof(mode_names[0])); i++) {
+        if (strcmp(name, mode_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+const char* msglog_mode_name(int m)
+{
+    return mode_names[m];
+}
+
+int msglog_mode(void)
+{
+    return mode;
+}
+
+static void futex_wake(int* addr)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+static void futex_wait(int* addr, int val)
+{
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+/* Queue a message for the log thread.
+ * Returns false if we are not logging asynchronously, and the caller has
+ * to write the message itself. A message that is dropped because the ring
+ * is full counts as queued.
+ */
+bool msglog_push(int level, const msg_fields_t* fields, const char* fmt, va_list vl)
+{
+    if (mode == MSGLOG_SYNC) {
+        return false;
+    }
+    slot_t* slot;
+    unsigned pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+    while (1) {
+        slot = &ring[pos % MSGLOG_SLOTS];
+        unsigned seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        int diff = (int)(seq - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&enqueue_pos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // The log thread has not gotten to this slot yet: full
+            __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+            return true;
+        } else {
+            pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+    slot->level = (unsigned char)level;
+    slot->fields = fields ? *fields : (msg_fields_t) { 0 };
+    int n = vsnprintf(slot->text, sizeof(slot->text), fmt, vl);
+    size_t fmtlen = strlen(fmt);
+    if (n >= (int)sizeof(slot->text) && fmtlen > 0 && fmt[fmtlen - 1] == '\n') {
+        // Keep the line break
+        slot->text[sizeof(slot->text) - 2] = '\n';
+    }
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+    // Pairs with the fence in log_thread(): either we see that it is
+    // waiting, or it sees the message
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&waiting, __ATOMIC_RELAXED) && __atomic_exchange_n(&waiting, 0, __ATOMIC_SEQ_CST)) {
+        futex_wake(&waiting);
+    }
+    return true;
+}
+
+// The slot at dequeue_pos, or NULL if it has not been filled yet
+static slot_t* ring_peek(void)
+{
+    slot_t* slot = &ring[dequeue_pos % MSGLOG_SLOTS];
+    unsigned seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    return seq == dequeue_pos + 1 ? slot : NULL;
+}
+
+static void ring_release(slot_t* slot)
+{
+    __atomic_store_n(&slot->seq, dequeue_pos + MSGLOG_SLOTS, __ATOMIC_RELEASE);
+    dequeue_pos++;
+}
+
+static void write_all(int fd, const char* buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            // Nowhere to complain to
+            return;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+}
+
+// Batched output of the log thread to stdout / stderr
+static char out_buf[8192];
+static size_t out_len;
+static int out_fd = -1;
+
+static void out_flush(void)
+{
+    if (out_len > 0) {
+        write_all(out_fd, out_buf, out_len);
+        out_len = 0;
+    }
+}
+
+static void out_append(int fd, const char* s)
+{
+    size_t len = strlen(s);
+    if (fd != out_fd || out_len + len > sizeof(out_buf)) {
+        // Switching streams keeps the order
+        out_flush();
+        out_fd = fd;
+    }
+    if (len > sizeof(out_buf)) {
+        len = sizeof(out_buf);
+    }
+    memcpy(out_buf + out_len, s, len);
+    out_len += len;
+}
+
+static void write_stream(int level, const char* text)
+{
+    int fd = level <= MSG_WARN ? STDERR_FILENO : STDOUT_FILENO;
+    const char* color = msg_color(level);
+    out_append(fd, color);
+    out_append(fd, text);
+    if (color[0]) {
+        out_append(fd, "\033[0m");
+    }
+}
+
+// Messages are assembled into lines before they go to journald, as
+// debug() writes lines in pieces. One line per stream.
+typedef struct {
+    char text[MSGLOG_TEXT_LEN];
+    size_t len;
+    msg_fields_t fields;
+} line_t;
+static line_t lines[2];
+
+static void journal_send(int level, const line_t* line)
+{
+    char entry[MSGLOG_TEXT_LEN + 256];
+    int len = snprintf(entry, sizeof(entry), "PRIORITY=%d\nSYSLOG_IDENTIFIER=earlyoom\nMESSAGE=", priorities[level]);
+    // The simple KEY=value format can not have line breaks in the value
+    for (size_t i = 0; i < line->len && len < (int)sizeof(entry) - 1; i++) {
+        char c = line->text[i];
+        if (c == '\n' && i == line->len - 1) {
+            break;
+        }
+        entry[len++] = c == '\n' ? ' ' : c;
+    }
+    entry[len < (int)sizeof(entry) ? len : (int)sizeof(entry) - 1] = 0;
+    if (line->fields.victim_pid > 0) {
+        len += snprintf(entry + len, sizeof(entry) - (size_t)len, "\nVICTIM_PID=%d\nBADNESS=%d\nRSS_KIB=%lld",
+            line->fields.victim_pid, line->fields.badness, line->fields.rss_kib);
+    }
+    if (len >= (int)sizeof(entry) - 1) {
+        len = (int)sizeof(entry) - 2;
+    }
+    entry[len++] = '\n';
+    if (send(journal_fd, entry, (size_t)len, MSG_NOSIGNAL) < 0) {
+        // Not lost at least
+        write_stream(level, line->text);
+    }
+}
+
+static void write_journal(int level, const slot_t* slot)
+{
+    line_t* line = &lines[level <= MSG_WARN ? 0 : 1];
+    size_t len = strlen(slot->text);
+    if (line->len + len >= sizeof(line->text)) {
+        len = sizeof(line->text) - 1 - line->len;
+    }
+    memcpy(line->text + line->len, slot->text, len);
+    line->len += len;
+    line->text[line->len] = 0;
+    if (slot->fields.victim_pid > 0) {
+        line->fields = slot->fields;
+    }
+    if ((line->len > 0 && line->text[line->len - 1] == '\n') || line->len == sizeof(line->text) - 1) {
+        journal_send(level, line);
+        *line = (line_t) { 0 };
+    }
+}
+
+static void write_message(int level, const slot_t* slot)
+{
+    if (mode == MSGLOG_JOURNAL) {
+        write_journal(level, slot);
+    } else {
+        write_stream(level, slot->text);
+    }
+}
+
+/* Write out everything that is in the ring.
+ */
+static void drain(void)
+{
+    slot_t* slot;
+    while ((slot = ring_peek()) != NULL) {
+        write_message(slot->level, slot);
+        ring_release(slot);
+    }
+    unsigned long n = __atomic_exchange_n(&dropped, 0, __ATOMIC_RELAXED);
+    if (n > 0) {
+        slot_t note = { .level = MSG_WARN };
+        snprintf(note.text, sizeof(note.text), "log: ring full, dropped %lu messages\n", n);
+        write_message(MSG_WARN, &note);
+    }
+    out_flush();
+    __atomic_store_n(&written_pos, dequeue_pos, __ATOMIC_RELEASE);
+}
+
+static void* log_thread(void* arg)
+{
+    (void)arg;
+    prctl(PR_SET_NAME, "earlyoom-log");
+    // Below the poll loop, without starving like SCHED_IDLE would
+    setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), 19);
+    while (1) {
+        drain();
+        __atomic_store_n(&waiting, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (ring_peek() == NULL) {
+            futex_wait(&waiting, 1);
+        }
+        __atomic_store_n(&waiting, 0, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+// Forked children do not have the log thread
+static void atfork_child(void)
+{
+    mode = MSGLOG_SYNC;
+}
+
+static int journal_connect(void)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", JOURNAL_SOCKET);
+    int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -errno;
+    }
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        int connect_errno = errno;
+        close(fd);
+        return -connect_errno;
+    }
+    return fd;
+}
+
+/* Start logging in `m` (MSGLOG_*), once. MSGLOG_SYNC switches back to
+ * synchronous logging. MSGLOG_JOURNAL falls back to
+ * MSGLOG_ASYNC if journald is not there.
+ * Returns false if the log thread could not be started, in which case
+ * we stay synchronous.
+ */
+bool msglog_start(int m)
+{
+    if (m == MSGLOG_SYNC) {
+        // The log thread, if any, just idles from now on
+        mode = MSGLOG_SYNC;
+        return true;
+    }
+    if (m == MSGLOG_JOURNAL) {
+        journal_fd = journal_connect();
+        if (journal_fd < 0) {
+            warn("log: could not connect to %s: %s, logging to stderr\n", JOURNAL_SOCKET, strerror(-journal_fd));
+            m = MSGLOG_ASYNC;
+        }
+    }
+    for (unsigned i = 0; i < MSGLOG_SLOTS; i++) {
+        ring[i].seq = i;
+    }
+    if (mlock(ring, sizeof(ring)) != 0) {
+        debug("log: could not mlock the ring: %s\n", strerror(errno));
+    }
+
+    pthread_attr_t attr;
+    pthread_t thread;
+    sigset_t all, old;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, 64 * 1024);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    // Signals are for the poll loop
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    // Before the thread starts, so it sees it
+    mode = m;
+    int res = pthread_create(&thread, &attr, log_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    pthread_attr_destroy(&attr);
+    if (res != 0) {
+        mode = MSGLOG_SYNC;
+        warn("log: could not start the log thread: %s\n", strerror(res));
+        return false;
+    }
+    pthread_atfork(NULL, NULL, atfork_child);
+    return true;
+}
+
+/* Wait up to `timeout_ms` for the log thread to write out everything that
+ * was queued so far.
+ */
+void msglog_flush(int timeout_ms)
+{
+    if (mode == MSGLOG_SYNC) {
+        return;
+    }
+    unsigned target = __atomic_load_n(&enqueue_pos, __ATOMIC_ACQUIRE);
+    struct timespec tick = { .tv_nsec = 1000000 };
+    for (int i = 0; i < timeout_ms; i++) {
+        if ((int)(__atomic_load_n(&written_pos, __ATOMIC_ACQUIRE) - target) >= 0) {
+            return;
+        }
+        if (__atomic_exchange_n(&waiting, 0, __ATOMIC_SEQ_CST)) {
+            futex_wake(&waiting);
+        }
+        nanosleep(&tick, NULL);
+    }
+}
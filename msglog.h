@@ -0,0 +1,45 @@
+/* SPDX-License-Identifier: MIT */
+#ifndef MSGLOG_H
+#define MSGLOG_H
+
+#include <stdarg.h>
+#include <stdbool.h>
+
+#define JOURNAL_SOCKET "/run/systemd/journal/socket"
+// Number of messages the ring holds, a power of two
+#define MSGLOG_SLOTS 512
+// Longest message, longer ones are truncated
+#define MSGLOG_TEXT_LEN 320
+
+enum {
+    // Write from the calling thread (the default)
+    MSGLOG_SYNC,
+    // Queue to the ring, written to stdout / stderr by the log thread
+    MSGLOG_ASYNC,
+    // Queue to the ring, sent to journald by the log thread
+    MSGLOG_JOURNAL,
+};
+
+// Severity, also selects the stream: debug and info go to stdout
+enum {
+    MSG_FATAL,
+    MSG_WARN,
+    MSG_INFO,
+    MSG_DEBUG,
+};
+
+// Structured fields for journald, victim_pid 0 = none
+typedef struct {
+    int victim_pid;
+    int badness;
+    long long rss_kib;
+} msg_fields_t;
+
+int msglog_parse_mode(const char* name);
+const char* msglog_mode_name(int mode);
+int msglog_mode(void);
+bool msglog_start(int mode);
+bool msglog_push(int level, const msg_fields_t* fields, const char* fmt, va_list vl);
+void msglog_flush(int timeout_ms);
+
+#endif
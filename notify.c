@@ -0,0 +1,160 @@
+// SPDX-License-Identifier: MIT
+
+/* Desktop notifications through D-Bus (-n).
+ *
+ * Forking dbus-send at the moment we are killing something means copying
+ * the locked page tables of a process that sits at the memory limit, and
+ * faulting in a fresh dbus-send. So notify_init() forks a helper once at
+ * startup, before mlockall(), and notify() hands it the notifications over
+ * a non-blocking SOCK_SEQPACKET socketpair. The helper runs dbus-send for
+ * one notification at a time. When it falls behind and the socket buffer
+ * is full, notifications are dropped, and the next one that fits says how
+ * many, so the poll loop never waits for it.
+ *
+ * If the helper could not be started or has died, notify() falls back to
+ * forking dbus-send itself.
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "msg.h"
+#include "notify.h"
+
+// Our end of the socketpair, -1 = no helper
+static int helper_fd = -1;
+// Notifications dropped since the last one that got through
+static unsigned dropped;
+
+/* Run dbus-send for one notification. Does not return.
+ */
+static void exec_dbus_send(const char* summary, const char* body)
+{
+    char summary2[1024] = { 0 };
+    snprintf(summary2, sizeof(summary2), "string:%s", summary);
+    char body2[1024] = "string:";
+    if (body != NULL) {
+        snprintf(body2, sizeof(body2), "string:%s", body);
+    }
+    // Complete command line looks like this:
+    // dbus-send --system / net.nuetzlich.SystemNotifications.Notify 'string:summary text' 'string:and body text'
+    execl(NOTIFY_DBUS_SEND, "dbus-send", "--system", "/", "net.nuetzlich.SystemNotifications.Notify",
+        summary2, body2, NULL);
+    warn("notify: exec failed: %s\n", strerror(errno));
+    exit(1);
+}
+
+/* Main loop of the helper process. Each message is the summary and the
+ * body, both NUL-terminated. Exits when earlyoom closes its end.
+ */
+static void helper_loop(int fd)
+{
+    char msg[NOTIFY_MSG_MAX + 1];
+
+    prctl(PR_SET_NAME, "earlyoom-notify");
+    while (1) {
+        ssize_t len = recv(fd, msg, NOTIFY_MSG_MAX, 0);
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (len <= 0) {
+            exit(len < 0);
+        }
+        msg[len] = 0;
+        const char* summary = msg;
+        const char* body = msg + strlen(msg) + 1;
+        if (body > msg + len) {
+            body = NULL;
+        }
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(fd);
+            exec_dbus_send(summary, body);
+        }
+        if (pid < 0) {
+            warn("notify: fork failed: %s\n", strerror(errno));
+            continue;
+        }
+        while (waitpid(pid, NULL, 0) < 0 && errno == EINTR) {
+        }
+    }
+}
+
+/* Start the helper process. Must be called before mlockall(), so the
+ * helper does not inherit locked memory.
+ * Returns false if it could not be started.
+ */
+bool notify_init(void)
+{
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) != 0) {
+        warn("notify: socketpair failed: %s\n", strerror(errno));
+        return false;
+    }
+    int bufsize = NOTIFY_QUEUE_BYTES;
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        warn("notify: fork failed: %s\n", strerror(errno));
+        close(sv[0]);
+        close(sv[1]);
+        return false;
+    }
+    if (pid == 0) {
+        close(sv[0]);
+        helper_loop(sv[1]);
+    }
+    close(sv[1]);
+    helper_fd = sv[0];
+    return true;
+}
+
+// Fork and exec dbus-send directly, without the helper
+static void notify_fork(const char* summary, const char* body)
+{
+    int pid = fork();
+    if (pid == 0) {
+        exec_dbus_send(summary, body);
+    }
+}
+
+void notify(const char* summary, const char* body)
+{
+    if (helper_fd < 0) {
+        notify_fork(summary, body);
+        return;
+    }
+    char msg[NOTIFY_MSG_MAX];
+    int len;
+    if (dropped > 0) {
+        len = snprintf(msg, sizeof(msg), "%s%c%s (%u earlier notifications dropped)", summary, 0,
+            body ? body : "", dropped);
+    } else {
+        len = snprintf(msg, sizeof(msg), "%s%c%s", summary, 0, body ? body : "");
+    }
+    if (len < 0 || len >= (int)sizeof(msg)) {
+        len = (int)sizeof(msg) - 1;
+    }
+    // Include the terminating NUL
+    if (send(helper_fd, msg, (size_t)len + 1, MSG_DONTWAIT | MSG_NOSIGNAL) >= 0) {
+        dropped = 0;
+        return;
+    }
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        dropped++;
+        debug("notify: helper is busy, dropped notification \"%s\"\n", body ? body : summary);
+        return;
+    }
+    warn("notify: lost the helper process: %s. Forking dbus-send from now on.\n", strerror(errno));
+    close(helper_fd);
+    helper_fd = -1;
+    notify_fork(summary, body);
+}
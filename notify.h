@@ -0,0 +1,16 @@
+/* SPDX-License-Identifier: MIT */
+#ifndef NOTIFY_H
+#define NOTIFY_H
+
+#include <stdbool.h>
+
+#define NOTIFY_DBUS_SEND "/usr/bin/dbus-send"
+// Largest notification, summary and body together
+#define NOTIFY_MSG_MAX 2048
+// Send buffer of the socket to the helper, which bounds the queue
+#define NOTIFY_QUEUE_BYTES 16384
+
+bool notify_init(void);
+void notify(const char* summary, const char* body);
+
+#endif
@@ -0,0 +1,293 @@
+// SPDX-License-Identifier: MIT
+
+/* Monitor the memory of single NUMA nodes.
+ *
+ * With strict memory policies (membind, cpusets), one node can run out
+ * while /proc/meminfo still shows plenty of memory available overall, and
+ * the kernel reclaims and thrashes on that node. So for each monitored
+ * node, we estimate the available memory from node<N>/meminfo the way the
+ * kernel computes MemAvailable:
+ *
+ *   available = MemFree - high watermark
+ *             + page cache - min(page cache / 2, low watermark)
+ *             + SReclaimable - min(SReclaimable / 2, low watermark)
+ *
+ * and compare it with the node's SIGTERM and SIGKILL limits. The
+ * watermarks are read from /proc/zoneinfo once at startup.
+ *
+ * The meminfo files are opened once and read with pread().
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "globals.h"
+#include "meminfo.h"
+#include "msg.h"
+#include "numa.h"
+
+static numa_node_t nodes[NUMA_MAX];
+static int nnodes = 0;
+// From a spec without a node, for all nodes with memory. -1 = none.
+static double all_term_percent = -1;
+static double all_kill_percent = -1;
+
+// Set the limits of `node`, adding it if it is not there yet
+static void set_node(int node, double term_percent, double kill_percent)
+{
+    numa_node_t* n = NULL;
+    for (int i = 0; i < nnodes; i++) {
+        if (nodes[i].node == node) {
+            n = &nodes[i];
+        }
+    }
+    if (n == NULL) {
+        if (nnodes >= NUMA_MAX) {
+            fatal(14, "numa: can monitor at most %d nodes\n", NUMA_MAX);
+        }
+        n = &nodes[nnodes++];
+    }
+    *n = (numa_node_t) {
+        .node = node,
+        .term_percent = term_percent,
+        .kill_percent = kill_percent,
+        .meminfo_fd = -1,
+    };
+}
+
+/* Add nodes to monitor from a "[NODE:]PERCENT[,KILL_PERCENT]" spec.
+ * Without NODE, the limits apply to all nodes with memory that do not have
+ * their own.
+ */
+void numa_add(const char* spec)
+{
+    const char* colon = strchr(spec, ':');
+    term_kill_tuple_t tuple = parse_term_kill_tuple(colon ? colon + 1 : spec, 100);
+    if (strlen(tuple.err)) {
+        fatal(14, "numa: %s", tuple.err);
+    }
+    if (colon == NULL) {
+        all_term_percent = tuple.term;
+        all_kill_percent = tuple.kill;
+        return;
+    }
+    char* end = NULL;
+    long node = strtol(spec, &end, 10);
+    if (end == spec || end != colon || node < 0 || node > INT_MAX) {
+        fatal(14, "numa: expected [NODE:]PERCENT[,KILL_PERCENT], got '%s'\n", spec);
+    }
+    set_node((int)node, tuple.term, tuple.kill);
+}
+
+int numa_count(void)
+{
+    return nnodes;
+}
+
+// Add all nodes in the node list `list` (like "0-3,5") that are not there yet
+static void add_all(const char* list)
+{
+    const char* p = list;
+    while (isdigit(*p)) {
+        char* end = NULL;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+        }
+        for (long node = first; node <= last; node++) {
+            bool have = false;
+            for (int i = 0; i < nnodes; i++) {
+                have |= nodes[i].node == (int)node;
+            }
+            if (!have) {
+                set_node((int)node, all_term_percent, all_kill_percent);
+            }
+        }
+        p = *end == ',' ? end + 1 : end;
+    }
+}
+
+// Sum up the low and high watermarks of each node's zones
+static void read_watermarks(void)
+{
+    long page_kib = sysconf(_SC_PAGESIZE) / 1024;
+    char path[PATH_LEN];
+    char line[256];
+
+    snprintf(path, sizeof(path), "%s/zoneinfo", procdir_path);
+    FILE* f = fopen(path, "r");
+    if (f == NULL) {
+        warn("numa: could not open %s: %s. Ignoring watermarks.\n", path, strerror(errno));
+        return;
+    }
+    numa_node_t* cur = NULL;
+    while (fgets(line, sizeof(line), f)) {
+        int node = 0;
+        long long pages = 0;
+        if (sscanf(line, "Node %d, zone", &node) == 1) {
+            cur = NULL;
+            for (int i = 0; i < nnodes; i++) {
+                if (nodes[i].node == node) {
+                    cur = &nodes[i];
+                }
+            }
+        } else if (cur && sscanf(line, " low %lld", &pages) == 1) {
+            cur->wmark_low_kib += pages * page_kib;
+        } else if (cur && sscanf(line, " high %lld", &pages) == 1) {
+            cur->wmark_high_kib += pages * page_kib;
+        }
+    }
+    fclose(f);
+}
+
+/* Open all configured nodes. Nodes that do not exist are dropped.
+ */
+void numa_init(void)
+{
+    if (all_term_percent >= 0) {
+        char buf[256] = { 0 };
+        int fd = open(NUMA_NODE_DIR "/has_memory", O_RDONLY | O_CLOEXEC);
+        if (fd < 0 || read(fd, buf, sizeof(buf) - 1) < 0) {
+            warn("numa: could not read " NUMA_NODE_DIR "/has_memory: %s\n", strerror(errno));
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        add_all(buf);
+    }
+    for (int i = 0; i < nnodes;) {
+        numa_node_t* n = &nodes[i];
+        char path[PATH_LEN];
+        snprintf(path, sizeof(path), NUMA_NODE_DIR "/node%d/meminfo", n->node);
+        n->meminfo_fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (n->meminfo_fd < 0) {
+            warn("numa: could not open %s: %s. Not monitoring node %d.\n", path, strerror(errno), n->node);
+            nodes[i] = nodes[--nnodes];
+            continue;
+        }
+        fprintf(stderr, "monitoring NUMA node %d: SIGTERM when avail <= " PRIPCT ", SIGKILL when avail <= " PRIPCT "\n",
+            n->node, n->term_percent, n->kill_percent);
+        i++;
+    }
+    read_watermarks();
+}
+
+/* Get a value in KiB from a node<N>/meminfo line like
+ * "Node 0 MemFree:         4112884 kB". Returns -1 if `key` is not there.
+ */
+static long long node_value(const char* buf, const char* key)
+{
+    const char* pos = strstr(buf, key);
+    if (pos == NULL) {
+        return -1;
+    }
+    return strtoll(pos + strlen(key), NULL, 10);
+}
+
+static long long min_kib(long long a, long long b)
+{
+    return a < b ? a : b;
+}
+
+// Returns 0 on success and -errno on error
+static int numa_read(numa_node_t* n)
+{
+    // About 30 lines of up to 50 bytes
+    char buf[4096];
+    ssize_t len = pread(n->meminfo_fd, buf, sizeof(buf) - 1, 0);
+    if (len < 0) {
+        return -errno;
+    }
+    buf[len] = 0;
+
+    long long total = node_value(buf, " MemTotal:");
+    long long free = node_value(buf, " MemFree:");
+    long long active_file = node_value(buf, " Active(file):");
+    long long inactive_file = node_value(buf, " Inactive(file):");
+    long long reclaimable = node_value(buf, " SReclaimable:");
+    if (total <= 0 || free < 0 || active_file < 0 || inactive_file < 0 || reclaimable < 0) {
+        return -ENODATA;
+    }
+    long long pagecache = active_file + inactive_file;
+    long long avail = free - n->wmark_high_kib;
+    avail += pagecache - min_kib(pagecache / 2, n->wmark_low_kib);
+    avail += reclaimable - min_kib(reclaimable / 2, n->wmark_low_kib);
+    if (avail < 0) {
+        avail = 0;
+    }
+    if (avail > total) {
+        avail = total;
+    }
+    n->total_kib = total;
+    n->avail_kib = avail;
+    n->avail_percent = (double)avail * 100 / (double)total;
+    return 0;
+}
+
+/* Check all nodes against their limits.
+ * Returns the node that is worst off and sets `sig` to SIGTERM or SIGKILL,
+ * or returns NULL if all are fine.
+ */
+numa_node_t* numa_check(int* sig)
+{
+    numa_node_t* worst = NULL;
+    *sig = 0;
+
+    for (int i = 0; i < nnodes; i++) {
+        numa_node_t* n = &nodes[i];
+        int res = numa_read(n);
+        if (res < 0) {
+            warn("numa: could not read node %d: %s\n", n->node, strerror(-res));
+            continue;
+        }
+        int n_sig = 0;
+        if (n->avail_percent <= n->kill_percent) {
+            n_sig = SIGKILL;
+        } else if (n->avail_percent <= n->term_percent) {
+            n_sig = SIGTERM;
+        } else {
+            continue;
+        }
+        warn("NUMA node %d: low memory! avail %lld of %lld MiB (" PRIPCT "), at or below %s limit " PRIPCT "\n",
+            n->node, n->avail_kib / 1024, n->total_kib / 1024, n->avail_percent,
+            n_sig == SIGKILL ? "SIGKILL" : "SIGTERM",
+            n_sig == SIGKILL ? n->kill_percent : n->term_percent);
+        if (worst == NULL || (n_sig == SIGKILL && *sig != SIGKILL)
+            || (n_sig == *sig && n->avail_percent < worst->avail_percent)) {
+            worst = n;
+            *sig = n_sig;
+        }
+    }
+    return worst;
+}
+
+/* Smallest distance to the SIGTERM limit over all nodes, in KiB, as of
+ * the last numa_check(). Returns -1 if there is none.
+ */
+long long numa_headroom_kib(void)
+{
+    long long min_headroom = -1;
+    for (int i = 0; i < nnodes; i++) {
+        const numa_node_t* n = &nodes[i];
+        if (n->total_kib <= 0) {
+            continue;
+        }
+        long long headroom = n->avail_kib - (long long)(n->term_percent * (double)n->total_kib / 100);
+        if (headroom < 0) {
+            headroom = 0;
+        }
+        if (min_headroom < 0 || headroom < min_headroom) {
+            min_headroom = headroom;
+        }
+    }
+    return min_headroom;
+}
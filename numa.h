@@ -0,0 +1,32 @@
+/* SPDX-License-Identifier: MIT */
+#ifndef NUMA_H
+#define NUMA_H
+
+#include <stdbool.h>
+
+#define NUMA_NODE_DIR "/sys/devices/system/node"
+// Maximum number of monitored nodes
+#define NUMA_MAX 64
+
+typedef struct {
+    int node;
+    double term_percent;
+    double kill_percent;
+    // node<N>/meminfo, -1 = not open
+    int meminfo_fd;
+    // Sum over the node's zones, from /proc/zoneinfo
+    long long wmark_low_kib;
+    long long wmark_high_kib;
+    // From the last numa_check()
+    long long total_kib;
+    long long avail_kib;
+    double avail_percent;
+} numa_node_t;
+
+void numa_add(const char* spec);
+void numa_init(void);
+int numa_count(void);
+numa_node_t* numa_check(int* sig);
+long long numa_headroom_kib(void);
+
+#endif
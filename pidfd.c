@@ -0,0 +1,105 @@
+// SPDX-License-Identifier: MIT
+
+/* Process file descriptors (pidfds, Linux 5.3+).
+ *
+ * A pidfd refers to one specific process and can not be recycled like a pid,
+ * so a signal sent through it can never hit an unrelated process that got
+ * the victim's pid. It also becomes readable once the process has exited,
+ * so we can poll() for that instead of checking /proc repeatedly.
+ *
+ * glibc only has wrappers since 2.36, so we call the syscalls directly.
+ * Every function falls back to plain pids when pidfd is < 0.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "globals.h"
+#include "meminfo.h"
+#include "msg.h"
+#include "pidfd.h"
+
+// Same number on all architectures
+#ifndef __NR_pidfd_send_signal
+#define __NR_pidfd_send_signal 424
+#endif
+#ifndef __NR_pidfd_open
+#define __NR_pidfd_open 434
+#endif
+#ifndef __NR_process_mrelease
+#define __NR_process_mrelease 448
+#endif
+
+// Set once we know the kernel lacks process_mrelease() (added in 5.15)
+static bool mrelease_unsupported = false;
+
+/* Get a pidfd for `pid`.
+ * Returns the fd or -errno on error. -ENOSYS means the kernel is too old.
+ */
+int pidfd_get(pid_t pid)
+{
+    int fd = (int)syscall(__NR_pidfd_open, pid, 0);
+    if (fd < 0) {
+        return -errno;
+    }
+    return fd;
+}
+
+/* Send `sig` to the process, through the pidfd if we have one.
+ * Returns 0 on success, or -1 with errno set, like kill().
+ */
+int pidfd_kill(int pidfd, pid_t pid, int sig)
+{
+    if (pidfd < 0) {
+        return kill(pid, sig);
+    }
+    return (int)syscall(__NR_pidfd_send_signal, pidfd, sig, NULL, 0);
+}
+
+/* Wait up to `timeout_ms` for the process to exit.
+ * With a pidfd, this returns as soon as it has. Without, we sleep for
+ * `timeout_ms` and check /proc/[pid]/stat.
+ * Returns true if the process is gone.
+ */
+bool pidfd_wait_exit(int pidfd, pid_t pid, int timeout_ms)
+{
+    if (pidfd < 0) {
+        usleep((useconds_t)timeout_ms * 1000);
+        return !is_alive(pid);
+    }
+    struct pollfd pfd = { .fd = pidfd, .events = POLLIN };
+    int res = poll(&pfd, 1, timeout_ms);
+    if (res < 0) {
+        if (errno != EINTR) {
+            warn("pidfd_wait_exit: poll failed: %s\n", strerror(errno));
+        }
+        return !is_alive(pid);
+    }
+    return res > 0;
+}
+
+/* Free the memory of a process that has been sent SIGKILL right away,
+ * instead of waiting for its last thread to exit (which can take long
+ * for large processes, or ones stuck in uninterruptible sleep).
+ */
+void pidfd_reap(int pidfd)
+{
+    if (pidfd < 0 || mrelease_unsupported) {
+        return;
+    }
+    if (syscall(__NR_process_mrelease, pidfd, 0) == 0) {
+        debug("pidfd_reap: process_mrelease succeeded\n");
+        return;
+    }
+    if (errno == ENOSYS) {
+        debug("pidfd_reap: process_mrelease is not supported by the kernel\n");
+        mrelease_unsupported = true;
+    } else if (errno != ESRCH) {
+        // ESRCH: the process is already gone, which is fine.
+        debug("pidfd_reap: process_mrelease failed: %s\n", strerror(errno));
+    }
+}
@@ -0,0 +1,13 @@
+/* SPDX-License-Identifier: MIT */
+#ifndef PIDFD_H
+#define PIDFD_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+int pidfd_get(pid_t pid);
+int pidfd_kill(int pidfd, pid_t pid, int sig);
+bool pidfd_wait_exit(int pidfd, pid_t pid, int timeout_ms);
+void pidfd_reap(int pidfd);
+
+#endif
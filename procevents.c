@@ -0,0 +1,164 @@
+// SPDX-License-Identifier: MIT
+
+/* Process events from the kernel proc connector (netlink).
+ *
+ * The kernel tells us about every fork, exec, exit, uid and comm change,
+ * so the process table can be kept current without rescanning /proc.
+ * Only events about processes are passed on, events about their other
+ * threads are dropped.
+ *
+ * Listening needs CAP_NET_ADMIN. When we do not read fast enough, the
+ * socket buffer overflows and events are lost. procevents_read() reports
+ * that, and the caller has to resynchronize from /proc.
+ */
+
+#include <errno.h>
+#include <linux/cn_proc.h>
+#include <linux/connector.h>
+#include <linux/netlink.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "msg.h"
+#include "procevents.h"
+
+// Kernel socket buffer. Each event takes up about 1 KiB of it.
+#define PROCEVENTS_RCVBUF (4 * 1024 * 1024)
+
+static int sock = -1;
+
+/* Subscribe to the proc connector.
+ * Returns false if it is not available, in which case the caller should
+ * keep scanning /proc.
+ */
+bool procevents_init(void)
+{
+    int fd = socket(PF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_CONNECTOR);
+    if (fd < 0) {
+        warn("procevents: could not create netlink socket: %s\n", strerror(errno));
+        return false;
+    }
+    struct sockaddr_nl addr = {
+        .nl_family = AF_NETLINK,
+        .nl_groups = CN_IDX_PROC,
+    };
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        warn("procevents: could not bind netlink socket: %s\n", strerror(errno));
+        close(fd);
+        return false;
+    }
+    // Forcing a buffer larger than rmem_max needs CAP_NET_ADMIN, which we
+    // need anyway. Without it, we get what rmem_max allows.
+    int rcvbuf = PROCEVENTS_RCVBUF;
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf)) != 0) {
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    }
+
+    struct __attribute__((aligned(NLMSG_ALIGNTO))) {
+        struct nlmsghdr hdr;
+        struct __attribute__((packed)) {
+            struct cn_msg msg;
+            enum proc_cn_mcast_op op;
+        } body;
+    } req = { 0 };
+    req.hdr.nlmsg_len = sizeof(req);
+    req.hdr.nlmsg_type = NLMSG_DONE;
+    req.hdr.nlmsg_pid = (__u32)getpid();
+    req.body.msg.id.idx = CN_IDX_PROC;
+    req.body.msg.id.val = CN_VAL_PROC;
+    req.body.msg.len = sizeof(req.body.op);
+    req.body.op = PROC_CN_MCAST_LISTEN;
+    if (send(fd, &req, sizeof(req), 0) < 0) {
+        warn("procevents: could not subscribe to the proc connector: %s\n", strerror(errno));
+        close(fd);
+        return false;
+    }
+    sock = fd;
+    return true;
+}
+
+bool procevents_enabled(void)
+{
+    return sock >= 0;
+}
+
+/* Translate the kernel event `ev`. Returns false for events we do not
+ * care about.
+ */
+static bool translate(const struct proc_event* ev, procevent_t* out)
+{
+    memset(out, 0, sizeof(*out));
+    switch (ev->what) {
+    case PROC_EVENT_FORK:
+        out->type = PROCEVENT_FORK;
+        out->pid = ev->event_data.fork.child_tgid;
+        return ev->event_data.fork.child_pid == ev->event_data.fork.child_tgid;
+    case PROC_EVENT_EXEC:
+        out->type = PROCEVENT_EXEC;
+        out->pid = ev->event_data.exec.process_tgid;
+        return ev->event_data.exec.process_pid == ev->event_data.exec.process_tgid;
+    case PROC_EVENT_EXIT:
+        out->type = PROCEVENT_EXIT;
+        out->pid = ev->event_data.exit.process_tgid;
+        return ev->event_data.exit.process_pid == ev->event_data.exit.process_tgid;
+    case PROC_EVENT_UID:
+        out->type = PROCEVENT_UID;
+        out->pid = ev->event_data.id.process_tgid;
+        out->uid = (int)ev->event_data.id.e.euid;
+        return ev->event_data.id.process_pid == ev->event_data.id.process_tgid;
+    case PROC_EVENT_COMM:
+        out->type = PROCEVENT_COMM;
+        out->pid = ev->event_data.comm.process_tgid;
+        snprintf(out->comm, sizeof(out->comm), "%.*s", (int)sizeof(ev->event_data.comm.comm), ev->event_data.comm.comm);
+        return ev->event_data.comm.process_pid == ev->event_data.comm.process_tgid;
+    default:
+        return false;
+    }
+}
+
+/* Read up to `max` pending events into `out`, without blocking.
+ * Returns the number of events, or -1 if events have been lost since
+ * the last call.
+ */
+int procevents_read(procevent_t* out, int max)
+{
+    static char buf[8192] __attribute__((aligned(NLMSG_ALIGNTO)));
+    int n = 0;
+
+    while (n < max) {
+        struct sockaddr_nl from = { 0 };
+        socklen_t fromlen = sizeof(from);
+        ssize_t len = recvfrom(sock, buf, sizeof(buf), 0, (struct sockaddr*)&from, &fromlen);
+        if (len < 0) {
+            if (errno == ENOBUFS) {
+                debug("procevents: socket buffer overrun, events lost\n");
+                return -1;
+            }
+            if (errno != EAGAIN && errno != EINTR) {
+                warn("procevents: recv failed: %s\n", strerror(errno));
+            }
+            break;
+        }
+        // Only the kernel may talk to us
+        if (from.nl_pid != 0) {
+            continue;
+        }
+        // One datagram holds one event, but be prepared for more
+        for (struct nlmsghdr* hdr = (struct nlmsghdr*)buf; NLMSG_OK(hdr, (size_t)len); hdr = NLMSG_NEXT(hdr, len)) {
+            const struct cn_msg* msg = NLMSG_DATA(hdr);
+            if (msg->id.idx != CN_IDX_PROC || msg->id.val != CN_VAL_PROC) {
+                continue;
+            }
+            if (n == max) {
+                // No room for the rest of this datagram
+                return -1;
+            }
+            if (translate((const struct proc_event*)msg->data, &out[n])) {
+                n++;
+            }
+        }
+    }
+    return n;
+}
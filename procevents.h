@@ -0,0 +1,30 @@
+/* SPDX-License-Identifier: MIT */
+#ifndef PROCEVENTS_H
+#define PROCEVENTS_H
+
+#include <stdbool.h>
+
+enum {
+    PROCEVENT_FORK,
+    PROCEVENT_EXEC,
+    PROCEVENT_EXIT,
+    PROCEVENT_UID,
+    PROCEVENT_COMM,
+};
+
+typedef struct {
+    // PROCEVENT_*
+    int type;
+    // The process (thread group leader) the event is about
+    int pid;
+    // PROCEVENT_UID: the new effective uid
+    int uid;
+    // PROCEVENT_COMM: the new name
+    char comm[16];
+} procevent_t;
+
+bool procevents_init(void);
+bool procevents_enabled(void);
+int procevents_read(procevent_t* out, int max);
+
+#endif
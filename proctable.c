@@ -0,0 +1,604 @@
+// SPDX-License-Identifier: MIT
+
+/* Persistent process table.
+ *
+ * Instead of scanning all of /proc when memory is already low, we keep
+ * a table of all processes keyed by pid (and starttime, to detect pid reuse)
+ * that is refreshed a few hundred processes at a time while memory is
+ * plentiful. When selecting a victim, only the top entries (and processes
+ * that appeared since the last refresh) have to be read from /proc.
+ *
+ * The top entries are kept pre-ranked in a bounded min-heap of size K,
+ * so they can be handed out in O(K) without looking at the whole table.
+ *
+ * The table has a fixed capacity and is allocated and faulted in once
+ * at startup, before mlockall(), so it never allocates afterwards.
+ *
+ * With proc_events, the table is also kept current by the kernel's proc
+ * connector. Processes that forked, exec'ed or changed uid or name are
+ * read again right away, and processes that exited are dropped, so a
+ * victim selection does not have to look for untracked processes in /proc.
+ * When events are lost, a new pass is started, and we look in /proc until
+ * it is complete.
+ *
+ * With prefer_growing, the table also remembers VmRSS + VmSwap of every
+ * process, so that each refresh yields how fast it is growing. Processes
+ * that grow quickly get a badness bonus over large but steady ones.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dirscan.h"
+#include "globals.h"
+#include "kill.h"
+#include "meminfo.h"
+#include "msg.h"
+#include "procevents.h"
+#include "proctable.h"
+
+// Open-addressing hash table with linear probing, indexed by pid.
+// Has a power-of-two number of slots and is at most half full.
+static proctable_entry_t* slots;
+static unsigned slot_mask;
+static int capacity;
+static int count;
+// Incremented after each complete pass over /proc
+static unsigned generation = 1;
+// Position of the incremental refresh in /proc. Both keep their arena
+// slot for as long as the table exists.
+static dirscan_t refresh_dir = { .fd = -1 };
+// Used to find untracked processes when selecting a victim
+static dirscan_t lookup_dir = { .fd = -1 };
+// Processes we could not add because the table was full, in the last pass
+static int overflow;
+// Processes the proc events were about, to be read from /proc again
+static int changed[PROCTABLE_UNTRACKED_MAX];
+static int n_changed;
+// Incremented when proc events are lost. Entries from older epochs may
+// have a stale uid and name.
+static unsigned sync_epoch = 1;
+// No proc events were lost since the start of the last complete pass
+static bool in_sync;
+// MemTotal + SwapTotal for prefer_growing, 0 = growth is not tracked
+static long long growth_total_kib;
+
+// Ranking key of a heap entry, copied from the table
+typedef struct {
+    int pid;
+    int badness;
+    long long VmRSSkiB;
+} rank_t;
+
+/* Two bounded min-heaps of the top K entries, the smallest at index 0:
+ * top_cur is what we hand out. It is updated as entries are refreshed, but
+ * does not learn about entries that fell out of it. So we build top_next
+ * from scratch during each pass and replace top_cur at the end.
+ */
+static rank_t* top_cur;
+static rank_t* top_next;
+static int n_cur;
+static int n_next;
+static int top_k;
+
+void proctable_init(int max_processes, int k)
+{
+    unsigned n = 1;
+    while (n < (unsigned)max_processes * 2) {
+        n *= 2;
+    }
+    slots = calloc(n, sizeof(proctable_entry_t));
+    if (slots == NULL) {
+        fatal(1, "proctable: could not allocate %u slots\n", n);
+    }
+    // Fault in all pages now so mlockall() covers them
+    memset(slots, 0, n * sizeof(proctable_entry_t));
+    slot_mask = n - 1;
+    capacity = max_processes;
+
+    top_k = k > 0 ? k : PROCTABLE_TOP;
+    top_cur = calloc((size_t)top_k, sizeof(rank_t));
+    top_next = calloc((size_t)top_k, sizeof(rank_t));
+    if (top_cur == NULL || top_next == NULL) {
+        fatal(1, "proctable: could not allocate %d heap entries\n", top_k);
+    }
+    memset(top_cur, 0, (size_t)top_k * sizeof(rank_t));
+    memset(top_next, 0, (size_t)top_k * sizeof(rank_t));
+
+    int res = dirscan_open(&refresh_dir, procdir_path);
+    if (res == 0) {
+        res = dirscan_open(&lookup_dir, procdir_path);
+    }
+    if (res < 0) {
+        fatal(5, "Could not open %s: %s", procdir_path, strerror(-res));
+    }
+    debug("proctable: %d entries, %zu kiB, top %d\n", capacity, n * sizeof(proctable_entry_t) / 1024, top_k);
+}
+
+/* Drop the table, so that victim selection scans /proc again. Only used
+ * by the testsuite, earlyoom keeps its table until it exits.
+ */
+void proctable_exit(void)
+{
+    if (slots == NULL) {
+        return;
+    }
+    free(slots);
+    free(top_cur);
+    free(top_next);
+    dirscan_close(&refresh_dir);
+    dirscan_close(&lookup_dir);
+    slots = NULL;
+    top_cur = top_next = NULL;
+    count = n_cur = n_next = n_changed = overflow = 0;
+    generation = 1;
+    in_sync = false;
+    growth_total_kib = 0;
+}
+
+bool proctable_enabled(void)
+{
+    return slots != NULL;
+}
+
+int proctable_count(void)
+{
+    return count;
+}
+
+/*
+ * Track how fast VmRSS + VmSwap of each process grows, for
+ * proctable_growth_bonus(). `total_kib` is MemTotal + SwapTotal, which
+ * the bonus is relative to, like oom_score.
+ */
+void proctable_track_growth(long long total_kib)
+{
+    growth_total_kib = total_kib;
+}
+
+static unsigned slot_hash(int pid)
+{
+    return ((unsigned)pid * 2654435761u) & slot_mask;
+}
+
+static proctable_entry_t* slot_find(int pid)
+{
+    for (unsigned i = slot_hash(pid);; i = (i + 1) & slot_mask) {
+        if (slots[i].pid == pid) {
+            return &slots[i];
+        }
+        if (slots[i].pid == 0) {
+            return NULL;
+        }
+    }
+}
+
+// Returns NULL if the table is full
+static proctable_entry_t* slot_insert(int pid)
+{
+    if (count >= capacity) {
+        return NULL;
+    }
+    unsigned i = slot_hash(pid);
+    while (slots[i].pid != 0) {
+        i = (i + 1) & slot_mask;
+    }
+    slots[i] = (proctable_entry_t) { .pid = pid };
+    count++;
+    return &slots[i];
+}
+
+// Delete slot i, moving back following entries of the probe
+// sequence so lookups keep working without tombstones.
+static void slot_delete(unsigned i)
+{
+    unsigned j = i;
+    while (1) {
+        j = (j + 1) & slot_mask;
+        if (slots[j].pid == 0) {
+            break;
+        }
+        unsigned k = slot_hash(slots[j].pid);
+        // Entry j may stay if its home slot k lies cyclically in (i, j]
+        if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j)) {
+            continue;
+        }
+        slots[i] = slots[j];
+        i = j;
+    }
+    slots[i].pid = 0;
+    count--;
+}
+
+// Same ordering as is_larger(): badness first, then VmRSS
+static bool rank_less(const rank_t* a, const rank_t* b)
+{
+    return a->badness < b->badness || (a->badness == b->badness && a->VmRSSkiB < b->VmRSSkiB);
+}
+
+static void heap_swap(rank_t* heap, int i, int j)
+{
+    rank_t tmp = heap[i];
+    heap[i] = heap[j];
+    heap[j] = tmp;
+}
+
+// Restore the heap property after heap[i] has changed
+static void heap_fix(rank_t* heap, int n, int i)
+{
+    while (i > 0 && rank_less(&heap[i], &heap[(i - 1) / 2])) {
+        heap_swap(heap, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    while (1) {
+        int smallest = i;
+        int l = 2 * i + 1;
+        int r = 2 * i + 2;
+        if (l < n && rank_less(&heap[l], &heap[smallest])) {
+            smallest = l;
+        }
+        if (r < n && rank_less(&heap[r], &heap[smallest])) {
+            smallest = r;
+        }
+        if (smallest == i) {
+            return;
+        }
+        heap_swap(heap, i, smallest);
+        i = smallest;
+    }
+}
+
+static int heap_find(const rank_t* heap, int n, int pid)
+{
+    for (int i = 0; i < n; i++) {
+        if (heap[i].pid == pid) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void heap_remove(rank_t* heap, int* n, int pid)
+{
+    int i = heap_find(heap, *n, pid);
+    if (i < 0) {
+        return;
+    }
+    (*n)--;
+    if (i < *n) {
+        heap[i] = heap[*n];
+        heap_fix(heap, *n, i);
+    }
+}
+
+// Insert or update `r`, evicting the smallest entry if the heap is full
+static void heap_offer(rank_t* heap, int* n, const rank_t* r)
+{
+    int i = heap_find(heap, *n, r->pid);
+    if (i >= 0) {
+        heap[i] = *r;
+        heap_fix(heap, *n, i);
+    } else if (*n < top_k) {
+        heap[*n] = *r;
+        (*n)++;
+        heap_fix(heap, *n, *n - 1);
+    } else if (rank_less(&heap[0], r)) {
+        heap[0] = *r;
+        heap_fix(heap, *n, 0);
+    }
+}
+
+/*
+ * Badness bonus for `pid` with prefer_growing = `weight`: weight points per
+ * permille of MemTotal + SwapTotal that the process grew per second, up to
+ * 1000. 0 for shrinking or untracked processes.
+ */
+int proctable_growth_bonus(int pid, double weight)
+{
+    if (!proctable_enabled() || growth_total_kib <= 0) {
+        return 0;
+    }
+    const proctable_entry_t* e = slot_find(pid);
+    if (e == NULL || e->growth_kibps <= 0) {
+        return 0;
+    }
+    double bonus = weight * (double)e->growth_kibps * 1000 / (double)growth_total_kib;
+    return bonus < 1000 ? (int)bonus : 1000;
+}
+
+// Take a new growth sample from `cur`, if the last one is old enough
+static void sample_growth(proctable_entry_t* e, const struct procinfo* cur, double now)
+{
+    long long kib = cur->VmRSSkiB + cur->VmSwapkiB;
+    if (e->sample_time == 0 || e->starttime != cur->starttime) {
+        // New process, or the pid was reused
+        e->growth_kibps = 0;
+    } else if (now - e->sample_time < PROCTABLE_GROWTH_INTERVAL) {
+        return;
+    } else {
+        e->growth_kibps = (long long)((double)(kib - e->sample_kib) / (now - e->sample_time));
+    }
+    e->sample_kib = kib;
+    e->sample_time = now;
+}
+
+static void refresh_pid(const poll_loop_args_t* args, procscan_t* scan, int pid)
+{
+    struct procinfo cur = {
+        .pid = pid,
+        .uid = -1,
+        .badness = -1,
+        .VmRSSkiB = -1,
+    };
+    proctable_entry_t* e = slot_find(pid);
+
+    if (e && e->epoch == sync_epoch) {
+        // Kept current by the proc events
+        cur.uid = e->uid;
+        snprintf(cur.name, sizeof(cur.name), "%s", e->name);
+        cur.fields = PROC_UID | PROC_COMM;
+    }
+    unsigned growth_fields = growth_total_kib > 0 ? PROC_SWAP : 0;
+    int dirfd = procinfo_open(scan, pid);
+    int res = dirfd;
+    if (dirfd >= 0) {
+        // Otherwise, comm and uid change on exec and setuid, so we have
+        // to read them again every time.
+        res = procinfo_read(scan, dirfd, &cur,
+            PROC_OOM_SCORE | PROC_OOM_SCORE_ADJ | PROC_COMM | PROC_UID | PROC_RSS | PROC_TIMES | growth_fields | badness_fields(args));
+        procinfo_close(scan, dirfd);
+    }
+    if (res < 0) {
+        // Process is gone
+        if (e) {
+            slot_delete((unsigned)(e - slots));
+        }
+        heap_remove(top_cur, &n_cur, pid);
+        return;
+    }
+    if (e == NULL) {
+        e = slot_insert(pid);
+        if (e == NULL) {
+            overflow++;
+            // Untracked processes have to be looked for in /proc again
+            in_sync = false;
+            return;
+        }
+    }
+    // Before badness_adjust(), which adds the bonus for the new rate
+    if (growth_fields) {
+        sample_growth(e, &cur, monotonic_secs());
+    }
+    badness_adjust(args, &cur);
+    bool eligible = cur.VmRSSkiB > 0 && cur.oom_score_adj != -1000;
+
+    if (eligible) {
+        rank_t r = { .pid = pid, .badness = cur.badness, .VmRSSkiB = cur.VmRSSkiB };
+        heap_offer(top_cur, &n_cur, &r);
+        heap_offer(top_next, &n_next, &r);
+    } else {
+        heap_remove(top_cur, &n_cur, pid);
+    }
+    e->uid = cur.uid;
+    e->badness = cur.badness;
+    e->VmRSSkiB = cur.VmRSSkiB;
+    e->starttime = cur.starttime;
+    e->generation = generation;
+    e->epoch = procevents_enabled() ? sync_epoch : 0;
+    e->eligible = eligible;
+    // comm is at most 15 bytes, the rest of cur.name is unused
+    strncpy(e->name, cur.name, sizeof(e->name) - 1);
+}
+
+// With -d, log the processes that grew fastest in the last pass
+static void debug_growers(void)
+{
+    const proctable_entry_t* top[PROCTABLE_GROWERS] = { 0 };
+
+    for (unsigned i = 0; i <= slot_mask; i++) {
+        const proctable_entry_t* e = &slots[i];
+        if (e->pid == 0 || e->growth_kibps <= 0) {
+            continue;
+        }
+        // Insertion into the short sorted list
+        for (int j = 0; j < PROCTABLE_GROWERS; j++) {
+            if (top[j] == NULL || e->growth_kibps > top[j]->growth_kibps) {
+                memmove(&top[j + 1], &top[j], (size_t)(PROCTABLE_GROWERS - 1 - j) * sizeof(top[0]));
+                top[j] = e;
+                break;
+            }
+        }
+    }
+    for (int j = 0; j < PROCTABLE_GROWERS && top[j]; j++) {
+        debug("proctable: growing fastest: pid %5d \"%s\" %+.1f MiB/s to %lld MiB, badness %d\n",
+            top[j]->pid, top[j]->name, (double)top[j]->growth_kibps / 1024, top[j]->sample_kib / 1024,
+            top[j]->badness);
+    }
+}
+
+// Drop all entries that were not seen in the pass that just completed
+static void end_pass(void)
+{
+    if (overflow) {
+        warn("proctable: table full, %d processes not tracked. Increase process_table.\n", overflow);
+    }
+    for (unsigned i = 0; i <= slot_mask; i++) {
+        // slot_delete() may move another stale entry into slot i
+        while (slots[i].pid != 0 && slots[i].generation != generation) {
+            slot_delete(i);
+        }
+    }
+    debug("proctable: pass %u complete, %d processes tracked\n", generation, count);
+    if (enable_debug && growth_total_kib > 0) {
+        debug_growers();
+    }
+    in_sync = procevents_enabled() && overflow == 0;
+    generation++;
+    overflow = 0;
+    // Switch to the freshly built heap
+    rank_t* tmp = top_cur;
+    top_cur = top_next;
+    n_cur = n_next;
+    top_next = tmp;
+    n_next = 0;
+    dirscan_rewind(&refresh_dir);
+}
+
+// Proc events were lost. Start a new pass, and do not trust the table
+// until it is complete.
+static void events_lost(void)
+{
+    debug("proctable: proc events lost, resynchronizing from %s\n", procdir_path);
+    in_sync = false;
+    sync_epoch++;
+    n_changed = 0;
+    overflow = 0;
+    n_next = 0;
+    dirscan_rewind(&refresh_dir);
+}
+
+static void apply_event(const procevent_t* ev)
+{
+    proctable_entry_t* e = slot_find(ev->pid);
+
+    switch (ev->type) {
+    case PROCEVENT_EXIT:
+        if (e) {
+            slot_delete((unsigned)(e - slots));
+        }
+        heap_remove(top_cur, &n_cur, ev->pid);
+        heap_remove(top_next, &n_next, ev->pid);
+        return;
+    case PROCEVENT_UID:
+        if (e) {
+            e->uid = ev->uid;
+        }
+        break;
+    case PROCEVENT_COMM:
+        if (e) {
+            snprintf(e->name, sizeof(e->name), "%s", ev->comm);
+        }
+        break;
+    case PROCEVENT_EXEC:
+        // The event does not tell us the new name
+        if (e) {
+            e->epoch = 0;
+        }
+        break;
+    }
+    // New process, or one whose badness may have changed
+    if (n_changed > 0 && changed[n_changed - 1] == ev->pid) {
+        return;
+    }
+    if (n_changed == PROCTABLE_UNTRACKED_MAX) {
+        events_lost();
+        return;
+    }
+    changed[n_changed++] = ev->pid;
+}
+
+/* Apply the pending proc events, and read the processes they were about
+ * from /proc again.
+ */
+void proctable_sync(const poll_loop_args_t* args)
+{
+    static procevent_t events[64];
+
+    if (!procevents_enabled()) {
+        return;
+    }
+    int n;
+    while ((n = procevents_read(events, 64)) > 0) {
+        for (int i = 0; i < n; i++) {
+            apply_event(&events[i]);
+        }
+    }
+    if (n < 0) {
+        events_lost();
+        return;
+    }
+    procscan_t scan;
+    procscan_begin(&scan);
+    for (int i = 0; i < n_changed; i++) {
+        // Let's not kill init.
+        if (changed[i] > 1) {
+            refresh_pid(args, &scan, changed[i]);
+        }
+    }
+    n_changed = 0;
+}
+
+/* Refresh up to `budget` processes, continuing where the last call
+ * stopped. A budget <= 0 refreshes until the end of the current pass.
+ */
+void proctable_refresh(const poll_loop_args_t* args, int budget)
+{
+    procscan_t scan;
+    procscan_begin(&scan);
+    proctable_sync(args);
+
+    for (int done = 0; budget <= 0 || done < budget;) {
+        errno = 0;
+        int pid = dirscan_next_pid(&refresh_dir);
+        if (pid == 0) {
+            if (errno != 0) {
+                warn("proctable: getdents64 error: %s\n", strerror(errno));
+            }
+            end_pass();
+            break;
+        }
+        // Let's not kill init.
+        if (pid <= 1) {
+            continue;
+        }
+        refresh_pid(args, &scan, pid);
+        done++;
+    }
+}
+
+/* Store the pids of up to `n` pre-ranked top entries in `pids`,
+ * in no particular order.
+ * Returns the number of pids.
+ */
+int proctable_top(int* pids, int n)
+{
+    int found = 0;
+    for (int i = 0; i < n_cur && found < n; i++) {
+        pids[found++] = top_cur[i].pid;
+    }
+    return found;
+}
+
+/* Find processes in /proc that are not in the table (yet).
+ * Returns the number of pids stored in `pids`, or -1 if there were more
+ * than `max`.
+ */
+int proctable_untracked(int* pids, int max)
+{
+    int n = 0;
+    // The proc events have told us about every new process
+    if (in_sync) {
+        return 0;
+    }
+    dirscan_rewind(&lookup_dir);
+    while (1) {
+        errno = 0;
+        int pid = dirscan_next_pid(&lookup_dir);
+        if (pid == 0) {
+            if (errno != 0) {
+                warn("proctable: getdents64 error: %s\n", strerror(errno));
+            }
+            break;
+        }
+        if (pid <= 1 || slot_find(pid) != NULL) {
+            continue;
+        }
+        if (n >= max) {
+            return -1;
+        }
+        pids[n++] = pid;
+    }
+    return n;
+}
@@ -0,0 +1,58 @@
+/* SPDX-License-Identifier: MIT */
+#ifndef PROCTABLE_H
+#define PROCTABLE_H
+
+#include <stdbool.h>
+
+#include "kill.h"
+
+// Processes looked at per proctable_refresh() call in the calm phase
+#define PROCTABLE_BATCH 256
+// Default and maximum number of top entries that are re-read when
+// selecting a victim
+#define PROCTABLE_TOP 16
+#define PROCTABLE_TOP_MAX 1024
+// Maximum number of pids the table does not know about that we accept
+// when selecting a victim. If there are more, we do a full scan instead.
+#define PROCTABLE_UNTRACKED_MAX 1024
+// /proc/[pid]/comm is at most 15 bytes plus NUL
+#define PROCTABLE_NAME_LEN 16
+// Minimum time between two samples for the growth rate, in seconds
+#define PROCTABLE_GROWTH_INTERVAL 1.0
+// Number of processes in the "growing fastest" debug message
+#define PROCTABLE_GROWERS 3
+
+typedef struct {
+    int pid; // 0 = empty slot
+    int uid;
+    int badness;
+    long long VmRSSkiB;
+    // Together with the pid, identifies the process
+    unsigned long long starttime;
+    // Refresh pass this entry was last seen in
+    unsigned generation;
+    // uid and name are kept current by the proc events if this is
+    // the current sync epoch
+    unsigned epoch;
+    // false for kernel threads, oom_score_adj = -1000 and the like
+    bool eligible;
+    char name[PROCTABLE_NAME_LEN];
+    // With prefer_growing: VmRSS + VmSwap at sample_time (monotonic
+    // seconds), and how fast that grew up to then, in KiB per second
+    long long sample_kib;
+    double sample_time;
+    long long growth_kibps;
+} proctable_entry_t;
+
+void proctable_init(int capacity, int top_k);
+void proctable_exit(void);
+bool proctable_enabled(void);
+void proctable_refresh(const poll_loop_args_t* args, int budget);
+void proctable_sync(const poll_loop_args_t* args);
+int proctable_top(int* pids, int n);
+int proctable_untracked(int* pids, int max);
+int proctable_count(void);
+void proctable_track_growth(long long total_kib);
+int proctable_growth_bonus(int pid, double weight);
+
+#endif
@@ -0,0 +1,214 @@
+// SPDX-License-Identifier: MIT
+
+/* Wake up on memory pressure using PSI triggers
+ * (/proc/pressure/memory, Linux 5.2+).
+ * See https://www.kernel.org/doc/html/latest/accounting/psi.html
+ *
+ * Other files that signal changes with POLLPRI, like cgroup
+ * memory.events, can be added to the same poll() with psi_watch_fd().
+ * Their owner decides which changes are worth waking up for. */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "globals.h"
+#include "kill.h"
+#include "msg.h"
+#include "psi.h"
+
+#define PSI_MEMORY_PATH "/proc/pressure/memory"
+
+// One trigger per fd: [0] = "some", [1] = "full", followed by
+// PSI_WATCH_MAX fds added with psi_watch_fd().
+// Unused slots have fd = -1 and are ignored by poll().
+#define PSI_NFDS (2 + PSI_WATCH_MAX)
+static struct pollfd psi_fds[PSI_NFDS] = { { .fd = -1 }, { .fd = -1 } };
+static int psi_nwatch = 0;
+// For the fds in psi_fds[2...]
+static psi_changed_fn psi_changed[PSI_WATCH_MAX];
+static void* psi_ctx[PSI_WATCH_MAX];
+static bool psi_enabled = false;
+static unsigned psi_window = PSI_WINDOW_MS;
+
+/* Open PSI_MEMORY_PATH and register a trigger that fires when tasks
+ * were stalled for more than `stall_ms` within `window_ms`.
+ * Returns the fd or -errno on error.
+ */
+static int psi_open_trigger(const char* type, unsigned stall_ms, unsigned window_ms)
+{
+    char buf[64] = { 0 };
+    int fd = open(PSI_MEMORY_PATH, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        return -errno;
+    }
+    // Trigger format: "<some|full> <stall amount in us> <time window in us>"
+    int len = snprintf(buf, sizeof(buf), "%s %u %u", type, stall_ms * 1000, window_ms * 1000);
+    // The terminating NUL byte must be written as well
+    if (write(fd, buf, (size_t)len + 1) < 0) {
+        int write_errno = errno;
+        close(fd);
+        return -write_errno;
+    }
+    return fd;
+}
+
+/* Register "some" and "full" memory pressure triggers. A stall value of
+ * zero disables the respective trigger.
+ * Returns false if PSI is not available, in which case the caller should
+ * keep using plain sleeps.
+ */
+bool psi_init(unsigned some_ms, unsigned full_ms)
+{
+    const char* types[2] = { "some", "full" };
+    unsigned stalls[2] = { some_ms, full_ms };
+
+    for (int i = 0; i < 2; i++) {
+        if (stalls[i] == 0) {
+            continue;
+        }
+        if (stalls[i] >= PSI_WINDOW_MS) {
+            warn("psi: %s stall %u ms must be below the %u ms window\n", types[i], stalls[i], PSI_WINDOW_MS);
+            return false;
+        }
+        int fd = psi_open_trigger(types[i], stalls[i] * psi_window / PSI_WINDOW_MS, psi_window);
+        if (fd == -EINVAL && psi_window == PSI_WINDOW_MS) {
+            // Probably missing CAP_SYS_RESOURCE. Retry with the window size
+            // unprivileged users may use, keeping the stall ratio.
+            psi_window = PSI_WINDOW_UNPRIV_MS;
+            fd = psi_open_trigger(types[i], stalls[i] * psi_window / PSI_WINDOW_MS, psi_window);
+        }
+        if (fd < 0) {
+            warn("psi: could not register %s trigger on %s: %s\n", types[i], PSI_MEMORY_PATH, strerror(-fd));
+            for (int j = 0; j < i; j++) {
+                if (psi_fds[j].fd >= 0) {
+                    close(psi_fds[j].fd);
+                    psi_fds[j].fd = -1;
+                }
+            }
+            return false;
+        }
+        psi_fds[i].fd = fd;
+        psi_fds[i].events = POLLPRI;
+        debug("psi: registered %s trigger: %u ms stall per %u ms window\n", types[i],
+            stalls[i] * psi_window / PSI_WINDOW_MS, psi_window);
+    }
+    psi_enabled = (psi_fds[0].fd >= 0 || psi_fds[1].fd >= 0);
+    return psi_enabled;
+}
+
+bool psi_active(void)
+{
+    return psi_enabled;
+}
+
+/* Also wake up psi_wait() when `fd` signals POLLPRI and changed(ctx)
+ * returns true. changed() has to read `fd`, which re-arms the
+ * notification.
+ * Returns false if there is no free slot.
+ */
+bool psi_watch_fd(int fd, psi_changed_fn changed, void* ctx)
+{
+    if (psi_nwatch >= PSI_WATCH_MAX) {
+        return false;
+    }
+    // Slots 2... are initialized here, the initializer only covers 0 and 1
+    psi_fds[2 + psi_nwatch].fd = fd;
+    psi_fds[2 + psi_nwatch].events = POLLPRI;
+    psi_changed[psi_nwatch] = changed;
+    psi_ctx[psi_nwatch] = ctx;
+    psi_nwatch++;
+    return true;
+}
+
+// Stop watching `fd`. Must be called before closing it.
+void psi_unwatch_fd(int fd)
+{
+    for (int i = 2; i < 2 + psi_nwatch; i++) {
+        if (psi_fds[i].fd == fd) {
+            psi_nwatch--;
+            psi_fds[i] = psi_fds[2 + psi_nwatch];
+            psi_changed[i - 2] = psi_changed[psi_nwatch];
+            psi_ctx[i - 2] = psi_ctx[psi_nwatch];
+            return;
+        }
+    }
+}
+
+// Whether psi_wait() has anything to wait for besides the timeout
+bool psi_pollable(void)
+{
+    return psi_enabled || psi_nwatch > 0;
+}
+
+// Window size of the registered triggers, in milliseconds
+unsigned psi_window_ms(void)
+{
+    return psi_window;
+}
+
+// Stop using the PSI triggers, the watched fds stay active
+static void psi_disable(void)
+{
+    for (int i = 0; i < 2; i++) {
+        if (psi_fds[i].fd >= 0) {
+            close(psi_fds[i].fd);
+            psi_fds[i].fd = -1;
+        }
+    }
+    psi_enabled = false;
+}
+
+/* Sleep until a PSI trigger fires, a watched fd changes in a way its
+ * owner cares about, or a signal arrives, but at most `timeout_ms`.
+ * Returns the number of milliseconds actually slept.
+ */
+unsigned psi_wait(unsigned timeout_ms)
+{
+    double t0 = monotonic_secs();
+    long long slept_ms = 0;
+    bool wake = false;
+
+    while (!wake && slept_ms < timeout_ms) {
+        int res = poll(psi_fds, (nfds_t)(2 + psi_nwatch), (int)(timeout_ms - slept_ms));
+        slept_ms = (long long)((monotonic_secs() - t0) * 1000);
+        if (res < 0) {
+            if (errno != EINTR) {
+                warn("psi: poll failed: %s, falling back to adaptive sleep\n", strerror(errno));
+                psi_disable();
+            }
+            break;
+        }
+        for (int i = 0; res > 0 && i < 2; i++) {
+            if (psi_fds[i].revents & POLLERR) {
+                // The trigger has been invalidated
+                warn("psi: trigger error, falling back to adaptive sleep\n");
+                psi_disable();
+                wake = true;
+                break;
+            } else if (psi_fds[i].revents & POLLPRI) {
+                debug("psi: %s trigger fired after %lld ms\n", i == 0 ? "some" : "full", slept_ms);
+                wake = true;
+            }
+        }
+        // kernfs files report POLLERR together with POLLPRI on every change,
+        // so POLLERR is not an error here. changed() reads the file, which
+        // re-arms the notification also if we keep sleeping.
+        for (int i = 2; res > 0 && i < 2 + psi_nwatch; i++) {
+            if ((psi_fds[i].revents & POLLPRI) && psi_changed[i - 2](psi_ctx[i - 2])) {
+                debug("psi: watched fd %d changed after %lld ms\n", psi_fds[i].fd, slept_ms);
+                wake = true;
+            }
+        }
+        if (res == 0 || slept_ms < 0) {
+            break;
+        }
+    }
+    if (slept_ms < 0) {
+        return 0;
+    }
+    return (unsigned)slept_ms;
+}
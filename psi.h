@@ -0,0 +1,27 @@
+/* SPDX-License-Identifier: MIT */
+#ifndef PSI_H
+#define PSI_H
+
+#include <stdbool.h>
+
+// Tracking window for the PSI triggers, in milliseconds.
+// The kernel accepts 500ms ... 10s.
+#define PSI_WINDOW_MS 1000
+// Without CAP_SYS_RESOURCE, the kernel (since Linux 6.4) only accepts
+// windows that are a multiple of 2 seconds.
+#define PSI_WINDOW_UNPRIV_MS 2000
+// Maximum number of additional fds for psi_watch_fd()
+#define PSI_WATCH_MAX 16
+
+// Called when a watched fd signals a change. Returns whether to wake up.
+typedef bool (*psi_changed_fn)(void* ctx);
+
+bool psi_init(unsigned some_ms, unsigned full_ms);
+bool psi_active(void);
+bool psi_watch_fd(int fd, psi_changed_fn changed, void* ctx);
+void psi_unwatch_fd(int fd);
+bool psi_pollable(void);
+unsigned psi_window_ms(void);
+unsigned psi_wait(unsigned timeout_ms);
+
+#endif
@@ -0,0 +1,156 @@
+// SPDX-License-Identifier: MIT
+
+/* Publish our status for monitoring.
+ *
+ * The text file was rewritten on every poll loop iteration. Now it is only
+ * rewritten when the status changes, and the current values are in a
+ * fixed-layout file that is mmap'ed once and updated in place behind a
+ * seqlock, so neither we nor the readers do any syscalls per tick.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "kill.h"
+#include "msg.h"
+#include "status.h"
+#include "throttle.h"
+
+static char text_path[PATH_LEN];
+static status_shm_t* shm;
+// What the text file says, -1 = not written yet
+static int text_code = -1;
+static char text_victim[sizeof(shm->last_victim)];
+static char text_throttled[sizeof(shm->throttled_cgroup)];
+
+static const char* const code_names[] = {
+    [STATUS_OK] = "ok",
+    [STATUS_TERM] = "term",
+    [STATUS_KILL] = "kill",
+    [STATUS_HIGH] = "high",
+    [STATUS_EMERGENCY] = "emergency",
+    [STATUS_THROTTLE] = "throttle",
+};
+
+/*
+ * Write the status files to `dir`.
+ */
+void status_init(const char* dir)
+{
+    char shm_path[PATH_LEN];
+
+    snprintf(text_path, sizeof(text_path), "%s/%s", dir, STATUS_NAME);
+    snprintf(shm_path, sizeof(shm_path), "%s/%s", dir, STATUS_SHM_NAME);
+    text_code = -1;
+
+    int fd = open(shm_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        warn("could not open status file %s: %s\n", shm_path, strerror(errno));
+        return;
+    }
+    if (ftruncate(fd, sizeof(status_shm_t)) != 0) {
+        warn("could not resize status file %s: %s\n", shm_path, strerror(errno));
+        close(fd);
+        return;
+    }
+    void* p = mmap(NULL, sizeof(status_shm_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    // The mapping stays valid without the fd
+    close(fd);
+    if (p == MAP_FAILED) {
+        warn("could not mmap status file %s: %s\n", shm_path, strerror(errno));
+        return;
+    }
+    shm = p;
+    // Readers may still have the file open from our last run, so we keep
+    // seq going. Make it even in case we died while writing.
+    shm->seq = (shm->seq + 1) & ~1u;
+    shm->magic = STATUS_SHM_MAGIC;
+    shm->version = STATUS_SHM_VERSION;
+}
+
+static void shm_update(int code, double memavail, double setpoint, time_t now, const char* victim, const char* throttled)
+{
+    uint32_t seq = shm->seq;
+
+    __atomic_store_n(&shm->seq, seq + 1, __ATOMIC_RELAXED);
+    // Readers must see the odd seq before any of the new data
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    shm->code = (uint32_t)code;
+    shm->mem_avail_percent = memavail;
+    shm->setpoint = setpoint;
+    shm->last_update = (int64_t)now;
+    snprintf(shm->code_name, sizeof(shm->code_name), "%s", code_names[code]);
+    snprintf(shm->last_victim, sizeof(shm->last_victim), "%s", victim);
+    snprintf(shm->throttled_cgroup, sizeof(shm->throttled_cgroup), "%s", throttled);
+    __atomic_store_n(&shm->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static void text_update(int code, double memavail, double setpoint, time_t now, const char* victim, const char* throttled)
+{
+    FILE* sfile;
+
+    if ((sfile = fopen(text_path, "w"))) {
+        // Write status file, one value per line:
+        // StatusCode
+        fprintf(sfile, "%s\n", code_names[code]);
+
+        // MemAvailable
+        fprintf(sfile, "%0.02f\n", memavail);
+
+        // TriggeredSetpoint
+        fprintf(sfile, "%0.02f\n", setpoint);
+
+        // LastUpdate
+        fprintf(sfile, "%ld\n", (long)now);
+
+        // LastVictim: what we last sent a signal to, like
+        // "process 1234 firefox" or "cgroup /user.slice/foo.scope".
+        // Empty if nothing yet.
+        fprintf(sfile, "%s\n", victim);
+
+        // ThrottledCgroup: whose memory.high we lowered with
+        // memory_throttle, like "/user.slice/foo.scope". Empty if none.
+        fprintf(sfile, "%s\n", throttled);
+
+        fclose(sfile);
+    } else {
+        warn("failed to write to status file (%s)\n", text_path);
+    }
+    // Also on failure, so we do not retry (and warn) on every tick
+    text_code = code;
+    snprintf(text_victim, sizeof(text_victim), "%s", victim);
+    snprintf(text_throttled, sizeof(text_throttled), "%s", throttled);
+}
+
+void status_update(int sig, bool emergency, bool high, double memavail, double setpoint)
+{
+    int code = STATUS_OK;
+    if (high) {
+        code = STATUS_HIGH;
+    } else if (emergency) {
+        code = STATUS_EMERGENCY;
+    } else if (sig == SIGTERM) {
+        code = STATUS_TERM;
+    } else if (sig == SIGKILL) {
+        code = STATUS_KILL;
+    } else if (throttle_active()) {
+        code = STATUS_THROTTLE;
+    }
+    const char* victim = kill_last_victim();
+    const char* throttled = throttle_cgroup();
+    time_t now = time(NULL);
+
+    if (shm) {
+        shm_update(code, memavail, setpoint, now, victim, throttled);
+    }
+    if (code != text_code || strncmp(victim, text_victim, sizeof(text_victim) - 1) != 0
+        || strncmp(throttled, text_throttled, sizeof(text_throttled) - 1) != 0) {
+        text_update(code, memavail, setpoint, now, victim, throttled);
+    }
+}
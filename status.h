@@ -0,0 +1,54 @@
+/* SPDX-License-Identifier: MIT */
+#ifndef STATUS_H
+#define STATUS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define STATUS_DIR "/var/run/earlyoom"
+// Text file, rewritten when the status code or the last victim changes
+#define STATUS_NAME "status"
+// status_shm_t, updated in place on every poll loop iteration
+#define STATUS_SHM_NAME "status.shm"
+
+#define STATUS_SHM_MAGIC 0x4d4f4f45 // "EOOM" in little endian
+#define STATUS_SHM_VERSION 2
+
+enum {
+    STATUS_OK,
+    STATUS_TERM,
+    STATUS_KILL,
+    STATUS_HIGH,
+    STATUS_EMERGENCY,
+    STATUS_THROTTLE,
+};
+
+/* Layout of the status.shm file, in host byte order.
+ *
+ * `seq` is a seqlock: it is odd while earlyoom is writing. To get a
+ * consistent copy, read seq, copy the struct, and read seq again. Retry
+ * if the two values differ or are odd.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t seq;
+    // STATUS_*
+    uint32_t code;
+    double mem_avail_percent;
+    double setpoint;
+    // Unix time of the last update
+    int64_t last_update;
+    // Same as the text file: "ok", "term", "kill", "high", "emergency"
+    // or "throttle"
+    char code_name[16];
+    // Like "process 1234 firefox", empty if nothing yet
+    char last_victim[256];
+    // Version 2: the cgroup whose memory.high we lowered, empty if none
+    char throttled_cgroup[256];
+} status_shm_t;
+
+void status_init(const char* dir);
+void status_update(int sig, bool emergency, bool high, double memavail, double setpoint);
+
+#endif
@@ -3,12 +3,29 @@ package earlyoom_testsuite
 import (
 	"fmt"
 	"strings"
+	"unsafe"
 )
 
 // #cgo CFLAGS: -std=gnu99 -DCGO
 // #include "meminfo.h"
 // #include "kill.h"
 // #include "msg.h"
+// #include <stdlib.h>
+// #include <string.h>
+// #include "cgroup.h"
+// #include "compswap.h"
+// #include "globals.h"
+// #include "group.h"
+// #include "metrics.h"
+// #include "procevents.h"
+// #include "proctable.h"
+// #include "status.h"
+// #include "throttle.h"
+// #include "trace.h"
+// #include "trend.h"
+// #include "uring.h"
+// #include "vmstat.h"
+// #include "workers.h"
 import "C"
 
 func parse_term_kill_tuple(optarg string, upper_limit int) (error, float64, float64) {
@@ -41,6 +58,342 @@ func kill_largest_process() {
 	C.kill_largest_process(&args, 0)
 }
 
+// set_procdir makes earlyoom read dir instead of /proc. Call the returned
+// function to switch back.
+func set_procdir(dir string) (restore func()) {
+	old := C.procdir_path
+	cs := C.CString(dir)
+	C.procdir_path = cs
+	return func() {
+		C.procdir_path = old
+		C.free(unsafe.Pointer(cs))
+	}
+}
+
+// set_cgroup_root makes earlyoom look for cgroups in dir instead of
+// /sys/fs/cgroup. Call the returned function to switch back.
+func set_cgroup_root(dir string) (restore func()) {
+	old := C.cgroup_root_path
+	cs := C.CString(dir)
+	C.cgroup_root_path = cs
+	return func() {
+		C.cgroup_root_path = old
+		C.free(unsafe.Pointer(cs))
+	}
+}
+
+// set_sysfs_root makes earlyoom look for zram and zswap in dir instead of
+// /sys. Call the returned function to switch back.
+func set_sysfs_root(dir string) (restore func()) {
+	old := C.sysfs_path
+	cs := C.CString(dir)
+	C.sysfs_path = cs
+	return func() {
+		C.sysfs_path = old
+		C.free(unsafe.Pointer(cs))
+	}
+}
+
+// compswap_init makes parse_meminfo() account for the zram swap devices
+// and zswap it finds. Call the returned function to stop.
+func compswap_init() (found bool, restore func()) {
+	found = bool(C.compswap_init())
+	return found, func() { C.compswap_exit() }
+}
+
+// cgroup_add adds a cgroup to monitor. Call the returned function to stop
+// monitoring all of them.
+func cgroup_add(spec string) (restore func()) {
+	cs := C.CString(spec)
+	defer C.free(unsafe.Pointer(cs))
+	C.cgroup_add(cs)
+	return func() { C.cgroup_exit() }
+}
+
+type cgroupState struct {
+	path                     string
+	termPercent, killPercent float64
+	currentKiB, maxKiB       int64
+	availKiB                 int64
+	availPercent             float64
+	c                        *C.cgroup_t
+}
+
+// events_changed is what psi_wait() calls when memory.events of cg changes
+func (cg *cgroupState) events_changed() bool {
+	return bool(C.cgroup_events_changed(unsafe.Pointer(cg.c)))
+}
+
+// cgroup_check checks the monitored cgroups and returns the signal to
+// send and the state of the cgroup that is worst off, if any
+func cgroup_check() (sig int, cg *cgroupState) {
+	var csig C.int
+	c := C.cgroup_check(&csig)
+	if c == nil {
+		return int(csig), nil
+	}
+	return int(csig), &cgroupState{
+		path:         C.GoString(&c.path[0]),
+		termPercent:  float64(c.term_percent),
+		killPercent:  float64(c.kill_percent),
+		currentKiB:   int64(c.current_kib),
+		maxKiB:       int64(c.max_kib),
+		availKiB:     int64(c.avail_kib),
+		availPercent: float64(c.avail_percent),
+		c:            c,
+	}
+}
+
+func compile_regex(pattern string) *C.regex_t {
+	if pattern == "" {
+		return nil
+	}
+	re := (*C.regex_t)(C.malloc(C.sizeof_regex_t))
+	cs := C.CString(pattern)
+	defer C.free(unsafe.Pointer(cs))
+	if C.regcomp(re, cs, C.REG_EXTENDED|C.REG_NOSUB) != 0 {
+		panic("could not compile regex " + pattern)
+	}
+	return re
+}
+
+// trace_record writes a recording of two samples with one victim
+// selection between them, which looked at pids 2... with the given names
+func trace_record(path string, names []string) {
+	cs := C.CString(path)
+	defer C.free(unsafe.Pointer(cs))
+	C.trace_record_open(cs)
+	defer C.trace_exit()
+	m := C.parse_meminfo()
+	C.trace_meminfo(&m)
+	C.trace_candidates_begin()
+	for i, name := range names {
+		p := C.struct_procinfo{pid: C.int(i + 2), badness: C.int(i), VmRSSkiB: 1024}
+		cname := C.CString(name)
+		C.strncpy(&p.name[0], cname, C.PATH_LEN-1)
+		C.free(unsafe.Pointer(cname))
+		C.trace_candidate(&p)
+	}
+	C.trace_candidates_end()
+	C.trace_meminfo(&m)
+}
+
+// trace_replay returns the pids and names of the candidates that the
+// first victim selection in the trace at path looked at
+func trace_replay(path string) (pids []int, names []string) {
+	cs := C.CString(path)
+	defer C.free(unsafe.Pointer(cs))
+	C.trace_replay_open(cs)
+	defer C.trace_exit()
+	C.trace_next_meminfo()
+	var n C.int
+	cands := C.trace_replay_candidates(&n)
+	for _, p := range unsafe.Slice(cands, int(n)) {
+		pids = append(pids, int(p.pid))
+		names = append(names, C.GoString(&p.name[0]))
+	}
+	return pids, names
+}
+
+func status_init(dir string) {
+	cs := C.CString(dir)
+	defer C.free(unsafe.Pointer(cs))
+	C.status_init(cs)
+}
+
+func status_update(sig int, memavail float64) {
+	C.status_update(C.int(sig), false, false, C.double(memavail), 0)
+}
+
+// status_shm_decode interprets buf, the contents of the status.shm file
+func status_shm_decode(buf []byte) (magic uint32, seq uint32, codeName string, memavail float64) {
+	if len(buf) != C.sizeof_status_shm_t {
+		panic(fmt.Sprintf("status.shm has %d bytes, want %d", len(buf), C.sizeof_status_shm_t))
+	}
+	s := (*C.status_shm_t)(unsafe.Pointer(&buf[0]))
+	return uint32(s.magic), uint32(s.seq), C.GoString(&s.code_name[0]), float64(s.mem_avail_percent)
+}
+
+// metrics_write records a SIGTERM, an escalation and a victim selection
+// that took selectionSecs, and writes the metrics to path.
+func metrics_write(path string, selectionSecs float64) {
+	cs := C.CString(path)
+	defer C.free(unsafe.Pointer(cs))
+	C.metrics_init(cs)
+	C.metrics_add(C.METRIC_SIGTERM, 1)
+	C.metrics_add(C.METRIC_ESCALATIONS, 1)
+	C.metrics_observe(C.METRIC_SELECTION_SECONDS, C.double(selectionSecs))
+	C.metrics_flush()
+	C.metrics_init(nil)
+}
+
+// avoid_users resolves the avoid_users regex and returns the number of
+// matching users. An empty pattern clears the set.
+func avoid_users(pattern string) int {
+	re := compile_regex(pattern)
+	n := int(C.kill_avoid_users_set(re))
+	if re != nil {
+		C.regfree(re)
+		C.free(unsafe.Pointer(re))
+	}
+	return n
+}
+
+func user_avoided(uid int) bool {
+	return bool(C.kill_user_avoided(C.int(uid)))
+}
+
+func user_name(uid int) string {
+	return C.GoString(C.kill_user_name(C.int(uid)))
+}
+
+// kill_emergency_dryrun runs the emergency kill for the comma-separated
+// process names in dryrun mode and returns the number of matches. It stops
+// once MemAvailable is above mem_high_percent.
+func kill_emergency_dryrun(names string, mem_high_percent float64) int {
+	cs := C.CString(names)
+	defer C.free(unsafe.Pointer(cs))
+	C.kill_emergency_set_names(cs)
+	var args C.poll_loop_args_t
+	args.dryrun = true
+	args.emerg_kill = cs
+	args.mem_high_percent = C.double(mem_high_percent)
+	return int(C.kill_emergency(&args))
+}
+
+// scanArgs holds the poll_loop_args_t for victim selection benchmarks
+type scanArgs struct {
+	args C.poll_loop_args_t
+}
+
+func new_scan_args(prefer, avoid string) *scanArgs {
+	a := &scanArgs{}
+	a.args.prefer_regex = compile_regex(prefer)
+	a.args.avoid_regex = compile_regex(avoid)
+	C.kill_rules_compile(&a.args)
+	return a
+}
+
+func (a *scanArgs) free() {
+	for _, re := range []*C.regex_t{a.args.prefer_regex, a.args.avoid_regex} {
+		if re != nil {
+			C.regfree(re)
+			C.free(unsafe.Pointer(re))
+		}
+	}
+	a.args = C.poll_loop_args_t{}
+	C.kill_rules_compile(&a.args)
+}
+
+// kill_rule_add adds a scoring rule, picked up by the next new_scan_args.
+// Returns what is wrong with spec, or "". An empty spec drops all rules.
+func kill_rule_add(spec string) string {
+	if spec == "" {
+		C.kill_rule_add(nil)
+		return ""
+	}
+	cs := C.CString(spec)
+	defer C.free(unsafe.Pointer(cs))
+	if err := C.kill_rule_add(cs); err != nil {
+		return C.GoString(err)
+	}
+	return ""
+}
+
+// find_largest_process runs victim selection (without killing anything)
+// and returns the pid it picked, how many processes it looked at, and how
+// many syscalls that took.
+func (a *scanArgs) find_largest_process() (pid int, candidates int, syscalls uint64) {
+	victim := C.find_largest_process(&a.args, nil)
+	var cand C.int
+	var sys C.ulong
+	C.kill_scan_stats(&cand, &sys)
+	return int(victim.pid), int(cand), uint64(sys)
+}
+
+const (
+	KILL_UNIT_CGROUP = int(C.KILL_UNIT_CGROUP)
+	KILL_UNIT_PGRP   = int(C.KILL_UNIT_PGRP)
+)
+
+// proctable_init builds the process table. Call the returned function to
+// drop it again.
+func proctable_init(capacity int, top_k int) (restore func()) {
+	C.proctable_init(C.int(capacity), C.int(top_k))
+	return func() { C.proctable_exit() }
+}
+
+// proctable_refresh refreshes up to budget processes, all of the current
+// pass if budget is 0
+func (a *scanArgs) proctable_refresh(budget int) {
+	C.proctable_refresh(&a.args, C.int(budget))
+}
+
+func proctable_count() int {
+	return int(C.proctable_count())
+}
+
+// proctable_top returns the pids of up to n pre-ranked top entries
+func proctable_top(n int) []int {
+	pids := make([]C.int, n)
+	found := int(C.proctable_top(&pids[0], C.int(n)))
+	out := make([]int, found)
+	for i := range out {
+		out[i] = int(pids[i])
+	}
+	return out
+}
+
+// proctable_untracked returns the processes in /proc that are not in the
+// table, or nil if there are more than max
+func proctable_untracked(max int) []int {
+	pids := make([]C.int, max)
+	n := int(C.proctable_untracked(&pids[0], C.int(max)))
+	if n < 0 {
+		return nil
+	}
+	out := make([]int, n)
+	for i := range out {
+		out[i] = int(pids[i])
+	}
+	return out
+}
+
+var groupInitDone bool
+
+// group_find_largest picks the unit to kill with kill_unit (C.KILL_UNIT_*)
+// and returns its id, number of members and score. ok is false if there is
+// none.
+func (a *scanArgs) group_find_largest(kill_unit int) (ok bool, id int, members int, badness int) {
+	if !groupInitDone {
+		C.group_init()
+		groupInitDone = true
+	}
+	a.args.kill_unit = C.int(kill_unit)
+	var g C.group_t
+	if !C.group_find_largest(&a.args, nil, &g) {
+		return false, 0, 0, 0
+	}
+	return true, int(g.id), int(g.members), int(g.badness)
+}
+
+// uring_init switches victim selection to the io_uring backend. Call the
+// returned function to switch back. ok is false if io_uring is not
+// available here.
+func uring_init() (ok bool, restore func()) {
+	if !C.uring_init() {
+		return false, func() {}
+	}
+	return true, func() { C.uring_exit() }
+}
+
+// workers_init makes victim selection scan with n threads. Call the
+// returned function to go back to one.
+func workers_init(n int) (ok bool, restore func()) {
+	ok = bool(C.workers_init(C.int(n)))
+	return ok, func() { C.workers_init(1) }
+}
+
 func get_oom_score(pid int) int {
 	return int(C.get_oom_score(C.int(pid)))
 }
@@ -56,8 +409,95 @@ func get_vm_rss_kib(pid int) int {
 	return int(C.get_vm_rss_kib(C.int(pid)))
 }
 
+func get_numa_node_kib(pid int, node int) int {
+	return int(C.get_numa_node_kib(C.int(pid), C.int(node)))
+}
+
 func get_comm(pid int) (int, string) {
 	cstr := C.CString(strings.Repeat("\000", 256))
 	res := C.get_comm(C.int(pid), cstr, 256)
 	return int(res), C.GoString(cstr)
 }
+
+// trend_feed resets the trend, adds samples of available memory (in percent
+// of 1 GiB, no swap) taken at times ts (seconds), and returns the trend at
+// the last sample, and the seconds until mem_percent is reached.
+func trend_feed(ts []float64, memPct []float64, mem_percent float64) (ok bool, memRate float64, eta float64) {
+	var m C.meminfo_t
+	m.MemTotalKiB = 1024 * 1024
+	C.trend_reset()
+	for i := range ts {
+		m.MemAvailablePercent = C.double(memPct[i])
+		C.trend_add(&m, C.double(ts[i]))
+	}
+	var t C.trend_t
+	if !C.trend_get(C.double(ts[len(ts)-1]), &t) {
+		return false, 0, 0
+	}
+	return true, float64(t.mem_rate), float64(C.trend_eta(&t, &m, C.double(mem_percent), 0))
+}
+
+func vmstat_add(spec string) {
+	cs := C.CString(spec)
+	defer C.free(unsafe.Pointer(cs))
+	C.vmstat_add(cs)
+}
+
+func vmstat_reset() {
+	C.vmstat_reset()
+}
+
+// vmstat_check samples the vmstat file at time now (seconds), and returns
+// the signal to send and why, if any.
+func vmstat_check(now float64) (sig int, desc string) {
+	var csig C.int
+	cdesc := C.vmstat_check(C.double(now), &csig)
+	if cdesc != nil {
+		desc = C.GoString(cdesc)
+	}
+	return int(csig), desc
+}
+
+func procevents_init() bool {
+	return bool(C.procevents_init())
+}
+
+const (
+	PROCEVENT_FORK = int(C.PROCEVENT_FORK)
+	PROCEVENT_EXEC = int(C.PROCEVENT_EXEC)
+	PROCEVENT_EXIT = int(C.PROCEVENT_EXIT)
+)
+
+type procEvent struct {
+	typ  int
+	pid  int
+	uid  int
+	comm string
+}
+
+// procevents_read returns the pending proc events, and false if
+// events were lost
+func procevents_read() ([]procEvent, bool) {
+	var buf [64]C.procevent_t
+	n := int(C.procevents_read(&buf[0], C.int(len(buf))))
+	if n < 0 {
+		return nil, false
+	}
+	out := make([]procEvent, n)
+	for i := range out {
+		out[i] = procEvent{int(buf[i]._type), int(buf[i].pid), int(buf[i].uid), C.GoString(&buf[i].comm[0])}
+	}
+	return out, true
+}
+
+// throttle_init keeps the throttle state in dir, and restores what a
+// previous run left there
+func throttle_init(dir string) {
+	cs := C.CString(dir)
+	defer C.free(unsafe.Pointer(cs))
+	C.throttle_init(cs)
+}
+
+func throttle_target_kib(currentKiB int64, needKiB int64) int64 {
+	return int64(C.throttle_target_kib(C.longlong(currentKiB), C.longlong(needKiB)))
+}
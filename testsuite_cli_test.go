@@ -9,6 +9,7 @@ import (
 	"strconv"
 	"strings"
 	"testing"
+	"time"
 )
 
 type cliTestCase struct {
@@ -107,6 +108,20 @@ func TestCli(t *testing.T) {
 		// Extra arguments should error out
 		{args: []string{"xyz"}, code: 13, stderrContains: "extra argument not understood", stdoutEmpty: true},
 		{args: []string{"-i", "1"}, code: 13, stderrContains: "extra argument not understood", stdoutEmpty: true},
+		{args: []string{"--replay", "/nonexistent/trace"}, code: 17, stderrContains: "fatal", stdoutEmpty: true},
+		{args: []string{"--replay", "/proc/self/stat"}, code: 17, stderrContains: "not an earlyoom trace", stdoutEmpty: true},
+		{args: []string{"--record", "/dev/null", "--replay", "/dev/null"}, code: 2, stderrContains: "fatal", stdoutEmpty: true},
+		{args: []string{"--batch", "4"}, code: -1, stderrContains: "killing up to 4 processes at once", stdoutContains: memReport},
+		{args: []string{"--batch", "17"}, code: 14, stderrContains: "fatal", stdoutEmpty: true},
+		{args: []string{"--log", "async", "-d"}, code: -1, stderrContains: "log thread (async)", stdoutContains: "new victim"},
+		{args: []string{"--log", "bogus"}, code: 14, stderrContains: "fatal", stdoutEmpty: true},
+		{args: []string{"--flight-recorder", "-"}, code: -1, stderrContains: "flight recorder: keeping the last 128 iterations", stdoutContains: "mem avail"},
+		{args: []string{"--scan-threads", "17"}, code: 14, stderrContains: "fatal", stdoutEmpty: true},
+		{args: []string{"--throttle", "0"}, code: 15, stderrContains: "fatal", stdoutEmpty: true},
+		{args: []string{"--cgroup", "tenant.slice"}, code: 14, stderrContains: "fatal", stdoutEmpty: true},
+		{args: []string{"--cgroup", "tenant.slice:x"}, code: 14, stderrContains: "fatal", stdoutEmpty: true},
+		{args: []string{"--cgroup", ":10"}, code: 14, stderrContains: "fatal", stdoutEmpty: true},
+		{args: []string{"--thrash", "swapin:2000,1000"}, code: 14, stderrContains: "fatal", stdoutEmpty: true},
 		// Tuples
 		{args: []string{"-m", "2,1"}, code: -1, stderrContains: "sending SIGTERM when mem <=  2.00% and swap <= 10.00%", stdoutContains: memReport},
 		{args: []string{"-m", "1,2"}, code: -1, stdoutContains: memReport},
@@ -258,3 +273,38 @@ func TestI(t *testing.T) {
 		t.Error("saw badness 1000, but should not have")
 	}
 }
+
+// TestRecordReplay records a trace where every sample triggers a (dry-run)
+// SIGTERM, and checks that replaying it with the same and with default
+// limits gives the expected decisions.
+func TestRecordReplay(t *testing.T) {
+	trace := t.TempDir() + "/trace"
+	cmd := exec.Command(earlyoomBinary, "--dryrun", "-m", "99", "-s", "100", "--record", trace)
+	if err := cmd.Start(); err != nil {
+		t.Fatal(err)
+	}
+	time.Sleep(1500 * time.Millisecond)
+	cmd.Process.Kill()
+	cmd.Wait()
+
+	summary := regexp.MustCompile(`sent (\d+) signals, (\d+) in the recording, (\d+) of them the same`)
+	replay := func(args ...string) []string {
+		out, err := exec.Command(earlyoomBinary, append([]string{"--replay", trace}, args...)...).CombinedOutput()
+		if code := extractCmdExitCode(err); code != 0 {
+			t.Fatalf("replay exited with code %d:\n%s", code, out)
+		}
+		m := summary.FindStringSubmatch(string(out))
+		if m == nil {
+			t.Fatalf("no summary in replay output:\n%s", out)
+		}
+		return m[1:]
+	}
+	same := replay("-m", "99", "-s", "100")
+	if same[0] == "0" || same[0] != same[1] || same[1] != same[2] {
+		t.Errorf("replay with the recorded limits should do the same: sent %s, recorded %s, same %s", same[0], same[1], same[2])
+	}
+	defaults := replay()
+	if defaults[0] != "0" {
+		t.Errorf("replay with default limits sent %s signals", defaults[0])
+	}
+}
@@ -0,0 +1,491 @@
+package earlyoom_testsuite
+
+import (
+	"fmt"
+	"math/rand"
+	"os"
+	"path/filepath"
+	"sort"
+	"strconv"
+	"testing"
+)
+
+// Process names used in the synthetic trees. Some of them match the
+// --prefer and --avoid regexes below.
+var procTreeNames = []string{"bash", "firefox", "java", "postgres", "nginx", "sshd", "Xorg", "python3"}
+
+const (
+	benchPrefer = "^(java|postgres)$"
+	benchAvoid  = "^(sshd|Xorg)$"
+)
+
+// genProcTree writes a fake /proc with n processes to dir, containing
+// the files earlyoom reads during victim selection, plus meminfo and
+// uptime copied from the real /proc.
+func genProcTree(dir string, n int) error {
+	rnd := rand.New(rand.NewSource(int64(n)))
+	for _, name := range []string{"meminfo", "uptime"} {
+		buf, err := os.ReadFile("/proc/" + name)
+		if err != nil {
+			return err
+		}
+		if err := os.WriteFile(filepath.Join(dir, name), buf, 0644); err != nil {
+			return err
+		}
+	}
+	// Non-numeric entries must be skipped
+	if err := os.MkdirAll(filepath.Join(dir, "sys"), 0755); err != nil {
+		return err
+	}
+	for i := 0; i < n; i++ {
+		pid := 1000 + i
+		comm := procTreeNames[rnd.Intn(len(procTreeNames))]
+		rssPages := 100 + rnd.Intn(100000)
+		pgrp := 1000 + i - i%8
+		files := map[string]string{
+			"oom_score":     fmt.Sprintf("%d\n", rnd.Intn(1000)),
+			"oom_score_adj": "0\n",
+			"comm":          comm + "\n",
+			"statm":         fmt.Sprintf("%d %d 300 5 0 123 0\n", rssPages*2, rssPages),
+			"stat": fmt.Sprintf("%d (%s) S 1 %d %d 0 -1 4194304 83 0 0 0 %d %d 0 0 20 0 1 0 %d %d %d 18446744073709551615 0 0 0 0 0 0 0 0 0 0 0 0 17 0 0 0 0 0 0 0 0 0 0 0 0 0 0\n",
+				pid, comm, pgrp, pgrp, rnd.Intn(1000), rnd.Intn(1000), 1000+i, rssPages*2*4096, rssPages),
+			"cgroup": fmt.Sprintf("0::/synthetic.slice/unit%d.service\n", pgrp),
+		}
+		pdir := filepath.Join(dir, fmt.Sprint(pid))
+		if err := os.Mkdir(pdir, 0755); err != nil {
+			return err
+		}
+		for name, content := range files {
+			if err := os.WriteFile(filepath.Join(pdir, name), []byte(content), 0644); err != nil {
+				return err
+			}
+		}
+	}
+	return nil
+}
+
+// Generated trees, by size. Generating 100k processes takes a while, so
+// they are shared between benchmarks and removed by TestMain.
+var procTrees = map[int]string{}
+
+func procTree(b *testing.B, n int) string {
+	if dir, ok := procTrees[n]; ok {
+		return dir
+	}
+	b.StopTimer()
+	defer b.StartTimer()
+	dir, err := os.MkdirTemp("", fmt.Sprintf("earlyoom-proc%d-", n))
+	if err != nil {
+		b.Fatal(err)
+	}
+	if err := genProcTree(dir, n); err != nil {
+		os.RemoveAll(dir)
+		b.Fatal(err)
+	}
+	procTrees[n] = dir
+	return dir
+}
+
+func TestMain(m *testing.M) {
+	code := m.Run()
+	for _, dir := range procTrees {
+		os.RemoveAll(dir)
+	}
+	os.Exit(code)
+}
+
+func Test_find_largest_process_synthetic(t *testing.T) {
+	dir := t.TempDir()
+	if err := genProcTree(dir, 100); err != nil {
+		t.Fatal(err)
+	}
+	restore := set_procdir(dir)
+	defer restore()
+	a := new_scan_args("", "")
+	defer a.free()
+	pid, candidates, syscalls := a.find_largest_process()
+	if pid < 1000 || pid >= 1100 {
+		t.Errorf("picked pid %d, which is not in the synthetic tree", pid)
+	}
+	if candidates != 100 {
+		t.Errorf("looked at %d processes, want 100", candidates)
+	}
+	if syscalls == 0 {
+		t.Errorf("no syscalls counted")
+	}
+}
+
+// The io_uring batches must pick the same victim as the synchronous scan
+func Test_find_largest_process_uring(t *testing.T) {
+	dir := t.TempDir()
+	// More than one batch
+	if err := genProcTree(dir, 300); err != nil {
+		t.Fatal(err)
+	}
+	restore := set_procdir(dir)
+	defer restore()
+	for _, re := range [][2]string{{"", ""}, {benchPrefer, benchAvoid}} {
+		a := new_scan_args(re[0], re[1])
+		wantPid, wantCandidates, wantSyscalls := a.find_largest_process()
+		ok, stop := uring_init()
+		if !ok {
+			a.free()
+			t.Skip("io_uring is not available")
+		}
+		pid, candidates, syscalls := a.find_largest_process()
+		stop()
+		a.free()
+		if pid != wantPid || candidates != wantCandidates {
+			t.Errorf("prefer %q avoid %q: picked pid %d out of %d, synchronous scan picked %d out of %d",
+				re[0], re[1], pid, candidates, wantPid, wantCandidates)
+		}
+		if syscalls >= wantSyscalls {
+			t.Errorf("used %d syscalls, synchronous scan %d", syscalls, wantSyscalls)
+		}
+	}
+}
+
+// The scan threads must pick the same victim as the single-threaded scan
+func Test_find_largest_process_parallel(t *testing.T) {
+	dir := t.TempDir()
+	if err := genProcTree(dir, 1000); err != nil {
+		t.Fatal(err)
+	}
+	restore := set_procdir(dir)
+	defer restore()
+	for _, re := range [][2]string{{"", ""}, {benchPrefer, benchAvoid}} {
+		a := new_scan_args(re[0], re[1])
+		wantPid, wantCandidates, _ := a.find_largest_process()
+		ok, stop := workers_init(4)
+		if !ok {
+			a.free()
+			t.Skip("could not start scan threads")
+		}
+		pid, candidates, _ := a.find_largest_process()
+		stop()
+		a.free()
+		if pid != wantPid || candidates != wantCandidates {
+			t.Errorf("prefer %q avoid %q: picked pid %d out of %d, single-threaded scan picked %d out of %d",
+				re[0], re[1], pid, candidates, wantPid, wantCandidates)
+		}
+	}
+}
+
+func Test_find_largest_process_rules(t *testing.T) {
+	dir := t.TempDir()
+	if err := genProcTree(dir, 100); err != nil {
+		t.Fatal(err)
+	}
+	restore := set_procdir(dir)
+	defer restore()
+	defer kill_rule_add("")
+	tests := []struct {
+		rules []string
+		// The victim must be in this cgroup, or have this name
+		cgroup, comm string
+	}{
+		{rules: []string{"cgroup ^/synthetic.slice/unit1008.service$ +5000"}, cgroup: "/synthetic.slice/unit1008.service"},
+		// Multipliers apply to what the rules before them added
+		{rules: []string{"comm ^postgres$ +2000", "comm ^postgres$ *0", "comm ^sshd$ +1000"}, comm: "sshd"},
+		{rules: []string{"uid 0-4294967295 *0", "comm ^java$ +1"}, comm: "java"},
+	}
+	for _, tc := range tests {
+		kill_rule_add("")
+		for _, r := range tc.rules {
+			if err := kill_rule_add(r); err != "" {
+				t.Fatalf("rule %q: %s", r, err)
+			}
+		}
+		a := new_scan_args("", "")
+		pid, _, _ := a.find_largest_process()
+		a.free()
+		pdir := filepath.Join(dir, fmt.Sprint(pid))
+		cgroup, _ := os.ReadFile(filepath.Join(pdir, "cgroup"))
+		comm, _ := os.ReadFile(filepath.Join(pdir, "comm"))
+		if tc.cgroup != "" && string(cgroup) != "0::"+tc.cgroup+"\n" {
+			t.Errorf("rules %q: picked pid %d in cgroup %q", tc.rules, pid, cgroup)
+		}
+		if tc.comm != "" && string(comm) != tc.comm+"\n" {
+			t.Errorf("rules %q: picked pid %d named %q", tc.rules, pid, comm)
+		}
+	}
+
+	for _, bad := range []string{"comm", "comm x", "pid 1 +1", "uid 2-1 +1", "comm ( +1", "age 5 age/0", "comm x %3"} {
+		if err := kill_rule_add(bad); err == "" {
+			t.Errorf("rule %q was accepted", bad)
+		}
+	}
+}
+
+// fakeRanking returns the pids of the fake /proc in dir, ranked like
+// victim selection without preferences: oom_score, then VmRSS
+func fakeRanking(t *testing.T, dir string) []int {
+	type rank struct{ pid, badness, rss int }
+	var ranks []rank
+	entries, err := os.ReadDir(dir)
+	if err != nil {
+		t.Fatal(err)
+	}
+	for _, e := range entries {
+		pid, err := strconv.Atoi(e.Name())
+		if err != nil {
+			continue
+		}
+		var r rank
+		r.pid = pid
+		buf, err := os.ReadFile(filepath.Join(dir, e.Name(), "oom_score"))
+		if err != nil {
+			t.Fatal(err)
+		}
+		fmt.Sscan(string(buf), &r.badness)
+		buf, err = os.ReadFile(filepath.Join(dir, e.Name(), "statm"))
+		if err != nil {
+			t.Fatal(err)
+		}
+		fmt.Sscan(string(buf), new(int), &r.rss)
+		ranks = append(ranks, r)
+	}
+	sort.Slice(ranks, func(i, j int) bool {
+		if ranks[i].badness != ranks[j].badness {
+			return ranks[i].badness > ranks[j].badness
+		}
+		return ranks[i].rss > ranks[j].rss
+	})
+	pids := make([]int, len(ranks))
+	for i := range ranks {
+		pids[i] = ranks[i].pid
+	}
+	return pids
+}
+
+// checkProctableTop checks that the pre-ranked top entries are the top k
+// of the fake /proc in dir, and that victim selection through the table
+// picks the same process as a full scan
+func checkProctableTop(t *testing.T, a *scanArgs, dir string, k int, what string) {
+	t.Helper()
+	want := fakeRanking(t, dir)[:k]
+	have := proctable_top(k)
+	sort.Ints(have)
+	sorted := append([]int(nil), want...)
+	sort.Ints(sorted)
+	if fmt.Sprint(have) != fmt.Sprint(sorted) {
+		t.Errorf("%s: top entries %v, want %v", what, have, sorted)
+	}
+	if pid, _, _ := a.find_largest_process(); pid != want[0] {
+		t.Errorf("%s: picked pid %d, want %d", what, pid, want[0])
+	}
+}
+
+func Test_proctable_synthetic(t *testing.T) {
+	dir := t.TempDir()
+	if err := genProcTree(dir, 300); err != nil {
+		t.Fatal(err)
+	}
+	restore := set_procdir(dir)
+	defer restore()
+	a := new_scan_args("", "")
+	defer a.free()
+	// What a full scan picks, before there is a table
+	if pid, _, _ := a.find_largest_process(); pid != fakeRanking(t, dir)[0] {
+		t.Fatalf("full scan picked pid %d, want %d", pid, fakeRanking(t, dir)[0])
+	}
+
+	// 1024 slots. Consecutive pids never collide, so add processes whose
+	// home slot (like slot_hash()) is that of a pid that exits below, to
+	// get probe chains through the deleted slots.
+	const capacity, slots = 400, 1024
+	home := func(pid int) uint32 { return uint32(pid) * 2654435761 & (slots - 1) }
+	exiting := map[uint32]bool{}
+	for pid := 1000; pid < 1300; pid += 3 {
+		exiting[home(pid)] = true
+	}
+	for pid, added := 5000, 0; added < 30; pid++ {
+		if exiting[home(pid)] {
+			writeFakeProc(t, dir, pid, "nginx", pid, pid%1000, 0, 500)
+			added++
+		}
+	}
+
+	const k = 16
+	defer proctable_init(capacity, k)()
+	// The first pass in batches. The pass ends on the call that finds the
+	// end of the directory.
+	for i := 0; i < 330/50+1; i++ {
+		a.proctable_refresh(50)
+	}
+	if n := proctable_count(); n != 330 {
+		t.Errorf("%d processes in the table, want 330", n)
+	}
+	checkProctableTop(t, a, dir, k, "first pass")
+
+	// Processes exit, among them the top 3 and every third one. The
+	// table drops them at the end of the next pass, and the deletions
+	// must not lose the entries that were probed past them.
+	gone := fakeRanking(t, dir)[:3]
+	for pid := 1000; pid < 1300; pid += 3 {
+		gone = append(gone, pid)
+	}
+	for _, pid := range gone {
+		if err := os.RemoveAll(filepath.Join(dir, fmt.Sprint(pid))); err != nil {
+			t.Fatal(err)
+		}
+	}
+	want := len(fakeRanking(t, dir))
+	a.proctable_refresh(0)
+	if n := proctable_count(); n != want {
+		t.Errorf("%d processes in the table after the exits, want %d", n, want)
+	}
+	if u := proctable_untracked(1024); len(u) != 0 {
+		t.Errorf("processes missing from the table: %v", u)
+	}
+	checkProctableTop(t, a, dir, k, "after the exits")
+
+	// A process from the bottom gets a high oom_score, and new processes
+	// reuse pids of exited ones
+	last := fakeRanking(t, dir)
+	low := last[len(last)-1]
+	if err := os.WriteFile(filepath.Join(dir, fmt.Sprint(low), "oom_score"), []byte("1500\n"), 0644); err != nil {
+		t.Fatal(err)
+	}
+	for i, pid := range gone[:5] {
+		writeFakeProc(t, dir, pid, "python3", pid, 1400+i, 0, 1000)
+	}
+	if u := proctable_untracked(1024); len(u) != 5 {
+		t.Errorf("untracked processes: %v, want the 5 new ones", u)
+	}
+	a.proctable_refresh(0)
+	checkProctableTop(t, a, dir, k, "after the changes")
+	if top := fakeRanking(t, dir)[0]; top != low {
+		t.Errorf("fake ranking: pid %d is first, want %d", top, low)
+	}
+}
+
+// writeFakeProc adds process pid to the fake /proc in dir
+func writeFakeProc(t *testing.T, dir string, pid int, comm string, pgrp int, oomScore int, oomScoreAdj int, rssPages int) {
+	files := map[string]string{
+		"oom_score":     fmt.Sprintf("%d\n", oomScore),
+		"oom_score_adj": fmt.Sprintf("%d\n", oomScoreAdj),
+		"comm":          comm + "\n",
+		"statm":         fmt.Sprintf("%d %d 300 5 0 123 0\n", rssPages*2, rssPages),
+		"stat": fmt.Sprintf("%d (%s) S 1 %d %d 0 -1 4194304 83 0 0 0 10 10 0 0 20 0 1 0 %d %d %d 18446744073709551615 0 0 0 0 0 0 0 0 0 0 0 0 17 0 0 0 0 0 0 0 0 0 0 0 0 0 0\n",
+			pid, comm, pgrp, pgrp, pid, rssPages*2*4096, rssPages),
+		"cgroup": fmt.Sprintf("0::/synthetic.slice/unit%d.service\n", pgrp),
+	}
+	pdir := filepath.Join(dir, fmt.Sprint(pid))
+	if err := os.Mkdir(pdir, 0755); err != nil {
+		t.Fatal(err)
+	}
+	for name, content := range files {
+		if err := os.WriteFile(filepath.Join(pdir, name), []byte(content), 0644); err != nil {
+			t.Fatal(err)
+		}
+	}
+}
+
+// Many small processes with a high oom_score_adj must not outscore one
+// large process just because there are many of them
+func Test_group_find_largest_synthetic(t *testing.T) {
+	dir := t.TempDir()
+	// 64 GiB, no swap
+	meminfo := "MemTotal: 67108864 kB\nMemFree: 1000 kB\nMemAvailable: 33554432 kB\nSwapTotal: 0 kB\nSwapFree: 0 kB\n"
+	if err := os.WriteFile(filepath.Join(dir, "meminfo"), []byte(meminfo), 0644); err != nil {
+		t.Fatal(err)
+	}
+	pageKiB := os.Getpagesize() / 1024
+	// A 20 GiB database: 312 permille of memory
+	writeFakeProc(t, dir, 3000, "postgres", 3000, 874, 0, 20*1024*1024/pageKiB)
+	// 20 renderers of 100 MiB each with oom_score_adj 200: 30 + 200
+	for i := 0; i < 20; i++ {
+		writeFakeProc(t, dir, 2000+i, "renderer", 2000, 800, 200, 100*1024/pageKiB)
+	}
+	restore := set_procdir(dir)
+	defer restore()
+
+	a := new_scan_args("", "")
+	defer a.free()
+	ok, id, members, badness := a.group_find_largest(KILL_UNIT_PGRP)
+	if !ok || id != 3000 || members != 1 || badness != 312 {
+		t.Errorf("picked %d (%d members, badness %d), want the database 3000 (1 member, badness 312)", id, members, badness)
+	}
+	// The renderer unit wins once it is preferred, but only by one +300
+	a = new_scan_args("^renderer$", "")
+	defer a.free()
+	ok, id, members, badness = a.group_find_largest(KILL_UNIT_PGRP)
+	if !ok || id != 2000 || members != 20 || badness != 30+200+300 {
+		t.Errorf("picked %d (%d members, badness %d), want the renderers 2000 (20 members, badness 530)", id, members, badness)
+	}
+}
+
+func Test_kill_emergency_synthetic(t *testing.T) {
+	dir := t.TempDir()
+	if err := genProcTree(dir, 200); err != nil {
+		t.Fatal(err)
+	}
+	want := 0
+	for i := 0; i < 200; i++ {
+		comm, err := os.ReadFile(filepath.Join(dir, fmt.Sprint(1000+i), "comm"))
+		if err != nil {
+			t.Fatal(err)
+		}
+		if c := string(comm); c == "java\n" || c == "postgres\n" {
+			want++
+		}
+	}
+	restore := set_procdir(dir)
+	defer restore()
+	// Duplicates and unknown names must not matter
+	if have := kill_emergency_dryrun("java,postgres,java,nosuchprocess", 100); have != want {
+		t.Errorf("matched %d processes, want %d", have, want)
+	}
+	// Memory is checked before the first kill
+	if have := kill_emergency_dryrun("java,postgres", 0); have != 0 {
+		t.Errorf("killed %d processes with memory above the high watermark", have)
+	}
+}
+
+func benchmarkScan(b *testing.B, n int, prefer, avoid string, uring bool) {
+	restore := set_procdir(procTree(b, n))
+	defer restore()
+	if uring {
+		ok, stop := uring_init()
+		if !ok {
+			b.Skip("io_uring is not available")
+		}
+		defer stop()
+	}
+	a := new_scan_args(prefer, avoid)
+	defer a.free()
+	var candidates int
+	var syscalls uint64
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		_, candidates, syscalls = a.find_largest_process()
+	}
+	if candidates != n {
+		b.Fatalf("looked at %d processes, want %d", candidates, n)
+	}
+	b.ReportMetric(float64(syscalls)/float64(n), "syscalls/pid")
+	b.ReportMetric(float64(b.Elapsed().Nanoseconds())/float64(b.N)/float64(n), "ns/pid")
+}
+
+func Benchmark_scan(b *testing.B) {
+	for _, n := range []int{1000, 10000, 100000} {
+		b.Run(fmt.Sprintf("%dk", n/1000), func(b *testing.B) {
+			benchmarkScan(b, n, "", "", false)
+		})
+		b.Run(fmt.Sprintf("%dk_regex", n/1000), func(b *testing.B) {
+			benchmarkScan(b, n, benchPrefer, benchAvoid, false)
+		})
+		b.Run(fmt.Sprintf("%dk_uring", n/1000), func(b *testing.B) {
+			benchmarkScan(b, n, "", "", true)
+		})
+	}
+}
+
+func Benchmark_parse_meminfo_synthetic(b *testing.B) {
+	restore := set_procdir(procTree(b, 1000))
+	defer restore()
+	for n := 0; n < b.N; n++ {
+		parse_meminfo()
+	}
+}
@@ -1,10 +1,16 @@
 package earlyoom_testsuite
 
 import (
+	"fmt"
+	"math"
 	"os"
+	"os/exec"
+	"path/filepath"
+	"strconv"
 	"strings"
 	"syscall"
 	"testing"
+	"time"
 	"unicode/utf8"
 )
 
@@ -83,6 +89,36 @@ func TestIsAlive(t *testing.T) {
 	}
 }
 
+// The state follows the last ')', the name can contain anything
+func Test_is_alive_synthetic(t *testing.T) {
+	dir := t.TempDir()
+	tcs := []struct {
+		stat string
+		res  bool
+	}{
+		{"100 (sleep) S 1 100 100 0 -1", true},
+		{"101 (a) Z (b) R 1 101 101 0 -1", true},
+		{"102 (x) R) Z 1 102 102 0 -1", false},
+		{"103 (no paren R 1", false},
+	}
+	for i, tc := range tcs {
+		pdir := filepath.Join(dir, fmt.Sprint(100+i))
+		if err := os.Mkdir(pdir, 0755); err != nil {
+			t.Fatal(err)
+		}
+		if err := os.WriteFile(filepath.Join(pdir, "stat"), []byte(tc.stat+"\n"), 0644); err != nil {
+			t.Fatal(err)
+		}
+	}
+	restore := set_procdir(dir)
+	defer restore()
+	for i, tc := range tcs {
+		if res := is_alive(100 + i); res != tc.res {
+			t.Errorf("%q: expected %v, got %v", tc.stat, tc.res, res)
+		}
+	}
+}
+
 func Test_fix_truncated_utf8(t *testing.T) {
 	// From https://gist.github.com/w-vi/67fe49106c62421992a2
 	str := "___😀∮ E⋅da = Q,  n → ∞, 𐍈∑ f(i) = ∏ g(i)"
@@ -146,6 +182,560 @@ func Test_get_comm(t *testing.T) {
 	}
 }
 
+// meminfoKiB reads the value of `key` from /proc/meminfo
+func meminfoKiB(t *testing.T, key string) int64 {
+	buf, err := os.ReadFile("/proc/meminfo")
+	if err != nil {
+		t.Fatal(err)
+	}
+	for _, line := range strings.Split(string(buf), "\n") {
+		fields := strings.Fields(line)
+		if len(fields) >= 2 && fields[0] == key+":" {
+			val, err := strconv.ParseInt(fields[1], 10, 64)
+			if err != nil {
+				t.Fatal(err)
+			}
+			return val
+		}
+	}
+	t.Fatalf("%q not found in /proc/meminfo", key)
+	return 0
+}
+
+func Test_parse_meminfo(t *testing.T) {
+	// The second call uses the offsets learned by the first
+	for i := 0; i < 2; i++ {
+		m := parse_meminfo()
+		if have, want := int64(m.MemTotalKiB), meminfoKiB(t, "MemTotal"); have != want {
+			t.Errorf("MemTotalKiB: want %d, have %d", want, have)
+		}
+		if have, want := int64(m.SwapTotalKiB), meminfoKiB(t, "SwapTotal"); have != want {
+			t.Errorf("SwapTotalKiB: want %d, have %d", want, have)
+		}
+		if m.MemAvailablePercent <= 0 || m.MemAvailablePercent > 100 {
+			t.Errorf("MemAvailablePercent out of range: %v", m.MemAvailablePercent)
+		}
+		// Must not have matched "Active:" or "Inactive:"
+		if m.ActiveFileKiB < 0 || m.InactiveFileKiB < 0 ||
+			int64(m.ActiveFileKiB+m.InactiveFileKiB) > meminfoKiB(t, "MemTotal") {
+			t.Errorf("bad file LRU sizes: active %d, inactive %d", m.ActiveFileKiB, m.InactiveFileKiB)
+		}
+		if m.SReclaimableKiB < 0 || m.ShmemKiB < 0 || m.DirtyKiB < 0 || m.WritebackKiB < 0 {
+			t.Errorf("missing entries: %+v", m)
+		}
+	}
+}
+
+func Test_parse_meminfo_shifted(t *testing.T) {
+	dir := t.TempDir()
+	defer set_procdir(dir)()
+	// No MemAvailable, so it is estimated from MemFree + Buffers + Cached.
+	// The Buffers line shrinks by 20 bytes, which puts the learned offset
+	// of "Cached:" inside "SwapCached:".
+	for _, pad := range []string{strings.Repeat(" ", 20), ""} {
+		content := "MemTotal: 1000000 kB\nMemFree: 1000 kB\nSwapTotal: 0 kB\nSwapFree: 0 kB\nShmem: 0 kB\n" +
+			"Buffers:" + pad + " 0 kB\nCached: 2000 kB\nSwapCached: 500000 kB\n"
+		if err := os.WriteFile(dir+"/meminfo", []byte(content), 0600); err != nil {
+			t.Fatal(err)
+		}
+		if have := parse_meminfo().MemAvailableKiB; have != 3000 {
+			t.Errorf("MemAvailableKiB with %d bytes of padding: want 3000, have %d", len(pad), have)
+		}
+	}
+}
+
+func Test_compswap(t *testing.T) {
+	proc := t.TempDir()
+	defer set_procdir(proc)()
+	sys := t.TempDir()
+	defer set_sysfs_root(sys)()
+	for _, d := range []string{"/block/zram0", "/module/zswap/parameters"} {
+		if err := os.MkdirAll(sys+d, 0755); err != nil {
+			t.Fatal(err)
+		}
+	}
+	write := func(path string, content string) {
+		if err := os.WriteFile(path, []byte(content), 0644); err != nil {
+			t.Fatal(err)
+		}
+	}
+	const GiB = 1024 * 1024
+	// 8 GiB of RAM, 1 GiB available, a 2 GiB disk swap that is unused, and
+	// a 4 GiB zram device that holds swapUsedKiB. The zswap numbers only
+	// count once zswap is enabled.
+	writeMeminfo := func(swapUsedKiB int) {
+		write(proc+"/meminfo", fmt.Sprintf("MemTotal: %d kB\nMemFree: 0 kB\nMemAvailable: %d kB\nBuffers: 0 kB\nCached: 0 kB\n"+
+			"SwapCached: 0 kB\nShmem: 0 kB\nSwapTotal: %d kB\nSwapFree: %d kB\nZswap: 102400 kB\nZswapped: 307200 kB\n",
+			8*GiB, 1*GiB, 6*GiB, 6*GiB-swapUsedKiB))
+	}
+	const diskSwap = "Filename\tType\tSize\tUsed\tPriority\n/dev/sda2 partition\t2097148\t0\t-2\n"
+	write(sys+"/module/zswap/parameters/enabled", "N\n")
+	write(sys+"/module/zswap/parameters/max_pool_percent", "20\n")
+
+	// Only real swap: nothing to do
+	write(proc+"/swaps", diskSwap)
+	writeMeminfo(0)
+	found, restore := compswap_init()
+	restore()
+	if found {
+		t.Errorf("found compressed swap with only %q in /proc/swaps", diskSwap)
+	}
+
+	write(proc+"/swaps", diskSwap+"/dev/zram0 partition\t4194304\t0\t100\n")
+	write(sys+"/block/zram0/mm_stat", "0 0 0 0 0 0 0 0\n")
+	found, restore = compswap_init()
+	if !found {
+		t.Fatal("zram0 not found")
+	}
+	pageKiB := os.Getpagesize() / 1024
+	testCases := []struct {
+		name string
+		// orig_data_size compr_data_size mem_used_total mem_limit, in bytes
+		orig, compr, used, limit int
+		samePages                int
+		wantAvailKiB             int
+	}{
+		// Nothing measured yet, so the default ratio of 2: 4 GiB of room
+		// frees 2 GiB
+		{"empty", 0, 0, 0, 0, 0, 3 * GiB},
+		// 1 GiB in 256 MiB is a ratio of 4, the 3 GiB of room left free
+		// 3/4 of that
+		{"swap only", 1 << 30, 1 << 28, 1 << 28, 0, 0, 1*GiB + 3*GiB*3/4},
+		// 256 MiB more of RAM fits under mem_limit, which holds 1 GiB
+		{"mem_limit", 1 << 30, 1 << 28, 1 << 28, 1 << 29, 0, 1*GiB + 1*GiB*3/4},
+		// 1 GiB of same-filled pages takes up swap slots, 2 GiB of room
+		// are left
+		{"same_pages", 1 << 30, 1 << 28, 1 << 28, 0, GiB / pageKiB, 1*GiB + 2*GiB*3/4},
+	}
+	for _, tc := range testCases {
+		write(sys+"/block/zram0/mm_stat", fmt.Sprintf("%d %d %d %d %d %d 0 0\n",
+			tc.orig, tc.compr, tc.used, tc.limit, tc.used, tc.samePages))
+		writeMeminfo(tc.orig/1024 + tc.samePages*pageKiB)
+		m := parse_meminfo()
+		if int(m.MemAvailableKiB) != tc.wantAvailKiB {
+			t.Errorf("%s: MemAvailableKiB: want %d, have %d", tc.name, tc.wantAvailKiB, m.MemAvailableKiB)
+		}
+		// Only the disk swap is left
+		if m.SwapTotalKiB != 2*GiB || m.SwapFreeKiB != 2*GiB {
+			t.Errorf("%s: want 2 GiB of 2 GiB swap free, have %d of %d", tc.name, m.SwapFreeKiB, m.SwapTotalKiB)
+		}
+	}
+	restore()
+
+	// zswap in front of the swap: 100 MiB of the 20 % pool are used, the
+	// rest holds three times as much at the ratio of 3, and frees 2/3 of it
+	write(proc+"/swaps", diskSwap)
+	write(sys+"/module/zswap/parameters/enabled", "Y\n")
+	writeMeminfo(0)
+	found, restore = compswap_init()
+	defer restore()
+	if !found {
+		t.Fatal("zswap not found")
+	}
+	wantAvailKiB := 1*GiB + (8*GiB*20/100-102400)*3*2/3
+	if m := parse_meminfo(); int(m.MemAvailableKiB) != wantAvailKiB {
+		t.Errorf("zswap: MemAvailableKiB: want %d, have %d", wantAvailKiB, m.MemAvailableKiB)
+	}
+}
+
+func Test_cgroup(t *testing.T) {
+	root := t.TempDir()
+	defer set_cgroup_root(root)()
+	dir := filepath.Join(root, "tenant.slice")
+	if err := os.Mkdir(dir, 0755); err != nil {
+		t.Fatal(err)
+	}
+	const MiB = 1024 * 1024
+	write := func(current, max string, inactiveFileMiB, slabMiB int, present ...string) {
+		files := map[string]string{
+			"memory.current": current + "\n",
+			"memory.max":     max + "\n",
+			"memory.stat": fmt.Sprintf("anon 1000\nactive_file 7340032\ninactive_file %d\nslab_reclaimable %d\nslab_unreclaimable 4096\n",
+				inactiveFileMiB*MiB, slabMiB*MiB),
+			"memory.events": "low 0\nhigh 0\nmax 3\noom 0\noom_kill 0\n",
+		}
+		for name, content := range files {
+			if err := os.WriteFile(filepath.Join(dir, name), []byte(content), 0644); err != nil {
+				t.Fatal(err)
+			}
+		}
+	}
+	defer cgroup_add("tenant.slice:10")()
+
+	// avail = max - current + inactive_file + slab_reclaimable
+	// = 1024 - 1000 + 10 + 5 MiB = 3.8 %, below the default KILL of 5 %
+	write(fmt.Sprint(1000*MiB), fmt.Sprint(1024*MiB), 10, 5)
+	sig, cg := cgroup_check()
+	if sig != int(syscall.SIGKILL) || cg == nil {
+		t.Fatalf("want SIGKILL, have %d %+v", sig, cg)
+	}
+	if cg.path != root+"/tenant.slice" || cg.termPercent != 10 || cg.killPercent != 5 {
+		t.Errorf("parsed spec: %+v", cg)
+	}
+	if cg.availKiB != 39*1024 || cg.maxKiB != 1024*1024 || cg.currentKiB != 1000*1024 {
+		t.Errorf("want 39 MiB of 1024 MiB available, have %+v", cg)
+	}
+	// Only max, oom and oom_kill going up wake the poll loop, high goes up
+	// all the time while the cgroup is above memory.high
+	for _, tc := range []struct {
+		events string
+		want   bool
+	}{
+		{"low 0\nhigh 0\nmax 3\noom 0\noom_kill 0\n", false},
+		{"low 0\nhigh 500\nmax 3\noom 0\noom_kill 0\n", false},
+		{"low 0\nhigh 500\nmax 4\noom 0\noom_kill 0\n", true},
+		{"low 0\nhigh 500\nmax 4\noom 1\noom_kill 1\n", true},
+		{"low 0\nhigh 900\nmax 4\noom 1\noom_kill 1\n", false},
+	} {
+		if err := os.WriteFile(filepath.Join(dir, "memory.events"), []byte(tc.events), 0644); err != nil {
+			t.Fatal(err)
+		}
+		if have := cg.events_changed(); have != tc.want {
+			t.Errorf("memory.events %q: want %v, have %v", tc.events, tc.want, have)
+		}
+	}
+	// 1024 - 1000 + 40 + 0 = 64 MiB = 6.25 %
+	write(fmt.Sprint(1000*MiB), fmt.Sprint(1024*MiB), 40, 0)
+	if sig, cg := cgroup_check(); sig != int(syscall.SIGTERM) || cg == nil || cg.availKiB != 64*1024 {
+		t.Errorf("want SIGTERM with 64 MiB available, have %d %+v", sig, cg)
+	}
+	// Plenty available
+	write(fmt.Sprint(10*MiB), fmt.Sprint(1024*MiB), 900, 0)
+	if sig, cg := cgroup_check(); sig != 0 || cg != nil {
+		t.Errorf("want no signal, have %d %+v", sig, cg)
+	}
+	// Without a limit, there is nothing to check
+	write(fmt.Sprint(2000*MiB), "max", 0, 0)
+	if sig, cg := cgroup_check(); sig != 0 || cg != nil {
+		t.Errorf("memory.max = max: want no signal, have %d %+v", sig, cg)
+	}
+
+	// A cgroup without the memory controller is skipped, and picked up
+	// once the files are there
+	defer cgroup_add(root + "/other.slice:50,40")()
+	other := filepath.Join(root, "other.slice")
+	if err := os.Mkdir(other, 0755); err != nil {
+		t.Fatal(err)
+	}
+	if sig, cg := cgroup_check(); sig != 0 || cg != nil {
+		t.Errorf("missing files: want no signal, have %d %+v", sig, cg)
+	}
+	dir = other
+	write(fmt.Sprint(600*MiB), fmt.Sprint(1024*MiB), 0, 0)
+	if sig, cg := cgroup_check(); sig != int(syscall.SIGTERM) || cg == nil || cg.path != other || cg.killPercent != 40 {
+		t.Errorf("want SIGTERM for %s, have %d %+v", other, sig, cg)
+	}
+}
+
+func Test_status(t *testing.T) {
+	dir := t.TempDir()
+	status_init(dir)
+	readText := func() string {
+		buf, err := os.ReadFile(dir + "/status")
+		if err != nil {
+			t.Fatal(err)
+		}
+		return string(buf)
+	}
+	readShm := func() (uint32, string, float64) {
+		buf, err := os.ReadFile(dir + "/status.shm")
+		if err != nil {
+			t.Fatal(err)
+		}
+		magic, seq, code, memavail := status_shm_decode(buf)
+		if magic != 0x4d4f4f45 {
+			t.Fatalf("wrong magic %#x", magic)
+		}
+		return seq, code, memavail
+	}
+
+	status_update(0, 50)
+	first := readText()
+	if !strings.HasPrefix(first, "ok\n50.00\n") {
+		t.Errorf("unexpected status file contents %q", first)
+	}
+	seq1, code, memavail := readShm()
+	if seq1%2 != 0 || code != "ok" || memavail != 50 {
+		t.Errorf("unexpected status.shm: seq %d code %q memavail %f", seq1, code, memavail)
+	}
+
+	// Same status code: only status.shm changes
+	status_update(0, 40)
+	if text := readText(); text != first {
+		t.Errorf("status file was rewritten without a status change: %q", text)
+	}
+	seq2, _, memavail := readShm()
+	if seq2 != seq1+2 || memavail != 40 {
+		t.Errorf("status.shm not updated: seq %d -> %d, memavail %f", seq1, seq2, memavail)
+	}
+
+	status_update(int(syscall.SIGTERM), 9)
+	if text := readText(); !strings.HasPrefix(text, "term\n9.00\n") {
+		t.Errorf("status file not rewritten on status change: %q", text)
+	}
+	if _, code, _ := readShm(); code != "term" {
+		t.Errorf("status.shm code %q, want term", code)
+	}
+}
+
+func Test_throttle_target_kib(t *testing.T) {
+	tests := []struct{ current, need, want int64 }{
+		{1000, 100, 900},
+		// Never below half of memory.current
+		{1000, 900, 500},
+		{2048, 0, 2048},
+	}
+	for _, tc := range tests {
+		if have := throttle_target_kib(tc.current, tc.need); have != tc.want {
+			t.Errorf("current %d need %d: want %d, have %d", tc.current, tc.need, tc.want, have)
+		}
+	}
+}
+
+func Test_throttle_init(t *testing.T) {
+	root := t.TempDir()
+	defer set_cgroup_root(root)()
+	dir := t.TempDir()
+	state := dir + "/throttle"
+	high := root + "/user.slice/foo.scope/memory.high"
+	if err := os.MkdirAll(filepath.Dir(high), 0755); err != nil {
+		t.Fatal(err)
+	}
+	write := func(path string, content string) {
+		if err := os.WriteFile(path, []byte(content), 0644); err != nil {
+			t.Fatal(err)
+		}
+	}
+	testCases := []struct {
+		name, state, want string
+	}{
+		// A previous run died with foo.scope throttled
+		{"left over", "/user.slice/foo.scope\nmax\n", "max\n"},
+		{"garbage", "max\n", "1048576\n"},
+		// Nothing to do for a cgroup that is gone
+		{"gone", "/user.slice/bar.scope\nmax\n", "1048576\n"},
+	}
+	for _, tc := range testCases {
+		write(high, "1048576\n")
+		write(state, tc.state)
+		throttle_init(dir)
+		if buf, err := os.ReadFile(high); err != nil || string(buf) != tc.want {
+			t.Errorf("%s: memory.high: want %q, have %q (%v)", tc.name, tc.want, buf, err)
+		}
+		if _, err := os.Stat(state); !os.IsNotExist(err) {
+			t.Errorf("%s: %s was not removed: %v", tc.name, state, err)
+		}
+	}
+	// Without a state file, memory.high is left alone
+	throttle_init(dir)
+	if buf, _ := os.ReadFile(high); string(buf) != "1048576\n" {
+		t.Errorf("no state: memory.high changed to %q", buf)
+	}
+}
+
+// A victim selection that does not fit into one trace frame is split into
+// several, and the replay puts it back together
+func Test_trace_candidates(t *testing.T) {
+	path := t.TempDir() + "/trace"
+	var names []string
+	for i := 0; i < 5000; i++ {
+		names = append(names, fmt.Sprintf("process-%d-%s", i, strings.Repeat("x", i%30)))
+	}
+	trace_record(path, names)
+	pids, replayed := trace_replay(path)
+	if len(pids) != len(names) {
+		t.Fatalf("want %d candidates, have %d", len(names), len(pids))
+	}
+	for i := range names {
+		if pids[i] != i+2 || replayed[i] != names[i] {
+			t.Fatalf("candidate %d: want pid %d %q, have %d %q", i, i+2, names[i], pids[i], replayed[i])
+		}
+	}
+}
+
+func Test_metrics(t *testing.T) {
+	path := t.TempDir() + "/earlyoom.prom"
+	metrics_write(path, 0.002)
+	buf, err := os.ReadFile(path)
+	if err != nil {
+		t.Fatal(err)
+	}
+	for _, want := range []string{
+		`earlyoom_signals_total{signal="SIGTERM"} 1`,
+		`earlyoom_signals_total{signal="SIGKILL"} 0`,
+		`earlyoom_escalations_total 1`,
+		`earlyoom_victim_selection_seconds_bucket{le="0.001"} 0`,
+		`earlyoom_victim_selection_seconds_bucket{le="0.003"} 1`,
+		`earlyoom_victim_selection_seconds_bucket{le="+Inf"} 1`,
+		`earlyoom_victim_selection_seconds_count 1`,
+	} {
+		if !strings.Contains(string(buf), want+"\n") {
+			t.Errorf("metrics do not contain %q:\n%s", want, buf)
+		}
+	}
+}
+
+func Test_trend(t *testing.T) {
+	// 1 % of 1 GiB per second = 10485.76 KiB/s, from 50 % down to 46 %
+	ok, rate, eta := trend_feed([]float64{100, 101, 102, 103, 104}, []float64{50, 49, 48, 47, 46}, 5)
+	if !ok {
+		t.Fatal("no trend from 5 samples")
+	}
+	if math.Abs(rate+10485.76) > 0.01 {
+		t.Errorf("rate: want -10485.76 KiB/s, have %v", rate)
+	}
+	if math.Abs(eta-41) > 0.01 {
+		t.Errorf("eta: want 41 s, have %v", eta)
+	}
+	// Not enough samples
+	if ok, _, _ := trend_feed([]float64{1, 2}, []float64{50, 40}, 5); ok {
+		t.Error("got a trend from 2 samples")
+	}
+	// Samples older than the window are ignored
+	if ok, _, _ := trend_feed([]float64{1, 2, 100}, []float64{50, 40, 30}, 5); ok {
+		t.Error("used samples outside of the window")
+	}
+	// Rising memory never reaches the limit
+	if _, _, eta := trend_feed([]float64{1, 2, 3}, []float64{40, 50, 60}, 5); !math.IsInf(eta, 1) {
+		t.Errorf("eta: want +Inf, have %v", eta)
+	}
+}
+
+func Test_vmstat(t *testing.T) {
+	dir := t.TempDir()
+	defer set_procdir(dir)()
+	// The old refault counter name (before Linux 5.9), and a
+	// workingset_refault_anon that must not be taken for it
+	write := func(refault, anon, majfault int) {
+		content := fmt.Sprintf("nr_free_pages 1000\nworkingset_refault_anon %d\nworkingset_refault %d\n"+
+			"pswpin 0\npswpout 0\npgmajfault %d\n", anon, refault, majfault)
+		if err := os.WriteFile(dir+"/vmstat", []byte(content), 0600); err != nil {
+			t.Fatal(err)
+		}
+	}
+	vmstat_add("majfault:100,300")
+	vmstat_add("refault:1000,10000")
+	vmstat_reset()
+
+	steps := []struct {
+		now               float64
+		refault, majfault int
+		sig               int
+		desc              string
+	}{
+		{10, 0, 0, 0, ""},
+		// One interval above the SIGTERM limit is not enough
+		{11, 0, 200, 0, ""},
+		// Less than VMSTAT_INTERVAL since the last sample
+		{11.5, 0, 10000, 0, ""},
+		{12, 0, 400, int(syscall.SIGTERM), "majfault 200/s"},
+		{13, 0, 800, int(syscall.SIGTERM), "majfault 400/s"},
+		{14, 0, 1200, int(syscall.SIGKILL), "majfault 400/s"},
+		// Back to normal
+		{15, 0, 1210, 0, ""},
+		{16, 5000, 1220, 0, ""},
+		{17, 10000, 1230, int(syscall.SIGTERM), "refault 5000/s"},
+	}
+	for _, s := range steps {
+		write(s.refault, 100000*int(s.now), s.majfault)
+		sig, desc := vmstat_check(s.now)
+		if sig != s.sig || desc != s.desc {
+			t.Errorf("t=%v: want %d %q, have %d %q", s.now, s.sig, s.desc, sig, desc)
+		}
+	}
+	// After a kill, we start over
+	vmstat_reset()
+	write(20000, 0, 1300)
+	if sig, _ := vmstat_check(18); sig != 0 {
+		t.Errorf("signal %d right after vmstat_reset()", sig)
+	}
+}
+
+func Test_avoid_users(t *testing.T) {
+	defer avoid_users("")
+	if n := avoid_users("^root$"); n != 1 {
+		t.Fatalf("^root$ matched %d users, want 1", n)
+	}
+	if !user_avoided(0) {
+		t.Error("root is not avoided")
+	}
+	if user_avoided(INT32_MAX) {
+		t.Error("unknown uid is avoided")
+	}
+	if name := user_name(0); name != "root" {
+		t.Errorf("name of uid 0: want root, have %q", name)
+	}
+	if name := user_name(INT32_MAX); name != "" {
+		t.Errorf("name of unknown uid: want \"\", have %q", name)
+	}
+	avoid_users("")
+	if user_avoided(0) {
+		t.Error("root is still avoided after clearing")
+	}
+}
+
+func Test_get_numa_node_kib(t *testing.T) {
+	dir := t.TempDir()
+	pdir := filepath.Join(dir, "1000")
+	if err := os.Mkdir(pdir, 0755); err != nil {
+		t.Fatal(err)
+	}
+	// More than one read() worth of lines, so some are split between reads
+	var maps strings.Builder
+	want := 0
+	for i := 0; i < 500; i++ {
+		fmt.Fprintf(&maps, "7f%010x default file=/usr/lib/x86_64-linux-gnu/libfoo%d.so mapped=%d N0=%d N1=%d kernelpagesize_kB=4\n",
+			i*4096, i, 2*i, i, i+1)
+		want += 4 * (i + 1)
+	}
+	maps.WriteString("7f0000200000 default anon=512 dirty=512 N1=512 kernelpagesize_kB=2048\n")
+	want += 512 * 2048
+	maps.WriteString("7ffd00000000 default stack anon=3 dirty=3 N0=3 kernelpagesize_kB=4\n")
+	if err := os.WriteFile(filepath.Join(pdir, "numa_maps"), []byte(maps.String()), 0644); err != nil {
+		t.Fatal(err)
+	}
+	restore := set_procdir(dir)
+	defer restore()
+	if have := get_numa_node_kib(1000, 1); have != want {
+		t.Errorf("node 1: want %d kiB, have %d", want, have)
+	}
+	if have := get_numa_node_kib(1000, 7); have != 0 {
+		t.Errorf("node 7: want 0 kiB, have %d", have)
+	}
+	if have := get_numa_node_kib(1001, 0); have >= 0 {
+		t.Errorf("nonexistent pid: want an error, have %d", have)
+	}
+}
+
+func Test_procevents(t *testing.T) {
+	if !procevents_init() {
+		t.Skip("proc connector not available (needs CAP_NET_ADMIN)")
+	}
+	cmd := exec.Command("/bin/true")
+	if err := cmd.Run(); err != nil {
+		t.Fatal(err)
+	}
+	pid := cmd.Process.Pid
+	seen := map[int]bool{}
+	for deadline := time.Now().Add(time.Second); time.Now().Before(deadline) && len(seen) < 3; {
+		events, ok := procevents_read()
+		if !ok {
+			t.Fatal("events lost")
+		}
+		for _, ev := range events {
+			if ev.pid == pid {
+				seen[ev.typ] = true
+			}
+		}
+		time.Sleep(10 * time.Millisecond)
+	}
+	for _, typ := range []int{PROCEVENT_FORK, PROCEVENT_EXEC, PROCEVENT_EXIT} {
+		if !seen[typ] {
+			t.Errorf("no event of type %d for pid %d", typ, pid)
+		}
+	}
+}
+
 func Benchmark_parse_meminfo(b *testing.B) {
 	for n := 0; n < b.N; n++ {
 		parse_meminfo()
@@ -0,0 +1,269 @@
+// SPDX-License-Identifier: MIT
+
+/* Soft throttle before SIGTERM (memory_throttle).
+ *
+ * When MemAvailable drops to memory_throttle, we lower memory.high of the
+ * cgroup of the process that would be killed first. The kernel then
+ * reclaims from, and slows down, that workload only, instead of us
+ * throwing away its work. Once MemAvailable is above memory_high again,
+ * the original memory.high is written back. Only one cgroup is throttled
+ * at a time.
+ *
+ * The original memory.high is also saved to a file in the status
+ * directory, so that it is written back by throttle_init() if we were
+ * killed with a cgroup throttled.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cgroup.h"
+#include "globals.h"
+#include "msg.h"
+#include "throttle.h"
+
+// memory.high is never set below this fraction of memory.current, a
+// cgroup squeezed harder than that mostly stalls
+#define THROTTLE_MIN_FRACTION 2
+
+// The throttled cgroup, -1 = none
+static int throttled_dirfd = -1;
+static char throttled_path[PATH_LEN];
+// memory.high as it was before, like "max\n"
+static char saved_high[64];
+// Nothing was written, so nothing to restore
+static bool throttled_dryrun;
+// throttle_start() was called since the last throttle_restore(). We do not
+// retry on every tick if there was nothing to throttle.
+static bool attempted;
+// Where the throttled cgroup and saved_high are kept, "" = nowhere
+static char state_path[PATH_LEN];
+
+/* Save the throttled cgroup and its memory.high to state_path, as two
+ * lines. Written to a temporary file first, so a crash never leaves half
+ * of it. Returns 0 or -errno.
+ */
+static int state_save(const char* cgroup, const char* high)
+{
+    char tmp[PATH_LEN + 4];
+    char buf[PATH_LEN + sizeof(saved_high)];
+
+    if (state_path[0] == 0) {
+        return 0;
+    }
+    snprintf(tmp, sizeof(tmp), "%s.tmp", state_path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return -errno;
+    }
+    // saved_high has its trailing newline
+    int len = snprintf(buf, sizeof(buf), "%s\n%s", cgroup, high);
+    ssize_t res = write(fd, buf, (size_t)len);
+    int write_errno = errno;
+    close(fd);
+    if (res != len) {
+        unlink(tmp);
+        return res < 0 ? -write_errno : -EIO;
+    }
+    if (rename(tmp, state_path) != 0) {
+        write_errno = errno;
+        unlink(tmp);
+        return -write_errno;
+    }
+    return 0;
+}
+
+static void state_remove(void)
+{
+    if (state_path[0] != 0 && unlink(state_path) != 0 && errno != ENOENT) {
+        warn("throttle: could not remove %s: %s\n", state_path, strerror(errno));
+    }
+}
+
+/*
+ * Keep the throttle state in `dir`, and write back the memory.high that a
+ * previous earlyoom saved there, if it did not get to restore it itself.
+ */
+void throttle_init(const char* dir)
+{
+    char buf[PATH_LEN + sizeof(saved_high)];
+
+    snprintf(state_path, sizeof(state_path), "%s/%s", dir, THROTTLE_STATE_NAME);
+    ssize_t len = read_file_at(NULL, AT_FDCWD, state_path, buf, sizeof(buf));
+    if (len == -ENOENT) {
+        return;
+    }
+    if (len < 0) {
+        warn("throttle: could not read %s: %s\n", state_path, strerror((int)-len));
+        return;
+    }
+    // "/user.slice/foo.scope\nmax\n"
+    char* high = strchr(buf, '\n');
+    if (buf[0] != '/' || high == NULL || high[1] == 0) {
+        warn("throttle: could not parse %s: '%s'\n", state_path, buf);
+        state_remove();
+        return;
+    }
+    *high++ = 0;
+    char path[2 * PATH_LEN];
+    snprintf(path, sizeof(path), "%s%s/memory.high", cgroup_root_path, buf);
+    int res = write_file_at(AT_FDCWD, path, high);
+    if (res == -ENOENT || res == -ENODEV) {
+        debug("throttle: cgroup %s is gone\n", buf);
+    } else if (res < 0) {
+        warn("throttle: could not restore memory.high of cgroup %s: %s\n", buf, strerror(-res));
+    } else {
+        warn("restored memory.high of cgroup %s, left over from the last run\n", buf);
+    }
+    state_remove();
+}
+
+/*
+ * The memory.high to set on a cgroup using `current_kib`, to free
+ * `need_kib`: what it uses minus what we need, but at least
+ * 1/THROTTLE_MIN_FRACTION of what it uses.
+ */
+long long throttle_target_kib(long long current_kib, long long need_kib)
+{
+    long long floor_kib = current_kib / THROTTLE_MIN_FRACTION;
+    long long target = current_kib - need_kib;
+    return target > floor_kib ? target : floor_kib;
+}
+
+bool throttle_active(void)
+{
+    return throttled_dirfd >= 0;
+}
+
+/*
+ * Path of the throttled cgroup, relative to the cgroup root, or "" if
+ * none.
+ */
+const char* throttle_cgroup(void)
+{
+    return throttle_active() ? throttled_path : "";
+}
+
+/*
+ * Lower memory.high of the cgroup of the top victim candidate, by as much
+ * as is needed to get back to mem_high_percent. Returns false if nothing
+ * was throttled: no candidate, or it is in the root cgroup or in ours.
+ * Only tries once until the next throttle_restore().
+ */
+bool throttle_start(const poll_loop_args_t* args, const meminfo_t* m)
+{
+    if (attempted) {
+        return throttle_active();
+    }
+    attempted = true;
+    struct procinfo victim = find_largest_process(args, NULL);
+    if (victim.pid == 0) {
+        return false;
+    }
+    procscan_t scan;
+    struct procinfo self = { .pid = getpid() };
+    procscan_begin(&scan);
+    int dirfd = procinfo_open(&scan, victim.pid);
+    if (dirfd < 0) {
+        return false;
+    }
+    int res = procinfo_read(&scan, dirfd, &victim, PROC_CGROUP);
+    procinfo_close(&scan, dirfd);
+    if (res < 0) {
+        debug("throttle: could not read the cgroup of pid %d: %s\n", victim.pid, strerror(-res));
+        return false;
+    }
+    dirfd = procinfo_open(&scan, self.pid);
+    if (dirfd >= 0) {
+        procinfo_read(&scan, dirfd, &self, PROC_CGROUP);
+        procinfo_close(&scan, dirfd);
+    }
+    // The root cgroup has no memory.high, and we do not slow ourselves down
+    if (!strcmp(victim.cgroup, "/") || !strcmp(victim.cgroup, self.cgroup)) {
+        debug("throttle: pid %d \"%s\" is in cgroup %s, not throttling\n", victim.pid, victim.name, victim.cgroup);
+        return false;
+    }
+
+    char path[2 * PATH_LEN];
+    snprintf(path, sizeof(path), "%s%s", cgroup_root_path, victim.cgroup);
+    int cgfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (cgfd < 0) {
+        warn("throttle: could not open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    char current[64];
+    ssize_t len = read_file_at(NULL, cgfd, "memory.current", current, sizeof(current));
+    if (len >= 0) {
+        len = read_file_at(NULL, cgfd, "memory.high", saved_high, sizeof(saved_high));
+    }
+    if (len < 0) {
+        warn("throttle: could not read memory.current and memory.high of %s: %s\n", path, strerror((int)-len));
+        close(cgfd);
+        return false;
+    }
+    long long current_kib = strtoll(current, NULL, 10) / 1024;
+    long long need_kib = (long long)((args->mem_high_percent - m->MemAvailablePercent) / 100 * (double)m->MemTotalKiB);
+    long long high_kib = throttle_target_kib(current_kib, need_kib);
+    // Already lower than that
+    if (strncmp(saved_high, "max", 3) != 0 && strtoll(saved_high, NULL, 10) / 1024 <= high_kib) {
+        debug("throttle: memory.high of %s is already %s", path, saved_high);
+        close(cgfd);
+        return false;
+    }
+
+    warn("throttling cgroup %s of pid %d \"%s\": memory.high %lld MiB (current %lld MiB)%s\n",
+        victim.cgroup, victim.pid, victim.name, high_kib / 1024, current_kib / 1024,
+        args->dryrun ? ", dry run" : "");
+    if (!args->dryrun) {
+        // Before we touch memory.high, so that it is never lost
+        res = state_save(victim.cgroup, saved_high);
+        if (res < 0) {
+            warn("throttle: could not save memory.high of %s to %s: %s, not throttling\n", path, state_path, strerror(-res));
+            close(cgfd);
+            return false;
+        }
+        char value[32];
+        snprintf(value, sizeof(value), "%lld\n", high_kib * 1024);
+        res = write_file_at(cgfd, "memory.high", value);
+        if (res < 0) {
+            warn("throttle: could not write memory.high of %s: %s\n", path, strerror(-res));
+            state_remove();
+            close(cgfd);
+            return false;
+        }
+    }
+    throttled_dirfd = cgfd;
+    throttled_dryrun = args->dryrun;
+    snprintf(throttled_path, sizeof(throttled_path), "%s", victim.cgroup);
+    return true;
+}
+
+/*
+ * Write back the memory.high of the throttled cgroup, if there is one.
+ * The cgroup may be gone by now, which is fine.
+ */
+void throttle_restore(void)
+{
+    attempted = false;
+    if (!throttle_active()) {
+        return;
+    }
+    // saved_high has its trailing newline, memory.high takes it
+    int res = throttled_dryrun ? 0 : write_file_at(throttled_dirfd, "memory.high", saved_high);
+    if (res == -ENOENT || res == -ENODEV) {
+        debug("throttle: cgroup %s is gone\n", throttled_path);
+    } else if (res < 0) {
+        warn("throttle: could not restore memory.high of cgroup %s: %s\n", throttled_path, strerror(-res));
+    } else {
+        warn("restored memory.high of cgroup %s\n", throttled_path);
+    }
+    if (!throttled_dryrun) {
+        state_remove();
+    }
+    close(throttled_dirfd);
+    throttled_dirfd = -1;
+}
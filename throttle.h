@@ -0,0 +1,21 @@
+/* SPDX-License-Identifier: MIT */
+#ifndef THROTTLE_H
+#define THROTTLE_H
+
+#include <stdbool.h>
+
+#include "kill.h"
+#include "meminfo.h"
+
+// In the status directory: the throttled cgroup and its memory.high from
+// before, while one is throttled
+#define THROTTLE_STATE_NAME "throttle"
+
+void throttle_init(const char* dir);
+bool throttle_start(const poll_loop_args_t* args, const meminfo_t* m);
+void throttle_restore(void);
+bool throttle_active(void);
+const char* throttle_cgroup(void);
+long long throttle_target_kib(long long current_kib, long long need_kib);
+
+#endif
@@ -0,0 +1,590 @@
+// SPDX-License-Identifier: MIT
+
+/* Record memory samples and victim candidates to a trace file (--record),
+ * and feed them back through the unchanged poll loop and victim selection
+ * (--replay), to try out a configuration against a real incident.
+ *
+ * A trace is a stream of frames. Each frame starts with a type byte and
+ * the milliseconds since the previous frame. All numbers are LEB128
+ * varints, signed ones zigzag-encoded, and most are deltas to the
+ * previous value of the same kind, so a typical 'M' frame is 15 bytes:
+ *
+ *   'H' "EOOM" version unixtime   start of a recording, resets all deltas
+ *   'M' 10 meminfo values in KiB  deltas to the previous 'M' frame
+ *   'C' count candidates...       processes one victim selection looked
+ *                                 at, pid as delta to the previous one
+ *   'A' count candidates...       more of them, like 'C' (version 2)
+ *   'K' signal pid                a signal that was sent to a process
+ *
+ * Each frame goes out in one write(), so a trace can be read while it
+ * is being written, and a file can hold several recordings. The frames
+ * are put together in fixed buffers, so recording allocates nothing: a
+ * victim selection that looked at more than fits into one 'C' frame
+ * continues in 'A' frames.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "globals.h"
+#include "kill.h"
+#include "meminfo.h"
+#include "msg.h"
+#include "trace.h"
+
+#define TRACE_MAGIC "EOOM"
+// Number of values in a 'M' frame
+#define TRACE_MEM_VALUES 10
+// Sanity limit for the candidates of one victim selection
+#define TRACE_CANDIDATES_MAX (1 << 22)
+// Candidate bytes per 'C' or 'A' frame
+#define TRACE_CHUNK_LEN 65536
+// Longest encoded candidate: 10 varints and the name
+#define TRACE_CANDIDATE_LEN (10 * 10 + 10 + PATH_LEN)
+// Type, time and count
+#define TRACE_FRAME_HEADER_LEN 32
+
+typedef struct {
+    unsigned char* p;
+    size_t len;
+    size_t cap;
+    // Did not fit, contents are incomplete
+    bool failed;
+} tbuf_t;
+
+static void put_bytes(tbuf_t* b, const void* data, size_t len)
+{
+    if (b->len + len > b->cap) {
+        b->failed = true;
+        return;
+    }
+    memcpy(b->p + b->len, data, len);
+    b->len += len;
+}
+
+static void put_uvarint(tbuf_t* b, uint64_t v)
+{
+    unsigned char tmp[10];
+    size_t n = 0;
+    while (v >= 0x80) {
+        tmp[n++] = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    tmp[n++] = (unsigned char)v;
+    put_bytes(b, tmp, n);
+}
+
+static void put_svarint(tbuf_t* b, int64_t v)
+{
+    put_uvarint(b, ((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+}
+
+// The values of a 'M' frame, in this order
+static void mem_values(const meminfo_t* m, long long* v)
+{
+    v[0] = m->MemTotalKiB;
+    v[1] = m->MemAvailableKiB;
+    v[2] = m->SwapTotalKiB;
+    v[3] = m->SwapFreeKiB;
+    v[4] = m->ActiveFileKiB;
+    v[5] = m->InactiveFileKiB;
+    v[6] = m->SReclaimableKiB;
+    v[7] = m->ShmemKiB;
+    v[8] = m->DirtyKiB;
+    v[9] = m->WritebackKiB;
+}
+
+static meminfo_t mem_from_values(const long long* v)
+{
+    meminfo_t m = {
+        .MemTotalKiB = v[0],
+        .SwapTotalKiB = v[2],
+        .ActiveFileKiB = v[4],
+        .InactiveFileKiB = v[5],
+        .SReclaimableKiB = v[6],
+        .ShmemKiB = v[7],
+        .DirtyKiB = v[8],
+        .WritebackKiB = v[9],
+    };
+    meminfo_derive(&m, v[1], v[3]);
+    return m;
+}
+
+/* Recording */
+
+static int rec_fd = -1;
+static uint64_t rec_last_ms;
+static long long rec_mem[TRACE_MEM_VALUES];
+static unsigned char rec_frame_buf[TRACE_FRAME_HEADER_LEN + TRACE_CHUNK_LEN];
+static tbuf_t rec_frame = { .p = rec_frame_buf, .cap = sizeof(rec_frame_buf) };
+// Candidates of the victim selection in progress, since the last frame
+static unsigned char rec_cands_buf[TRACE_CHUNK_LEN];
+static tbuf_t rec_cands = { .p = rec_cands_buf, .cap = sizeof(rec_cands_buf) };
+static bool rec_collecting;
+// Candidates in rec_cands, and frames written for this selection
+static int rec_count;
+static int rec_frames;
+static int rec_last_pid;
+
+static void rec_stop(const char* why)
+{
+    warn("trace: %s, stopping the recording\n", why);
+    close(rec_fd);
+    rec_fd = -1;
+    rec_collecting = false;
+}
+
+static void frame_begin(unsigned char type)
+{
+    uint64_t t = (uint64_t)(monotonic_secs() * 1000);
+    rec_frame.len = 0;
+    put_bytes(&rec_frame, &type, 1);
+    put_uvarint(&rec_frame, t - rec_last_ms);
+    rec_last_ms = t;
+}
+
+static void frame_write(void)
+{
+    if (rec_frame.failed) {
+        rec_stop("frame too large");
+        return;
+    }
+    size_t off = 0;
+    while (off < rec_frame.len) {
+        ssize_t n = write(rec_fd, rec_frame.p + off, rec_frame.len - off);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            rec_stop(strerror(errno));
+            return;
+        }
+        off += (size_t)n;
+    }
+}
+
+/* Append a new recording to the trace file `path`. Call before
+ * mlockall(), the buffers are faulted in here.
+ */
+void trace_record_open(const char* path)
+{
+    rec_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (rec_fd < 0) {
+        fatal(17, "could not open trace file %s: %s\n", path, strerror(errno));
+    }
+    memset(rec_frame_buf, 0, sizeof(rec_frame_buf));
+    memset(rec_cands_buf, 0, sizeof(rec_cands_buf));
+    rec_last_ms = (uint64_t)(monotonic_secs() * 1000);
+    frame_begin('H');
+    put_bytes(&rec_frame, TRACE_MAGIC, 4);
+    put_uvarint(&rec_frame, TRACE_VERSION);
+    put_uvarint(&rec_frame, (uint64_t)time(NULL));
+    frame_write();
+}
+
+void trace_meminfo(const meminfo_t* m)
+{
+    if (rec_fd < 0) {
+        return;
+    }
+    long long v[TRACE_MEM_VALUES];
+    mem_values(m, v);
+    frame_begin('M');
+    for (int i = 0; i < TRACE_MEM_VALUES; i++) {
+        put_svarint(&rec_frame, v[i] - rec_mem[i]);
+        rec_mem[i] = v[i];
+    }
+    frame_write();
+}
+
+/* Start collecting the candidates of a victim selection. The caller
+ * passes every candidate with TRACE_PROC_FIELDS filled in to
+ * trace_candidate() while trace_collecting() is true.
+ */
+void trace_candidates_begin(void)
+{
+    if (rec_fd < 0) {
+        return;
+    }
+    rec_collecting = true;
+    rec_cands.len = 0;
+    rec_count = 0;
+    rec_frames = 0;
+    rec_last_pid = 0;
+}
+
+bool trace_collecting(void)
+{
+    return rec_collecting;
+}
+
+/* Write the candidates collected so far, as 'C' frame for the first of
+ * a victim selection and 'A' frame for the others
+ */
+static void cands_flush(void)
+{
+    frame_begin(rec_frames == 0 ? 'C' : 'A');
+    put_uvarint(&rec_frame, (uint64_t)rec_count);
+    put_bytes(&rec_frame, rec_cands.p, rec_cands.len);
+    frame_write();
+    rec_frames++;
+    rec_cands.len = 0;
+    rec_count = 0;
+    // Each frame starts over, so it can be decoded on its own
+    rec_last_pid = 0;
+}
+
+void trace_candidate(const struct procinfo* p)
+{
+    size_t name_len = strlen(p->name);
+
+    if (rec_cands.len + TRACE_CANDIDATE_LEN > rec_cands.cap) {
+        cands_flush();
+        if (rec_fd < 0) {
+            return;
+        }
+    }
+
+    put_svarint(&rec_cands, p->pid - rec_last_pid);
+    rec_last_pid = p->pid;
+    put_svarint(&rec_cands, p->badness);
+    put_svarint(&rec_cands, p->oom_score_adj);
+    put_svarint(&rec_cands, p->VmRSSkiB);
+    put_svarint(&rec_cands, p->uid);
+    put_uvarint(&rec_cands, p->utime);
+    put_uvarint(&rec_cands, p->stime);
+    put_uvarint(&rec_cands, p->rtime);
+    put_uvarint(&rec_cands, p->starttime);
+    put_uvarint(&rec_cands, name_len);
+    put_bytes(&rec_cands, p->name, name_len);
+    rec_count++;
+}
+
+void trace_candidates_end(void)
+{
+    if (!rec_collecting) {
+        return;
+    }
+    rec_collecting = false;
+    // Also with no candidates, so the replay sees the victim selection
+    if (rec_count > 0 || rec_frames == 0) {
+        cands_flush();
+    }
+}
+
+void trace_signal(int sig, int pid)
+{
+    if (rec_fd < 0) {
+        return;
+    }
+    frame_begin('K');
+    put_uvarint(&rec_frame, (uint64_t)sig);
+    put_svarint(&rec_frame, pid);
+    frame_write();
+}
+
+/* Replay */
+
+static FILE* rp;
+static const char* rp_path;
+static bool rp_end;
+// Virtual time of the last frame we read, and of the last sample we returned
+static uint64_t rp_clock_ms;
+static double rp_now;
+static long long rp_mem[TRACE_MEM_VALUES];
+// The next sample
+static bool rp_pending;
+static meminfo_t rp_pending_m;
+static uint64_t rp_pending_ms;
+// Candidates of the last recorded victim selection
+static struct procinfo* rp_cands;
+static int rp_ncands;
+static int rp_cap;
+// Signal recorded after the current sample, 0 if none
+static int rp_kill_sig;
+static int rp_kill_pid;
+static int rp_samples, rp_signals, rp_recorded_signals, rp_same;
+
+static bool get_uvarint(uint64_t* out)
+{
+    uint64_t v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int c = getc(rp);
+        if (c == EOF) {
+            return false;
+        }
+        v |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            *out = v;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool get_svarint(int64_t* out)
+{
+    uint64_t u;
+    if (!get_uvarint(&u)) {
+        return false;
+    }
+    *out = (int64_t)(u >> 1) ^ -(int64_t)(u & 1);
+    return true;
+}
+
+static bool read_header(void)
+{
+    char magic[4];
+    uint64_t version, unixtime;
+    if (fread(magic, 1, 4, rp) != 4 || !get_uvarint(&version) || !get_uvarint(&unixtime)) {
+        return false;
+    }
+    if (memcmp(magic, TRACE_MAGIC, 4) != 0) {
+        fatal(17, "%s is not an earlyoom trace\n", rp_path);
+    }
+    // Version 1 is version 2 without 'A' frames
+    if (version < 1 || version > TRACE_VERSION) {
+        fatal(17, "%s: unsupported trace version %llu\n", rp_path, (unsigned long long)version);
+    }
+    time_t t = (time_t)unixtime;
+    debug("trace: recording started %s", ctime(&t));
+    memset(rp_mem, 0, sizeof(rp_mem));
+    return true;
+}
+
+static bool read_meminfo(void)
+{
+    for (int i = 0; i < TRACE_MEM_VALUES; i++) {
+        int64_t d;
+        if (!get_svarint(&d)) {
+            return false;
+        }
+        rp_mem[i] += d;
+    }
+    rp_pending_m = mem_from_values(rp_mem);
+    rp_pending_ms = rp_clock_ms;
+    rp_pending = true;
+    return true;
+}
+
+/* Read the candidates of a 'C' frame, or of an 'A' frame, which are
+ * `append`ed to the ones before.
+ */
+static bool read_candidates(bool append)
+{
+    uint64_t count;
+    int first = append ? rp_ncands : 0;
+    if (!get_uvarint(&count) || count > (uint64_t)(TRACE_CANDIDATES_MAX - first)) {
+        return false;
+    }
+    int total = first + (int)count;
+    if (total > rp_cap) {
+        struct procinfo* p = realloc(rp_cands, (size_t)total * sizeof(*p));
+        if (p == NULL) {
+            fatal(17, "trace: out of memory for %d candidates\n", total);
+        }
+        rp_cands = p;
+        rp_cap = total;
+    }
+    rp_ncands = first;
+    int pid = 0;
+    for (int i = first; i < total; i++) {
+        struct procinfo* p = &rp_cands[i];
+        int64_t s[5];
+        uint64_t u[5];
+        for (int j = 0; j < 5; j++) {
+            if (!get_svarint(&s[j])) {
+                return false;
+            }
+        }
+        for (int j = 0; j < 5; j++) {
+            if (!get_uvarint(&u[j])) {
+                return false;
+            }
+        }
+        pid += (int)s[0];
+        *p = (struct procinfo) {
+            .pid = pid,
+            .badness = (int)s[1],
+            .oom_score_adj = (int)s[2],
+            .VmRSSkiB = s[3],
+            .uid = (int)s[4],
+            .utime = (unsigned long)u[0],
+            .stime = (unsigned long)u[1],
+            .rtime = (unsigned long)u[2],
+            .starttime = u[3],
+            .fields = TRACE_PROC_FIELDS,
+        };
+        // u[4] is the length of the name
+        if (u[4] >= sizeof(p->name) || fread(p->name, 1, u[4], rp) != u[4]) {
+            return false;
+        }
+        p->name[u[4]] = 0;
+        rp_ncands++;
+    }
+    return true;
+}
+
+static bool read_signal(void)
+{
+    uint64_t sig;
+    int64_t pid;
+    if (!get_uvarint(&sig) || !get_svarint(&pid)) {
+        return false;
+    }
+    rp_kill_sig = (int)sig;
+    rp_kill_pid = (int)pid;
+    rp_recorded_signals++;
+    return true;
+}
+
+/* Read one frame. Returns false at the end of the trace. */
+static bool read_frame(void)
+{
+    if (rp_end) {
+        return false;
+    }
+    int type = getc(rp);
+    if (type == EOF) {
+        rp_end = true;
+        return false;
+    }
+    uint64_t dt;
+    bool ok = get_uvarint(&dt);
+    rp_clock_ms += dt;
+    if (ok) {
+        switch (type) {
+        case 'H':
+            ok = read_header();
+            break;
+        case 'M':
+            ok = read_meminfo();
+            break;
+        case 'C':
+            ok = read_candidates(false);
+            break;
+        case 'A':
+            ok = read_candidates(true);
+            break;
+        case 'K':
+            ok = read_signal();
+            break;
+        default:
+            warn("trace: unknown frame type 0x%02x in %s\n", type, rp_path);
+            rp_end = true;
+            return false;
+        }
+    }
+    if (!ok) {
+        warn("trace: %s ends with a truncated frame\n", rp_path);
+        rp_end = true;
+    }
+    return ok;
+}
+
+/* Read the trace file `path` instead of /proc/meminfo, and the recorded
+ * candidates instead of /proc/[pid]. Returns the first sample, which is
+ * also what the next trace_next_meminfo() returns.
+ */
+meminfo_t trace_replay_open(const char* path)
+{
+    rp_path = path;
+    rp = fopen(path, "re");
+    if (rp == NULL) {
+        fatal(17, "could not open trace file %s: %s\n", path, strerror(errno));
+    }
+    int c = getc(rp);
+    if (c != 'H') {
+        fatal(17, "%s is not an earlyoom trace\n", path);
+    }
+    ungetc(c, rp);
+    while (!rp_pending && read_frame()) {
+    }
+    if (!rp_pending) {
+        fatal(17, "%s does not contain any samples\n", path);
+    }
+    return rp_pending_m;
+}
+
+bool trace_replaying(void)
+{
+    return rp != NULL;
+}
+
+/* Return the next recorded sample. Also loads what was recorded after it,
+ * up to the following sample. Exits at the end of the trace.
+ */
+meminfo_t trace_next_meminfo(void)
+{
+    if (!rp_pending) {
+        fprintf(stderr, "replay: end of trace after %d samples (%.1f seconds): sent %d signals, "
+                        "%d in the recording, %d of them the same\n",
+            rp_samples, rp_now, rp_signals, rp_recorded_signals, rp_same);
+        exit(0);
+    }
+    meminfo_t m = rp_pending_m;
+    rp_now = (double)rp_pending_ms / 1000;
+    rp_pending = false;
+    rp_samples++;
+    rp_kill_sig = 0;
+    rp_kill_pid = 0;
+    while (!rp_pending && read_frame()) {
+    }
+    return m;
+}
+
+/* Virtual time in seconds since the start of the trace */
+double trace_now(void)
+{
+    return rp_now;
+}
+
+const struct procinfo* trace_replay_candidates(int* count)
+{
+    *count = rp_ncands;
+    return rp_cands;
+}
+
+/* Compare `sig` to `pid`, which the replay would send now, to what
+ * the recording did.
+ */
+void trace_replay_signal(int sig, int pid)
+{
+    rp_signals++;
+    if (rp_kill_sig == 0) {
+        warn("replay: the recording sent no signal here\n");
+    } else if (rp_kill_pid == pid && rp_kill_sig == sig) {
+        warn("replay: the recording did the same\n");
+        rp_same++;
+    } else {
+        warn("replay: the recording sent signal %d to process %d\n", rp_kill_sig, rp_kill_pid);
+    }
+}
+
+/* Stop recording and replaying. Only used by the testsuite.
+ */
+void trace_exit(void)
+{
+    if (rec_fd >= 0) {
+        close(rec_fd);
+        rec_fd = -1;
+    }
+    rec_collecting = false;
+    if (rp != NULL) {
+        fclose(rp);
+        rp = NULL;
+    }
+    free(rp_cands);
+    rp_cands = NULL;
+    rp_ncands = rp_cap = 0;
+    rp_end = rp_pending = false;
+    rp_clock_ms = 0;
+    rp_samples = rp_signals = rp_recorded_signals = rp_same = 0;
+}
@@ -0,0 +1,29 @@
+/* SPDX-License-Identifier: MIT */
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+
+#include "meminfo.h"
+
+#define TRACE_VERSION 2
+// PROC_* fields recorded for each candidate
+#define TRACE_PROC_FIELDS (PROC_OOM_SCORE | PROC_OOM_SCORE_ADJ | PROC_COMM | PROC_UID | PROC_RSS | PROC_TIMES)
+
+void trace_record_open(const char* path);
+void trace_meminfo(const meminfo_t* m);
+void trace_candidates_begin(void);
+bool trace_collecting(void);
+void trace_candidate(const struct procinfo* p);
+void trace_candidates_end(void);
+void trace_signal(int sig, int pid);
+
+meminfo_t trace_replay_open(const char* path);
+bool trace_replaying(void);
+meminfo_t trace_next_meminfo(void);
+double trace_now(void);
+const struct procinfo* trace_replay_candidates(int* count);
+void trace_replay_signal(int sig, int pid);
+void trace_exit(void);
+
+#endif
@@ -0,0 +1,119 @@
+// SPDX-License-Identifier: MIT
+
+/* Measure how fast available memory and free swap are going down.
+ *
+ * We keep the last TREND_SAMPLES meminfo_t samples with their timestamps
+ * and fit a straight line through the ones from the last TREND_WINDOW
+ * seconds (least squares). The slope tells us how long we can sleep, and
+ * how soon we will hit the SIGKILL limits if nothing changes.
+ */
+
+#include <math.h>
+
+#include "globals.h"
+#include "meminfo.h"
+#include "msg.h"
+#include "trend.h"
+
+typedef struct {
+    double t; // seconds, monotonic
+    double mem_kib;
+    double swap_kib;
+} sample_t;
+
+static sample_t ring[TREND_SAMPLES];
+// Index of the next sample to write
+static int head;
+static int nsamples;
+
+static double mem_avail_kib(const meminfo_t* m)
+{
+    return m->MemAvailablePercent * (double)m->MemTotalKiB / 100;
+}
+
+static double swap_free_kib(const meminfo_t* m)
+{
+    return m->SwapFreePercent * (double)m->SwapTotalKiB / 100;
+}
+
+// Add a sample taken at `now` (seconds, monotonic)
+void trend_add(const meminfo_t* m, double now)
+{
+    ring[head] = (sample_t) {
+        .t = now,
+        .mem_kib = mem_avail_kib(m),
+        .swap_kib = swap_free_kib(m),
+    };
+    head = (head + 1) % TREND_SAMPLES;
+    if (nsamples < TREND_SAMPLES) {
+        nsamples++;
+    }
+}
+
+/* Forget all samples. Called after a kill, as the samples from before
+ * do not tell us anything about what happens next.
+ */
+void trend_reset(void)
+{
+    head = 0;
+    nsamples = 0;
+}
+
+/* Compute the slopes over the samples of the last TREND_WINDOW seconds.
+ * Returns false if there are fewer than three of them.
+ */
+bool trend_get(double now, trend_t* out)
+{
+    // Sums for the least-squares fit. Times are taken relative to `now`
+    // to keep the numbers small.
+    double st = 0, stt = 0, sm = 0, stm = 0, ss = 0, sts = 0;
+    int n = 0;
+
+    for (int i = 0; i < nsamples; i++) {
+        const sample_t* s = &ring[(head - 1 - i + TREND_SAMPLES) % TREND_SAMPLES];
+        double t = s->t - now;
+        if (t < -TREND_WINDOW) {
+            // Older samples are only older
+            break;
+        }
+        st += t;
+        stt += t * t;
+        sm += s->mem_kib;
+        stm += t * s->mem_kib;
+        ss += s->swap_kib;
+        sts += t * s->swap_kib;
+        n++;
+    }
+    double denom = n * stt - st * st;
+    if (n < 3 || (denom > -1e-9 && denom < 1e-9)) {
+        return false;
+    }
+    out->mem_rate = (n * stm - st * sm) / denom;
+    out->swap_rate = (n * sts - st * ss) / denom;
+    return true;
+}
+
+/* Seconds until available memory and free swap both reach the given
+ * percentages if the trend continues. Returns INFINITY if that does not
+ * happen, and 0 if they are already there.
+ */
+double trend_eta(const trend_t* t, const meminfo_t* m, double mem_percent, double swap_percent)
+{
+    double etas[2] = { 0, 0 };
+    double have[2] = { mem_avail_kib(m), swap_free_kib(m) };
+    double limit[2] = { mem_percent * (double)m->MemTotalKiB / 100, swap_percent * (double)m->SwapTotalKiB / 100 };
+    double rate[2] = { t->mem_rate, t->swap_rate };
+
+    for (int i = 0; i < 2; i++) {
+        // Also covers "no swap at all"
+        if (have[i] <= limit[i]) {
+            etas[i] = 0;
+        } else if (rate[i] >= 0) {
+            etas[i] = INFINITY;
+        } else {
+            etas[i] = (have[i] - limit[i]) / -rate[i];
+        }
+    }
+    // earlyoom only acts when both are below their limit
+    return etas[0] > etas[1] ? etas[0] : etas[1];
+}
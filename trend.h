@@ -0,0 +1,25 @@
+/* SPDX-License-Identifier: MIT */
+#ifndef TREND_H
+#define TREND_H
+
+#include <stdbool.h>
+
+#include "meminfo.h"
+
+// Number of samples kept
+#define TREND_SAMPLES 16
+// Only samples of the last TREND_WINDOW seconds are used
+#define TREND_WINDOW 5.0
+
+typedef struct {
+    // Least-squares slopes in KiB per second. Negative = decreasing.
+    double mem_rate;
+    double swap_rate;
+} trend_t;
+
+void trend_add(const meminfo_t* m, double now);
+void trend_reset(void);
+bool trend_get(double now, trend_t* out);
+double trend_eta(const trend_t* t, const meminfo_t* m, double mem_percent, double swap_percent);
+
+#endif
@@ -0,0 +1,408 @@
+// SPDX-License-Identifier: MIT
+
+/* Batched /proc reads through io_uring (--io-uring).
+ *
+ * The synchronous scan costs an openat(), read() and close() per file and
+ * process. Here, the files of up to URING_BATCH processes are read with one
+ * io_uring_enter(): per file, an OPENAT into a fixed file slot, a READ from
+ * that slot and a CLOSE of it, hard-linked so that they run in order and the
+ * slot is freed even if the read fails. With fixed slots, we do not need a
+ * round trip to learn the fd before we can queue the read.
+ *
+ * Opening into fixed slots needs Linux 5.15. When the ring can not be set
+ * up, because the kernel is too old or io_uring is restricted by the
+ * kernel.io_uring_disabled sysctl or a seccomp filter, uring_init() returns
+ * false and the scan stays synchronous. We do not use liburing, the three
+ * syscalls are called directly, like in pidfd.c.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "globals.h"
+#include "msg.h"
+#include "uring.h"
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+
+// IORING_FILE_INDEX_ALLOC is from the same time as opening into fixed slots
+#ifdef IORING_FILE_INDEX_ALLOC
+
+// Same number on all architectures
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup 425
+#endif
+#ifndef __NR_io_uring_enter
+#define __NR_io_uring_enter 426
+#endif
+#ifndef __NR_io_uring_register
+#define __NR_io_uring_register 427
+#endif
+
+// Number of submission queue entries. Each file takes three.
+#define URING_ENTRIES 1024
+#define URING_FILES 4
+#define URING_SLOTS (URING_BATCH * URING_FILES)
+// Large enough for statm and for the 63 characters of a kernel thread's comm
+#define URING_BUF_LEN 128
+// "<pid>/oom_score_adj"
+#define URING_PATH_LEN 32
+
+static const struct {
+    unsigned field;
+    const char* name;
+} files[URING_FILES] = {
+    { PROC_OOM_SCORE, "oom_score" },
+    { PROC_OOM_SCORE_ADJ, "oom_score_adj" },
+    { PROC_RSS, "statm" },
+    { PROC_COMM, "comm" },
+};
+
+// The mmap'ed rings
+static struct {
+    int fd;
+    unsigned entries;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* ring;
+    size_t ring_len;
+    size_t sqes_len;
+} r = { .fd = -1 };
+
+// The /proc the paths are relative to, usually procdir_path
+static int procfd = -1;
+static const char* procfd_path;
+
+// Per slot: the path, the read buffer, and the results of OPENAT and READ
+static char paths[URING_SLOTS][URING_PATH_LEN];
+static char bufs[URING_SLOTS][URING_BUF_LEN];
+static int open_res[URING_SLOTS];
+static int read_res[URING_SLOTS];
+
+static int read_batch(const char* dir, procscan_t* scan, struct procinfo* p, int n, unsigned fields);
+
+static int ring_setup(void)
+{
+    struct io_uring_params p = { 0 };
+    int fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (fd < 0) {
+        return -errno;
+    }
+    // Linux 5.4, much older than what we need anyway
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        close(fd);
+        return -ENOSYS;
+    }
+    size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r.ring_len = sq_len > cq_len ? sq_len : cq_len;
+    r.sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r.ring = mmap(NULL, r.ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (r.ring == MAP_FAILED) {
+        int err = errno;
+        close(fd);
+        return -err;
+    }
+    r.sqes = mmap(NULL, r.sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (r.sqes == MAP_FAILED) {
+        int err = errno;
+        munmap(r.ring, r.ring_len);
+        close(fd);
+        return -err;
+    }
+    char* base = r.ring;
+    r.sq_tail = (unsigned*)(base + p.sq_off.tail);
+    r.sq_mask = (unsigned*)(base + p.sq_off.ring_mask);
+    r.sq_array = (unsigned*)(base + p.sq_off.array);
+    r.cq_head = (unsigned*)(base + p.cq_off.head);
+    r.cq_tail = (unsigned*)(base + p.cq_off.tail);
+    r.cq_mask = (unsigned*)(base + p.cq_off.ring_mask);
+    r.cqes = (struct io_uring_cqe*)(base + p.cq_off.cqes);
+    r.entries = p.sq_entries;
+    r.fd = fd;
+
+    // All slots start out empty
+    int fds[URING_SLOTS];
+    for (int i = 0; i < URING_SLOTS; i++) {
+        fds[i] = -1;
+    }
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_FILES, fds, URING_SLOTS) != 0) {
+        int err = errno;
+        uring_exit();
+        return -err;
+    }
+    return 0;
+}
+
+/*
+ * Set up the ring. Returns false if io_uring is not available, and the
+ * scan has to stay synchronous.
+ */
+bool uring_init(void)
+{
+    int res = ring_setup();
+    if (res < 0) {
+        warn("io_uring: could not set up the ring: %s, scanning synchronously\n", strerror(-res));
+        return false;
+    }
+    // See whether the kernel can really do what we need: parsed results
+    // for all the fields of our own process. In the real /proc, as the
+    // tests point procdir_path elsewhere.
+    struct procinfo self = { .pid = getpid() };
+    procscan_t scan;
+    procscan_begin(&scan);
+    res = read_batch("/proc", &scan, &self, 1, URING_FIELDS);
+    if (res < 0 || (self.fields & URING_FIELDS) != URING_FIELDS) {
+        warn("io_uring: the kernel can not open into fixed file slots (needs Linux 5.15), scanning synchronously\n");
+        uring_exit();
+        return false;
+    }
+    return true;
+}
+
+void uring_exit(void)
+{
+    if (r.fd < 0) {
+        return;
+    }
+    munmap(r.sqes, r.sqes_len);
+    munmap(r.ring, r.ring_len);
+    close(r.fd);
+    r.fd = -1;
+    if (procfd >= 0) {
+        close(procfd);
+        procfd = -1;
+    }
+    procfd_path = NULL;
+}
+
+bool uring_enabled(void)
+{
+    return r.fd >= 0;
+}
+
+static int nfiles_of(unsigned fields, int* list)
+{
+    int n = 0;
+    for (int i = 0; i < URING_FILES; i++) {
+        if (fields & files[i].field) {
+            if (list) {
+                list[n] = i;
+            }
+            n++;
+        }
+    }
+    return n;
+}
+
+/*
+ * How many processes uring_read() can read `fields` of at once.
+ */
+int uring_batch_max(unsigned fields)
+{
+    int nfiles = nfiles_of(fields & URING_FIELDS, NULL);
+    if (nfiles == 0 || r.fd < 0) {
+        return URING_BATCH;
+    }
+    int n = (int)r.entries / (3 * nfiles);
+    return n < URING_BATCH ? n : URING_BATCH;
+}
+
+static struct io_uring_sqe* next_sqe(unsigned* tail)
+{
+    unsigned idx = *tail & *r.sq_mask;
+    struct io_uring_sqe* sqe = &r.sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    r.sq_array[idx] = idx;
+    (*tail)++;
+    return sqe;
+}
+
+// Queue OPENAT, READ and CLOSE of `path` through fixed slot `slot`
+static void queue_file(unsigned* tail, unsigned slot)
+{
+    struct io_uring_sqe* sqe = next_sqe(tail);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->flags = IOSQE_IO_HARDLINK;
+    sqe->fd = procfd;
+    sqe->addr = (uintptr_t)paths[slot];
+    // O_CLOEXEC does not apply to fixed slots, the kernel refuses it
+    sqe->open_flags = O_RDONLY;
+    sqe->file_index = slot + 1;
+    sqe->user_data = slot * 3;
+
+    sqe = next_sqe(tail);
+    sqe->opcode = IORING_OP_READ;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+    sqe->fd = (int)slot;
+    sqe->addr = (uintptr_t)bufs[slot];
+    sqe->len = URING_BUF_LEN - 1;
+    sqe->user_data = slot * 3 + 1;
+
+    sqe = next_sqe(tail);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->file_index = slot + 1;
+    sqe->user_data = slot * 3 + 2;
+}
+
+// Consume the available completions, returns how many
+static unsigned reap(void)
+{
+    unsigned head = *r.cq_head;
+    unsigned tail = __atomic_load_n(r.cq_tail, __ATOMIC_ACQUIRE);
+    unsigned n = 0;
+    for (; head != tail; head++, n++) {
+        const struct io_uring_cqe* cqe = &r.cqes[head & *r.cq_mask];
+        unsigned slot = (unsigned)(cqe->user_data / 3);
+        switch (cqe->user_data % 3) {
+        case 0:
+            open_res[slot] = cqe->res;
+            break;
+        case 1:
+            read_res[slot] = cqe->res;
+            break;
+        }
+    }
+    __atomic_store_n(r.cq_head, head, __ATOMIC_RELEASE);
+    return n;
+}
+
+static int read_batch(const char* dir, procscan_t* scan, struct procinfo* p, int n, unsigned fields)
+{
+    int list[URING_FILES];
+    int nfiles = nfiles_of(fields & URING_FIELDS, list);
+
+    if (r.fd < 0) {
+        return -ENOSYS;
+    }
+    if (nfiles == 0 || n <= 0) {
+        return 0;
+    }
+    if (n > uring_batch_max(fields)) {
+        return -EINVAL;
+    }
+    if (procfd_path != dir) {
+        if (procfd >= 0) {
+            close(procfd);
+        }
+        procfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (procfd < 0) {
+            procfd_path = NULL;
+            return -errno;
+        }
+        procfd_path = dir;
+    }
+
+    unsigned nslots = (unsigned)(n * nfiles);
+    // The submission queue is empty between calls, and only we write to it
+    unsigned tail = *r.sq_tail;
+    for (unsigned slot = 0; slot < nslots; slot++) {
+        snprintf(paths[slot], sizeof(paths[slot]), "%d/%s", p[slot / (unsigned)nfiles].pid,
+            files[list[slot % (unsigned)nfiles]].name);
+        open_res[slot] = -ECANCELED;
+        read_res[slot] = -ECANCELED;
+        queue_file(&tail, slot);
+    }
+    __atomic_store_n(r.sq_tail, tail, __ATOMIC_RELEASE);
+
+    unsigned want = nslots * 3;
+    unsigned submitted = 0;
+    unsigned reaped = 0;
+    while (reaped < want) {
+        // Waits for all completions, unless the kernel stopped submitting
+        // early, in which case we come back for the rest
+        long ret = syscall(__NR_io_uring_enter, r.fd, want - submitted, want - reaped, IORING_ENTER_GETEVENTS, NULL, 0);
+        scan->syscalls++;
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret < 0) {
+            int err = errno;
+            warn("io_uring: io_uring_enter failed: %s, scanning synchronously from now on\n", strerror(err));
+            uring_exit();
+            return -err;
+        }
+        submitted += (unsigned)ret;
+        unsigned got = reap();
+        reaped += got;
+        if (ret == 0 && got == 0 && submitted < want) {
+            warn("io_uring: the kernel does not take our requests, scanning synchronously from now on\n");
+            uring_exit();
+            return -EIO;
+        }
+    }
+
+    for (unsigned slot = 0; slot < nslots; slot++) {
+        if (open_res[slot] < 0 || read_res[slot] < 0) {
+            continue;
+        }
+        bufs[slot][read_res[slot]] = 0;
+        // A parse error also leaves the field for procinfo_read()
+        procinfo_parse(scan, &p[slot / (unsigned)nfiles], files[list[slot % (unsigned)nfiles]].field,
+            bufs[slot], (size_t)read_res[slot]);
+    }
+    return 0;
+}
+
+/*
+ * Read the PROC_* `fields` (out of URING_FIELDS) of the `n` processes in
+ * `p`, at most uring_batch_max(fields), whose pid must be set. What could
+ * be read is parsed and added to p[i].fields. What could not, because the
+ * process is gone or for any other reason, is left for procinfo_read().
+ * Returns 0, or -errno if the ring failed. Then, it is shut down, and
+ * uring_enabled() returns false.
+ */
+int uring_read(procscan_t* scan, struct procinfo* p, int n, unsigned fields)
+{
+    return read_batch(procdir_path, scan, p, n, fields);
+}
+
+#else // no IORING_FILE_INDEX_ALLOC
+
+bool uring_init(void)
+{
+    warn("io_uring: not supported by this build, scanning synchronously\n");
+    return false;
+}
+
+void uring_exit(void)
+{
+}
+
+bool uring_enabled(void)
+{
+    return false;
+}
+
+int uring_batch_max(unsigned fields)
+{
+    (void)fields;
+    return URING_BATCH;
+}
+
+int uring_read(procscan_t* scan, struct procinfo* p, int n, unsigned fields)
+{
+    (void)scan;
+    (void)p;
+    (void)n;
+    (void)fields;
+    return -ENOSYS;
+}
+
+#endif
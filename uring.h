@@ -0,0 +1,20 @@
+/* SPDX-License-Identifier: MIT */
+#ifndef URING_H
+#define URING_H
+
+#include <stdbool.h>
+
+#include "meminfo.h"
+
+// Maximum number of processes read in one batch
+#define URING_BATCH 128
+// PROC_* fields that can be read through the ring
+#define URING_FIELDS (PROC_OOM_SCORE | PROC_OOM_SCORE_ADJ | PROC_RSS | PROC_COMM)
+
+bool uring_init(void);
+void uring_exit(void);
+bool uring_enabled(void);
+int uring_batch_max(unsigned fields);
+int uring_read(procscan_t* scan, struct procinfo* p, int n, unsigned fields);
+
+#endif
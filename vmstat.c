@@ -0,0 +1,259 @@
+// SPDX-License-Identifier: MIT
+
+/* Thrash detection from /proc/vmstat (--thrash).
+ *
+ * A system that keeps evicting and refaulting its working set, or swapping
+ * in and out, can be unusable for minutes while MemAvailable and SwapFree
+ * still look fine. So we sample the counters
+ *
+ *   refault   workingset_refault_file (workingset_refault before Linux 5.9)
+ *   swapin    pswpin
+ *   swapout   pswpout
+ *   majfault  pgmajfault
+ *
+ * at least VMSTAT_INTERVAL seconds apart, and compare their rates, in pages
+ * (faults for majfault) per second, with the configured SIGTERM and SIGKILL
+ * limits. A rate has to stay at or above a limit for VMSTAT_STREAK
+ * intervals in a row, a single burst (starting a big program) does not
+ * count.
+ *
+ * /proc/vmstat is opened once and parsed in one pass, like /proc/meminfo.
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "globals.h"
+#include "meminfo.h"
+#include "msg.h"
+#include "vmstat.h"
+
+// /proc/vmstat has some 180 lines on current kernels
+#define VMSTAT_BUF_SIZE 16384
+
+enum {
+    VK_REFAULT_FILE,
+    VK_REFAULT,
+    VK_PSWPIN,
+    VK_PSWPOUT,
+    VK_PGMAJFAULT,
+    VK_COUNT
+};
+
+static const keyed_key_t vmstat_keys[VK_COUNT] = {
+    [VK_REFAULT_FILE] = KEYED_KEY("workingset_refault_file "),
+    [VK_REFAULT] = KEYED_KEY("workingset_refault "),
+    [VK_PSWPIN] = KEYED_KEY("pswpin "),
+    [VK_PSWPOUT] = KEYED_KEY("pswpout "),
+    [VK_PGMAJFAULT] = KEYED_KEY("pgmajfault "),
+};
+
+static size_t vmstat_offsets[VK_COUNT];
+static keyed_file_t vmstat_file = {
+    .name = "vmstat",
+    .sep = ' ',
+    .keys = vmstat_keys,
+    .count = VK_COUNT,
+    .offsets = vmstat_offsets,
+    .fd = -1,
+};
+
+static const char* const counter_names[VMSTAT_COUNTERS] = {
+    [VMSTAT_REFAULT] = "refault",
+    [VMSTAT_SWAPIN] = "swapin",
+    [VMSTAT_SWAPOUT] = "swapout",
+    [VMSTAT_MAJFAULT] = "majfault",
+};
+
+typedef struct {
+    // Per second, 0 = not monitored
+    double term_rate;
+    double kill_rate;
+    // Intervals in a row at or above the limits
+    int term_streak;
+    int kill_streak;
+} vmstat_limit_t;
+
+static vmstat_limit_t limits[VMSTAT_COUNTERS];
+static int nlimits = 0;
+
+// The last sample, sample_time = 0 = none
+static long long sample[VMSTAT_COUNTERS];
+static double sample_time;
+
+/* Parse a positive rate. Returns -1 on error. */
+static double parse_rate(const char* str, const char* end)
+{
+    char* endptr;
+    errno = 0;
+    double rate = strtod(str, &endptr);
+    if (errno || endptr == str || endptr != end || rate <= 0) {
+        return -1;
+    }
+    return rate;
+}
+
+/* Set the limits of a counter from a "COUNTER:TERM[,KILL]" spec, rates per
+ * second. Unlike with the percentages, higher is worse here: KILL defaults
+ * to TERM * 2, and can not be below TERM.
+ */
+void vmstat_add(const char* spec)
+{
+    const char* colon = strchr(spec, ':');
+    if (colon == NULL) {
+        fatal(14, "thrash: expected COUNTER:TERM[,KILL], got '%s'\n", spec);
+    }
+    int c;
+    for (c = 0; c < VMSTAT_COUNTERS; c++) {
+        if (strlen(counter_names[c]) == (size_t)(colon - spec)
+            && !strncmp(spec, counter_names[c], (size_t)(colon - spec))) {
+            break;
+        }
+    }
+    if (c == VMSTAT_COUNTERS) {
+        fatal(14, "thrash: expected refault, swapin, swapout or majfault, got '%s'\n", spec);
+    }
+    const char* rates = colon + 1;
+    const char* comma = strchr(rates, ',');
+    double term = parse_rate(rates, comma ? comma : rates + strlen(rates));
+    double kill = comma ? parse_rate(comma + 1, comma + 1 + strlen(comma + 1)) : term * 2;
+    if (term < 0 || kill < 0) {
+        fatal(14, "thrash: invalid rate in '%s'\n", spec);
+    }
+    if (kill < term) {
+        fatal(14, "thrash: KILL rate is below TERM rate in '%s'\n", spec);
+    }
+    if (limits[c].term_rate == 0) {
+        nlimits++;
+    }
+    limits[c] = (vmstat_limit_t) { .term_rate = term, .kill_rate = kill };
+}
+
+int vmstat_count(void)
+{
+    return nlimits;
+}
+
+/* Read the counters. Returns false on error.
+ */
+static bool vmstat_read(long long* out)
+{
+    static char buf[VMSTAT_BUF_SIZE];
+    long long vals[VK_COUNT];
+
+    int res = keyed_file_open(&vmstat_file);
+    if (res < 0) {
+        warn("thrash: could not open %s/vmstat: %s\n", procdir_path, strerror(-res));
+        return false;
+    }
+    ssize_t len = keyed_file_read(&vmstat_file, buf, sizeof(buf), vals);
+    if (len < 0) {
+        warn("thrash: could not read %s/vmstat: %s\n", procdir_path, strerror((int)-len));
+        return false;
+    }
+    out[VMSTAT_REFAULT] = vals[VK_REFAULT_FILE] >= 0 ? vals[VK_REFAULT_FILE] : vals[VK_REFAULT];
+    out[VMSTAT_SWAPIN] = vals[VK_PSWPIN];
+    out[VMSTAT_SWAPOUT] = vals[VK_PSWPOUT];
+    out[VMSTAT_MAJFAULT] = vals[VK_PGMAJFAULT];
+    return true;
+}
+
+/* Check that the configured counters exist, and print the limits.
+ * Counters the kernel does not have are dropped with a warning, all of
+ * them if /proc/vmstat can not be read.
+ */
+void vmstat_init(void)
+{
+    long long vals[VMSTAT_COUNTERS];
+    if (!vmstat_read(vals)) {
+        warn("thrash: not monitoring anything\n");
+        memset(limits, 0, sizeof(limits));
+        nlimits = 0;
+        return;
+    }
+    for (int c = 0; c < VMSTAT_COUNTERS; c++) {
+        if (limits[c].term_rate == 0) {
+            continue;
+        }
+        if (vals[c] < 0) {
+            warn("thrash: the kernel has no %s counter, ignoring it\n", counter_names[c]);
+            limits[c].term_rate = 0;
+            nlimits--;
+            continue;
+        }
+        fprintf(stderr, "monitoring %s rate: SIGTERM when >= %g/s, SIGKILL when >= %g/s\n",
+            counter_names[c], limits[c].term_rate, limits[c].kill_rate);
+    }
+}
+
+/*
+ * Sample the counters if VMSTAT_INTERVAL has passed since the last sample.
+ * Returns a description of the worst counter, like "swapin 12000/s", and
+ * sets `sig` to SIGTERM or SIGKILL, if one has been at or above its limit
+ * for VMSTAT_STREAK intervals. Returns NULL otherwise.
+ */
+const char* vmstat_check(double now, int* sig)
+{
+    static char desc[64];
+    long long vals[VMSTAT_COUNTERS];
+
+    *sig = 0;
+    if (nlimits == 0 || (sample_time > 0 && now - sample_time < VMSTAT_INTERVAL)) {
+        return NULL;
+    }
+    if (!vmstat_read(vals)) {
+        return NULL;
+    }
+    double elapsed = now - sample_time;
+    bool have_sample = sample_time > 0;
+    sample_time = now;
+    int worst = -1;
+    double worst_rate = 0;
+    double worst_ratio = 0;
+    for (int c = 0; c < VMSTAT_COUNTERS; c++) {
+        vmstat_limit_t* l = &limits[c];
+        long long delta = vals[c] - sample[c];
+        sample[c] = vals[c];
+        if (l->term_rate == 0 || !have_sample) {
+            continue;
+        }
+        // The counters only go down if they wrap
+        double rate = delta > 0 ? (double)delta / elapsed : 0;
+        l->kill_streak = rate >= l->kill_rate ? l->kill_streak + 1 : 0;
+        l->term_streak = rate >= l->term_rate ? l->term_streak + 1 : 0;
+        debug("thrash: %s %.0f/s\n", counter_names[c], rate);
+        int s = l->kill_streak >= VMSTAT_STREAK ? SIGKILL : l->term_streak >= VMSTAT_STREAK ? SIGTERM : 0;
+        if (s == 0) {
+            continue;
+        }
+        // SIGKILL first, then the one furthest above its SIGTERM limit
+        double ratio = rate / l->term_rate;
+        if (*sig == 0 || (s == SIGKILL && *sig == SIGTERM) || (s == *sig && ratio > worst_ratio)) {
+            *sig = s;
+            worst = c;
+            worst_rate = rate;
+            worst_ratio = ratio;
+        }
+    }
+    if (worst < 0) {
+        return NULL;
+    }
+    snprintf(desc, sizeof(desc), "%s %.0f/s", counter_names[worst], worst_rate);
+    return desc;
+}
+
+/*
+ * Start over after a kill: the rates from before do not say anything
+ * about the system afterwards.
+ */
+void vmstat_reset(void)
+{
+    sample_time = 0;
+    for (int c = 0; c < VMSTAT_COUNTERS; c++) {
+        limits[c].term_streak = 0;
+        limits[c].kill_streak = 0;
+    }
+}
@@ -0,0 +1,26 @@
+/* SPDX-License-Identifier: MIT */
+#ifndef VMSTAT_H
+#define VMSTAT_H
+
+#include <stdbool.h>
+
+// Rates are computed over at least this many seconds
+#define VMSTAT_INTERVAL 1.0
+// Number of intervals in a row a rate has to be at or above its limit
+#define VMSTAT_STREAK 2
+
+typedef enum {
+    VMSTAT_REFAULT,
+    VMSTAT_SWAPIN,
+    VMSTAT_SWAPOUT,
+    VMSTAT_MAJFAULT,
+    VMSTAT_COUNTERS
+} vmstat_counter_t;
+
+void vmstat_add(const char* spec);
+int vmstat_count(void);
+void vmstat_init(void);
+const char* vmstat_check(double now, int* sig);
+void vmstat_reset(void);
+
+#endif
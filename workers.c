@@ -0,0 +1,137 @@
+// SPDX-License-Identifier: MIT
+
+/* Pool of scan threads (--scan-threads N).
+ *
+ * The threads are started once, at startup, so that their stacks exist
+ * before mlockall() and the startup dry run has grown them. Then they
+ * sleep on a futex. workers_run() hands the same function to all of them,
+ * runs it on the calling thread as worker 0, and returns when all are done.
+ * Only the poll loop thread calls workers_run().
+ */
+
+#include <limits.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "msg.h"
+#include "workers.h"
+
+// Enough for victim selection, which keeps its buffers on the stack
+#define WORKER_STACK_SIZE (256 * 1024)
+
+static int nworkers = 1;
+// Threads started so far, counting worker 0
+static int started = 1;
+static void (*job)(int worker, void* ctx);
+static void* job_ctx;
+// Bumped to start a job
+static uint32_t generation;
+// Workers (other than worker 0) that have not finished the job yet
+static uint32_t pending;
+// Generation at the time each thread was started
+static uint32_t start_generation[WORKERS_MAX];
+
+static void futex_wake(uint32_t* addr, int n)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+static void futex_wait(uint32_t* addr, uint32_t val)
+{
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void* worker_thread(void* arg)
+{
+    int id = (int)(intptr_t)arg;
+    uint32_t seen = start_generation[id];
+
+    prctl(PR_SET_NAME, "earlyoom-scan");
+    while (1) {
+        uint32_t gen;
+        while ((gen = __atomic_load_n(&generation, __ATOMIC_ACQUIRE)) == seen) {
+            futex_wait(&generation, seen);
+        }
+        seen = gen;
+        // Left over from an earlier, larger workers_init()
+        if (id >= nworkers) {
+            continue;
+        }
+        job(id, job_ctx);
+        if (__atomic_sub_fetch(&pending, 1, __ATOMIC_ACQ_REL) == 0) {
+            futex_wake(&pending, 1);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Start `n` - 1 threads, so that workers_run() runs on `n` in total.
+ * Returns false if none could be started, then everything runs on the
+ * calling thread. Calling it again only starts the missing threads, and
+ * workers_init(1) goes back to the calling thread alone.
+ */
+bool workers_init(int n)
+{
+    if (n < 1) {
+        n = 1;
+    }
+    if (n > WORKERS_MAX) {
+        n = WORKERS_MAX;
+    }
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, WORKER_STACK_SIZE);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    // Signals are for the main thread
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    while (started < n) {
+        pthread_t t;
+        start_generation[started] = generation;
+        int err = pthread_create(&t, &attr, worker_thread, (void*)(intptr_t)started);
+        if (err != 0) {
+            warn("could not start scan thread %d: %s\n", started, strerror(err));
+            break;
+        }
+        started++;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    pthread_attr_destroy(&attr);
+    nworkers = started < n ? started : n;
+    return nworkers > 1;
+}
+
+int workers_count(void)
+{
+    return nworkers;
+}
+
+/*
+ * Run fn(worker, ctx) on all workers, worker 0 being the calling thread,
+ * and wait for all of them.
+ */
+void workers_run(void (*fn)(int worker, void* ctx), void* ctx)
+{
+    if (nworkers == 1) {
+        fn(0, ctx);
+        return;
+    }
+    job = fn;
+    job_ctx = ctx;
+    __atomic_store_n(&pending, (uint32_t)(nworkers - 1), __ATOMIC_RELAXED);
+    __atomic_add_fetch(&generation, 1, __ATOMIC_RELEASE);
+    futex_wake(&generation, INT_MAX);
+    fn(0, ctx);
+    uint32_t left;
+    while ((left = __atomic_load_n(&pending, __ATOMIC_ACQUIRE)) != 0) {
+        futex_wait(&pending, left);
+    }
+}
@@ -0,0 +1,14 @@
+/* SPDX-License-Identifier: MIT */
+#ifndef WORKERS_H
+#define WORKERS_H
+
+#include <stdbool.h>
+
+// Maximum for --scan-threads
+#define WORKERS_MAX 16
+
+bool workers_init(int n);
+int workers_count(void);
+void workers_run(void (*fn)(int worker, void* ctx), void* ctx);
+
+#endif